@@ -16,4 +16,11 @@ namespace svm {
     };
 
     void invlpga(uint32_t asid, uintptr_t va);
-} // namespace svm::asid
\ No newline at end of file
+
+    // ASIDs are allocated globally instead of per-CPU, so a VCPU keeps its ASID when it's migrated to a different CPU
+    namespace asid {
+        void init(uint32_t n_asids); // Only the first call does anything, every CPU supports at least as many ASIDs as the BSP
+        uint32_t alloc();
+        void free(uint32_t asid);
+    } // namespace asid
+} // namespace svm
\ No newline at end of file
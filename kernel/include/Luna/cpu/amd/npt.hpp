@@ -43,6 +43,7 @@ namespace npt {
             asid = std::move(other.asid);
             levels = std::move(other.levels);
             root_pa = std::move(other.root_pa);
+            tlb_flush_pending = std::move(other.tlb_flush_pending);
 
             other.levels = 0;
             other.asid = 0;
@@ -65,6 +66,11 @@ namespace npt {
 
         uint8_t get_levels() const { return levels; }
 
+        bool has_dirty_bits() const { return true; }
+        void clear_dirty(uintptr_t gpa, size_t n_pages, uint64_t* bitmap, bool scan);
+
+        bool tlb_flush_pending = false; // Picked up by svm::Vm on the next VMRUN, since invlpga can't flush a range
+
         private:
         page_entry* walk(uintptr_t va, bool create_new_tables);
 
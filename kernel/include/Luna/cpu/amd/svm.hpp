@@ -200,6 +200,8 @@ namespace svm {
         Vm(vm::AbstractMM* mm, vm::VCPU* vcpu);
         ~Vm();
         bool run() override;
+        bool logs_dirty_pages() const override { return false; }
+        void unload() override {} // The VMCB lives in memory and host state is saved by run(), so nothing is cached on the CPU
 
         void set(vm::VmCap cap, bool value) override;
         void set(vm::VmCap cap, uint64_t value) override;
@@ -207,6 +209,14 @@ namespace svm {
         void set_regs(const vm::RegisterState& regs, uint64_t flags) override;
         simd::Context& get_guest_simd_context() override { return guest_simd; }
 
+        // An IRET that was intercepted but hasn't run yet counts as blocked, it just gets intercepted again after a restore
+        bool get_nmi_blocking() const override { return nmi_masked || nmi_iret_pending; }
+        void set_nmi_blocking(bool blocked) override {
+            nmi_masked = blocked;
+            nmi_iret_pending = false;
+            vmcb->icept_iret = blocked;
+        }
+
         void inject_int(vm::AbstractVm::InjectType type, uint8_t vector, bool error_code = false, uint32_t error = 0) override;
 
         private:
@@ -219,6 +229,9 @@ namespace svm {
         vm::AbstractMM* mm;
         vm::VCPU* vcpu;
 
+        // SVM doesn't track NMI blocking for us, an injected NMI is masked until its IRET has run
+        bool nmi_masked = false, nmi_iret_pending = false;
+
         uint8_t* io_bitmap, *msr_bitmap;
         uintptr_t io_bitmap_pa, msr_bitmap_pa;
     };
@@ -76,7 +76,6 @@ struct CpuData {
 
         struct {
             uint32_t n_asids;
-            std::lazy_initializer<svm::AsidManager> asid_manager;
         } svm;
     } cpu;
 
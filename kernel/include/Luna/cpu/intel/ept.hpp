@@ -53,6 +53,9 @@ namespace ept {
             return 0; // We don't use VPIDs yet
         }
 
+        bool has_dirty_bits() const;
+        void clear_dirty(uintptr_t gpa, size_t n_pages, uint64_t* bitmap, bool scan);
+
         private:
         page_entry* walk(uintptr_t va, bool create_new_tables);
         void invept();
@@ -78,6 +78,7 @@ namespace vmx {
 
     enum class VMExitControls : uint32_t {
         LongMode = (1 << 9),
+        LoadIA32PerfGlobalCtrl = (1 << 12),
         SaveIA32PAT = (1 << 18),
         LoadIA32PAT = (1 << 19),
         SaveIA32EFER = (1 << 20),
@@ -86,6 +87,7 @@ namespace vmx {
     
     enum class VMEntryControls : uint32_t {
         IA32eModeGuest = (1 << 9),
+        LoadIA32PerfGlobalCtrl = (1 << 13),
         LoadIA32PAT = (1 << 14),
         LoadIA32EFER = (1 << 15)
     };
@@ -97,13 +99,15 @@ namespace vmx {
         IRQWindow = 7,
         CPUID = 10,
         Hlt = 12,
+        Rdpmc = 15,
         Vmcall = 18,
         MovToCr = 28,
         PIO = 30,
         Rdmsr = 31,
         Wrmsr = 32,
         InvalidGuestState = 33,
-        EPTViolation = 48
+        EPTViolation = 48,
+        PMLFull = 62
     };
 
     union [[gnu::packed]] InterruptionInfo {
@@ -201,6 +205,7 @@ namespace vmx {
 
     constexpr uint64_t host_pat_full = 0x2C00;
     constexpr uint64_t host_efer_full = 0x2C02;
+    constexpr uint64_t host_ia32_perf_global_ctrl_full = 0x2C04;
 
     constexpr uint64_t guest_es_selector = 0x800;
     constexpr uint64_t guest_cs_selector = 0x802;
@@ -262,12 +267,14 @@ namespace vmx {
 
     constexpr uint64_t guest_ia32_pat_full = 0x2804;
     constexpr uint64_t guest_efer_full = 0x2806;
+    constexpr uint64_t guest_ia32_perf_global_ctrl_full = 0x2808;
     
     constexpr uint64_t tsc_offset = 0x2010;
     constexpr uint64_t io_bitmap_a = 0x2001;
     constexpr uint64_t io_bitmap_b = 0x2003;
 
     constexpr uint64_t ept_control = 0x201A;
+    constexpr uint64_t pml_address = 0x200E;
     constexpr uint64_t ept_violation_addr = 0x2400;
     
     constexpr uint64_t vm_instruction_error = 0x4400;
@@ -295,16 +302,23 @@ namespace vmx {
     struct Vm final : public vm::AbstractVm {
         Vm(vm::AbstractMM* mm, vm::VCPU* vcpu);
         bool run() override;
+        void unload() override;
 
         void set(vm::VmCap cap, bool value) override;
         void set(vm::VmCap cap, uint64_t value) override;
         void get_regs(vm::RegisterState& regs, uint64_t flags) const override;
         void set_regs(const vm::RegisterState& regs, uint64_t flags) override;
         simd::Context& get_guest_simd_context() override { return guest_simd; }
+        bool logs_dirty_pages() const override { return pml_enabled; }
+
+        bool get_nmi_blocking() const override;
+        void set_nmi_blocking(bool blocked) override;
 
         void inject_int(vm::AbstractVm::InjectType type, uint8_t vector, bool error_code = false, uint32_t error = 0) override;
 
         private:
+        void flush_pml();
+        void invept() const;
         void vmclear();
         void vmptrld() const;
         void write(uint64_t field, uint64_t value);
@@ -314,9 +328,15 @@ namespace vmx {
 
         uintptr_t vmcs_pa;
         uintptr_t vmcs;
+        CpuData* active_cpu = nullptr; // CPU the VMCS is kept current on while run() is using it, the VCPU thread reloads it there when scheduled in
 
         uint64_t saved_host_rsp;
 
+        uintptr_t pml_pa = 0; // Page Modification Log, only allocated if supported
+        bool pml_enabled = false; // Only while some memslot is being dirty logged, see VmCap::DirtyLogging
+
+        bool perf_global_ctrl_switched = false; // Whether the VM-Entry and VM-Exit controls that load IA32_PERF_GLOBAL_CTRL are currently on
+
         vm::AbstractMM* mm;
         vm::VCPU* vcpu;
 
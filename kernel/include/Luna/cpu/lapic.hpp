@@ -17,6 +17,10 @@ namespace lapic
         constexpr uint64_t dfr = 0xE0;
         constexpr uint64_t spurious = 0xF0;
 
+        constexpr uint64_t isr = 0x100;
+        constexpr uint64_t tmr = 0x180;
+        constexpr uint64_t irr = 0x200;
+
         constexpr uint64_t error_status = 0x280;
 
         constexpr uint64_t icr_low = 0x300;
@@ -8,6 +8,7 @@ namespace msr {
     constexpr uint32_t ia32_feature_control = 0x3A;
     constexpr uint32_t ia32_tsc_adjust = 0x3B;
     constexpr uint32_t ia32_bios_sign_id = 0x8B;
+    constexpr uint32_t ia32_pmc0 = 0xC1;
 
     constexpr uint32_t ia32_mtrr_cap = 0xFE;
 
@@ -16,6 +17,14 @@ namespace msr {
     constexpr uint32_t ia32_sysenter_cs = 0x174;
     constexpr uint32_t ia32_sysenter_esp = 0x175;
     constexpr uint32_t ia32_sysenter_eip = 0x176;
+
+    constexpr uint32_t ia32_perfevtsel0 = 0x186;
+    constexpr uint32_t ia32_perf_capabilities = 0x345;
+    constexpr uint32_t ia32_fixed_ctr_ctrl = 0x38D;
+    constexpr uint32_t ia32_perf_global_status = 0x38E;
+    constexpr uint32_t ia32_perf_global_ctrl = 0x38F;
+    constexpr uint32_t ia32_perf_global_ovf_ctrl = 0x390;
+    constexpr uint32_t ia32_a_pmc0 = 0x4C1; // Full width writable alias of ia32_pmc0
     
     constexpr uint32_t ia32_mtrr_physbase0 = 0x200;
     constexpr uint32_t ia32_mtrr_physmask0 = 0x201;
@@ -77,7 +86,10 @@ namespace msr {
     constexpr uint32_t gs_base = 0xC0000101;
     constexpr uint32_t kernel_gs_base = 0xC0000102;
 
-    // AMD PMC
+    // AMD PMC, the legacy registers are aliases of the first 4 PerfCtrExtCore ones
+    constexpr uint32_t perf_legacy_evt_sel0 = 0xC001'0000;
+    constexpr uint32_t perf_legacy_ctr_0 = 0xC001'0004;
+
     constexpr uint32_t perf_evt_sel0 = 0xC001'0200;
     constexpr uint32_t perf_evt_sel1 = 0xC001'0202;
     constexpr uint32_t perf_evt_sel2 = 0xC001'0204;
@@ -71,6 +71,10 @@ namespace threading {
             bool is_pinned;
             uint32_t cpu_id;
         } cpu_pin;
+
+        // Called with IRQs off every time the thread is scheduled in, for per-CPU state another thread might have replaced, like the current VMCS
+        void (*schedule_in_hook)(void*) = nullptr;
+        void* schedule_in_userptr = nullptr;
     };
 
     // Do not use this struct or API directly, use Promise<T>
@@ -325,6 +325,17 @@ namespace amd_vi {
     };
     static_assert(IOMMUCommand<CmdInvalidateIOMMUPages>);
 
+    struct [[gnu::packed]] CmdInvalidateIntTable {
+        static constexpr uint8_t opcode = 0x5;
+        uint32_t device_id : 16;
+        uint32_t reserved : 16;
+        uint32_t reserved_0 : 28;
+        uint32_t op : 4;
+        uint32_t reserved_1;
+        uint32_t reserved_2;
+    };
+    static_assert(IOMMUCommand<CmdInvalidateIntTable>);
+
     struct [[gnu::packed]] CmdInvalidateIOMMUAll {
         static constexpr uint8_t opcode = 0x8;
         uint32_t reserved;
@@ -420,6 +431,26 @@ namespace amd_vi {
 
     constexpr size_t n_domains = 65536; // AMD does not have a limit to it like intel?
 
+    // Basic 32-bit format, the 128-bit one is only used with XTEn or GAEn, neither of which we set
+    union [[gnu::packed]] IRTE {
+        struct {
+            uint32_t remap_enable : 1;
+            uint32_t suppress_io_page_faults : 1;
+            uint32_t int_type : 3;
+            uint32_t rq_eoi : 1;
+            uint32_t destination_mode : 1;
+            uint32_t guest_mode : 1;
+            uint32_t destination : 8;
+            uint32_t vector : 8;
+            uint32_t reserved : 8;
+        };
+        uint32_t raw;
+    };
+    static_assert(sizeof(IRTE) == 4);
+
+    constexpr uint8_t irq_table_length = 11; // 2^11 entries, enough to use the MSI-X index directly as the IRTE index
+    constexpr size_t n_irtes = 1 << irq_table_length;
+
     struct IOMMU;
 
     struct IOMMUEngine {
@@ -428,6 +459,9 @@ namespace amd_vi {
         void map(const DeviceID& device, uintptr_t pa, uintptr_t iova, uint64_t flags);
         uintptr_t unmap(const DeviceID& device, uintptr_t iova);
 
+        bool remap_irq(const DeviceID& device, uint16_t i, uint8_t vector, uint32_t lapic_id, uint64_t& address, uint32_t& data);
+        void unmap_irq(const DeviceID& device, uint16_t i);
+
         uint16_t segment;
         std::vector<std::pair<DeviceID, DeviceID>> device_id_ranges;
 
@@ -446,6 +480,7 @@ namespace amd_vi {
         void flush_all_caches();
         
         void cmd_invalidate_devtab_entry(const DeviceID& device);
+        void cmd_invalidate_int_table(const DeviceID& device);
         void cmd_invalidate_all();
 
         template<IOMMUCommand T>
@@ -459,6 +494,8 @@ namespace amd_vi {
         io_paging::Context& get_translation(const DeviceID& device);
         void invalidate_iotlb_addr(const DeviceID& device, uintptr_t iova);
 
+        volatile IRTE* get_irq_table(const DeviceID& device);
+
         volatile IOMMUEngineRegs* regs;
         volatile DeviceTableEntry* device_table;
 
@@ -471,7 +508,9 @@ namespace amd_vi {
 
         std::unordered_map<uint16_t, uint16_t> alias_map;
 
-        bool non_present_cache;
+        std::unordered_map<uint16_t, volatile IRTE*> irq_tables;
+
+        bool non_present_cache, guest_vapic;
 
         struct {
             volatile uint8_t* ring;
@@ -499,6 +538,10 @@ namespace amd_vi {
         void map(const pci::Device& device, uintptr_t pa, uintptr_t iova, uint64_t flags);
         uintptr_t unmap(const pci::Device& device, uintptr_t iova);
         void invalidate_iotlb_entry(const pci::Device& device, uintptr_t iova);
+
+        bool remap_irq(const pci::Device& device, uint16_t i, uint8_t vector, uint32_t lapic_id, uint64_t& address, uint32_t& data);
+        void unmap_irq(const pci::Device& device, uint16_t i);
+        bool blocks_compat_irqs(const pci::Device& device);
         private:
         IOMMUEngine& engine_for_device(uint16_t seg, const DeviceID& id);
 
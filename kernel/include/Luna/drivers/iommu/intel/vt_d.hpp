@@ -350,6 +350,44 @@ namespace vt_d {
     };
     static_assert(sizeof(IOTLBInvalidationDescriptor) == (128 / 8));
 
+    struct [[gnu::packed]] IECInvalidationDescriptor {
+        static constexpr uint8_t cmd = 4;
+        uint64_t type : 4;
+        uint64_t granularity : 1; // 0 = Global, 1 = Index
+        uint64_t reserved : 4;
+        uint64_t zero : 3;
+        uint64_t reserved_0 : 15;
+        uint64_t index_mask : 5;
+        uint64_t index : 16;
+        uint64_t reserved_1 : 16;
+        uint64_t reserved_2;
+    };
+    static_assert(sizeof(IECInvalidationDescriptor) == (128 / 8));
+
+    // Remapped format, the Posted format (mode = 1) needs the VMM to use APIC virtualization, which it doesn't
+    union [[gnu::packed]] IRTE {
+        struct {
+            uint64_t present : 1;
+            uint64_t fault_processing_disable : 1;
+            uint64_t destination_mode : 1;
+            uint64_t redirection_hint : 1;
+            uint64_t trigger_mode : 1;
+            uint64_t delivery_mode : 3;
+            uint64_t available : 4;
+            uint64_t reserved : 3;
+            uint64_t mode : 1;
+            uint64_t vector : 8;
+            uint64_t reserved_0 : 8;
+            uint64_t destination : 32; // xAPIC ID in bits 15:8
+            uint64_t source_id : 16;
+            uint64_t source_qualifier : 2;
+            uint64_t source_validation_type : 2;
+            uint64_t reserved_1 : 44;
+        };
+        uint64_t raw[2];
+    };
+    static_assert(sizeof(IRTE) == 16);
+
     enum {
         ContextInvalidateGlobal = 0b01ull,
         ContextInvalidateDomain = 0b10ull,
@@ -397,6 +435,12 @@ namespace vt_d {
         void map(vt_d::SourceID device, uintptr_t pa, uintptr_t iova, uint64_t flags);
         uintptr_t unmap(vt_d::SourceID device, uintptr_t iova);
 
+        bool remap_irq(vt_d::SourceID device, uint16_t i, uint8_t vector, uint32_t lapic_id, uint64_t& address, uint32_t& data);
+        void unmap_irq(vt_d::SourceID device, uint16_t i);
+        bool blocks_compat_irqs();
+
+        static constexpr size_t n_irtes = 4096;
+
         private:
         void flush_cache(void* va, size_t sz);
         void enable_translation();
@@ -407,6 +451,10 @@ namespace vt_d {
         void invalidate_global_iotlb();
         void invalidate_domain_iotlb(uint16_t domain_id);
         void invalidate_iotlb_addr(uint16_t domain_id, uintptr_t iova);
+        void invalidate_iec(uint16_t index);
+        void invalidate_global_iec();
+
+        void enable_irq_remapping();
 
 
         void handle_irq();
@@ -433,8 +481,12 @@ namespace vt_d {
 
         std::lazy_initializer<InvalidationQueue> iq;
 
+        volatile IRTE* irq_table;
+        std::bitmap irte_ids;
+        std::unordered_map<uint32_t, uint16_t> irte_map; // (SourceID << 16) | MSI index -> IRTE, entries are kept when unmapped so the index can be reused
+
         bool all_devices_on_segment, eim, wbflush_needed, read_draining, write_draining, page_selective_invalidation, caching_mode;
-        bool zero_length_read, page_snoop, coherent, plmr, phmr, qi;
+        bool zero_length_read, page_snoop, coherent, plmr, phmr, qi, irq_remap, posted_irqs;
 
         size_t segment;
         std::vector<std::pair<SourceID, SourceID>> source_id_ranges;
@@ -449,6 +501,10 @@ namespace vt_d {
         
         void map(const pci::Device& device, uintptr_t pa, uintptr_t iova, uint64_t flags);
         uintptr_t unmap(const pci::Device& device, uintptr_t iova);
+
+        bool remap_irq(const pci::Device& device, uint16_t i, uint8_t vector, uint32_t lapic_id, uint64_t& address, uint32_t& data);
+        void unmap_irq(const pci::Device& device, uint16_t i);
+        bool blocks_compat_irqs(const pci::Device& device);
         
         private:
         RemappingEngine& get_engine(uint16_t seg, SourceID source);
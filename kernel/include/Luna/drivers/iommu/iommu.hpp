@@ -11,4 +11,13 @@ namespace iommu
     void init();
     void map(const pci::Device& device, uintptr_t pa, uintptr_t iova, uint64_t flags);
     uintptr_t unmap(const pci::Device& device, uintptr_t iova);
+
+    // Points MSI(-X) message i of the device at vector on lapic_id through the IRQ remapping tables, and returns the message to program into the device
+    // Returns false if remapping isn't available, in which case the device has to use a normal compatibility format message
+    bool remap_irq(const pci::Device& device, uint16_t i, uint8_t vector, uint32_t lapic_id, uint64_t& address, uint32_t& data);
+    void unmap_irq(const pci::Device& device, uint16_t i);
+
+    // Returns true if the only MSIs from the device that get delivered are the ones set up with remap_irq
+    // If compatibility format messages are let through untouched, the device can hit any vector on any CPU by just writing to 0xFEEx_xxxx
+    bool blocks_compat_irqs(const pci::Device& device);
 } // namespace iommu
@@ -3,6 +3,7 @@
 #include <Luna/common.hpp>
 #include <Luna/drivers/pci.hpp>
 #include <Luna/mm/iovmm.hpp>
+#include <Luna/cpu/mutex.hpp>
 
 #include <Luna/net/if.hpp>
 
@@ -93,6 +94,10 @@ namespace rtl81x9 {
     } // namespace tcr
 
     namespace rcr {
+        constexpr uint32_t accept_all = (1 << 0);
+        constexpr uint32_t accept_physical_match = (1 << 1);
+        constexpr uint32_t accept_multicast = (1 << 2);
+        constexpr uint32_t accept_broadcast = (1 << 3);
         constexpr uint32_t mxdma_unlimited = (0b111 << 8);
         constexpr uint32_t rxftr_none = (0b111 << 13);
     } // namespace rcr
@@ -142,6 +147,18 @@ namespace rtl81x9 {
         constexpr uint32_t ip_cs = (1 << 29);
         constexpr uint32_t udp_cs = (1u << 31);
     } // namespace tx_flags
+
+    namespace rx_flags {
+        constexpr uint32_t own = (1u << 31);
+        constexpr uint32_t eor = (1 << 30);
+        constexpr uint32_t fs = (1 << 29);
+        constexpr uint32_t ls = (1 << 28);
+        constexpr uint32_t res = (1 << 21); // Receive error
+
+        constexpr uint32_t length_mask = 0x3FFF; // Includes the CRC
+    } // namespace rx_flags
+
+    constexpr size_t crc_size = 4;
     
     constexpr size_t n_descriptor_sets = 256;
     constexpr size_t mtu = 1536;
@@ -158,9 +175,13 @@ namespace rtl81x9 {
         bool send_packet(const net::Mac& dst, uint16_t ethertype, const std::span<uint8_t>& packet, uint32_t offload);
         net::Mac get_mac() const { return mac; }
 
+        bool send_frame(const std::span<uint8_t>& frame);
+        void set_promiscuous(bool enable);
+
         private:
         void handle_irq();
         void handle_tx_ok();
+        void handle_rx();
 
         iovmm::Iovmm mm;
         volatile Regs* regs;
@@ -174,6 +195,7 @@ namespace rtl81x9 {
         iovmm::Iovmm::Allocation tx_alloc, rx_alloc, tx_set_alloc, rx_set_alloc;
 
         net::Mac mac;
-        size_t tx_index;
+        size_t tx_index, rx_index;
+        IrqTicketLock tx_lock; // The network stack and the VM switch can both send
     };
 } // namespace rtl81x9
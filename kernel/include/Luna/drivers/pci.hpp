@@ -208,6 +208,7 @@ namespace pci {
         } pcie{};
 
         void enable_irq(uint16_t i, uint8_t vector);
+        void enable_irq(uint16_t i, uint64_t address, uint32_t data); // For messages that don't use the normal format, like remappable ones from iommu::remap_irq()
         bool set_power(uint8_t state);
 
         Bar read_bar(size_t i) const;
@@ -60,6 +60,7 @@ namespace echfs {
         DirectoryEntry entry;
 
         std::vector<uint64_t> fat_chain;
+        bool dirty = false;
 
         Filesystem* fs;
     };
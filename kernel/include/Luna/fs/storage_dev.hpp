@@ -24,6 +24,7 @@ namespace storage_dev {
 
         bool read(size_t offset, size_t count, uint8_t* data);
         bool write(size_t offset, size_t count, uint8_t* data);
+        void flush();
 
         private:
         struct CacheBlock {
@@ -36,6 +37,7 @@ namespace storage_dev {
             bool modified;
         };
         CacheBlock& get_cache_block(size_t block);
+        void writeback(CacheBlock& entry);
 
         std::vector<CacheBlock> cache;
         uint64_t curr_timestamp;
@@ -42,7 +42,15 @@ namespace net {
         virtual bool send_packet(const Mac& dst, uint16_t ethertype, const std::span<uint8_t>& packet, uint32_t offload) = 0;
         virtual Mac get_mac() const = 0;
 
+        // Sends a complete ethernet frame as is, the source MAC doesn't have to be our own
+        virtual bool send_frame(const std::span<uint8_t>& frame) = 0;
+        virtual void set_promiscuous(bool enable) = 0;
+
         uint32_t checksum_offload;
+
+        // Called from IRQ context for every received frame, the frame is only valid during the call
+        void (*rx_handler)(const std::span<uint8_t>& frame, void* userptr) = nullptr;
+        void* rx_userptr = nullptr;
     };
 
     struct Interface {
@@ -51,6 +59,7 @@ namespace net {
     };
 
     void register_nic(Nic* nic);
+    bool has_default_if();
     Interface* get_default_if();
 } // namespace net
 
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <Luna/common.hpp>
+#include <Luna/fs/vfs.hpp>
+
+#include <std/vector.hpp>
+
+namespace vm {
+    struct Vm;
+} // namespace vm
+
+// Direct boot of a Linux bzImage through the 64-bit boot protocol, see Documentation/x86/boot.rst
+namespace vm::bzimage {
+    constexpr uint32_t header_magic = 0x5372'6448; // "HdrS"
+    constexpr uint16_t min_version = 0x20C; // 2.12 added xloadflags, which tell us if the 64-bit entry point exists
+
+    constexpr uint16_t xlf_kernel_64 = (1 << 0);
+    constexpr uint8_t type_of_loader_undefined = 0xFF;
+
+    // Guest physical layout of everything we put in lowmem, the kernel itself is loaded at its preferred address
+    constexpr uintptr_t gdt_addr = 0x6000;
+    constexpr uintptr_t boot_params_addr = 0x7000;
+    constexpr uintptr_t page_tables_addr = 0x9000; // PML4, PDPT and 4 PDs that identity map the first 4GiB with 2MiB pages
+    constexpr uintptr_t cmdline_addr = 0x2'0000;
+    constexpr size_t max_cmdline_size = 0x1'0000;
+
+    struct [[gnu::packed]] SetupHeader {
+        uint8_t setup_sects;
+        uint16_t root_flags;
+        uint32_t syssize;
+        uint16_t ram_size;
+        uint16_t vid_mode;
+        uint16_t root_dev;
+        uint16_t boot_flag;
+        uint16_t jump;
+        uint32_t header;
+        uint16_t version;
+        uint32_t realmode_swtch;
+        uint16_t start_sys_seg;
+        uint16_t kernel_version;
+        uint8_t type_of_loader;
+        uint8_t loadflags;
+        uint16_t setup_move_size;
+        uint32_t code32_start;
+        uint32_t ramdisk_image;
+        uint32_t ramdisk_size;
+        uint32_t bootsect_kludge;
+        uint16_t heap_end_ptr;
+        uint8_t ext_loader_ver;
+        uint8_t ext_loader_type;
+        uint32_t cmd_line_ptr;
+        uint32_t initrd_addr_max;
+        uint32_t kernel_alignment;
+        uint8_t relocatable_kernel;
+        uint8_t min_alignment;
+        uint16_t xloadflags;
+        uint32_t cmdline_size;
+        uint32_t hardware_subarch;
+        uint64_t hardware_subarch_data;
+        uint32_t payload_offset;
+        uint32_t payload_length;
+        uint64_t setup_data;
+        uint64_t pref_address;
+        uint32_t init_size;
+        uint32_t handover_offset;
+        uint32_t kernel_info_offset;
+    };
+    constexpr size_t setup_header_offset = 0x1F1;
+    static_assert(sizeof(SetupHeader) == (0x26C - setup_header_offset));
+
+    namespace E820Type {
+        enum : uint32_t {
+            Ram = 1,
+            Reserved = 2
+        };
+    } // namespace E820Type
+
+    struct [[gnu::packed]] E820Entry {
+        uint64_t addr, size;
+        uint32_t type;
+    };
+    static_assert(sizeof(E820Entry) == 20);
+
+    // Also known as the zero page, we only fill in what is needed to boot, everything else is left zeroed
+    struct [[gnu::packed]] BootParams {
+        uint8_t reserved[0xC0];
+        uint32_t ext_ramdisk_image, ext_ramdisk_size, ext_cmd_line_ptr;
+        uint8_t reserved_0[0x1E8 - 0xCC];
+        uint8_t e820_entries;
+        uint8_t reserved_1[setup_header_offset - 0x1E9];
+        SetupHeader hdr;
+        uint8_t reserved_2[0x2D0 - 0x26C];
+        E820Entry e820_table[128];
+        uint8_t reserved_3[0x1000 - 0xCD0];
+    };
+    static_assert(sizeof(BootParams) == 0x1000);
+
+    // Loads the kernel and initrd (which can be null) into guest RAM, and sets up the BSP to start at the kernel's 64-bit entry point
+    // Should be called on a freshly created VM without any firmware, the memory map has to match the memslots of the VM
+    bool boot(Vm& vm, vfs::File* kernel, vfs::File* initrd, const char* cmdline, const std::vector<E820Entry>& memory_map);
+} // namespace vm::bzimage
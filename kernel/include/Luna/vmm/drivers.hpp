@@ -6,6 +6,11 @@
 namespace vm {
     struct Vm;
 
+    namespace snapshot {
+        struct Writer;
+        struct Reader;
+    } // namespace snapshot
+
     struct AbstractPIODriver {
         virtual ~AbstractPIODriver() {}
 
@@ -32,6 +37,17 @@ namespace vm {
         virtual uint8_t read_irq_vector() = 0;
     };
 
+    struct AbstractSnapshotDriver {
+        virtual ~AbstractSnapshotDriver() {}
+
+        AbstractSnapshotDriver() = default;
+        AbstractSnapshotDriver(const vm::AbstractSnapshotDriver&) = default;
+
+        virtual const char* snapshot_id() const = 0; // Max 15 chars, used to check if a snapshot matches the VM
+        virtual void snapshot_save(snapshot::Writer& out) = 0;
+        virtual void snapshot_restore(snapshot::Reader& in) = 0;
+    };
+
     struct AbstractKeyboardListener {
         virtual ~AbstractKeyboardListener() {}
 
@@ -2,6 +2,7 @@
 
 #include <Luna/common.hpp>
 #include <Luna/vmm/vm.hpp>
+#include <Luna/vmm/snapshot.hpp>
 
 #include <Luna/misc/log.hpp>
 
@@ -35,10 +36,11 @@ namespace vm::cmos {
 
     };
 
-    struct Driver final : public vm::AbstractPIODriver {
+    struct Driver final : public vm::AbstractPIODriver, public vm::AbstractSnapshotDriver {
         Driver(Vm* vm) {
             vm->pio_map[base + cmd] = this;
             vm->pio_map[base + data] = this;
+            vm->snapshot_drivers.push_back(this);
 
             memset(ram, 0, 128);
             ram[0xD] = 0x80; // CMOS Battery power good
@@ -77,6 +79,20 @@ namespace vm::cmos {
         uint8_t read(uint8_t i) const { return ram[i]; }
         void write(uint8_t i, uint8_t v) { ram[i] = v; }
 
+        const char* snapshot_id() const { return "cmos"; }
+
+        void snapshot_save(snapshot::Writer& out) {
+            out.write(address);
+            out.write(nmi);
+            out.write(ram);
+        }
+
+        void snapshot_restore(snapshot::Reader& in) {
+            in.read(address);
+            in.read(nmi);
+            in.read(ram);
+        }
+
         private:
         bool reg_is_implemented(uint8_t reg) {
             for(auto i : implemented_regs)
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <Luna/common.hpp>
+#include <Luna/vmm/vm.hpp>
+#include <Luna/fs/vfs.hpp>
+
+#include <std/vector.hpp>
+
+// QEMU's firmware configuration interface, see docs/specs/fw_cfg.txt in QEMU
+namespace vm::fw_cfg {
+    constexpr uint16_t selector_port = 0x510;
+    constexpr uint16_t data_port = 0x511;
+    constexpr uint16_t dma_port_high = 0x514;
+    constexpr uint16_t dma_port_low = 0x518; // Writing here starts the transfer
+
+    constexpr uint16_t selector_write = (1 << 14);
+    constexpr uint16_t selector_arch = (1 << 15);
+
+    constexpr uint64_t dma_signature = 0x5145'4D55'2043'4647; // "QEMU CFG"
+
+    namespace Key {
+        enum : uint16_t {
+            Signature = 0x0,
+            Id = 0x1,
+            RamSize = 0x3,
+            NoGraphic = 0x4,
+            NbCpus = 0x5,
+            KernelAddr = 0x7,
+            KernelSize = 0x8,
+            InitrdAddr = 0xA,
+            InitrdSize = 0xB,
+            BootMenu = 0xE,
+            MaxCpus = 0xF,
+            KernelData = 0x11,
+            InitrdData = 0x12,
+            CmdlineAddr = 0x13,
+            CmdlineSize = 0x14,
+            CmdlineData = 0x15,
+            SetupAddr = 0x16,
+            SetupSize = 0x17,
+            SetupData = 0x18,
+            FileDir = 0x19,
+            FileFirst = 0x20
+        };
+    } // namespace Key
+
+    namespace IdFeatures {
+        enum : uint32_t {
+            Traditional = (1 << 0),
+            Dma = (1 << 1)
+        };
+    } // namespace IdFeatures
+
+    namespace DmaControl {
+        enum : uint32_t {
+            Error = (1 << 0),
+            Read = (1 << 1),
+            Skip = (1 << 2),
+            Select = (1 << 3),
+            Write = (1 << 4)
+        };
+    } // namespace DmaControl
+
+    // All fields are big endian
+    struct [[gnu::packed]] DmaAccess {
+        uint32_t control;
+        uint32_t length;
+        uint64_t address;
+    };
+
+    struct [[gnu::packed]] FileEntry {
+        uint32_t size; // Big endian
+        uint16_t select; // Big endian
+        uint16_t reserved;
+        char name[56];
+    };
+
+    struct Driver final : public vm::AbstractPIODriver {
+        Driver(Vm* vm);
+
+        // Data is copied, integers are little endian as the guest expects them
+        void add(uint16_t key, const void* data, size_t size);
+        template<typename T>
+        void add(uint16_t key, T v) { add(key, &v, sizeof(T)); }
+
+        // Large blobs like kernels stay in the file and are only read once the guest asks for them, the file has to stay open
+        void add(uint16_t key, vfs::File* file, size_t offset, size_t size);
+
+        void add_file(const char* name, const void* data, size_t size);
+        void add_file(const char* name, vfs::File* file, size_t offset, size_t size);
+
+        // Serves a bzImage over the legacy kernel keys, to be booted by a linuxboot option ROM, returns false if it isn't a valid bzImage
+        bool add_kernel(vfs::File* kernel, vfs::File* initrd, const char* cmdline, uintptr_t ram_end);
+
+        void pio_write(uint16_t port, uint32_t value, uint8_t size);
+        uint32_t pio_read(uint16_t port, uint8_t size);
+
+        private:
+        struct Item {
+            uint16_t key;
+            size_t size;
+
+            std::vector<uint8_t> data;
+            vfs::File* file;
+            size_t file_offset;
+        };
+
+        Item* find(uint16_t key);
+        Item& insert(uint16_t key);
+        uint16_t add_dir_entry(const char* name, size_t size); // Returns the key for the file
+
+        void read(size_t offset, uint8_t* buf, size_t size); // From the selected item, anything past its end reads as 0
+        void dma_transfer(uintptr_t gpa);
+
+        std::vector<Item> items;
+        std::vector<FileEntry> files;
+
+        uint16_t selector;
+        size_t offset;
+        uint32_t dma_addr_high;
+
+        Vm* vm;
+    };
+} // namespace vm::fw_cfg
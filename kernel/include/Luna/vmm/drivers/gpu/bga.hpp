@@ -4,6 +4,7 @@
 #include <Luna/vmm/vm.hpp>
 
 #include <Luna/drivers/timers/timers.hpp>
+#include <Luna/mm/vmm.hpp>
 #include <Luna/misc/log.hpp>
 
 #include <Luna/vmm/drivers/pci/pci_driver.hpp>
@@ -38,7 +39,7 @@ namespace vm::gpu::bga {
     constexpr size_t max_x = 800, max_y = 600;
     
 
-    struct Driver final : public vm::AbstractMMIODriver, vm::pci::PCIDriver {
+    struct Driver final : public vm::AbstractMMIODriver, vm::pci::PCIDriver, public vm::AbstractSnapshotDriver {
         Driver(vm::Vm* vm, pci::HostBridge* bridge, vfs::File* vgabios, uint8_t slot, vm::AbstractKeyboardListener* keyboard): PCIDriver{vm}, vm{vm}, keyboard{keyboard} {
             bridge->register_pci_driver(pci::DeviceID{0, 0, slot, 0}, this);
             pci_set_option_rom(vgabios);
@@ -55,6 +56,8 @@ namespace vm::gpu::bga {
             this->edid = edid::generate_edid({.native_x = max_x, .native_y = max_y});
 
             fb = {(uint8_t*)hmm::alloc(lfb_size, 0x1000), lfb_size};
+
+            vm->snapshot_drivers.push_back(this);
         }
 
         void register_mmio_driver(Vm* vm) { ASSERT(this->vm == vm); }
@@ -88,31 +91,9 @@ namespace vm::gpu::bga {
             } else if(addr == bar2 + regs::enable) {
                 mode.enabled = value & 1;
                 if(curr_mode.enabled == false && mode.enabled == true) {
-                    window = new gui::FbWindow{{(int32_t)mode.x, (int32_t)mode.y}, fb.data(), "VM Screen", [](void* userptr, gui::KeyOp op, gui::KeyCodes code) { ((Driver*)userptr)->keyboard->handle_key_op(op, code); }, this};
-                    gui::get_desktop().add_window(window);
-
-                    
-                    spawn([this] {
-                        Promise<void> promise{};
-
-                        constexpr size_t refresh_rate_hz = 50;
-                        constexpr size_t refresh_rate_ms = 1000 / refresh_rate_hz;
-
-                        timer::Timer timer{TimePoint::from_ms(refresh_rate_ms), true, [](void* promise) {
-                            ((Promise<void>*)promise)->complete();
-                        }, &promise};
-
-                        timer.start();
-
-                        while(1) {
-                            promise.await();
-                            promise.reset();
-                            
-                            window->update();
-                        }
-                    });
-
                     curr_mode = mode;
+
+                    start_display();
                 } else { }
             } else {
                 print("bga: Unhandled MMIO Write {:#x} <- {:#x}, bar2_addr: {:#x}\n", addr, value, addr - bar2);
@@ -169,6 +150,60 @@ namespace vm::gpu::bga {
             mmio_enabled = true;
         }
 
+        void start_display() {
+            window = new gui::FbWindow{{(int32_t)curr_mode.x, (int32_t)curr_mode.y}, fb.data(), "VM Screen", [](void* userptr, gui::KeyOp op, gui::KeyCodes code) { ((Driver*)userptr)->keyboard->handle_key_op(op, code); }, this};
+            gui::get_desktop().add_window(window);
+
+            
+            spawn([this] {
+                Promise<void> promise{};
+
+                constexpr size_t refresh_rate_hz = 50;
+                constexpr size_t refresh_rate_ms = 1000 / refresh_rate_hz;
+
+                timer::Timer timer{TimePoint::from_ms(refresh_rate_ms), true, [](void* promise) {
+                    ((Promise<void>*)promise)->complete();
+                }, &promise};
+
+                timer.start();
+
+                while(1) {
+                    promise.await();
+                    promise.reset();
+                    
+                    window->update();
+                }
+            });
+        }
+
+        const char* snapshot_id() const { return "bga"; }
+
+        void snapshot_save(snapshot::Writer& out) {
+            pci_snapshot_save(out);
+
+            out.write(curr_mode);
+            out.write(mode);
+            out.write(virtual_width);
+            out.write(virtual_height);
+
+            out.write(fb.data(), fb.size_bytes());
+        }
+
+        void snapshot_restore(snapshot::Reader& in) {
+            pci_snapshot_restore(in);
+
+            in.read(curr_mode);
+            in.read(mode);
+            in.read(virtual_width);
+            in.read(virtual_height);
+
+            in.read(fb.data(), fb.size_bytes());
+
+            pci_update_bars();
+            if(curr_mode.enabled)
+                start_display();
+        }
+
 
         vm::Vm* vm;
         gui::FbWindow* window;
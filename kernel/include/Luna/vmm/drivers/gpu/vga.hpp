@@ -2,27 +2,95 @@
 
 #include <Luna/common.hpp>
 #include <Luna/vmm/vm.hpp>
+#include <Luna/mm/pmm.hpp>
 
-
+#include <std/string.hpp>
 
 namespace vm::gpu::vga {
-    struct Driver final : public vm::AbstractMMIODriver, public vm::AbstractPIODriver {
-        Driver(Vm* vm) {
-            vm->mmio_map[0xA'0000] = {this, 0x2'0000};
+    constexpr uintptr_t window_base = 0xA'0000;
+    constexpr size_t window_size = 0x2'0000;
+    constexpr size_t n_window_pages = window_size / pmm::block_size;
+
+    constexpr uint8_t seq_memory_mode = 0x4;
+    constexpr uint8_t seq_chain4 = (1 << 3);
+
+    constexpr uint8_t gc_misc = 0x6;
+    constexpr uint8_t gc_graphics = (1 << 0);
+
+    // The legacy window is shared with SMRAM, the chipset decides who gets it and calls claim_window() and release_window()
+    // In text and chain-4 modes the window is just a linear view of VRAM, so it is mapped straight into the guest and only planar modes trap
+    struct Driver final : public vm::AbstractMMIODriver, public vm::AbstractPIODriver, public vm::AbstractSnapshotDriver {
+        Driver(Vm* vm): vm{vm} {
+            vm->mmio_map[window_base] = {this, window_size};
+            vm->pio_map[0x3C4] = this;
+            vm->pio_map[0x3C5] = this;
+            vm->pio_map[0x3CE] = this;
+            vm->pio_map[0x3CF] = this;
             vm->pio_map[0x3D4] = this;
             vm->pio_map[0x3D5] = this;
+
+            for(auto& page : vram) {
+                page = pmm::alloc_block();
+                ASSERT(page);
+
+                memset((uint8_t*)(page + phys_mem_map), 0, pmm::block_size);
+            }
+
+            // Text mode, like the BIOS leaves it
+            seq[seq_memory_mode] = 0x2;
+            gc[gc_misc] = 0xE;
+
+            vm->snapshot_drivers.push_back(this);
         }
-        
+
+        void claim_window() {
+            owns_window = true;
+            update_mapping(true); // Whatever the mode, SMRAM is still mapped there and has to go
+        }
+
+        void release_window() {
+            owns_window = false;
+            update_mapping(true);
+        }
+
+        // VRAM isn't part of any memslot, so it has to be freed separately once the chipset has taken the window back
+        void free_vram() {
+            ASSERT(!owns_window);
+
+            for(auto& page : vram) {
+                pmm::free_block(page);
+                page = 0;
+            }
+        }
+
+        // Only reached in planar modes, which aren't emulated
         void mmio_write([[maybe_unused]] uintptr_t addr, [[maybe_unused]] uint64_t value, [[maybe_unused]] uint8_t size) {
 
         }
 
-        uint64_t mmio_read([[maybe_unused]] uintptr_t addr, [[maybe_unused]] uint8_t size) { 
+        uint64_t mmio_read([[maybe_unused]] uintptr_t addr, [[maybe_unused]] uint8_t size) {
             return 0;
         }
 
         void pio_write(uint16_t port, uint32_t value, uint8_t size) {
-            if(port == 0x3D4) {
+            // 16-bit writes to an index port also write the high byte to the data port
+            auto write_indexed = [&](uint8_t& index, uint8_t* regs, size_t n_regs, bool is_index) {
+                if(is_index) {
+                    index = value;
+                    if(size == 2 && index < n_regs)
+                        regs[index] = value >> 8;
+                } else if(index < n_regs) {
+                    regs[index] = value;
+                }
+
+                update_mapping();
+            };
+
+            if(port == 0x3C4 || port == 0x3C5) {
+                write_indexed(seq_index, seq, sizeof(seq), port == 0x3C4);
+            } else if(port == 0x3CE || port == 0x3CF) {
+                write_indexed(gc_index, gc, sizeof(gc), port == 0x3CE);
+            } else if(port == 0x3D4) {
                 ASSERT(size == 1); // 2 byte writes are also allowed where the value to be written is the high byte
 
                 index_3d4 = value;
@@ -39,11 +107,77 @@ namespace vm::gpu::vga {
         }
 
         uint32_t pio_read(uint16_t port, uint8_t size) {
+            if(port == 0x3C4)
+                return seq_index;
+            else if(port == 0x3C5)
+                return (seq_index < sizeof(seq)) ? seq[seq_index] : 0;
+            else if(port == 0x3CE)
+                return gc_index;
+            else if(port == 0x3CF)
+                return (gc_index < sizeof(gc)) ? gc[gc_index] : 0;
+
             print("vga: Unknown VGA PIO read: {:#x} (size: {})\n", port, size);
             return 0;
         }
 
+        const char* snapshot_id() const { return "vga"; }
+
+        void snapshot_save(snapshot::Writer& out) {
+            out.write(seq);
+            out.write(gc);
+            out.write(seq_index);
+            out.write(gc_index);
+            out.write(index_3d4);
+
+            for(auto page : vram)
+                out.write((uint8_t*)(page + phys_mem_map), pmm::block_size);
+        }
+
+        void snapshot_restore(snapshot::Reader& in) {
+            in.read(seq);
+            in.read(gc);
+            in.read(seq_index);
+            in.read(gc_index);
+            in.read(index_3d4);
+
+            for(auto page : vram)
+                in.read((uint8_t*)(page + phys_mem_map), pmm::block_size);
+
+            update_mapping(); // The chipset gives the window back to us if it should be ours
+        }
+
         private:
-        uint8_t index_3d4;
+        bool is_linear() const {
+            bool text = !(gc[gc_misc] & gc_graphics);
+            return text || (seq[seq_memory_mode] & seq_chain4);
+        }
+
+        // force reapplies the mapping even if the mode didn't change, for when the window changes hands
+        void update_mapping(bool force = false) {
+            bool want_direct = owns_window && is_linear();
+            if(want_direct == direct && !force)
+                return;
+
+            direct = want_direct;
+            if(!owns_window)
+                return; // When giving the window back the chipset maps SMRAM over it
+
+            if(direct) {
+                for(size_t i = 0; i < n_window_pages; i++)
+                    vm->mm->map(vram[i], window_base + (i * pmm::block_size), paging::mapPagePresent | paging::mapPageWrite | paging::mapPageExecute);
+            } else {
+                // Planar, every access has to go through mmio_read() and mmio_write()
+                for(size_t i = 0; i < n_window_pages; i++)
+                    vm->mm->protect(window_base + (i * pmm::block_size), 0);
+            }
+        }
+
+        Vm* vm;
+        uintptr_t vram[n_window_pages];
+        bool owns_window = false, direct = false;
+
+        uint8_t seq[8] = {}, gc[9] = {};
+        uint8_t seq_index = 0, gc_index = 0;
+        uint8_t index_3d4 = 0;
     };
-} // namespace vm::e9
+} // namespace vm::gpu::vga
@@ -3,6 +3,7 @@
 
 #include <Luna/common.hpp>
 #include <Luna/vmm/vm.hpp>
+#include <Luna/vmm/snapshot.hpp>
 
 namespace vm::hpet {
     constexpr uintptr_t base = 0xFED0'0000;
@@ -27,12 +28,16 @@ namespace vm::hpet {
     constexpr uint64_t comparator_config_clear_bits = (1 << 15); // No FSB IRQs support
     constexpr uint64_t comparator_config_set_bits = (1 << 4) | (1 << 5); // Periodic support, 64bit timer
 
-    struct Driver final : public vm::AbstractMMIODriver {
+    struct Driver final : public vm::AbstractMMIODriver, public vm::AbstractSnapshotDriver {
         Driver(Vm* vm);
 
         void mmio_write(uintptr_t addr, uint64_t value, uint8_t size);
         uint64_t mmio_read(uintptr_t addr, uint8_t size);
 
+        const char* snapshot_id() const { return "hpet"; }
+        void snapshot_save(snapshot::Writer& out);
+        void snapshot_restore(snapshot::Reader& in);
+
         private:
         uint64_t update_counter();
         void reset_counter();
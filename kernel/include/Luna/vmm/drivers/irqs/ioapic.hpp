@@ -2,6 +2,7 @@
 
 #include <Luna/common.hpp>
 #include <Luna/vmm/vm.hpp>
+#include <Luna/vmm/snapshot.hpp>
 
 
 
@@ -17,9 +18,10 @@ namespace vm::irqs::ioapic {
     constexpr uint8_t ioapic_version = 0x20; // Most recent version
     constexpr uint8_t n_redirection_entries = 0x17;
 
-    struct Driver final : public vm::AbstractMMIODriver {
+    struct Driver final : public vm::AbstractMMIODriver, public vm::AbstractSnapshotDriver {
         Driver(Vm* vm, uint32_t apic_id, uint64_t base): vm{vm}, apic_id{apic_id}, base{base} {
             vm->mmio_map[base] = {this, 0x1000};
+            vm->snapshot_drivers.push_back(this);
         }
 
         void mmio_write(uintptr_t addr, uint64_t value, uint8_t size) {
@@ -46,6 +48,10 @@ namespace vm::irqs::ioapic {
             return 0;
         }
 
+        const char* snapshot_id() const { return "ioapic"; }
+        void snapshot_save(snapshot::Writer& out) { out.write(cur_index); }
+        void snapshot_restore(snapshot::Reader& in) { in.read(cur_index); }
+
         private:
         void ioapic_write(uint8_t index, uint32_t value) {
             print("ioapic: Write to unknown IOAPIC register {:#x} <- {:#x}\n", index, value);
@@ -9,11 +9,12 @@
 #include <std/unordered_map.hpp>
 
 #include <Luna/vmm/drivers.hpp>
+#include <Luna/vmm/snapshot.hpp>
 
 
 namespace vm::irqs::lapic {
     // LAPIC is a bit weird and not a normal MMIO driver
-    struct Driver final : public vm::AbstractMMIODriver {
+    struct Driver final : public vm::AbstractMMIODriver, public vm::AbstractSnapshotDriver {
         Driver(uint8_t id): id{id}, svr{0xFF} {}
 
         void register_mmio_driver([[maybe_unused]] Vm* vm) {}
@@ -39,6 +40,8 @@ namespace vm::irqs::lapic {
             } else if(addr == (base + regs::icr_high)) {
                 icr = (icr << 32) >> 32;
                 icr |= (value << 32);
+            } else if(addr == (base + regs::lvt_pmc)) {
+                lvt_pmc = value;
             } else if(addr == (base + regs::lvt_lint0)) {
                 lint0 = value;
             } else if(addr == (base + regs::lvt_lint1)) {
@@ -52,6 +55,9 @@ namespace vm::irqs::lapic {
 
                 ASSERT((dfr & 0x0FFF'FFFF) == 0x0FFF'FFFF);
                 destination_mode = static_cast<regs::DestinationModes>((dfr >> 28) & 0xF);
+            } else if(addr == (base + regs::eoi)) {
+                if(auto vector = highest_set(isr); vector != -1)
+                    isr[vector / 32] &= ~(1u << (vector % 32));
             } else {
                 print("lapic: Unhandled write to reg: {:#x} <- {:#x}, size {}\n", addr, value, (uint16_t)size);
             }
@@ -69,6 +75,8 @@ namespace vm::irqs::lapic {
                 return icr & 0xFFFF'FFFF;
             else if(addr == (base + regs::icr_high))
                 return (icr >> 32) & 0xFFFF'FFFF;
+            else if(addr == (base + regs::lvt_pmc))
+                return lvt_pmc;
             else if(addr == (base + regs::lvt_lint0))
                 return lint0;
             else if(addr == (base + regs::lvt_lint1))
@@ -77,25 +85,130 @@ namespace vm::irqs::lapic {
                 return ldr;
             else if(addr == (base + regs::dfr))
                 return dfr;
+            else if(addr >= (base + regs::isr) && addr < (base + regs::isr + 0x80))
+                return isr[(addr - base - regs::isr) / 0x10];
+            else if(addr >= (base + regs::irr) && addr < (base + regs::irr + 0x80))
+                return __atomic_load_n(&irr[(addr - base - regs::irr) / 0x10], __ATOMIC_SEQ_CST);
             else
                 print("lapic: Unhandled read from reg: {:#x}, size {}\n", addr, (uint16_t)size);
             
             return 0;
         }
 
+        // Fixed interrupts, e.g. from MSIs, can be raised from any thread, they're injected by the VCPU once the guest can take them
+        void raise_irq(uint8_t vector) { __atomic_fetch_or(&irr[vector / 32], 1u << (vector % 32), __ATOMIC_SEQ_CST); }
+
+        // There is no TPR support, so an IRQ is deliverable if its priority class is higher than that of the one in service
+        bool has_pending_irq() const {
+            auto pending = highest_set(irr);
+            auto in_service = highest_set(isr);
+
+            return enabled && pending != -1 && (in_service == -1 || (pending >> 4) > (in_service >> 4));
+        }
+
+        // Overflow of a vm::pmu counter, only called on the VCPU thread
+        // Like on real hardware the entry gets masked, the guest unmasks it again from its handler
+        void raise_pmi() {
+            if(lvt_pmc & (1 << 16))
+                return;
+
+            auto mode = (lvt_pmc >> 8) & 0b111;
+            lvt_pmc |= (1 << 16);
+
+            if(mode == 0b000) // Fixed
+                raise_irq(lvt_pmc & 0xFF);
+            else if(mode == 0b100) // NMI, which is what Linux uses
+                nmi_pending = true;
+        }
+
+        bool has_pending_nmi() const { return nmi_pending; }
+        void ack_nmi() { nmi_pending = false; }
+
+        uint8_t ack_irq() { // Only called on the VCPU thread, after has_pending_irq()
+            auto vector = highest_set(irr);
+            ASSERT(vector != -1);
+
+            __atomic_fetch_and(&irr[vector / 32], ~(1u << (vector % 32)), __ATOMIC_SEQ_CST);
+            isr[vector / 32] |= (1u << (vector % 32));
+
+            return vector;
+        }
+
+        bool matches_destination(uint8_t dest, bool logical) const {
+            if(dest == 0xFF)
+                return true;
+
+            if(!logical)
+                return dest == id;
+
+            if(destination_mode == ::lapic::regs::DestinationModes::Flat)
+                return (logical_id & dest) != 0;
+            else // Cluster, upper nibble is the cluster, lower nibble a bitmap of the LAPICs in it
+                return ((logical_id >> 4) == (dest >> 4)) && (logical_id & dest & 0xF);
+        }
+
+        const char* snapshot_id() const { return "lapic"; }
+
+        void snapshot_save(snapshot::Writer& out) {
+            out.write(base);
+            out.write(spurious_vector);
+            out.write(logical_id);
+            out.write(enabled);
+            out.write(lint0);
+            out.write(lint1);
+            out.write(lvt_pmc);
+            out.write(nmi_pending);
+            out.write(icr);
+            out.write(dfr);
+            out.write(ldr);
+            out.write(destination_mode);
+            out.write(svr);
+            out.write(irr);
+            out.write(isr);
+        }
+
+        void snapshot_restore(snapshot::Reader& in) {
+            in.read(base);
+            in.read(spurious_vector);
+            in.read(logical_id);
+            in.read(enabled);
+            in.read(lint0);
+            in.read(lint1);
+            in.read(lvt_pmc);
+            in.read(nmi_pending);
+            in.read(icr);
+            in.read(dfr);
+            in.read(ldr);
+            in.read(destination_mode);
+            in.read(svr);
+            in.read(irr);
+            in.read(isr);
+        }
+
         private:
+        static int highest_set(const uint32_t (&bits)[8]) {
+            for(int i = 7; i >= 0; i--)
+                if(auto v = __atomic_load_n(&bits[i], __ATOMIC_SEQ_CST); v)
+                    return (i * 32) + (31 - __builtin_clz(v));
+
+            return -1;
+        }
+
         uint64_t base;
 
         uint8_t spurious_vector;
-        uint8_t id, logical_id;
+        uint8_t id, logical_id = 0;
 
-        bool enabled;
+        bool enabled = false;
 
         uint32_t lint0, lint1;
+        uint32_t lvt_pmc = (1 << 16); // Masked
+        bool nmi_pending = false;
         uint64_t icr, dfr, ldr;
-        ::lapic::regs::DestinationModes destination_mode;
+        ::lapic::regs::DestinationModes destination_mode = ::lapic::regs::DestinationModes::Flat;
 
         uint32_t svr;
+        uint32_t irr[8] = {}, isr[8] = {}; // 256 bits each, laid out like their registers
         vm::Vm* vm;
     };
 } // namespace vm::irqs::lapic
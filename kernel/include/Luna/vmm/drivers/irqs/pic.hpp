@@ -2,6 +2,7 @@
 
 #include <Luna/common.hpp>
 #include <Luna/vmm/vm.hpp>
+#include <Luna/vmm/snapshot.hpp>
 
 namespace vm::irqs::pic {
     constexpr uint16_t master_base = 0x20;
@@ -16,7 +17,7 @@ namespace vm::irqs::pic {
     constexpr uint16_t elcr_master = 0x4D0;
     constexpr uint16_t elcr_slave = 0x4D1;
 
-    struct Driver final : public vm::AbstractPIODriver, public vm::AbstractIRQListener {
+    struct Driver final : public vm::AbstractPIODriver, public vm::AbstractIRQListener, public vm::AbstractSnapshotDriver {
         Driver(Vm* vm);
 
         void pio_write(uint16_t port, uint32_t value, uint8_t size);
@@ -24,6 +25,10 @@ namespace vm::irqs::pic {
 
         void irq_set(uint8_t irq, bool level) override;
 
+        const char* snapshot_id() const { return "pic"; }
+        void snapshot_save(snapshot::Writer& out);
+        void snapshot_restore(snapshot::Reader& in);
+
         private:
         uint8_t get_priority(uint8_t device, uint8_t mask);
         std::optional<uint8_t> get_irq(uint8_t device);
@@ -2,17 +2,35 @@
 #pragma once
 
 #include <Luna/common.hpp>
+#include <Luna/cpu/mutex.hpp>
+#include <Luna/cpu/threads.hpp>
 #include <Luna/vmm/vm.hpp>
 
 #include <Luna/misc/log.hpp>
 #include <Luna/vmm/drivers/pci/pci_driver.hpp>
+#include <Luna/vmm/drivers/pci/msix.hpp>
+#include <Luna/drivers/timers/timers.hpp>
 
 #include <Luna/fs/vfs.hpp>
 
+#include <std/array.hpp>
+
 
 namespace vm::nvme {
     constexpr size_t bar_size = 0x4000;
 
+    // Doorbells start at 0x1000, the MSI-X table and PBA live after them in BAR0
+    constexpr uint32_t doorbell_base = 0x1000;
+    constexpr uint32_t msix_table = 0x2000;
+    constexpr uint32_t msix_pba = 0x3000;
+    constexpr uint16_t n_msix_vectors = 32;
+
+    constexpr uint16_t max_io_queues = n_msix_vectors - 1; // So every I/O CQ can have a vector of its own
+
+    // Maximum Data Transfer Size, in units of the minimum page size, 4MiB
+    constexpr uint8_t mdts = 10;
+    constexpr size_t max_transfer_size = (1ull << mdts) * pmm::block_size;
+
 
     constexpr size_t max_queue_entries = 256;
 
@@ -60,6 +78,51 @@ namespace vm::nvme {
     };
     static_assert(sizeof(SubmissionEntry) == 64);
 
+    // Generic command status codes, with a Status Code Type of 0
+    namespace status {
+        constexpr uint16_t success = 0x0;
+        constexpr uint16_t invalid_field = 0x2;
+        constexpr uint16_t data_transfer_error = 0x4;
+        constexpr uint16_t invalid_namespace = 0xB;
+        constexpr uint16_t sgl_invalid_descriptor_count = 0xE;
+        constexpr uint16_t sgl_invalid_data_length = 0xF;
+        constexpr uint16_t sgl_invalid_descriptor_type = 0x11;
+        constexpr uint16_t prp_invalid_offset = 0x13;
+        constexpr uint16_t lba_out_of_range = 0x80;
+
+        constexpr uint16_t invalid_interrupt_vector = (1 << 8) | 0x8; // Command Specific
+    } // namespace status
+
+    namespace sgl_type {
+        constexpr uint8_t data_block = 0;
+        constexpr uint8_t segment = 2;
+        constexpr uint8_t last_segment = 3;
+    } // namespace sgl_type
+
+    struct [[gnu::packed]] SglDescriptor {
+        uint64_t addr;
+        uint32_t len;
+        uint8_t reserved[3];
+        uint8_t id; // Type in the high nibble, subtype in the low one
+    };
+    static_assert(sizeof(SglDescriptor) == 16);
+
+    namespace feature {
+        constexpr uint8_t volatile_write_cache = 0x6;
+        constexpr uint8_t number_of_queues = 0x7;
+        constexpr uint8_t interrupt_coalescing = 0x8;
+        constexpr uint8_t interrupt_vector_config = 0x9;
+    } // namespace feature
+
+    struct [[gnu::packed]] DsmRange {
+        uint32_t attributes;
+        uint32_t n_lbas;
+        uint64_t lba;
+    };
+    static_assert(sizeof(DsmRange) == 16);
+
+    constexpr size_t max_sgl_segments = 256; // Segments can point to each other, so the guest could make us loop forever
+
     struct [[gnu::packed]] CompletionEntry {
         uint32_t cmd_specific;
         uint32_t reserved;
@@ -83,7 +146,11 @@ namespace vm::nvme {
         uint8_t cmic;
         uint8_t mdts;
 
-        uint8_t ignored[516 - 78];
+        uint8_t ignored[256 - 78];
+
+        uint16_t oacs;
+
+        uint8_t ignored_0[516 - 258];
 
         uint32_t nn;
 
@@ -132,22 +199,32 @@ namespace vm::nvme {
     };
     static_assert(sizeof(NVMSpecificIdentifyCNS06hCSI00h) == 4096);
 
-    struct Driver : vm::pci::PCIDriver, public vm::AbstractMMIODriver {
-        Driver(Vm* vm, pci::HostBridge* bridge, uint8_t slot, uint8_t func, vfs::File* file);
+    // Doorbell writes only record the new tail, commands are executed and completed on a separate I/O thread per controller
+    // so the VCPU can keep running the guest while disk I/O is in progress
+    // Every file in namespaces becomes a namespace, with NSIDs starting at 1, and up to n_io_queues I/O queue pairs are offered
+    struct Driver : vm::pci::PCIDriver, public vm::AbstractMMIODriver, public vm::AbstractSnapshotDriver {
+        Driver(Vm* vm, pci::HostBridge* bridge, uint8_t slot, uint8_t func, const std::vector<vfs::File*>& namespaces, uint16_t n_io_queues);
+        ~Driver(); // Has to be called on the VCPU thread, since the I/O thread might be waiting for it
 
         void register_mmio_driver([[maybe_unused]] Vm* vm) { }
 
         void mmio_write(uintptr_t addr, uint64_t value, uint8_t size);
         uint64_t mmio_read(uintptr_t addr, uint8_t size);
 
-        void pci_handle_write(uint16_t reg, uint32_t value, [[maybe_unused]] uint8_t size) {
+        void pci_handle_write(uint16_t reg, uint32_t value, uint8_t size) {
+            if(msix.pci_write(reg, value, size))
+                return;
+
             print("nvme: Unhandled PCI write, reg: {:#x}, value: {:#x}\n", reg, value);
         }
 
         uint32_t pci_handle_read(uint16_t reg, uint8_t size) {
-            print("nvme: Unhandled PCI read, reg: {:#x}, size: {:#x}\n", reg, (uint16_t)size);
-
-            return 0;
+            switch (size) {
+                case 1: return pci_space->data8[reg];
+                case 2: return pci_space->data16[reg / 2];
+                case 4: return pci_space->data32[reg / 4];
+                default: PANIC("Unknown PCI Access size");
+            }
         }
 
         void pci_update_bars() {
@@ -164,8 +241,16 @@ namespace vm::nvme {
             mmio_enabled = true;
         }
 
+        const char* snapshot_id() const { return "nvme"; }
+        void snapshot_save(snapshot::Writer& out);
+        void snapshot_restore(snapshot::Reader& in);
+
         private:
-        void kick_queue(uint16_t qid, uint32_t value);
+        void write_cc(uint32_t value);
+        void write_doorbell(uintptr_t offset, uint32_t value);
+
+        void iothread_main();
+        void process_queue(uint16_t qid);
 
         struct Queue;
 
@@ -175,8 +260,34 @@ namespace vm::nvme {
 
         void cq_push(uint16_t qid, CompletionEntry entry);
 
-        bool handle_admin_identify(const SubmissionEntry& cmd);
+        // With a Doorbell Buffer, the guest only rings the SQ doorbell once the tail passes the EventIdx
+        // so the I/O thread has to pick up new entries from the shadow doorbell itself before going idle
+        bool refresh_sq_tail(uint16_t qid);
+        void write_eventidx(uint16_t qid, bool completion, uint32_t value);
+
+        uint16_t handle_admin_identify(const SubmissionEntry& cmd); // Returns a status code
+
+        struct DmaRange {
+            uint64_t gpa;
+            size_t len;
+        };
+
+        // Turn the PRPs or SGL of a command into guest physical ranges covering size bytes, returns a status code
+        uint16_t build_prp_ranges(const SubmissionEntry& cmd, size_t size);
+        uint16_t build_sgl_ranges(const SubmissionEntry& cmd, size_t size);
+        void add_range(uint64_t gpa, size_t len);
+
+        vfs::File* get_namespace(uint32_t nsid) const { return (nsid >= 1 && nsid <= namespaces.size()) ? namespaces[nsid - 1] : nullptr; }
+        void flush_namespaces();
+
+        // Moves size bytes between the file at offset and the buffers of cmd in as few file accesses as possible, returns a status code
+        uint16_t transfer(const SubmissionEntry& cmd, vfs::File* file, uint64_t offset, size_t size, bool to_guest);
+        uint16_t read_data(const SubmissionEntry& cmd, void* data, size_t size); // Copies from the buffers of cmd into host memory
+
+        uint16_t write_zeroes(vfs::File* file, uint64_t offset, size_t size);
+        uint16_t handle_dsm(const SubmissionEntry& cmd, vfs::File* file);
 
+        // Both need lock to be held, except while restoring a snapshot since the I/O thread is idle then
         void check_irq() {
             uint32_t v = irq_status & ~irq_mask;
 
@@ -184,18 +295,14 @@ namespace vm::nvme {
                 pci_set_irq_line(true);
             else
                 pci_set_irq_line(false);
-        }   
+        }
 
-        void update_irqs(uint16_t qid, bool status) { // TODO: MSI-X/MSI
-            ASSERT(qid < 32);
+        void update_irqs(uint16_t qid, bool status); // Legacy INTx only
 
-            if(status)
-                irq_status |= (1 << qid);
-            else
-                irq_status &= ~(1 << qid);
-            
-            check_irq();
-        }
+        // With MSI-X every CQ has its own vector, I/O vectors can hold off on sending it until enough entries have aggregated
+        // Needs lock to be held, returns true if the coalescing timer has to be started
+        bool signal_vector(uint16_t vector);
+        void flush_coalesced();
 
         bool mmio_enabled = false;
         uintptr_t mmio_base;
@@ -210,12 +317,48 @@ namespace vm::nvme {
             uint16_t sq_head, sq_tail;
 
             bool phase = true, send_irqs = false;
+            uint16_t vector = 0;
         };
         std::unordered_map<uint16_t, Queue> queues;
 
         uint8_t cq_entry_size, sq_entry_size;
 
+        uint16_t n_io_queues, io_queues_allocated; // The latter is negotiated with Set Features, and protected by lock
+
+        // Doorbell Buffer Config, the shadow doorbells and EventIdxs are laid out just like the doorbell registers
+        bool dbbuf_enabled = false;
+        uintptr_t dbbuf_shadow = 0, dbbuf_eventidx = 0;
+
+        IrqTicketLock lock{}; // Protects the registers and queues, which are shared between the VCPU and the I/O thread
+        TicketLock io_lock{}; // Held by the I/O thread while it is executing commands
+        Promise<void> io_work{};
+        bool io_stopping = false; // Protected by io_lock
+        bool io_exited = false; // Set by the I/O thread right before it exits, only accessed with __atomic builtins
+        bool irq_update_queued = false; // Protected by lock
+
+        pci::msix::Table msix;
+
+        // Interrupt Coalescing, the threshold is 0's based and the time is in 100us units, protected by lock
+        uint8_t coalesce_threshold = 0, coalesce_time = 0;
+        struct VectorState {
+            uint16_t pending = 0; // Completions that haven't been signalled yet
+            bool coalescing_disabled = false;
+        };
+        std::array<VectorState, n_msix_vectors> vectors{};
+        bool coalesce_timer_armed = false; // ^
+        timer::Timer coalesce_timer{};
+
+        // Only used by the I/O thread
+        std::vector<DmaRange> dma_ranges;
+        std::vector<uint64_t> prp_entries;
+        std::vector<SglDescriptor> sgl_segment;
+        std::vector<DsmRange> dsm_ranges;
+        std::vector<uint8_t> zeroes;
+
+        // Writes are only cached by the host storage stack until a Flush, unless the guest turns this off
+        bool write_cache = true;
+
         vm::Vm* vm;
-        vfs::File* file;
+        std::vector<vfs::File*> namespaces;
     };
 } // namespace vm::nvme
\ No newline at end of file
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <Luna/common.hpp>
+#include <Luna/cpu/mutex.hpp>
+#include <Luna/drivers/pci.hpp>
+
+#include <Luna/vmm/vm.hpp>
+#include <Luna/vmm/drivers/pci/pci_driver.hpp>
+#include <Luna/vmm/drivers/pci/msix.hpp>
+
+#include <std/memory.hpp>
+
+namespace vm::passthrough {
+    constexpr size_t max_vectors = 32; // Host IRQ vectors given to a device, MSI-X entries past this never fire
+    constexpr size_t max_traps = 2; // The MSI-X table and the PBA
+
+    // Prints why and returns false if the device can't be handed to a guest, has to be checked before creating a Driver for it
+    bool can_attach(const ::pci::Device& device);
+
+    // Hands a host PCI function to the guest
+    // Its BARs are mapped straight into the guest, and it DMAs into guest RAM through its own IOMMU context, which maps GPAs to the backing host frames
+    // That means guest RAM can't ever move or be merged while the device is attached, vm::manager takes care of that
+    // Config space goes to the hardware, except for the header and the MSI and MSI-X capabilities, so the guest never gets to program real interrupt messages
+    // The host gets the real IRQs instead, and sends the message the guest wrote into the emulated capability or table
+    struct Driver final : public vm::AbstractMMIODriver, public vm::pci::PCIDriver {
+        Driver(Vm* vm, pci::HostBridge* bridge, uint8_t slot, uint8_t func, ::pci::Device& device);
+        ~Driver();
+
+        // Only reached for the pages that hold the MSI-X table or PBA, everything else in the BARs is mapped directly
+        void mmio_write(uintptr_t addr, uint64_t value, uint8_t size);
+        uint64_t mmio_read(uintptr_t addr, uint8_t size);
+
+        uint32_t pci_handle_read(uint16_t reg, uint8_t size);
+        void pci_handle_write(uint16_t reg, uint32_t value, uint8_t size);
+        void pci_update_bars();
+
+        private:
+        void map_guest_ram();
+        void unmap_bars();
+        bool is_trapped(uint8_t bar, uint64_t offset) const;
+
+        void handle_irq(uint16_t i);
+
+        void msi_write(uint16_t reg, uint32_t value, uint8_t size); // MSI lock has to be held
+        void send_msi(); // ^
+
+        ::pci::Device& device;
+
+        struct {
+            ::pci::Bar host;
+            uintptr_t gpa; // Where the guest has it mapped right now, 0 if it isn't
+        } bars[6];
+
+        struct Trap {
+            uint8_t bar;
+            uint64_t offset, size; // Page aligned
+        };
+        Trap traps[max_traps];
+        size_t n_traps = 0;
+
+        std::unique_ptr<vm::pci::msix::Table> msix;
+
+        IrqTicketLock msi_lock; // Taken from the host IRQ handler
+        uint8_t msi_offset = 0, msi_size = 0; // msi_offset is 0 if the device has no MSI capability
+        uint8_t msi_mask_offset = 0;
+        bool msi_pending = false;
+
+        struct Vector {
+            Driver* self;
+            uint16_t i;
+            uint8_t host_vector;
+        };
+        Vector vectors[max_vectors];
+        uint16_t n_vectors = 0;
+    };
+} // namespace vm::passthrough
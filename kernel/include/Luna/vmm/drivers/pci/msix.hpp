@@ -0,0 +1,152 @@
+#pragma once
+
+#include <Luna/common.hpp>
+#include <Luna/vmm/vm.hpp>
+#include <Luna/vmm/drivers/pci/pci.hpp>
+#include <Luna/vmm/snapshot.hpp>
+
+#include <std/vector.hpp>
+#include <std/string.hpp>
+
+namespace vm::pci::msix {
+    constexpr uint8_t cap_id = 0x11;
+    constexpr uint16_t no_vector = 0xFFFF;
+
+    namespace Control {
+        enum : uint16_t {
+            FunctionMask = (1 << 14),
+            Enable = (1 << 15)
+        };
+    } // namespace Control
+
+    constexpr uint32_t vector_control_masked = (1 << 0);
+
+    struct [[gnu::packed]] Capability {
+        uint8_t id, next;
+        uint16_t control;
+        uint32_t table; // BAR in the low 3 bits
+        uint32_t pba; // ^
+    };
+    static_assert(sizeof(Capability) == 12);
+
+    struct [[gnu::packed]] Entry {
+        uint64_t address;
+        uint32_t data;
+        uint32_t control;
+    };
+    static_assert(sizeof(Entry) == 16);
+
+    // Emulates the capability, vector table and PBA, the owning driver has to forward its config space writes and the MMIO for the table and PBA
+    struct Table {
+        Table(Vm* vm, ConfigSpace& space, uint8_t cap_offset, uint16_t n_vectors, uint8_t bar, uint32_t table_offset, uint32_t pba_offset):
+            vm{vm}, cap{(Capability*)&space.data8[cap_offset]}, cap_offset{cap_offset}, table_offset{table_offset}, pba_offset{pba_offset} {
+            ASSERT(n_vectors > 0 && n_vectors <= 2048);
+
+            *cap = {.id = cap_id, .next = 0, .control = (uint16_t)(n_vectors - 1), .table = table_offset | bar, .pba = pba_offset | bar};
+
+            entries.resize(n_vectors);
+            for(auto& entry : entries)
+                entry.control = vector_control_masked; // All vectors start out masked
+
+            pending.resize(div_ceil(n_vectors, 64));
+        }
+
+        bool is_enabled() const { return cap->control & Control::Enable; }
+        size_t table_size() const { return entries.size() * sizeof(Entry); }
+
+        // Sends the message for vector, or marks it as pending if it is masked, can be called from any thread
+        void notify(uint16_t vector) {
+            if(vector >= entries.size())
+                return;
+
+            if((cap->control & Control::FunctionMask) || (entries[vector].control & vector_control_masked)) {
+                __atomic_fetch_or(&pending[vector / 64], 1ull << (vector % 64), __ATOMIC_SEQ_CST);
+                return;
+            }
+
+            vm->deliver_msi(entries[vector].address, entries[vector].data);
+        }
+
+        // Returns false if the write wasn't to the capability, only the Enable and Function Mask bits are writable
+        bool pci_write(uint16_t reg, uint32_t value, uint8_t size) {
+            if(!ranges_overlap(reg, size, cap_offset, sizeof(Capability)))
+                return false;
+
+            uint16_t control = cap->control;
+            if(reg == cap_offset && size == 4)
+                control = value >> 16;
+            else if(reg == (cap_offset + 2) && size >= 2)
+                control = value;
+            else if(reg == (cap_offset + 3) && size == 1)
+                control = (control & 0xFF) | (value << 8);
+            else
+                return true;
+
+            constexpr uint16_t writable = Control::Enable | Control::FunctionMask;
+            cap->control = (cap->control & ~writable) | (control & writable);
+
+            deliver_pending();
+            return true;
+        }
+
+        // Returns false if offset into the BAR isn't part of the table or PBA
+        bool mmio_write(uint32_t offset, uint64_t value, uint8_t size) {
+            if(offset >= pba_offset && offset < (pba_offset + (pending.size() * sizeof(uint64_t))))
+                return true; // Read-only
+
+            if(offset < table_offset || (offset + size) > (table_offset + table_size()))
+                return false;
+
+            memcpy((uint8_t*)entries.data() + (offset - table_offset), &value, size);
+
+            deliver_pending(); // Might have been unmasked
+            return true;
+        }
+
+        bool mmio_read(uint32_t offset, uint8_t size, uint64_t& value) {
+            value = 0;
+            if(offset >= table_offset && (offset + size) <= (table_offset + table_size())) {
+                memcpy(&value, (uint8_t*)entries.data() + (offset - table_offset), size);
+                return true;
+            } else if(offset >= pba_offset && (offset + size) <= (pba_offset + (pending.size() * sizeof(uint64_t)))) {
+                memcpy(&value, (uint8_t*)pending.data() + (offset - pba_offset), size);
+                return true;
+            }
+
+            return false;
+        }
+
+        void snapshot_save(snapshot::Writer& out) {
+            out.write(entries.data(), table_size());
+            out.write(pending.data(), pending.size() * sizeof(uint64_t));
+        }
+
+        void snapshot_restore(snapshot::Reader& in) {
+            in.read(entries.data(), table_size());
+            in.read(pending.data(), pending.size() * sizeof(uint64_t));
+        }
+
+        private:
+        void deliver_pending() {
+            if(!is_enabled() || (cap->control & Control::FunctionMask))
+                return;
+
+            for(size_t i = 0; i < entries.size(); i++) {
+                auto bit = 1ull << (i % 64);
+                if(!(pending[i / 64] & bit) || (entries[i].control & vector_control_masked))
+                    continue;
+
+                __atomic_fetch_and(&pending[i / 64], ~bit, __ATOMIC_SEQ_CST);
+                vm->deliver_msi(entries[i].address, entries[i].data);
+            }
+        }
+
+        Vm* vm;
+        Capability* cap; // Lives in the config space of the device
+        uint8_t cap_offset;
+        uint32_t table_offset, pba_offset;
+
+        std::vector<Entry> entries;
+        std::vector<uint64_t> pending;
+    };
+} // namespace vm::pci::msix
@@ -4,6 +4,7 @@
 #include <Luna/cpu/paging.hpp>
 #include <Luna/vmm/vm.hpp>
 #include <Luna/vmm/drivers/pci/pci.hpp>
+#include <Luna/vmm/snapshot.hpp>
 #include <Luna/fs/vfs.hpp>
 #include <std/memory.hpp>
 
@@ -32,6 +33,13 @@ namespace vm::pci {
             }
         }
 
+        // Capabilities live after the header, so drivers that add them have to return them from pci_handle_read()
+        void pci_add_capability(uint8_t offset) {
+            pci_space->data8[offset + 1] = pci_space->header.capabilities;
+            pci_space->header.capabilities = offset;
+            pci_space->header.status |= (1 << 4); // Capabilities List
+        }
+
         void pci_set_irq_line(bool active) {
             if(pci_space->header.command & (1 << 10)) // IRQ Disable
                 return;
@@ -44,6 +52,21 @@ namespace vm::pci {
             vm->set_irq(pci_space->header.irq_line, active);
         }
 
+        // Snapshot helpers for the generic PCI state, drivers should call these from their own snapshot hooks
+        void pci_snapshot_save(snapshot::Writer& out) {
+            out.write(*pci_space);
+            out.write(option_rom_state);
+        }
+
+        void pci_snapshot_restore(snapshot::Reader& in) {
+            in.read(*pci_space);
+
+            bool rom_state = false;
+            in.read(rom_state);
+            if(rom_state && option_rom_file)
+                update_option_rom();
+        }
+
         std::unique_ptr<ConfigSpace> pci_space;
         protected:
         // Handlers
@@ -2,6 +2,7 @@
 
 #include <Luna/common.hpp>
 #include <Luna/vmm/vm.hpp>
+#include <Luna/vmm/snapshot.hpp>
 
 #include <Luna/drivers/timers/timers.hpp>
 #include <Luna/misc/log.hpp>
@@ -17,7 +18,7 @@ namespace vm::pit {
     constexpr uint64_t clock_frequency = 1193182;
     constexpr uint32_t irq_line = 0;
 
-    struct Driver final : public vm::AbstractPIODriver {
+    struct Driver final : public vm::AbstractPIODriver, public vm::AbstractSnapshotDriver {
         Driver(Vm* vm);
 
         Driver(Driver&&) = delete;
@@ -28,6 +29,10 @@ namespace vm::pit {
         void pio_write(uint16_t port, uint32_t value, uint8_t size);
         uint32_t pio_read(uint16_t port, uint8_t size);
 
+        const char* snapshot_id() const { return "pit"; }
+        void snapshot_save(snapshot::Writer& out);
+        void snapshot_restore(snapshot::Reader& in);
+
         private:
         void irq_handler();
 
@@ -2,6 +2,7 @@
 
 #include <Luna/common.hpp>
 #include <Luna/vmm/vm.hpp>
+#include <Luna/vmm/snapshot.hpp>
 
 #include <Luna/gui/gui.hpp>
 
@@ -17,7 +18,7 @@ namespace vm::ps2 {
     constexpr uint8_t port_a_irq_line = 1;
     constexpr uint8_t port_b_irq_line = 12;
 
-    struct Driver final : public vm::AbstractPIODriver, public vm::AbstractKeyboardListener {
+    struct Driver final : public vm::AbstractPIODriver, public vm::AbstractKeyboardListener, public vm::AbstractSnapshotDriver {
         Driver(Vm* vm);
 
         void handle_key_op(gui::KeyOp op, gui::KeyCodes code) override;    
@@ -25,6 +26,10 @@ namespace vm::ps2 {
         void pio_write(uint16_t port, uint32_t value, uint8_t size);
         uint32_t pio_read(uint16_t port, uint8_t size);
 
+        const char* snapshot_id() const { return "ps2"; }
+        void snapshot_save(snapshot::Writer& out);
+        void snapshot_restore(snapshot::Reader& in);
+
         private:
         struct Port;
 
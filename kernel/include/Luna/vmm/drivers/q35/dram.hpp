@@ -7,6 +7,7 @@
 
 #include <Luna/vmm/drivers/pci/pci_driver.hpp>
 #include <Luna/vmm/drivers/pci/ecam.hpp>
+#include <Luna/vmm/drivers/gpu/vga.hpp>
 
 namespace vm::q35::dram {
     constexpr uint16_t cap_off = 0xE0;
@@ -56,9 +57,10 @@ namespace vm::q35::dram {
 
     constexpr uint32_t c_smram_base = 0xA'0000;
     constexpr uint32_t c_smram_limit = 0xB'FFFF;
+    constexpr size_t n_smram_pages = (c_smram_limit + 1 - c_smram_base) / pmm::block_size;
 
-    struct Driver : vm::pci::PCIDriver {
-        Driver(vm::Vm* vm, vm::pci::HostBridge* bus, pci::ecam::Driver* ecam): PCIDriver{vm}, ecam{ecam}, vm{vm} {
+    struct Driver : vm::pci::PCIDriver, public vm::AbstractSnapshotDriver {
+        Driver(vm::Vm* vm, vm::pci::HostBridge* bus, pci::ecam::Driver* ecam, gpu::vga::Driver* vga): PCIDriver{vm}, ecam{ecam}, vga{vga}, vm{vm} {
             bus->register_pci_driver(vm::pci::DeviceID{0, 0, 0, 0}, this); // Bus 0, Slot 0, Func 0
 
             pci_space->header.vendor_id = 0x8086;
@@ -85,6 +87,44 @@ namespace vm::q35::dram {
             // Rest of the cap fields are 0
 
             pci_space->data8[smram] = 0x2;
+
+            vm->snapshot_drivers.push_back(this);
+        }
+
+        const char* snapshot_id() const { return "q35-dram"; }
+
+        void snapshot_save(snapshot::Writer& out) {
+            pci_snapshot_save(out);
+
+            out.write(smram_locked);
+            out.write(smram_accessible);
+            out.write(smram_enabled);
+
+            // SMRAM isn't mapped while the VGA has the window, so the RAM snapshot won't have it
+            out.write(vga_owns_window);
+            if(vga_owns_window)
+                for(auto page : smram_pages)
+                    out.write((uint8_t*)(page + phys_mem_map), pmm::block_size);
+        }
+
+        void snapshot_restore(snapshot::Reader& in) {
+            pci_snapshot_restore(in);
+
+            in.read(smram_locked);
+            in.read(smram_accessible);
+            in.read(smram_enabled);
+
+            bool saved_vga_owns_window = false;
+            in.read(saved_vga_owns_window);
+            if(saved_vga_owns_window) // Restored into a fresh VM, so SMRAM is still mapped
+                for(size_t addr = c_smram_base; addr < c_smram_limit; addr += pmm::block_size)
+                    in.read((uint8_t*)(vm->mm->get_phys(addr) + phys_mem_map), pmm::block_size);
+
+            memset(pam_cache, 0xFF, n_pam); // Force all PAM regions to be reprotected
+            pam_update();
+            pciexbar_update();
+
+            route_window(!smram_accessible);
         }
 
         void pci_handle_write(uint16_t reg, uint32_t value, uint8_t size) {
@@ -201,12 +241,7 @@ namespace vm::q35::dram {
                 PANIC("TODO: Implement SMRAM Closing"); // Code accesses references reference SMRAM, however Data accesses reference VGA VRAM
 
             if(new_state != smram_accessible) {
-                uint64_t flags = 0;
-                if(new_state)
-                    flags |= paging::mapPagePresent | paging::mapPageWrite | paging::mapPageExecute;
-
-                for(size_t addr = c_smram_base; addr < c_smram_limit; addr += pmm::block_size)
-                    vm->mm->protect(addr, flags);
+                route_window(!new_state);
 
                 smram_accessible = new_state;
             }
@@ -216,19 +251,46 @@ namespace vm::q35::dram {
             if(smram_accessible)
                 return;
             
-            for(size_t addr = c_smram_base; addr < c_smram_limit; addr += pmm::block_size)
-                vm->mm->protect(addr, paging::mapPagePresent | paging::mapPageWrite | paging::mapPageExecute);
+            route_window(false);
         }
 
         void smm_leave() {
             if(smram_accessible)
                 return;
 
-            for(size_t addr = c_smram_base; addr < c_smram_limit; addr += pmm::block_size)
-                vm->mm->protect(addr, 0);
+            route_window(true);
+        }
+
+        // SMRAM goes back into the window, so freeing the guest RAM memslots frees it and not the VGA's VRAM
+        void reclaim_window() {
+            route_window(false);
+        }
+
+        // Outside of SMM, with SMRAM closed, the window goes to the VGA which maps its own VRAM there
+        void route_window(bool to_vga) {
+            if(to_vga == vga_owns_window)
+                return;
+
+            if(to_vga) {
+                for(size_t i = 0; i < n_smram_pages; i++)
+                    smram_pages[i] = vm->mm->get_phys(c_smram_base + (i * pmm::block_size));
+
+                vga->claim_window();
+            } else {
+                vga->release_window();
+
+                for(size_t i = 0; i < n_smram_pages; i++)
+                    vm->mm->map(smram_pages[i], c_smram_base + (i * pmm::block_size), paging::mapPagePresent | paging::mapPageWrite | paging::mapPageExecute);
+            }
+
+            vga_owns_window = to_vga;
         }
 
         pci::ecam::Driver* ecam;
+        gpu::vga::Driver* vga;
+
+        uintptr_t smram_pages[n_smram_pages]; // Where SMRAM lives while the VGA has the window
+        bool vga_owns_window = false;
 
         uint8_t pam_cache[n_pam];
         bool smram_locked = false, smram_accessible = true, smram_enabled = false; // TODO: Maybe SMRAM shouldn't be enabled by default
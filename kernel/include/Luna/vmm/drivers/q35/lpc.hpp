@@ -27,7 +27,7 @@ namespace vm::q35::lpc {
 
     constexpr uint8_t root_complex_base = 0xF0;
 
-    struct Driver : pci::PCIDriver {
+    struct Driver : pci::PCIDriver, public vm::AbstractSnapshotDriver {
         Driver(vm::Vm* vm, vm::pci::HostBridge* bus, vm::q35::acpi::Driver* acpi_dev): PCIDriver{vm}, vm{vm}, acpi_dev{acpi_dev} {
             bus->register_pci_driver(pci::DeviceID{0, 0, 31, 0}, this);
 
@@ -67,6 +67,42 @@ namespace vm::q35::lpc {
             pci_space->data8[pirq_b_base + 3] = 0x80;
 
             pci_space->data32[root_complex_base / 4] = 0;
+
+            vm->snapshot_drivers.push_back(this);
+        }
+
+        const char* snapshot_id() const { return "q35-lpc"; }
+
+        void snapshot_save(snapshot::Writer& out) {
+            pci_snapshot_save(out);
+
+            // The ACPI PM block lives behind the LPC, so save it here too
+            out.write(acpi_dev->generate_smis);
+            out.write(acpi_dev->smi_enable);
+            out.write(acpi_dev->pm1_control_val);
+            out.write(acpi_dev->pm1_status_val);
+            out.write(acpi_dev->pm1_enable_val);
+            out.write(acpi_dev->gpe0_sts_val);
+            out.write(acpi_dev->gpe0_en_val);
+        }
+
+        void snapshot_restore(snapshot::Reader& in) {
+            pci_snapshot_restore(in);
+
+            in.read(acpi_dev->generate_smis);
+            in.read(acpi_dev->smi_enable);
+            in.read(acpi_dev->pm1_control_val);
+            in.read(acpi_dev->pm1_status_val);
+            in.read(acpi_dev->pm1_enable_val);
+            in.read(acpi_dev->gpe0_sts_val);
+            in.read(acpi_dev->gpe0_en_val);
+
+            // Everything else is derived from PCI config space
+            pmbase_update();
+            acpi_cntl_update();
+
+            root_complex_enable = (pci_space->data32[root_complex_base / 4] & 1);
+            root_complex_addr = (pci_space->data32[root_complex_base / 4] >> 13) << 13;
         }
 
         void pci_handle_write(uint16_t reg, uint32_t value, uint8_t size) {
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <Luna/common.hpp>
+#include <Luna/vmm/drivers/virtio/virtio.hpp>
+
+#include <Luna/fs/vfs.hpp>
+
+namespace vm::virtio::blk {
+    constexpr size_t sector_size = 512;
+    constexpr uint16_t queue_size = 256;
+    constexpr uint32_t seg_max = queue_size - 2; // Minus the header and status
+
+    namespace Features {
+        enum : uint64_t {
+            SegMax = (1 << 2),
+            BlkSize = (1 << 6),
+            Flush = (1 << 9),
+            Mq = (1 << 12)
+        };
+    } // namespace Features
+
+    namespace RequestType {
+        enum : uint32_t {
+            In = 0,
+            Out = 1,
+            Flush = 4,
+            GetId = 8
+        };
+    } // namespace RequestType
+
+    namespace RequestStatus {
+        enum : uint8_t {
+            Ok = 0,
+            IoErr = 1,
+            Unsupported = 2
+        };
+    } // namespace RequestStatus
+
+    struct [[gnu::packed]] RequestHeader {
+        uint32_t type;
+        uint32_t reserved;
+        uint64_t sector;
+    };
+
+    struct [[gnu::packed]] Config {
+        uint64_t capacity; // In 512 byte sectors
+        uint32_t size_max;
+        uint32_t seg_max;
+        struct {
+            uint16_t cylinders;
+            uint8_t heads;
+            uint8_t sectors;
+        } geometry;
+        uint32_t blk_size;
+        struct {
+            uint8_t physical_block_exp;
+            uint8_t alignment_offset;
+            uint16_t min_io_size;
+            uint32_t opt_io_size;
+        } topology;
+        uint8_t writeback;
+        uint8_t unused;
+        uint16_t num_queues;
+    };
+    static_assert(sizeof(Config) == 0x24);
+
+    // 1 request queue per VCPU, so every VCPU can submit without contending with the others
+    struct Driver final : public vm::virtio::Device {
+        Driver(Vm* vm, pci::HostBridge* bridge, uint8_t slot, uint8_t func, vfs::File* file);
+
+        const char* snapshot_id() const { return "virtio-blk"; }
+
+        private:
+        void handle_queue(uint16_t i);
+        uint64_t device_config_read(uint32_t offset, uint8_t size);
+
+        uint8_t handle_request(const Chain& chain, uint32_t& written);
+
+        Config config;
+        vfs::File* file;
+        TicketLock file_lock{}; // Files and overlays aren't thread safe, and every queue can be processed on a different VCPU thread
+    };
+} // namespace vm::virtio::blk
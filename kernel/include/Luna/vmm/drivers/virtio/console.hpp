@@ -0,0 +1,103 @@
+#pragma once
+
+#include <Luna/common.hpp>
+#include <Luna/cpu/mutex.hpp>
+#include <Luna/vmm/drivers/virtio/virtio.hpp>
+
+#include <Luna/misc/log.hpp>
+
+namespace vm::virtio::console {
+    constexpr uint16_t queue_size = 128;
+
+    // With multiport, port 0 uses queues 0 and 1, the control queues are 2 and 3, and port n uses the 2 after that
+    constexpr uint16_t control_rx_queue = 2;
+    constexpr uint16_t control_tx_queue = 3;
+
+    namespace Features {
+        enum : uint64_t {
+            Size = (1 << 0),
+            Multiport = (1 << 1),
+            EmergWrite = (1 << 2)
+        };
+    } // namespace Features
+
+    namespace ControlEvent {
+        enum : uint16_t {
+            DeviceReady = 0,
+            DeviceAdd = 1,
+            DeviceRemove = 2,
+            PortReady = 3,
+            ConsolePort = 4,
+            Resize = 5,
+            PortOpen = 6,
+            PortName = 7
+        };
+    } // namespace ControlEvent
+
+    struct [[gnu::packed]] Control {
+        uint32_t id;
+        uint16_t event;
+        uint16_t value;
+    };
+    static_assert(sizeof(Control) == 8);
+
+    struct [[gnu::packed]] Config {
+        uint16_t cols;
+        uint16_t rows;
+        uint32_t max_nr_ports;
+        uint32_t emerg_wr;
+    };
+    static_assert(sizeof(Config) == 12);
+
+    // Keeps the last bytes written to it, older output is overwritten once it is full
+    struct Ring {
+        Ring(size_t size);
+
+        void write(const uint8_t* data, size_t size);
+        size_t read(uint8_t* data, size_t size); // Returns the amount of bytes taken out
+
+        private:
+        TicketLock lock{};
+        std::vector<uint8_t> buf;
+        size_t head = 0, count = 0;
+    };
+
+    // Port 0 is the console, which writes into a logger, other ports are named and go into a ring buffer
+    // Output arrives a whole buffer at a time, instead of a VM exit per character like the UART
+    struct Driver final : public vm::virtio::Device {
+        Driver(Vm* vm, pci::HostBridge* bridge, uint8_t slot, uint8_t func, log::Logger* console, uint32_t max_ports);
+
+        // Has to be called before the guest starts, returns the ID of the port
+        uint32_t add_port(const char* name, size_t ring_size);
+
+        // Takes up to size bytes of output out of a named port, can be called from any thread
+        size_t read(uint32_t id, uint8_t* data, size_t size);
+
+        const char* snapshot_id() const { return "virtio-console"; }
+
+        private:
+        void handle_queue(uint16_t i);
+        uint64_t device_config_read(uint32_t offset, uint8_t size);
+        void device_config_write(uint32_t offset, uint64_t value, uint8_t size);
+        void device_reset();
+
+        void handle_output(uint32_t id);
+        void handle_control();
+        void handle_control_message(const Control& msg);
+
+        void send_control(uint32_t id, uint16_t event, uint16_t value, const char* name = nullptr);
+        void flush_control(); // Control RX queue lock has to be held
+
+        struct Port {
+            const char* name; // nullptr for the console
+            log::Logger* logger;
+            Ring* ring;
+        };
+
+        Config config;
+        std::vector<Port> ports;
+
+        std::vector<std::vector<uint8_t>> control_pending; // Messages for the guest that didn't fit in the control RX queue yet, protected by its lock
+        size_t control_pending_head = 0; // ^
+    };
+} // namespace vm::virtio::console
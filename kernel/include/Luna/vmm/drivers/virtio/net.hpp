@@ -0,0 +1,95 @@
+#pragma once
+
+#include <Luna/common.hpp>
+#include <Luna/vmm/drivers/virtio/virtio.hpp>
+#include <Luna/vmm/netswitch.hpp>
+
+#include <Luna/net/if.hpp>
+
+namespace vm::virtio::net {
+    constexpr uint16_t queue_size = 256;
+    constexpr uint16_t rx_queue = 0;
+    constexpr uint16_t tx_queue = 1;
+    constexpr size_t max_backlog = 256; // Packets that arrived while the guest had no RX buffers
+
+    namespace Features {
+        enum : uint64_t {
+            Csum = (1 << 0),
+            GuestCsum = (1 << 1),
+            Mac = (1 << 5),
+            GuestTso4 = (1 << 7),
+            HostTso4 = (1 << 11),
+            MrgRxbuf = (1 << 15),
+            Status = (1 << 16)
+        };
+    } // namespace Features
+
+    namespace HeaderFlags {
+        enum : uint8_t {
+            NeedsCsum = (1 << 0),
+            DataValid = (1 << 1)
+        };
+    } // namespace HeaderFlags
+
+    namespace GsoType {
+        enum : uint8_t {
+            None = 0,
+            TcpV4 = 1,
+            Ecn = 0x80
+        };
+    } // namespace GsoType
+
+    struct [[gnu::packed]] Header {
+        uint8_t flags;
+        uint8_t gso_type;
+        uint16_t hdr_len;
+        uint16_t gso_size;
+        uint16_t csum_start;
+        uint16_t csum_offset;
+        uint16_t num_buffers; // Amount of chains a received packet was merged over
+    };
+    static_assert(sizeof(Header) == 12);
+
+    namespace LinkStatus {
+        enum : uint16_t {
+            Up = (1 << 0)
+        };
+    } // namespace LinkStatus
+
+    struct [[gnu::packed]] Config {
+        uint8_t mac[6];
+        uint16_t status;
+        uint16_t max_virtqueue_pairs;
+        uint16_t mtu;
+    };
+    static_assert(sizeof(Config) == 12);
+
+    // Transmitted packets go straight from guest memory to the switch, so they're only copied once, into the RX buffers of the receiver
+    struct Driver final : public vm::virtio::Device, public vm::netswitch::Port {
+        Driver(Vm* vm, pci::HostBridge* bridge, uint8_t slot, uint8_t func, const ::net::Mac& mac, vm::netswitch::Switch& sw);
+        ~Driver();
+
+        const char* snapshot_id() const { return "virtio-net"; }
+
+        void receive(const vm::netswitch::Packet& packet);
+
+        private:
+        void handle_queue(uint16_t i);
+        uint64_t device_config_read(uint32_t offset, uint8_t size);
+        void device_reset();
+
+        void transmit();
+        bool deliver(const vm::netswitch::Packet& packet); // RX queue lock has to be held, returns false if there weren't enough buffers
+        void flush_backlog(); // ^
+
+        struct Pending {
+            std::vector<uint8_t> data;
+            vm::netswitch::Offload offload;
+        };
+
+        Config config;
+        vm::netswitch::Switch& sw;
+        std::vector<Pending> backlog; // Protected by the RX queue lock
+        size_t backlog_head = 0; // ^, first packet in backlog that hasn't been delivered yet
+    };
+} // namespace vm::virtio::net
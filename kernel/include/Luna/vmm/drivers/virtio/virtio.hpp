@@ -0,0 +1,312 @@
+#pragma once
+
+#include <Luna/common.hpp>
+#include <Luna/cpu/mutex.hpp>
+#include <Luna/mm/pmm.hpp>
+#include <Luna/vmm/vm.hpp>
+
+#include <Luna/misc/log.hpp>
+#include <Luna/vmm/drivers/pci/pci_driver.hpp>
+#include <Luna/vmm/drivers/pci/msix.hpp>
+
+#include <std/vector.hpp>
+
+// Virtio 1.x over PCI, see the OASIS Virtual I/O Device (VIRTIO) Version 1.2 spec
+namespace vm::virtio {
+    constexpr uint16_t pci_vendor_id = 0x1AF4;
+    constexpr uint16_t pci_device_id_base = 0x1040; // Modern devices are 0x1040 + their device type
+
+    namespace DeviceType {
+        enum : uint16_t {
+            Net = 1,
+            Block = 2,
+            Console = 3
+        };
+    } // namespace DeviceType
+
+    namespace Features {
+        enum : uint64_t {
+            RingIndirectDesc = (1ull << 28),
+            RingEventIdx = (1ull << 29),
+            Version1 = (1ull << 32),
+            RingPacked = (1ull << 34)
+        };
+    } // namespace Features
+
+    namespace Status {
+        enum : uint8_t {
+            Acknowledge = (1 << 0),
+            Driver = (1 << 1),
+            DriverOk = (1 << 2),
+            FeaturesOk = (1 << 3),
+            NeedsReset = (1 << 6),
+            Failed = (1 << 7)
+        };
+    } // namespace Status
+
+    namespace Isr {
+        enum : uint8_t {
+            Queue = (1 << 0),
+            Config = (1 << 1)
+        };
+    } // namespace Isr
+
+    // Everything lives in BAR0, each structure gets its own page
+    constexpr size_t bar_size = 0x8000;
+    namespace regions {
+        constexpr uint32_t common = 0x0;
+        constexpr uint32_t isr = 0x1000;
+        constexpr uint32_t device = 0x2000;
+        constexpr uint32_t notify = 0x3000;
+        constexpr uint32_t msix_table = 0x4000;
+        constexpr uint32_t msix_pba = 0x5000;
+    } // namespace regions
+
+    constexpr uint32_t notify_off_multiplier = 4; // Every queue gets its own doorbell, so the queue doesn't have to be looked up from the value
+
+    namespace common {
+        constexpr uint32_t device_feature_select = 0x0;
+        constexpr uint32_t device_feature = 0x4;
+        constexpr uint32_t driver_feature_select = 0x8;
+        constexpr uint32_t driver_feature = 0xC;
+        constexpr uint32_t config_msix_vector = 0x10;
+        constexpr uint32_t num_queues = 0x12;
+        constexpr uint32_t device_status = 0x14;
+        constexpr uint32_t config_generation = 0x15;
+        constexpr uint32_t queue_select = 0x16;
+        constexpr uint32_t queue_size = 0x18;
+        constexpr uint32_t queue_msix_vector = 0x1A;
+        constexpr uint32_t queue_enable = 0x1C;
+        constexpr uint32_t queue_notify_off = 0x1E;
+        constexpr uint32_t queue_desc = 0x20;
+        constexpr uint32_t queue_driver = 0x28;
+        constexpr uint32_t queue_device = 0x30;
+        constexpr uint32_t size = 0x38;
+    } // namespace common
+
+    namespace CapType {
+        enum : uint8_t {
+            Common = 1,
+            Notify = 2,
+            Isr = 3,
+            Device = 4
+        };
+    } // namespace CapType
+
+    struct [[gnu::packed]] PciCap {
+        uint8_t id, next, len, type;
+        uint8_t bar, cap_id;
+        uint16_t padding;
+        uint32_t offset, length;
+    };
+    static_assert(sizeof(PciCap) == 16);
+
+    struct [[gnu::packed]] PciNotifyCap {
+        PciCap cap;
+        uint32_t notify_off_multiplier;
+    };
+    static_assert(sizeof(PciNotifyCap) == 20);
+
+    namespace DescFlags {
+        enum : uint16_t {
+            Next = (1 << 0),
+            Write = (1 << 1),
+            Indirect = (1 << 2),
+            Avail = (1 << 7), // Packed only
+            Used = (1 << 15) // ^
+        };
+    } // namespace DescFlags
+
+    struct [[gnu::packed]] SplitDesc {
+        uint64_t addr;
+        uint32_t len;
+        uint16_t flags, next;
+    };
+    static_assert(sizeof(SplitDesc) == 16);
+
+    struct [[gnu::packed]] PackedDesc {
+        uint64_t addr;
+        uint32_t len;
+        uint16_t id, flags;
+    };
+    static_assert(sizeof(PackedDesc) == 16);
+
+    namespace EventFlags { // Packed ring event suppression
+        enum : uint16_t {
+            Enable = 0,
+            Disable = 1,
+            Desc = 2 // Only with RingEventIdx
+        };
+    } // namespace EventFlags
+
+    bool copy_from_guest(Vm& vm, uintptr_t gpa, void* data, size_t size);
+    bool copy_to_guest(Vm& vm, uintptr_t gpa, const void* data, size_t size);
+
+    template<typename T>
+    T read_guest(Vm& vm, uintptr_t gpa) {
+        T v{};
+        copy_from_guest(vm, gpa, &v, sizeof(T));
+        return v;
+    }
+
+    template<typename T>
+    void write_guest(Vm& vm, uintptr_t gpa, const T& v) { copy_to_guest(vm, gpa, &v, sizeof(T)); }
+
+    struct Buffer {
+        uint64_t gpa;
+        uint32_t len;
+        bool write; // Device writable
+    };
+
+    // A descriptor chain, with the readable buffers always before the writable ones
+    struct Chain {
+        uint16_t id; // Head index for split rings, buffer ID for packed rings
+        uint16_t n_descs; // Amount of ring slots it takes up, only needed for packed rings
+        std::vector<Buffer> bufs;
+        size_t readable, writable; // Total sizes
+
+        // Calls f(host_va, size) for the pieces of the size bytes at offset into the readable or writable part, returns false if it is out of bounds
+        template<typename F>
+        bool for_each_range(Vm& vm, bool writable_part, size_t offset, size_t size, F&& f) const {
+            if((offset + size) > (writable_part ? writable : readable))
+                return false;
+
+            for(const auto& buf : bufs) {
+                if(buf.write != writable_part)
+                    continue;
+
+                if(offset >= buf.len) {
+                    offset -= buf.len;
+                    continue;
+                }
+
+                auto chunk = min(buf.len - offset, size);
+                if(!for_each_host_range(vm, buf.gpa + offset, chunk, writable_part, f))
+                    return false;
+
+                size -= chunk;
+                offset = 0;
+                if(size == 0)
+                    break;
+            }
+
+            return true;
+        }
+
+        bool read(Vm& vm, size_t offset, void* data, size_t size) const {
+            auto* dst = (uint8_t*)data;
+            return for_each_range(vm, false, offset, size, [&](uint8_t* va, size_t chunk) { memcpy(dst, va, chunk); dst += chunk; return true; });
+        }
+
+        bool write(Vm& vm, size_t offset, const void* data, size_t size) const {
+            auto* src = (const uint8_t*)data;
+            return for_each_range(vm, true, offset, size, [&](uint8_t* va, size_t chunk) { memcpy(va, src, chunk); src += chunk; return true; });
+        }
+    };
+
+    struct Queue {
+        // Returns false if there are no more available chains
+        bool pop(Chain& chain);
+        void push(const Chain& chain, uint32_t written);
+
+        // Whether the driver wants an IRQ for the chains pushed since the last time this returned true
+        bool should_notify();
+
+        // Tells the driver not to kick the queue while we're already processing it
+        void disable_notifications();
+
+        // Returns true if chains were made available after processing stopped, in which case they have to be processed too
+        bool enable_notifications();
+
+        void reset();
+
+        // Lets a device put back chains it popped but can't use yet, e.g. when a packet doesn't fit in the RX buffers that are available
+        struct Checkpoint {
+            uint16_t next_avail;
+            bool avail_wrap;
+        };
+
+        Checkpoint checkpoint() const { return {next_avail, avail_wrap}; }
+        void rewind(const Checkpoint& checkpoint) {
+            next_avail = checkpoint.next_avail;
+            avail_wrap = checkpoint.avail_wrap;
+        }
+
+        // Set up by the driver
+        uint16_t size = 0, max_size = 0;
+        uint16_t msix_vector = pci::msix::no_vector;
+        bool enabled = false;
+        uint64_t desc = 0, driver = 0, device = 0; // Split: Descriptor table, available ring, used ring, Packed: Descriptor ring, driver and device event suppression
+
+        // Negotiated when the queue is enabled
+        bool packed = false, event_idx = false, indirect = false;
+
+        uint16_t next_avail = 0, next_used = 0; // Free running for split rings, ring indices for packed rings
+        bool avail_wrap = true, used_wrap = true;
+        uint16_t used_since_notify = 0;
+
+        Vm* vm = nullptr;
+        TicketLock lock{}; // Held while the queue is being processed
+
+        private:
+        bool fail(const char* msg);
+        bool add_desc(Chain& chain, uint64_t addr, uint32_t len, bool write);
+        bool add_indirect(Chain& chain, uint64_t addr, uint32_t len);
+
+        bool split_pop(Chain& chain);
+        bool packed_pop(Chain& chain);
+        bool packed_is_avail(uint16_t i, bool wrap);
+    };
+
+    struct Device : public vm::pci::PCIDriver, public vm::AbstractMMIODriver, public vm::AbstractSnapshotDriver {
+        // n_vectors MSI-X vectors are exposed, vector 0 is meant for config changes, and queues are expected to use the ones after that
+        Device(Vm* vm, pci::HostBridge* bridge, uint8_t slot, uint8_t func, uint16_t type, uint16_t n_queues, uint16_t max_queue_size, uint64_t features);
+
+        void register_mmio_driver([[maybe_unused]] Vm* vm) { }
+
+        void mmio_write(uintptr_t addr, uint64_t value, uint8_t size);
+        uint64_t mmio_read(uintptr_t addr, uint8_t size);
+
+        void pci_handle_write(uint16_t reg, uint32_t value, uint8_t size);
+        uint32_t pci_handle_read(uint16_t reg, uint8_t size);
+        void pci_update_bars();
+
+        void snapshot_save(snapshot::Writer& out);
+        void snapshot_restore(snapshot::Reader& in);
+
+        protected:
+        // Called on the thread of the VCPU that kicked the queue, with nothing locked
+        virtual void handle_queue(uint16_t i) = 0;
+        virtual uint64_t device_config_read(uint32_t offset, uint8_t size) = 0;
+        virtual void device_config_write(uint32_t offset, uint64_t value, uint8_t size) {
+            print("virtio: Unhandled device config write {:#x} <- {:#x} ({})\n", offset, value, (uint16_t)size);
+        }
+        virtual void device_reset() {}
+        virtual void device_ready() {} // The driver has set DRIVER_OK
+
+        bool has_feature(uint64_t feature) const { return (driver_features & feature) == feature; }
+
+        // Sends an IRQ for the queue if the driver wants one
+        void notify_queue(Queue& queue);
+        void notify_config();
+
+        std::vector<Queue> queues;
+
+        private:
+        void common_write(uint32_t reg, uint64_t value, uint8_t size);
+        uint64_t common_read(uint32_t reg, uint8_t size);
+
+        void raise_irq(uint16_t vector, uint8_t isr_bit);
+        void reset();
+
+        uint64_t device_features, driver_features;
+        uint32_t device_feature_select, driver_feature_select;
+        uint16_t queue_select, config_msix_vector;
+        uint8_t status, config_generation, isr;
+
+        pci::msix::Table msix;
+
+        bool mmio_enabled = false;
+        uintptr_t mmio_base;
+    };
+} // namespace vm::virtio
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <Luna/common.hpp>
+
+namespace vm {
+    struct Vm;
+} // namespace vm
+
+// Same page merging, a background thread periodically scans the mergeable memslots of every registered VM
+// and maps identical pages to a single read-only frame, writes to them break the sharing again through Vm::handle_memslot_fault
+namespace vm::ksm {
+    constexpr size_t scan_interval_ms = 5000;
+
+    // Should be called once the VM is fully set up, e.g. after a snapshot was restored
+    void register_vm(Vm* vm);
+    void unregister_vm(Vm* vm); // Has to be called from the thread of VCPU 0, since an in progress scan might still need it
+
+    bool is_shared(uintptr_t hpa);
+    void put(uintptr_t hpa); // Drop a reference to a shared frame, frees it if this was the last one
+} // namespace vm::ksm
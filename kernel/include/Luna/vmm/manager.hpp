@@ -0,0 +1,102 @@
+#pragma once
+
+#include <Luna/common.hpp>
+
+namespace vm {
+    struct Vm;
+} // namespace vm
+
+namespace vm::manager {
+    enum class NetBackend {
+        None,
+        Loopback, // Only connected to other VMs on the loopback switch
+        Host // Bridged to the host NIC, together with the other VMs that use it
+    };
+
+    // Every interval the guest time of each host CPU is compared, and a VM is moved from the busiest one to the idlest one if the gap is large enough
+    constexpr size_t rebalance_interval_ms = 1000;
+    constexpr size_t rebalance_threshold_percent = 25; // Of the interval
+    constexpr size_t max_extra_disks = 4;
+    constexpr size_t max_passthrough_devices = 4;
+
+    // Location of a host PCI function that is handed to the guest, see vm::passthrough
+    struct HostPciDevice {
+        bool enabled = false;
+        uint16_t seg = 0;
+        uint8_t bus = 0, slot = 0, func = 0;
+    };
+
+    struct VmConfig {
+        const char* name = "VM";
+
+        size_t ram_size = 128 * 1024 * 1024; // RAM above 1MiB
+        uint8_t n_cpus = 1;
+
+        const char* bios = "A:/luna/bios.bin"; // Not used if kernel is set
+        const char* vgabios = "A:/luna/vgabios.bin"; // Only used if display is true
+
+        // Boots a Linux bzImage directly, without going through the firmware and a bootloader
+        // If linuxboot_rom is set the firmware still runs, and boots the kernel it gets over fw_cfg with that option ROM instead
+        const char* kernel = nullptr;
+        const char* initrd = nullptr; // Optional
+        const char* cmdline = "console=hvc0"; // The virtio-console, use ttyS0 if virtio_console is false
+        const char* linuxboot_rom = nullptr;
+
+        const char* boot_order = nullptr; // Newline separated firmware device paths, passed to the firmware over fw_cfg
+
+        const char* disk_image = nullptr; // Attached as an NVMe drive if not null, can be a raw image or an overlay
+        const char* disk_overlay = nullptr; // If not null, writes go to this overlay and disk_image is only read, formatted on top of disk_image if it isn't an overlay yet
+        const char* extra_disk_images[max_extra_disks] = {}; // Attached as NVMe namespaces 2 and up, always written to directly
+        uint16_t nvme_queues = 0; // I/O queue pairs the NVMe drive offers, 0 means one per VCPU
+        const char* virtio_disk_image = nullptr; // Attached as a virtio-blk drive if not null, can be a raw image or an overlay
+        const char* snapshot = nullptr; // Restored from if it contains a valid snapshot, the guest can save to it with a hypercall
+
+        // Put on the guest PCI bus from slot 10 onwards, they need an IOMMU and a host MSI or MSI-X capability, and can't have a host driver
+        // Guest RAM is allocated up front and never merged for VMs that use this, and they can't be snapshotted, since the hardware state can't be saved
+        HostPciDevice passthrough[max_passthrough_devices] = {};
+
+        NetBackend net = NetBackend::None; // Attaches a virtio-net NIC with MAC 52:54:00:4C:55:<VM ID> if not None
+
+        // Attaches a virtio-console, its console port (hvc0) writes to the log window, like the UART but without a VM exit per character
+        // Port "org.luna.log" goes into a per-VM ring buffer instead, which can be read with read_log()
+        bool virtio_console = true;
+
+        bool display = true;
+
+        // Dirty logs the RAM above 1MiB, Usage::dirty_pages is then the amount of pages written since the previous get_usage()
+        bool track_dirty = false;
+
+        // Samples the guest RIP every vm::profiler::sample_interval_ms and writes the histogram in folded stack format to this file once the VM stops
+        // The file has to exist already and be big enough, since files can't be grown, profile_symbols is an optional guest System.map
+        const char* profile = nullptr;
+        const char* profile_symbols = nullptr;
+    };
+
+    enum class VmState { Starting, Running, Stopped };
+
+    struct Usage {
+        VmState state;
+        uint32_t host_cpu;
+
+        uint64_t guest_time_ns; // Summed over all VCPUs
+        size_t resident_pages, shared_pages;
+        size_t dirty_pages; // Only with VmConfig::track_dirty
+    };
+
+    void add_host_cpu(uint32_t lapic_id); // Called by vm::init() on every CPU that supports virtualization
+
+    constexpr size_t invalid_id = ~0ull;
+
+    // Returns an ID that can be used to refer to the VM, the VM is built and started asynchronously on its own thread
+    // Returns invalid_id if the config isn't supported, guests can't start APs yet since INIT/SIPI isn't emulated, so n_cpus has to be 1
+    size_t create(const VmConfig& config);
+    void destroy(size_t id); // Blocks until the VM has stopped and its RAM is freed
+    bool migrate(size_t id, uint32_t lapic_id); // Moves all VCPUs of the VM to another host CPU, returns false if the VM isn't running
+
+    bool get_usage(size_t id, Usage& usage);
+    void print_usage();
+
+    constexpr size_t log_ring_size = 64 * 1024;
+    size_t read_log(size_t id, uint8_t* data, size_t size); // Takes up to size bytes out of the log port of the VM, returns how many
+
+} // namespace vm::manager
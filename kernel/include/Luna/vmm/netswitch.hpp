@@ -0,0 +1,66 @@
+#pragma once
+
+#include <Luna/common.hpp>
+#include <Luna/cpu/mutex.hpp>
+#include <Luna/net/if.hpp>
+
+#include <std/vector.hpp>
+#include <std/span.hpp>
+#include <std/unordered_map.hpp>
+
+// A learning ethernet switch that connects virtual NICs to each other and optionally to a host NIC
+namespace vm::netswitch {
+    constexpr size_t max_frame_size = 1536; // Without offloads
+
+    struct Offload {
+        bool needs_csum = false; // The L4 checksum still has to be calculated over everything from csum_start, and stored at csum_start + csum_offset
+        uint16_t csum_start = 0, csum_offset = 0;
+
+        uint16_t gso_size = 0; // If not 0, this is a TCPv4 packet that still has to be split into segments with this much payload
+        uint16_t hdr_len = 0;
+    };
+
+    // A frame, possibly scattered over multiple pieces of memory that belong to the sender
+    struct Packet {
+        std::vector<std::span<uint8_t>> segments;
+        size_t size = 0;
+        Offload offload;
+
+        void add_segment(uint8_t* data, size_t len) {
+            segments.push_back(std::span<uint8_t>{data, len});
+            size += len;
+        }
+
+        // Gathers len bytes starting at offset into dst, returns the amount of bytes copied
+        size_t copy_to(size_t offset, uint8_t* dst, size_t len) const;
+    };
+
+    struct Port {
+        virtual ~Port() {}
+
+        // Called with the switch locked, the packet is only valid for the duration of the call
+        virtual void receive(const Packet& packet) = 0;
+    };
+
+    struct Switch {
+        void attach(Port* port);
+        void detach(Port* port);
+
+        // Forwards a packet to the port that has its destination MAC, or to every port except the sender if it is unknown
+        void send(Port* from, const Packet& packet);
+
+        private:
+        TicketLock lock{}; // Also keeps ports from going away while they're being delivered to
+        std::vector<Port*> ports;
+        std::unordered_map<uint64_t, Port*> fdb; // MAC -> Port it was last seen on
+    };
+
+    // Calls f for every frame packet turns into, after doing the offloads in software that the receiver can't do itself
+    void resolve_offloads(const Packet& packet, bool can_csum, bool can_tso, void (*f)(const Packet& packet, void* userptr), void* userptr);
+
+    // Only connects VMs to each other
+    Switch& get_loopback();
+
+    // Also connects to the default host NIC if there is one, which is put in promiscuous mode
+    Switch& get_host();
+} // namespace vm::netswitch
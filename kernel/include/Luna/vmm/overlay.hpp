@@ -0,0 +1,64 @@
+#pragma once
+
+#include <Luna/common.hpp>
+#include <Luna/fs/vfs.hpp>
+
+#include <std/vector.hpp>
+
+// Sparse copy-on-write disk images, clusters that haven't been written are read from the backing image, or as zeros if there is none
+// Backing images are never written to, so they can be shared between VMs, and can themselves be overlays
+namespace vm::overlay {
+    constexpr char magic[8] = {'L', 'U', 'N', 'A', 'C', 'O', 'W', 'D'};
+    constexpr uint32_t version = 1;
+
+    constexpr uint32_t default_cluster_bits = 16; // 64KiB
+    constexpr size_t max_chain_depth = 8;
+
+    struct [[gnu::packed]] Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t cluster_bits;
+        uint64_t virtual_size;
+
+        uint64_t table_offset; // 1 uint64_t per cluster containing the file offset of its data, or 0 if it is unallocated
+        uint64_t n_clusters;
+
+        // echfs files can't be grown, so clusters are allocated from the preallocated space after the table
+        uint64_t next_free;
+
+        char backing[128]; // Path of the backing image, empty if there is none
+    };
+
+    struct Image final : public vfs::File {
+        // Takes ownership of file, returns nullptr if it isn't a valid overlay or the backing chain can't be opened
+        static Image* open(vfs::File* file, size_t depth = 0);
+
+        vfs::FileType get_type() { return vfs::FileType::File; }
+        size_t read(size_t offset, size_t count, uint8_t* data);
+        size_t write(size_t offset, size_t count, uint8_t* data); // Returns a short count if the overlay is out of space
+        size_t get_size() { return header.virtual_size; }
+
+        void close();
+
+        private:
+        Image(vfs::File* file, vfs::File* backing, const Header& header);
+
+        void read_cluster(size_t cluster, size_t offset, size_t count, uint8_t* data);
+        bool alloc_cluster(size_t cluster);
+
+        Header header;
+        size_t cluster_size;
+        std::vector<uint64_t> table;
+
+        vfs::File* file;
+        vfs::File* backing;
+    };
+
+    bool is_valid(vfs::File* file);
+
+    // Formats an all zero file as an empty overlay on top of backing, the file has to be large enough to hold at least the header and table
+    bool create(vfs::File* file, const char* backing, size_t virtual_size, uint32_t cluster_bits = default_cluster_bits);
+
+    // Opens path as an overlay if it is one, or as a raw image otherwise, returns nullptr on failure
+    vfs::File* open(const char* path, size_t depth = 0);
+} // namespace vm::overlay
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <Luna/common.hpp>
+#include <Luna/cpu/cpu.hpp>
+#include <Luna/cpu/regs.hpp>
+
+#include <Luna/vmm/snapshot.hpp>
+
+// Virtual PMU, the guest gets its own set of general purpose counters, which are loaded into the real ones while it runs
+// Intel guests see architectural perfmon v2 without fixed counters, AMD guests the 4 legacy counters without PerfCtrExtCore
+namespace vm::pmu {
+    constexpr size_t max_counters = 4;
+
+    namespace evtsel {
+        enum : uint64_t {
+            Int = (1 << 20),
+            AnyThread = (1 << 21), // Intel
+            Enable = (1 << 22),
+            GuestOnly = (1ull << 40), // AMD
+            HostOnly = (1ull << 41), // ^
+
+            IntelReserved = ~0xFFFF'FFFFull,
+            AmdReserved = (0xFull << 36) | (~0ull << 42) // Writing these #GPs on real hardware, so they can't reach the real MSRs
+        };
+    } // namespace evtsel
+
+    struct Pmu {
+        Pmu(CpuVendor vendor);
+
+        void cpuid_leaf_a(uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d) const;
+
+        bool handles_msr(uint32_t index) const;
+        uint64_t read_msr(uint32_t index);
+        bool write_msr(uint32_t index, uint64_t value); // Returns false if the guest should get a #GP
+        uint64_t rdpmc(uint32_t index) const;
+
+        // Swap the guest counters into the hardware and back, have to be called with IRQs off right around entry and exit
+        // Nothing is touched while the guest has no counter enabled, which is the common case
+        void load();
+        void save();
+        bool is_loaded() const { return loaded; }
+
+        // Value for the VMCS guest IA32_PERF_GLOBAL_CTRL field when the backend switches it on entry, see hw_global_ctrl
+        uint64_t entry_global_ctrl() const { return loaded ? global_ctrl : 0; }
+
+        // Returns true once for every overflow of a counter with its Int bit set, the VCPU should raise a PMI through its LAPIC
+        bool take_pmi() {
+            bool ret = pmi_pending;
+            pmi_pending = false;
+            return ret;
+        }
+
+        void snapshot_save(snapshot::Writer& out);
+        void snapshot_restore(snapshot::Reader& in);
+
+        bool hw_global_ctrl = false; // Set by the VMX backend if entry and exit can load IA32_PERF_GLOBAL_CTRL, it turns them on while is_loaded(), with the host value being 0
+
+        private:
+        uint32_t evtsel_msr(size_t i) const { return (vendor == CpuVendor::Intel) ? (msr::ia32_perfevtsel0 + i) : (msr::perf_legacy_evt_sel0 + i); }
+        uint32_t counter_msr(size_t i) const;
+        bool is_enabled(size_t i) const;
+        uint64_t hw_evtsel(size_t i) const;
+        uint64_t hw_counter(size_t i) const;
+        uint64_t reserved_evtsel_bits() const { return (vendor == CpuVendor::Intel) ? evtsel::IntelReserved : evtsel::AmdReserved; }
+
+        CpuVendor vendor;
+        size_t n_counters = 0;
+        uint8_t width = 48;
+        uint64_t mask = 0;
+        uint32_t event_mask = 0, event_mask_length = 0; // CPUID 0xA EBX, events the host doesn't have
+        bool full_width_writes = false;
+
+        uint64_t evtsels[max_counters] = {}, counters[max_counters] = {};
+        uint64_t global_ctrl = 0, global_status = 0;
+
+        bool loaded = false, pmi_pending = false;
+        uint64_t host_evtsels[max_counters], host_counters[max_counters], host_global_ctrl;
+        uint64_t reload_base[max_counters]; // What was cut off of counters[i] to fit it in the hardware counter, see hw_counter()
+    };
+} // namespace vm::pmu
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <Luna/common.hpp>
+
+namespace vm {
+    struct Vm;
+    struct VCPU;
+} // namespace vm
+
+// Guest RIP sampling, every interval the VCPUs of profiled VMs are kicked out of the guest, and the RIP, CPL and CR3 they were at are counted
+// This doesn't need anything from the guest, so it also shows spin loops and MMIO polling that the guest's own tools can't see
+namespace vm::profiler {
+    constexpr size_t sample_interval_ms = 10;
+
+    // system_map is an optional path to the System.map of the guest kernel, which is used to turn kernel RIPs into symbols
+    void start(Vm* vm, const char* name, const char* system_map = nullptr);
+    void stop(Vm* vm);
+
+    // Writes the samples in the folded stack format flamegraph.pl takes, one "name;kernel;symbol count" or "name;cr3_<cr3>;<rip> count" line each
+    // Files can't be grown, so it has to be big enough already, the rest of it is filled with newlines
+    bool export_folded(Vm* vm, const char* path);
+
+    // Called by the backends on the VCPU thread before entering the guest, when VCPU::sample_pending is set
+    void sample(VCPU& vcpu);
+} // namespace vm::profiler
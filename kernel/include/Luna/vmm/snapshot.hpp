@@ -0,0 +1,83 @@
+#pragma once
+
+#include <Luna/common.hpp>
+#include <Luna/fs/vfs.hpp>
+
+namespace vm {
+    struct Vm;
+} // namespace vm
+
+namespace vm::snapshot {
+    constexpr char magic[8] = {'L', 'U', 'N', 'A', 'S', 'N', 'A', 'P'};
+    constexpr uint32_t version = 5;
+
+    constexpr uint64_t hypercall_save = 0x5041'4E53; // VMCALL with RAX = "SNAP" saves a snapshot, RAX = 0 on success
+
+    struct [[gnu::packed]] Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t n_cpus, n_drivers, n_memslots;
+    };
+
+    struct [[gnu::packed]] DriverHeader {
+        char id[16];
+        uint64_t size;
+    };
+
+    struct [[gnu::packed]] MemslotHeader {
+        uint64_t base, size;
+        uint64_t table_offset; // File offset of the page table, 1 uint64_t per page containing the file offset of its data, or 0 if it is zero filled
+    };
+
+    struct Writer {
+        Writer(vfs::File* file, size_t offset = 0): file{file}, offset{offset} {}
+
+        void write(const void* data, size_t size) {
+            if(file->write(offset, size, (uint8_t*)data) != size)
+                failed = true;
+
+            offset += size;
+        }
+
+        template<typename T>
+        void write(const T& v) { write(&v, sizeof(T)); }
+
+        template<typename T>
+        void write_at(size_t at, const T& v) {
+            if(file->write(at, sizeof(T), (uint8_t*)&v) != sizeof(T))
+                failed = true;
+        }
+
+        vfs::File* file;
+        size_t offset;
+        bool failed = false;
+    };
+
+    struct Reader {
+        Reader(vfs::File* file, size_t offset = 0): file{file}, offset{offset} {}
+
+        void read(void* data, size_t size) {
+            if(file->read(offset, size, (uint8_t*)data) != size)
+                failed = true;
+
+            offset += size;
+        }
+
+        template<typename T>
+        void read(T& v) { read(&v, sizeof(T)); }
+
+        vfs::File* file;
+        size_t offset;
+        bool failed = false;
+    };
+
+    bool is_valid(vfs::File* file);
+
+    // Snapshots should only be taken or restored while none of the VCPUs are running guest code
+    // e.g. from a VM Exit handler on a single VCPU VM, or before the first VCPU is started
+    bool save(Vm& vm, vfs::File* file);
+
+    // Guest RAM is mapped lazily, so the file has to be kept open for as long as the VM exists
+    // Should be called on a freshly created VM with the same devices and memslots as the one that was saved
+    bool restore(Vm& vm, vfs::File* file);
+} // namespace vm::snapshot
@@ -2,11 +2,15 @@
 
 #include <Luna/common.hpp>
 #include <Luna/fs/vfs.hpp>
+#include <Luna/mm/pmm.hpp>
 
 #include <std/vector.hpp>
+#include <std/mutex.hpp>
 
+#include <Luna/cpu/cpu.hpp>
 #include <Luna/cpu/regs.hpp>
 #include <Luna/vmm/drivers.hpp>
+#include <Luna/vmm/pmu.hpp>
 #include <Luna/vmm/drivers/irqs/lapic.hpp>
 
 namespace vm {
@@ -49,7 +53,7 @@ namespace vm {
 
     constexpr size_t max_x86_instruction_size = 15;
     struct VmExit {
-        enum class Reason { Unknown, Hlt, Vmcall, MMUViolation, PIO, MSR, CPUID, RSM, CrMov };
+        enum class Reason { Unknown, Hlt, Vmcall, MMUViolation, PIO, MSR, CPUID, RSM, CrMov, Rdpmc };
         static constexpr const char* reason_to_string(const Reason& reason) {
             switch (reason) {
                 case Reason::Unknown: return "Unknown";
@@ -61,6 +65,7 @@ namespace vm {
                 case Reason::CPUID: return "CPUID";
                 case Reason::RSM: return "RSM";
                 case Reason::CrMov: return "Move {to, from} CR";
+                case Reason::Rdpmc: return "RDPMC";
                 default: return "Unknown";
             }
         }
@@ -111,9 +116,16 @@ namespace vm {
         virtual uintptr_t get_root_pa() const = 0;
         virtual uint32_t get_asid() const = 0;
         virtual uint8_t get_levels() const = 0;
+
+        // Dirty logging, without hardware dirty bits a page counts as dirty while it's writable, so it is write protected when harvested
+        virtual bool has_dirty_bits() const = 0;
+
+        // Sets the bit in bitmap for every page in the range that was dirtied and clears its dirty state
+        // If scan is false, only pages that already have their bit set are checked, all TLB invalidation is done in 1 go at the end
+        virtual void clear_dirty(uintptr_t gpa, size_t n_pages, uint64_t* bitmap, bool scan) = 0;
     };
 
-    enum class VmCap { FullPIOAccess, SMMEntryCallback, SMMLeaveCallback, HypercallCallback, TSCOffset };
+    enum class VmCap { FullPIOAccess, SMMEntryCallback, SMMLeaveCallback, HypercallCallback, TSCOffset, DirtyLogging };
     namespace VmRegs {
         enum {
             General = (1 << 0),
@@ -136,7 +148,14 @@ namespace vm {
         enum class InjectType { ExtInt, NMI, Exception, SoftwareInt };
         virtual void inject_int(InjectType type, uint8_t vector, bool error_code = false, uint32_t error = 0) = 0;
 
-        virtual bool run() = 0;
+        // Whether NMIs are blocked because the guest hasn't returned from the last one yet, kept by the hardware on VMX but not on SVM
+        virtual bool get_nmi_blocking() const = 0;
+        virtual void set_nmi_blocking(bool blocked) = 0;
+
+        virtual bool logs_dirty_pages() const = 0; // Whether every page that gets dirtied is reported with Vm::log_dirty(), e.g. by VMX PML
+
+        virtual bool run() = 0; // Returns true if the VCPU has a pending request, see VCPU::has_pending_request()
+        virtual void unload() = 0; // Called on the current CPU before the VCPU thread moves to a different one
     };
 
     struct Vm;
@@ -150,18 +169,22 @@ namespace vm {
         VCPU(Vm* vm, threading::Thread* thread, uint8_t id);
         bool run();
         void exit();
+        void migrate(uint32_t lapic_id); // Move the VCPU thread to a different host CPU
+        bool has_pending_request() const { return __atomic_load_n(&should_exit, __ATOMIC_SEQ_CST) || __atomic_load_n(&migrate_to, __ATOMIC_SEQ_CST) != no_migration; }
         
         void set(VmCap cap, bool value);
         void set(VmCap cap, void (*fn)(VCPU*, void*), void* userptr);
         
         void get_regs(vm::RegisterState& regs, uint64_t flags = VmRegs::General | VmRegs::Segment | VmRegs::Control) const;
         void set_regs(const vm::RegisterState& regs, uint64_t flags = VmRegs::General | VmRegs::Segment | VmRegs::Control);
+        void inject_int(AbstractVm::InjectType type, uint8_t vector, bool error_code = false, uint32_t error = 0);
 
         void enter_smm();
         void handle_rsm();
 
-        void dma_write(uintptr_t gpa, std::span<uint8_t> buf);
-        void dma_read(uintptr_t gpa, std::span<uint8_t> buf);
+        // Both return false if part of the range isn't RAM
+        bool dma_write(uintptr_t gpa, std::span<uint8_t> buf);
+        bool dma_read(uintptr_t gpa, std::span<uint8_t> buf);
 
         PageWalkInfo walk_guest_paging(uintptr_t gva);
 
@@ -197,16 +220,23 @@ namespace vm {
 
         uint64_t guest_tsc_offset = 0, host_tsc_at_vmexit = 0;
 
-        bool is_in_smm, should_exit;
+        bool is_in_smm = false;
+        bool should_exit = false; // Set from other threads, only accessed with __atomic builtins, like migrate_to
+        bool sample_pending = false; // Set by vm::profiler, which then kicks the VCPU out of the guest, also only accessed with __atomic builtins
+
+        static constexpr uint32_t no_migration = ~0u;
+        uint32_t migrate_to = no_migration;
 
         uint64_t cr0_constraint = 0, cr4_constraint = 0, efer_constraint = 0;
 
         Vm* vm;
-        AbstractVm* vcpu;
+        AbstractVm* vcpu; // Only goes through the vtable outside of vm.cpp, which switches on vendor instead
+        CpuVendor vendor; // Of vcpu, fixed at creation
         threading::Thread* thread;
         uint64_t time_spent_in_vm = 0; // ns
 
         irqs::lapic::Driver lapic;
+        pmu::Pmu pmu;
 
         bool irq_pin;
 
@@ -215,18 +245,105 @@ namespace vm {
         void (*hypercall_callback)(VCPU*, void*); void* hypercall_userptr;
     };
 
+    namespace MemslotFlags {
+        enum {
+            Mergeable = (1 << 0), // Identical pages can be shared with other VMs, see vm::ksm
+            ReadOnly = (1 << 1), // ROM, writes are never allowed, even to merged pages
+            DirtyLog = (1 << 2) // Pages written by the guest are tracked, see Vm::get_dirty_log(), not for slots whose permissions are changed by devices
+        };
+    } // namespace MemslotFlags
+
+    struct Memslot {
+        uintptr_t base;
+        size_t size;
+        uint8_t flags;
+
+        // RAM is only allocated once the guest touches it, until then pages are zero filled
+        // or can be backed by a file, e.g. a snapshot, every page has a file offset, or 0 if it should be zero filled
+        vfs::File* backing = nullptr;
+        std::vector<uint64_t> backing_offsets;
+
+        std::vector<uint64_t> dirty_bitmap; // 1 bit per page, only used with MemslotFlags::DirtyLog
+    };
+
     struct Vm {
         Vm(uint8_t n_cpus, threading::Thread* thread);
 
         void set_irq(uint8_t irq, bool level);
+        void deliver_msi(uint64_t address, uint32_t data); // Can be called from any thread
+
+        void add_memslot(uintptr_t base, size_t size, uint8_t flags = 0);
+        Memslot* find_memslot(uintptr_t gpa);
+        bool handle_memslot_fault(uintptr_t gpa, bool write = false);
+
+        void set_dirty_log(uintptr_t base, bool enable); // base has to be the start of a memslot
+        void log_dirty(uintptr_t gpa);
+
+        // Copies the pages dirtied since the last call into bitmap, 1 bit per page, and resets them, returns the amount of dirty pages
+        // Can be called from any thread, writes from the host through gpa_to_hpa() are logged too
+        size_t get_dirty_log(uintptr_t base, std::vector<uint64_t>& bitmap);
+        uintptr_t gpa_to_hpa(uintptr_t gpa, bool write = false); // Faults in RAM if needed, for accesses that don't go through the nested page tables, returns 0 if gpa isn't RAM, or is read only RAM and write is set
+
+        // Nested paging changes are only invalidated on the CPU that made them, so the ones the guest has to see right away are made on the VCPU thread
+        // Runs f there as an APC and waits for it, or calls it directly when already on the VCPU thread
+        void on_vcpu_thread(void (*f)(void*), void* userptr);
+
+        // Host side users of guest RAM, like device threads, pin it for as long as they use addresses from gpa_to_hpa()
+        // While pinned vm::ksm doesn't remap anything, and merged pages that got unshared are only released after the last unpin
+        void pin_ram();
+        void unpin_ram();
 
         std::unordered_map<uint16_t, AbstractPIODriver*> pio_map;
         std::unordered_map<uintptr_t, std::pair<AbstractMMIODriver*, size_t>> mmio_map;
 
         std::vector<VCPU> cpus;
         std::vector<AbstractIRQListener*> irq_listeners;
+        std::vector<AbstractSnapshotDriver*> snapshot_drivers;
         AbstractMM* mm;
+
+        std::vector<Memslot> memslots;
+        IrqTicketLock memslot_lock; // Taken from APCs on the VCPU thread, see vm::ksm
+
+        size_t ram_pins = 0; // Protected by memslot_lock
+        std::vector<uintptr_t> deferred_puts; // ^, vm::ksm references that are dropped once ram_pins hits 0
+    };
+
+    struct RamPin {
+        RamPin(Vm& vm): vm{vm} { vm.pin_ram(); }
+        ~RamPin() { vm.unpin_ram(); }
+
+        RamPin(const RamPin&) = delete;
+        RamPin& operator=(const RamPin&) = delete;
+
+        Vm& vm;
     };
 
+    // Calls f(host_va, size) for every host contiguous piece of a guest physical range, so data can go straight between e.g. a file and guest RAM
+    // Returns false if part of the range isn't RAM
+    template<typename F>
+    bool for_each_host_range(Vm& vm, uintptr_t gpa, size_t size, bool write, F&& f) {
+        RamPin pin{vm};
+
+        size_t curr = 0;
+        while(curr < size) {
+            auto hpa = vm.gpa_to_hpa(gpa + curr, write);
+            if(!hpa)
+                return false;
+
+            auto chunk = min(pmm::block_size - ((gpa + curr) & 0xFFF), size - curr);
+
+            // Neighbouring guest pages are often neighbours on the host too, so merge those into 1 bigger piece
+            while((curr + chunk) < size && vm.gpa_to_hpa(gpa + curr + chunk, write) == (hpa + chunk))
+                chunk += min(pmm::block_size, size - curr - chunk);
+
+            if(!f((uint8_t*)(hpa + phys_mem_map), chunk))
+                return false;
+
+            curr += chunk;
+        }
+
+        return true;
+    }
+
     void init();
 } // namespace vm
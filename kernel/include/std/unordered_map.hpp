@@ -93,6 +93,19 @@ namespace std
             return end();
         }
 
+        size_t erase(const Key& key) {
+            auto& list = _map[_hasher(key) % bucket_size];
+
+            for(size_t i = 0; i < list.size(); i++) {
+                if(list[i].first == key) {
+                    list.erase(list.begin() + i);
+                    return 1;
+                }
+            }
+
+            return 0;
+        }
+
         void clear() {
             _map.clear();
             _map.resize(bucket_size);
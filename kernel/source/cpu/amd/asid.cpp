@@ -1,4 +1,8 @@
 #include <Luna/cpu/amd/asid.hpp>
+#include <Luna/cpu/mutex.hpp>
+
+#include <std/mutex.hpp>
+#include <std/utility.hpp>
 
 svm::AsidManager::AsidManager(uint32_t n_asids): _asids{n_asids} {
     _asids.set(0); // Reserve ASID 0
@@ -18,6 +22,25 @@ void svm::AsidManager::free(uint32_t asid) {
     _asids.clear(asid);
 }
 
+static IrqTicketLock lock{};
+static std::lazy_initializer<svm::AsidManager> manager;
+
+void svm::asid::init(uint32_t n_asids) {
+    std::lock_guard guard{lock};
+    if(!manager)
+        manager.init(n_asids);
+}
+
+uint32_t svm::asid::alloc() {
+    std::lock_guard guard{lock};
+    return manager->alloc();
+}
+
+void svm::asid::free(uint32_t asid) {
+    std::lock_guard guard{lock};
+    manager->free(asid);
+}
+
 void svm::invlpga(uint32_t asid, uintptr_t va) {
     asm volatile("invlpga %[Address], %[Asid]" : : [Asid] "c"(asid), [Address] "a"(va) : "memory");
 }
\ No newline at end of file
@@ -42,7 +42,7 @@ npt::Context::Context(uint8_t levels): levels{levels} {
     const auto [pa, _] = create_table();
     root_pa = pa;
 
-    asid = get_cpu().cpu.svm.asid_manager->alloc();
+    asid = svm::asid::alloc();
     ASSERT(asid != ~0u);
 }
 
@@ -50,7 +50,7 @@ npt::Context::~Context(){
     if(root_pa)
         clean_table(root_pa, levels);
 
-    get_cpu().cpu.svm.asid_manager->free(asid);
+    svm::asid::free(asid);
 }
 
 npt::page_entry* npt::Context::walk(uintptr_t va, bool create_new_tables) {
@@ -129,6 +129,31 @@ uintptr_t npt::Context::unmap(uintptr_t va) {
     return ret;
 }
 
+void npt::Context::clear_dirty(uintptr_t gpa, size_t n_pages, uint64_t* bitmap, bool scan) {
+    constexpr size_t table_size = 512 * pmm::block_size;
+
+    for(size_t i = 0; i < n_pages; i++) {
+        if(!scan && !(bitmap[i / 64] & (1ull << (i % 64))))
+            continue;
+
+        auto va = gpa + (i * pmm::block_size);
+        auto* entry = walk(va, false);
+        if(!entry) {
+            // There's no PML1 so nothing else up to the next one can be mapped either
+            i = ((align_down(va, table_size) + table_size - gpa) / pmm::block_size) - 1;
+            continue;
+        }
+
+        if(!entry->present || !entry->dirty)
+            continue;
+
+        entry->dirty = 0;
+
+        bitmap[i / 64] |= (1ull << (i % 64));
+        tlb_flush_pending = true;
+    }
+}
+
 uintptr_t npt::Context::get_phys(uintptr_t va) {
     uintptr_t off = va & 0xFFF;
     auto* entry = walk(va, false); // Since we're just getting stuff it wouldn't make sense to make new tables, so we can get null as valid result
@@ -7,6 +7,8 @@
 
 #include <Luna/misc/log.hpp>
 
+#include <Luna/vmm/profiler.hpp>
+
 void svm::init() {
     ASSERT(svm::is_supported());
 
@@ -34,7 +36,7 @@ void svm::init() {
 
     msr::write(msr::vm_hsave_pa, hsave);
 
-    svm.asid_manager.init(svm.n_asids);
+    asid::init(svm.n_asids);
 }
 
 npt::Context* svm::create_npt() {
@@ -161,6 +163,8 @@ void svm::Vm::inject_int(vm::AbstractVm::InjectType type, uint8_t vector, bool e
 void svm::Vm::set(vm::VmCap cap, bool value) {
     if(cap == vm::VmCap::FullPIOAccess)
         vmcb->icept_io = (value ? 0 : 1);
+    else if(cap == vm::VmCap::DirtyLogging)
+        return; // No hardware logging, pages are found by scanning the NPT
     else
         PANIC("Unknown VmCap");
 }
@@ -174,12 +178,37 @@ void svm::Vm::set(vm::VmCap cap, uint64_t value) {
 }
 
 bool svm::Vm::run() {
+    // The host save area is per-CPU state, so it has to be saved again whenever we might have been migrated
     asm volatile("vmsave" : : "a"(host_save_vmcb_pa) : "memory");
 
+    // NPT changes are only invalidated with invlpga on the CPU that made them, so this CPU might still have stale translations for our ASID
+    vmcb->tlb_control = 1;
+
     while(true) {
+        if(vcpu->has_pending_request()) // Requested from another thread, which kicked us out of the guest
+            return true;
+
+        if(__atomic_exchange_n(&vcpu->sample_pending, false, __ATOMIC_SEQ_CST))
+            vm::profiler::sample(*vcpu);
+
+        if(vcpu->pmu.take_pmi())
+            vcpu->lapic.raise_pmi();
+
+        bool nmi_injected = false;
+        if(vcpu->lapic.has_pending_nmi() && !nmi_masked && !nmi_iret_pending && !vmcb->irq_shadow && !(vmcb->event_inject & (1ull << 31))) {
+            vcpu->lapic.ack_nmi();
+            inject_int(vm::AbstractVm::InjectType::NMI, 2);
+            nmi_injected = true;
+
+            nmi_masked = true;
+            vmcb->icept_iret = 1;
+        }
+
         ASSERT(vcpu->vm->irq_listeners.size() == 1); // TODO
         auto& irq_dev = vcpu->vm->irq_listeners[0];
-        if(irq_dev->read_irq_pin() && !vmcb->v_irq && !(vmcb->rflags & (1 << 9))) {
+        bool pic_pending = irq_dev->read_irq_pin();
+        bool irq_pending = pic_pending || vcpu->lapic.has_pending_irq();
+        if(irq_pending && !vmcb->v_irq && (!(vmcb->rflags & (1 << 9)) || nmi_injected)) {
             vmcb->icept_vintr = 1;
 
             vmcb->v_intr_vector = 0;
@@ -188,8 +217,8 @@ bool svm::Vm::run() {
             vmcb->v_irq = 1;
         }
 
-        if(irq_dev->read_irq_pin() && (vmcb->rflags & (1 << 9))) {
-            auto v = irq_dev->read_irq_vector();
+        if(irq_pending && (vmcb->rflags & (1 << 9)) && !nmi_injected) {
+            auto v = pic_pending ? irq_dev->read_irq_vector() : vcpu->lapic.ack_irq();
             inject_int(vm::AbstractVm::InjectType::ExtInt, v);
         }
 
@@ -203,13 +232,24 @@ bool svm::Vm::run() {
 
         asm volatile("vmload" : : "a"(vmcb_pa) : "memory");
 
+        if(auto* npt = static_cast<npt::Context*>(mm); npt->tlb_flush_pending) { // This downcast should be safe
+            npt->tlb_flush_pending = false;
+            vmcb->tlb_control = 1;
+        }
+
+        vcpu->pmu.load();
+
         auto tsc_at_entry = tsc::rdtsc();
         svm_vmrun(&guest_gprs, vmcb_pa);
         vcpu->host_tsc_at_vmexit = tsc::rdtsc();
 
+        vcpu->pmu.save();
+
         asm volatile("vmsave" : : "a"(vmcb_pa) : "memory");
         asm volatile("vmload" : : "a"(host_save_vmcb_pa) : "memory");
 
+        vmcb->tlb_control = 0;
+
         vcpu->time_spent_in_vm += tsc::time_ns_at(vcpu->host_tsc_at_vmexit - tsc_at_entry);
 
         guest_simd.store();
@@ -220,6 +260,8 @@ bool svm::Vm::run() {
 
         asm("stgi");
 
+        nmi_iret_pending = false; // The guest got to run at least one instruction, so the IRET is done
+
         vm::VmExit exit{};
 
         auto next_instruction = [&]() { vmcb->rip += exit.instruction_len; };
@@ -270,6 +312,17 @@ bool svm::Vm::run() {
             vmcb->icept_vintr = false;
             continue;
 
+        case 0x6F: { // RDPMC
+            exit.reason = vm::VmExit::Reason::Rdpmc;
+
+            exit.instruction_len = 2;
+            exit.instruction[0] = 0x0F;
+            exit.instruction[1] = 0x33;
+
+            next_instruction();
+            break;
+        }
+
         case 0x72: { // CPUID
             exit.reason = vm::VmExit::Reason::CPUID;
 
@@ -292,6 +345,12 @@ bool svm::Vm::run() {
             break;
         }
 
+        case 0x74: // IRET, intercepted before it runs, so NMIs are only unmasked after the next exit
+            nmi_masked = false;
+            nmi_iret_pending = true;
+            vmcb->icept_iret = 0;
+            continue;
+
         case 0x7B: { // Port IO
             IOInterceptInfo info{.raw = vmcb->exitinfo1};
 
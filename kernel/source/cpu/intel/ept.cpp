@@ -1,5 +1,6 @@
 #include <Luna/cpu/intel/ept.hpp>
 #include <Luna/cpu/paging.hpp>
+#include <Luna/cpu/cpu.hpp>
 
 #include <std/utility.hpp>
 #include <std/string.hpp>
@@ -125,6 +126,43 @@ uintptr_t ept::Context::get_phys(uintptr_t va) {
     return (entry->frame << 12) + off;
 }
 
+bool ept::Context::has_dirty_bits() const {
+    return get_cpu().cpu.vmx.ept_dirty_accessed; // vmx::Vm enables them in the EPTP if they're supported
+}
+
+void ept::Context::clear_dirty(uintptr_t gpa, size_t n_pages, uint64_t* bitmap, bool scan) {
+    constexpr size_t table_size = 512 * pmm::block_size;
+    auto dirty_bits = has_dirty_bits();
+
+    bool cleared = false;
+    for(size_t i = 0; i < n_pages; i++) {
+        if(!scan && !(bitmap[i / 64] & (1ull << (i % 64))))
+            continue;
+
+        auto va = gpa + (i * pmm::block_size);
+        auto* entry = walk(va, false);
+        if(!entry) {
+            // There's no PML1 so nothing else up to the next one can be mapped either
+            i = ((align_down(va, table_size) + table_size - gpa) / pmm::block_size) - 1;
+            continue;
+        }
+
+        if(!entry->r || !(dirty_bits ? entry->dirty : entry->w))
+            continue;
+
+        if(dirty_bits)
+            entry->dirty = 0;
+        else
+            entry->w = 0;
+
+        bitmap[i / 64] |= (1ull << (i % 64));
+        cleared = true;
+    }
+
+    if(cleared)
+        invept();
+}
+
 uintptr_t ept::Context::get_root_pa() const {
     return root_pa;
 }
@@ -17,6 +17,7 @@
 #include <Luna/mm/vmm.hpp>
 
 #include <Luna/vmm/emulate.hpp>
+#include <Luna/vmm/profiler.hpp>
 
 #include <std/bit.hpp>
 
@@ -182,6 +183,14 @@ vmx::Vm::Vm(vm::AbstractMM* mm, vm::VCPU* vcpu): mm{mm}, vcpu{vcpu} {
 
     vmptrld();
 
+    // Another VCPU thread on the same CPU loads its own VMCS, so put ours back whenever we get to run again
+    vcpu->thread->schedule_in_hook = [](void* userptr) {
+        auto& self = *(Vm*)userptr;
+        if(self.active_cpu == &get_cpu())
+            self.vmptrld();
+    };
+    vcpu->thread->schedule_in_userptr = this;
+
     write(vmcs_link_pointer, -1ll);
 
     auto adjust_controls = [&](uint32_t min, uint32_t opt, uint32_t msr) -> uint32_t {
@@ -220,7 +229,21 @@ vmx::Vm::Vm(vm::AbstractMM* mm, vm::VCPU* vcpu): mm{mm}, vcpu{vcpu} {
                      | (uint32_t)ProcBasedControls2::UnrestrictedGuest;
                      
         uint32_t opt = (uint32_t)ProcBasedControls2::RDTSCPEnable | (uint32_t)ProcBasedControls2::EnableInvpcid;
-        write(proc_based_vm_exec_controls2, adjust_controls(min, opt, msr::ia32_vmx_procbased_ctls2));
+        if(get_cpu().cpu.vmx.ept_dirty_accessed) // PML logs pages when their EPT dirty bit gets set, so it's useless without them
+            opt |= (uint32_t)ProcBasedControls2::PMLEnable;
+
+        auto controls = adjust_controls(min, opt, msr::ia32_vmx_procbased_ctls2);
+
+        // Logging costs a VMREAD on every exit, so it starts off and is only enabled while dirty logging is on, see VmCap::DirtyLogging
+        if(controls & (uint32_t)ProcBasedControls2::PMLEnable) {
+            pml_pa = pmm::alloc_block();
+            ASSERT(pml_pa);
+
+            write(pml_address, pml_pa);
+            write(guest_pml_index, 511);
+        }
+
+        write(proc_based_vm_exec_controls2, controls & ~(uint32_t)ProcBasedControls2::PMLEnable);
     }
     
     write(exception_bitmap, (1 << 1) | (1 << 6) | (1 << 17) | (1 << 18));
@@ -244,14 +267,23 @@ vmx::Vm::Vm(vm::AbstractMM* mm, vm::VCPU* vcpu): mm{mm}, vcpu{vcpu} {
 
     {
         uint32_t min = (uint32_t)VMExitControls::LongMode | (uint32_t)VMExitControls::LoadIA32EFER | (uint32_t)VMExitControls::SaveIA32EFER | (uint32_t)VMExitControls::SaveIA32PAT | (uint32_t)VMExitControls::LoadIA32PAT;
-        uint32_t opt = 0;
-        write(vm_exit_control, adjust_controls(min, opt, msr::ia32_vmx_exit_ctls));
-    }
+        uint32_t opt = (uint32_t)VMExitControls::LoadIA32PerfGlobalCtrl;
+        auto exit_controls = adjust_controls(min, opt, msr::ia32_vmx_exit_ctls);
+
+        min = (uint32_t)VMEntryControls::LoadIA32EFER | (uint32_t)VMEntryControls::LoadIA32PAT;
+        opt = (uint32_t)VMEntryControls::LoadIA32PerfGlobalCtrl;
+        auto entry_controls = adjust_controls(min, opt, msr::ia32_vmx_entry_ctls);
+
+        // Only switch IA32_PERF_GLOBAL_CTRL in the VMCS if it can be done both ways, so the guest counters don't count any host instructions
+        // The controls start off, run() only turns them on while the guest counters are loaded, as the host value is 0
+        if((exit_controls & (uint32_t)VMExitControls::LoadIA32PerfGlobalCtrl) && (entry_controls & (uint32_t)VMEntryControls::LoadIA32PerfGlobalCtrl)) {
+            write(host_ia32_perf_global_ctrl_full, 0); // Pmu::load() has already cleared it, and Pmu::save() puts the real value back
+            write(guest_ia32_perf_global_ctrl_full, 0);
+            vcpu->pmu.hw_global_ctrl = true;
+        }
 
-    {
-        uint32_t min = (uint32_t)VMEntryControls::LoadIA32EFER | (uint32_t)VMEntryControls::LoadIA32PAT;
-        uint32_t opt = 0;
-        write(vm_entry_control, adjust_controls(min, opt, msr::ia32_vmx_entry_ctls));
+        write(vm_exit_control, exit_controls & ~(uint32_t)VMExitControls::LoadIA32PerfGlobalCtrl);
+        write(vm_entry_control, entry_controls & ~(uint32_t)VMEntryControls::LoadIA32PerfGlobalCtrl);
     }
 
     {
@@ -270,23 +302,6 @@ vmx::Vm::Vm(vm::AbstractMM* mm, vm::VCPU* vcpu): mm{mm}, vcpu{vcpu} {
     write(guest_activity_state, 0);
 
     //write(guest_intr_status, 0); // Only do if we use Virtual-Interrupt Delivery
-    //write(guest_pml_index, 0); // Only do if we do PMLs
-
-    write(host_tr_base, (uint64_t)&get_cpu().tss_table);
-
-    {
-        gdt::Pointer gdtr{};
-        gdtr.store();
-
-        write(host_gdtr_base, gdtr.table);
-    }
-
-    {
-        idt::Pointer idtr{};
-        idtr.store();
-
-        write(host_idtr_base, idtr.table);
-    }
 
     write(host_cr0, cr0::read());
     write(host_cr4, cr4::read());
@@ -295,6 +310,12 @@ vmx::Vm::Vm(vm::AbstractMM* mm, vm::VCPU* vcpu): mm{mm}, vcpu{vcpu} {
     write(host_rip, (uint64_t)vmx_do_vmexit);
 }
 
+void vmx::Vm::unload() {
+    // Flush the cached VMCS state to memory, so it can be loaded on another CPU
+    active_cpu = nullptr;
+    vmclear();
+}
+
 void vmx::Vm::set(vm::VmCap cap, bool value) {
     vmptrld();
     if(cap == vm::VmCap::FullPIOAccess) {
@@ -302,6 +323,19 @@ void vmx::Vm::set(vm::VmCap cap, bool value) {
             write(proc_based_vm_exec_controls, read(proc_based_vm_exec_controls) & ~(uint32_t)ProcBasedControls::VMExitOnPIO);
         else
             write(proc_based_vm_exec_controls, read(proc_based_vm_exec_controls) | (uint32_t)ProcBasedControls::VMExitOnPIO);
+    } else if(cap == vm::VmCap::DirtyLogging) {
+        if(!pml_pa || pml_enabled == value)
+            return;
+
+        // Anything still in the log was dirtied while logging was on, the index is reset either way
+        if(pml_enabled)
+            flush_pml();
+
+        pml_enabled = value;
+        if(value)
+            write(proc_based_vm_exec_controls2, read(proc_based_vm_exec_controls2) | (uint32_t)ProcBasedControls2::PMLEnable);
+        else
+            write(proc_based_vm_exec_controls2, read(proc_based_vm_exec_controls2) & ~(uint32_t)ProcBasedControls2::PMLEnable);
     } else {
         PANIC("Unknown VmCap\n");
     }
@@ -318,6 +352,7 @@ void vmx::Vm::set(vm::VmCap cap, uint64_t value) {
 
 bool vmx::Vm::run() {
     vmptrld();
+    active_cpu = &get_cpu(); // The thread is pinned, so this stays valid until unload()
 
     #define SAVE_REG(reg) \
         { \
@@ -342,17 +377,57 @@ bool vmx::Vm::run() {
     write(host_fs_base, msr::read(msr::fs_base));
     write(host_gs_base, msr::read(msr::gs_base));
 
+    // These are per-CPU, so they have to be refreshed whenever we might have been migrated
+    write(host_tr_base, (uint64_t)&get_cpu().tss_table);
+
+    {
+        gdt::Pointer gdtr{};
+        gdtr.store();
+
+        write(host_gdtr_base, gdtr.table);
+    }
+
+    {
+        idt::Pointer idtr{};
+        idtr.store();
+
+        write(host_idtr_base, idtr.table);
+    }
+
+    // EPT changes are only invalidated on the CPU that made them, so this CPU might still have stale translations from when the VCPU last ran here
+    invept();
+
     vmclear();
+    vmptrld(); // The accesses at the top of the loop run with IRQs on, the schedule in hook keeps it current from here
 
     bool launched = false;
     while(true) {
+        if(vcpu->has_pending_request()) // Requested from another thread, which kicked us out of the guest
+            return true;
+
+        if(__atomic_exchange_n(&vcpu->sample_pending, false, __ATOMIC_SEQ_CST))
+            vm::profiler::sample(*vcpu);
+
+        if(vcpu->pmu.take_pmi())
+            vcpu->lapic.raise_pmi();
+
+        // NMIs are blocked by STI, MOV SS and an unfinished NMI handler, if that's the case try again on the next exit
+        bool nmi_injected = false;
+        if(vcpu->lapic.has_pending_nmi() && !(read(guest_interruptibility_state) & 0b1011) && !(read(vm_entry_interruption_info) & (1u << 31))) {
+            vcpu->lapic.ack_nmi();
+            inject_int(vm::AbstractVm::InjectType::NMI, 2);
+            nmi_injected = true;
+        }
+
         ASSERT(vcpu->vm->irq_listeners.size() == 1); // TODO
         auto& irq_dev = vcpu->vm->irq_listeners[0];
-        if(irq_dev->read_irq_pin() && !(read(guest_rflags) & (1 << 9)))
+        bool pic_pending = irq_dev->read_irq_pin();
+        bool irq_pending = pic_pending || vcpu->lapic.has_pending_irq();
+        if(irq_pending && (!(read(guest_rflags) & (1 << 9)) || nmi_injected))
             write(proc_based_vm_exec_controls, read(proc_based_vm_exec_controls) | (uint64_t)ProcBasedControls::IRQWindowExiting);
 
-        if(irq_dev->read_irq_pin() && (read(guest_rflags) & (1 << 9))) {
-            auto vector = irq_dev->read_irq_vector();
+        if(irq_pending && (read(guest_rflags) & (1 << 9)) && !nmi_injected) {
+            auto vector = pic_pending ? irq_dev->read_irq_vector() : vcpu->lapic.ack_irq();
 
             inject_int(vm::AbstractVm::InjectType::ExtInt, vector, false);
         }
@@ -364,10 +439,29 @@ bool vmx::Vm::run() {
         host_simd.store();
         guest_simd.load();
 
+        vcpu->pmu.load();
+        if(vcpu->pmu.hw_global_ctrl && vcpu->pmu.is_loaded() != perf_global_ctrl_switched) {
+            perf_global_ctrl_switched = vcpu->pmu.is_loaded();
+
+            auto exit_controls = read(vm_exit_control) & ~(uint64_t)VMExitControls::LoadIA32PerfGlobalCtrl;
+            auto entry_controls = read(vm_entry_control) & ~(uint64_t)VMEntryControls::LoadIA32PerfGlobalCtrl;
+            if(perf_global_ctrl_switched) {
+                exit_controls |= (uint64_t)VMExitControls::LoadIA32PerfGlobalCtrl;
+                entry_controls |= (uint64_t)VMEntryControls::LoadIA32PerfGlobalCtrl;
+            }
+
+            write(vm_exit_control, exit_controls);
+            write(vm_entry_control, entry_controls);
+        }
+
+        if(perf_global_ctrl_switched)
+            write(guest_ia32_perf_global_ctrl_full, vcpu->pmu.entry_global_ctrl());
+
         vcpu->adjust_guest_tsc(vcpu->host_tsc_at_vmexit - tsc::rdtsc()); // On first entry this will be 0 - tsc, so it will adjust the guest's TSC to 0
         auto tsc_at_entry = tsc::rdtsc();
         auto rflags = vmx_vmenter(this, &guest_gprs, launched);
         vcpu->host_tsc_at_vmexit = tsc::rdtsc();
+        vcpu->pmu.save();
         vcpu->time_spent_in_vm += tsc::time_ns_at(vcpu->host_tsc_at_vmexit - tsc_at_entry);
 
         launched = true;
@@ -391,6 +485,9 @@ bool vmx::Vm::run() {
             return false;
         }
 
+        if(pml_enabled)
+            flush_pml();
+
         vm::VmExit exit{};
 
         auto next_instruction = [&]() { write(guest_rip, read(guest_rip) + exit.instruction_len); };
@@ -444,6 +541,9 @@ bool vmx::Vm::run() {
         } else if(basic_reason == VMExitReasons::ExtInt) {
             // CPU does not acknowledge the interrupt, so it should have occurred just after the sti
             continue;
+        } else if(basic_reason == VMExitReasons::PMLFull) {
+            // Log was already flushed above
+            continue;
         } else if(basic_reason == VMExitReasons::IRQWindow) {
             write(proc_based_vm_exec_controls, read(proc_based_vm_exec_controls) & ~(uint64_t)ProcBasedControls::IRQWindowExiting);
 
@@ -467,6 +567,14 @@ bool vmx::Vm::run() {
             exit.instruction_len = 1;
             exit.instruction[0] = 0xF4;
 
+            next_instruction();
+        } else if(basic_reason == VMExitReasons::Rdpmc) {
+            exit.reason = vm::VmExit::Reason::Rdpmc;
+
+            exit.instruction_len = 2;
+            exit.instruction[0] = 0x0F;
+            exit.instruction[1] = 0x33;
+
             next_instruction();
         } else if(basic_reason == VMExitReasons::MovToCr) {
             exit.reason = vm::VmExit::Reason::CrMov;
@@ -592,6 +700,17 @@ bool vmx::Vm::run() {
     }
 }
 
+bool vmx::Vm::get_nmi_blocking() const {
+    vmptrld();
+    return read(guest_interruptibility_state) & (1 << 3);
+}
+
+void vmx::Vm::set_nmi_blocking(bool blocked) {
+    vmptrld();
+    auto state = read(guest_interruptibility_state) & ~(1 << 3);
+    write(guest_interruptibility_state, state | (blocked ? (1 << 3) : 0));
+}
+
 void vmx::Vm::inject_int(vm::AbstractVm::InjectType type, uint8_t vector, bool error_code, uint32_t error) {
     using enum vm::AbstractVm::InjectType;
 
@@ -803,6 +922,32 @@ void vmx::Vm::vmptrld() const {
     ASSERT(success);
 }
 
+void vmx::Vm::flush_pml() {
+    // The index counts down from 511 and points at the next free entry, it wraps around to 0xFFFF once the log is full
+    auto index = read(guest_pml_index) & 0xFFFF;
+    if(index == 511)
+        return;
+
+    auto* log = (uint64_t*)(pml_pa + phys_mem_map);
+    for(size_t i = (index >= 512) ? 0 : (index + 1); i < 512; i++)
+        vcpu->vm->log_dirty(log[i] & ~0xFFF);
+
+    write(guest_pml_index, 511);
+}
+
+void vmx::Vm::invept() const {
+    // invept mode 1 was already guaranteed to be supported by vmx::init()
+    struct {
+        uint64_t eptp;
+        uint64_t reserved;
+    } descriptor{read(ept_control), 0};
+    uint64_t mode = 1; // Single Context
+
+    bool success = false;
+    asm volatile("invept %[Descriptor], %[Mode]" : "=@cca"(success) : [Mode] "r"(mode), [Descriptor] "m"(descriptor) : "memory");
+    ASSERT(success);
+}
+
 void vmx::Vm::vmclear() {
     bool success = false;
     asm volatile("vmclear %[Vmcs]" : "=@cca"(success) : [Vmcs] "m"(vmcs_pa) : "memory");
@@ -211,6 +211,9 @@ static void quantum_irq_schedule(const idt::Regs* regs) {
 
     cpu.lapic.eoi();
 
+    if(next->schedule_in_hook)
+        next->schedule_in_hook(next->schedule_in_userptr);
+
     thread_invoke(&next->ctx);
 
     PANIC("Unreachable");
@@ -38,6 +38,11 @@ amd_vi::IOMMUEngine::IOMMUEngine(const amd_vi::IVHDInfo& ivhd): segment{ivhd.seg
         page_levels = 5; // TODO: Support 6 level paging
     print("       Page Levels: {}\n", (uint16_t)page_levels);
 
+    // Guest vAPIC mode posts IRQs straight into an AVIC backing page, which the VMM doesn't use, so it is only reported
+    guest_vapic = (regs->extended_features >> 7) & 1;
+    if(guest_vapic)
+        print("       Guest vAPIC supported\n");
+
     erratum_746_workaround();
     ats_write_check_workaround();
 
@@ -462,6 +467,16 @@ void amd_vi::IOMMUEngine::cmd_invalidate_devtab_entry(const amd_vi::DeviceID& de
     completion_wait();
 }
 
+void amd_vi::IOMMUEngine::cmd_invalidate_int_table(const amd_vi::DeviceID& device) {
+    CmdInvalidateIntTable cmd{};
+    cmd.op = CmdInvalidateIntTable::opcode;
+
+    cmd.device_id = device.raw;
+
+    ASSERT(queue_command(cmd));
+    completion_wait();
+}
+
 void amd_vi::IOMMUEngine::cmd_invalidate_all() {
     CmdInvalidateIOMMUAll cmd{};
     cmd.op = CmdInvalidateIOMMUAll::opcode;
@@ -588,6 +603,78 @@ uintptr_t amd_vi::IOMMUEngine::unmap(const DeviceID& device, uintptr_t iova) {
     return ret;
 }
 
+volatile amd_vi::IRTE* amd_vi::IOMMUEngine::get_irq_table(const amd_vi::DeviceID& device) {
+    if(irq_tables.contains(device.raw))
+        return irq_tables[device.raw];
+
+    get_translation(device); // Make sure the entry is valid with translation on, otherwise DMA would be untranslated
+
+    constexpr size_t n_pages = (n_irtes * sizeof(IRTE)) / pmm::block_size;
+    auto table_pa = pmm::alloc_n_blocks(n_pages);
+    ASSERT(table_pa);
+
+    auto* table = (volatile IRTE*)(table_pa + phys_mem_map);
+    memset((void*)table, 0, n_pages * pmm::block_size);
+
+    volatile auto* entry_ptr = &device_table[device.raw];
+    DeviceTableEntry entry{};
+    entry.load(entry_ptr);
+
+    entry.interrupt_table_root_ptr = (table_pa >> 6);
+    entry.interrupt_table_length = irq_table_length;
+    entry.ignore_unmapped_interrupts = 0; // Log them, an unmapped IRQ means something is wrong
+    entry.interrupt_control = 0b10; // Remap fixed and arbitrated IRQs
+    entry.interrupt_map_valid = 1;
+
+    entry.store(entry_ptr);
+    irq_tables[device.raw] = table;
+    cmd_invalidate_devtab_entry(device);
+
+    if(alias_map.contains(device.raw)) {
+        auto alias = alias_map[device.raw];
+
+        entry.store(&device_table[alias]);
+        irq_tables[alias] = table;
+        cmd_invalidate_devtab_entry(DeviceID{.raw = alias});
+    }
+
+    return table;
+}
+
+bool amd_vi::IOMMUEngine::remap_irq(const amd_vi::DeviceID& device, uint16_t i, uint8_t vector, uint32_t lapic_id, uint64_t& address, uint32_t& data) {
+    if(i >= n_irtes || lapic_id > 0xFF)
+        return false;
+
+    auto* table = get_irq_table(device);
+
+    IRTE entry{};
+    entry.int_type = 0; // Fixed
+    entry.destination_mode = 0; // Physical
+    entry.destination = lapic_id;
+    entry.vector = vector;
+    entry.remap_enable = 1;
+
+    table[i].raw = entry.raw;
+    cmd_invalidate_int_table(device);
+
+    // The IOMMU takes the IRTE index from the low bits of the data, the address is just a normal one
+    pci::msi::Address msi_addr{.raw = 0};
+    msi_addr.base_address = 0xFEE;
+    msi_addr.destination_id = lapic_id;
+
+    address = msi_addr.raw;
+    data = i;
+    return true;
+}
+
+void amd_vi::IOMMUEngine::unmap_irq(const amd_vi::DeviceID& device, uint16_t i) {
+    if(i >= n_irtes || !irq_tables.contains(device.raw))
+        return;
+
+    irq_tables[device.raw][i].raw = 0;
+    cmd_invalidate_int_table(device);
+}
+
 amd_vi::IOMMU::IOMMU() {
     ivrs = acpi::get_table<Ivrs>();
     if(!ivrs)
@@ -696,6 +783,31 @@ void amd_vi::IOMMU::invalidate_iotlb_entry(const pci::Device& device, uintptr_t
     engine.invalidate_iotlb_addr(id, iova);
 }
 
+bool amd_vi::IOMMU::remap_irq(const pci::Device& device, uint16_t i, uint8_t vector, uint32_t lapic_id, uint64_t& address, uint32_t& data) {
+    auto id = DeviceID::from_device(device);
+
+    auto& engine = engine_for_device(device.seg, id);
+
+    std::lock_guard guard{engine.lock};
+
+    return engine.remap_irq(id, i, vector, lapic_id, address, data);
+}
+
+void amd_vi::IOMMU::unmap_irq(const pci::Device& device, uint16_t i) {
+    auto id = DeviceID::from_device(device);
+
+    auto& engine = engine_for_device(device.seg, id);
+
+    std::lock_guard guard{engine.lock};
+
+    engine.unmap_irq(id, i);
+}
+
+bool amd_vi::IOMMU::blocks_compat_irqs(const pci::Device&) {
+    // Every device that has an IRQ table gets remapping with unmapped IRQs blocked, there is no separate compatibility format
+    return true;
+}
+
 bool amd_vi::has_iommu() {
     return acpi::get_table<Ivrs>() ? true : false;
 }
\ No newline at end of file
@@ -159,6 +159,10 @@ vt_d::RemappingEngine::RemappingEngine(vt_d::Drhd* drhd): drhd{drhd} {
     qi = (regs->extended_capabilities >> 1) & 1;
     eim = (regs->extended_capabilities >> 4) & 1;
     page_snoop = (regs->extended_capabilities >> 7) & 1;
+    irq_remap = ((regs->extended_capabilities >> 3) & 1) && qi; // IEC invalidation only exists as a QI descriptor
+    posted_irqs = (regs->capabilities >> 59) & 1;
+
+    print("      IRQ Remapping: {}{}\n", irq_remap ? "Yes" : "No", posted_irqs ? ", Posted IRQs" : "");
 
     if(caching_mode)
         domain_ids.set(0);
@@ -273,6 +277,47 @@ vt_d::RemappingEngine::RemappingEngine(vt_d::Drhd* drhd): drhd{drhd} {
     invalidate_global_iotlb();
 
     print("Done\n");
+
+    if(irq_remap)
+        enable_irq_remapping();
+}
+
+void vt_d::RemappingEngine::enable_irq_remapping() {
+    print("      Installing IRQ Remapping Table ... ");
+
+    constexpr size_t n_pages = (n_irtes * sizeof(IRTE)) / pmm::block_size;
+    auto table_pa = pmm::alloc_n_blocks(n_pages);
+    ASSERT(table_pa);
+
+    for(size_t i = 0; i < n_pages; i++)
+        vmm::get_kernel_context().map(table_pa + (i * pmm::block_size), table_pa + phys_mem_map + (i * pmm::block_size), paging::mapPagePresent | paging::mapPageWrite, msr::pat::wb);
+
+    irq_table = (IRTE*)(table_pa + phys_mem_map);
+    memset((void*)irq_table, 0, n_pages * pmm::block_size);
+    flush_cache((void*)irq_table, n_pages * pmm::block_size);
+
+    irte_ids = std::bitmap{n_irtes};
+
+    wbflush();
+    regs->irq_remapping_table_base = table_pa | (__builtin_ctz(n_irtes) - 1); // xAPIC mode, 2^(S + 1) entries
+
+    regs->global_command = regs->global_status | GlobalCommand::SetIRQRemapTable;
+    while(!(regs->global_status & GlobalCommand::SetIRQRemapTable))
+        asm("pause");
+
+    invalidate_global_iec();
+
+    // Compatibility format messages keep going through untouched, so host drivers that program their own MSIs, and the IOAPIC, keep working
+    // That means any device can still hit any vector, so passthrough is refused while this is set, see blocks_compat_irqs()
+    regs->global_command = regs->global_status | GlobalCommand::CompatibilityFormatIRQ;
+    while(!(regs->global_status & GlobalCommand::CompatibilityFormatIRQ))
+        asm("pause");
+
+    regs->global_command = regs->global_status | GlobalCommand::IRQRemappingEnable;
+    while(!(regs->global_status & GlobalCommand::IRQRemappingEnable))
+        asm("pause");
+
+    print("Done\n");
 }
 
 void vt_d::RemappingEngine::enable_translation() {
@@ -433,6 +478,24 @@ void vt_d::RemappingEngine::invalidate_iotlb_addr(uint16_t domain_id, uintptr_t
     }
 }
 
+void vt_d::RemappingEngine::invalidate_iec(uint16_t index) {
+    IECInvalidationDescriptor cmd{};
+    cmd.type = IECInvalidationDescriptor::cmd;
+    cmd.granularity = 1;
+    cmd.index_mask = 0;
+    cmd.index = index;
+
+    iq->submit_sync((uint8_t*)&cmd);
+}
+
+void vt_d::RemappingEngine::invalidate_global_iec() {
+    IECInvalidationDescriptor cmd{};
+    cmd.type = IECInvalidationDescriptor::cmd;
+    cmd.granularity = 0;
+
+    iq->submit_sync((uint8_t*)&cmd);
+}
+
 sl_paging::Context& vt_d::RemappingEngine::get_device_translation(vt_d::SourceID device) {
     auto* root_entry = &root_table->entries[device.bus];
     if(!root_entry->present) {
@@ -503,6 +566,62 @@ uintptr_t vt_d::RemappingEngine::unmap(vt_d::SourceID device, uintptr_t iova) {
     return ret;
 }
 
+bool vt_d::RemappingEngine::remap_irq(vt_d::SourceID device, uint16_t i, uint8_t vector, uint32_t lapic_id, uint64_t& address, uint32_t& data) {
+    if(!irq_remap || lapic_id > 0xFF)
+        return false;
+
+    uint32_t key = ((uint32_t)device.raw << 16) | i;
+    uint16_t index = 0;
+    if(irte_map.contains(key)) {
+        index = irte_map[key];
+    } else {
+        auto id = irte_ids.get_free_bit();
+        if(id == ~0u)
+            return false;
+
+        irte_ids.set(id);
+        index = id;
+        irte_map[key] = index;
+    }
+
+    IRTE entry{};
+    entry.vector = vector;
+    entry.destination = (lapic_id & 0xFF) << 8;
+    entry.source_id = device.raw;
+    entry.source_qualifier = 0;
+    entry.source_validation_type = 1; // Requester ID has to match exactly
+    entry.present = 1;
+
+    // Present is in the low half, so write the high half first
+    irq_table[index].raw[1] = entry.raw[1];
+    irq_table[index].raw[0] = entry.raw[0];
+    flush_cache((void*)&irq_table[index], sizeof(IRTE));
+
+    invalidate_iec(index);
+
+    // Remappable format, the handle is the IRTE index and SHV is off, so data is left 0
+    address = (0xFEEull << 20) | ((index & 0x7FFF) << 5) | (1 << 4) | (((index >> 15) & 1) << 2);
+    data = 0;
+    return true;
+}
+
+void vt_d::RemappingEngine::unmap_irq(vt_d::SourceID device, uint16_t i) {
+    uint32_t key = ((uint32_t)device.raw << 16) | i;
+    if(!irq_remap || !irte_map.contains(key))
+        return;
+
+    auto index = irte_map[key];
+    irq_table[index].raw[0] = 0;
+    irq_table[index].raw[1] = 0;
+    flush_cache((void*)&irq_table[index], sizeof(IRTE));
+
+    invalidate_iec(index);
+}
+
+bool vt_d::RemappingEngine::blocks_compat_irqs() {
+    return irq_remap && !(regs->global_status & GlobalCommand::CompatibilityFormatIRQ);
+}
+
 void vt_d::RemappingEngine::handle_primary_fault() {
     for(size_t i = 0; i < n_fault_recording_regs; i++) {
         uint64_t* reg = (uint64_t*)&fault_recording_regs[i];
@@ -707,6 +826,36 @@ uintptr_t vt_d::IOMMU::unmap(const pci::Device& device, uintptr_t iova) {
     return engine.unmap(id, iova);
 }
 
+bool vt_d::IOMMU::remap_irq(const pci::Device& device, uint16_t i, uint8_t vector, uint32_t lapic_id, uint64_t& address, uint32_t& data) {
+    auto id = SourceID::from_device(device);
+
+    auto& engine = get_engine(device.seg, id);
+
+    std::lock_guard guard{engine.lock};
+
+    return engine.remap_irq(id, i, vector, lapic_id, address, data);
+}
+
+void vt_d::IOMMU::unmap_irq(const pci::Device& device, uint16_t i) {
+    auto id = SourceID::from_device(device);
+
+    auto& engine = get_engine(device.seg, id);
+
+    std::lock_guard guard{engine.lock};
+
+    engine.unmap_irq(id, i);
+}
+
+bool vt_d::IOMMU::blocks_compat_irqs(const pci::Device& device) {
+    auto id = SourceID::from_device(device);
+
+    auto& engine = get_engine(device.seg, id);
+
+    std::lock_guard guard{engine.lock};
+
+    return engine.blocks_compat_irqs();
+}
+
 bool vt_d::has_iommu() {
     return acpi::get_table<Dmar>() ? true : false;
 }
\ No newline at end of file
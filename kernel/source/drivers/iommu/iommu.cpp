@@ -40,4 +40,30 @@ uintptr_t iommu::unmap(const pci::Device& device, uintptr_t iova) {
         return amd_iommu->unmap(device, iova);
     else
         PANIC("Unknown vendor");
+}
+bool iommu::remap_irq(const pci::Device& device, uint16_t i, uint8_t vector, uint32_t lapic_id, uint64_t& address, uint32_t& data) {
+    if(vendor == CpuVendor::Intel)
+        return intel_iommu->remap_irq(device, i, vector, lapic_id, address, data);
+    else if(vendor == CpuVendor::AMD)
+        return amd_iommu->remap_irq(device, i, vector, lapic_id, address, data);
+    else
+        PANIC("Unknown vendor");
+}
+
+void iommu::unmap_irq(const pci::Device& device, uint16_t i) {
+    if(vendor == CpuVendor::Intel)
+        intel_iommu->unmap_irq(device, i);
+    else if(vendor == CpuVendor::AMD)
+        amd_iommu->unmap_irq(device, i);
+    else
+        PANIC("Unknown vendor");
+}
+
+bool iommu::blocks_compat_irqs(const pci::Device& device) {
+    if(vendor == CpuVendor::Intel)
+        return intel_iommu->blocks_compat_irqs(device);
+    else if(vendor == CpuVendor::AMD)
+        return amd_iommu->blocks_compat_irqs(device);
+    else
+        PANIC("Unknown vendor");
 }
\ No newline at end of file
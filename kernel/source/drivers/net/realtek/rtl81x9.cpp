@@ -98,10 +98,10 @@ rtl81x9::Nic::Nic(pci::Device& device, uint16_t did): mm{&device}, regs{nullptr}
 
     regs->cr = cr::tx_enable;
     regs->tcr = tcr::mxdma_unlimited | tcr::ifg_normal;
-    regs->rcr = rcr::mxdma_unlimited | rcr::rxftr_none;
+    regs->rcr = rcr::mxdma_unlimited | rcr::rxftr_none | rcr::accept_physical_match | rcr::accept_multicast | rcr::accept_broadcast;
 
     regs->etthr = 0x3B;
-    regs->rms = 0x1FFF;
+    regs->rms = mtu; // Bigger frames wouldn't fit in 1 RX buffer
 
     regs->imr = isr::rx_ok | isr::rx_err | isr::tx_ok | isr::tx_err | isr::link_change;
     auto isr = regs->isr;
@@ -113,9 +113,11 @@ rtl81x9::Nic::Nic(pci::Device& device, uint16_t did): mm{&device}, regs{nullptr}
     regs->cr9346 = cr9346::lock_regs;
 
     tx_index = 0;
+    rx_index = 0;
 }
 
 bool rtl81x9::Nic::send_packet(const net::Mac& dst, uint16_t ethertype, const std::span<uint8_t>& packet, uint32_t offload) {
+    std::lock_guard guard{tx_lock};
     if(tx[tx_index].flags & tx_flags::own) {
         regs->txpoll = txpoll::poll_normal_prio;
 
@@ -148,20 +150,74 @@ bool rtl81x9::Nic::send_packet(const net::Mac& dst, uint16_t ethertype, const st
     return true;
 }
 
+bool rtl81x9::Nic::send_frame(const std::span<uint8_t>& frame) {
+    if(frame.size_bytes() > mtu)
+        return false;
+
+    std::lock_guard guard{tx_lock};
+    if(tx[tx_index].flags & tx_flags::own) {
+        regs->txpoll = txpoll::poll_normal_prio;
+
+        return false;
+    }
+
+    memcpy((uint8_t*)tx_set->descriptor[tx_index].buf, frame.data(), frame.size_bytes());
+    tx[tx_index].flags |= (tx_flags::own | tx_flags::fs | tx_flags::ls | (frame.size_bytes() & 0xFFFF));
+
+    tx_index = (tx_index + 1) % n_descriptor_sets;
+
+    regs->txpoll = txpoll::poll_normal_prio;
+    return true;
+}
+
+void rtl81x9::Nic::set_promiscuous(bool enable) {
+    regs->cr9346 = cr9346::unlock_regs;
+    if(enable)
+        regs->rcr |= rcr::accept_all;
+    else
+        regs->rcr &= ~rcr::accept_all;
+    regs->cr9346 = cr9346::lock_regs;
+}
+
 void rtl81x9::Nic::handle_irq() {
     auto sts = regs->isr;
 
     if(sts & isr::link_change) {
         // TODO: Handle Link Change events
-    } else if(sts & isr::tx_ok) {
+    }
+
+    if(sts & (isr::rx_ok | isr::rx_err))
+        handle_rx();
+
+    if(sts & isr::tx_ok) {
+        std::lock_guard guard{tx_lock};
         handle_tx_ok();
-    } else {
-        print("rtl81x9: Unhandled IRQ: {:#x}\n", sts);
     }
 
+    if(sts & ~(isr::link_change | isr::rx_ok | isr::rx_err | isr::tx_ok))
+        print("rtl81x9: Unhandled IRQ: {:#x}\n", sts);
+
     regs->isr = sts;
 }
 
+void rtl81x9::Nic::handle_rx() {
+    while(!(rx[rx_index].flags & rx_flags::own)) {
+        auto flags = rx[rx_index].flags;
+
+        // Frames never span multiple buffers, since RMS is set to the buffer size
+        auto len = flags & rx_flags::length_mask;
+        bool complete = (flags & rx_flags::fs) && (flags & rx_flags::ls);
+        if(!(flags & rx_flags::res) && complete && len > crc_size && len <= mtu && rx_handler)
+            rx_handler(std::span<uint8_t>{(uint8_t*)rx_set->descriptor[rx_index].buf, len - crc_size}, rx_userptr);
+
+        // Give the descriptor back to the NIC
+        rx[rx_index].vlan = 0;
+        rx[rx_index].flags = rx_flags::own | mtu | ((rx_index == (n_descriptor_sets - 1)) ? rx_flags::eor : 0);
+
+        rx_index = (rx_index + 1) % n_descriptor_sets;
+    }
+}
+
 void rtl81x9::Nic::handle_tx_ok() {
     for(size_t i = 0; i < n_descriptor_sets; i++) {
         if(tx[i].flags & tx_flags::own) // Descriptor was not transmitted?
@@ -373,7 +373,7 @@ void pci::write_raw(uint16_t seg, uint8_t bus, uint8_t slot, uint8_t func, size_
     else PANIC("Invalid width");
 }
 
-static void install_msix(pci::Device& device, uint16_t index, uint8_t vector) {
+static void install_msix(pci::Device& device, uint16_t index, uint64_t address, uint32_t data) {
     pci::msix::Control control{.raw = device.read<uint16_t>(device.msix.offset + pci::msix::control)};
     control.mask = 1;
     control.enable = 1;
@@ -388,20 +388,12 @@ static void install_msix(pci::Device& device, uint16_t index, uint8_t vector) {
     vmm::get_kernel_context().map(base, base + phys_mem_map, paging::mapPagePresent | paging::mapPageWrite, msr::pat::uc); // TODO: How should this interact with device drivers?
     volatile auto* table = (pci::msix::Entry*)(base + phys_mem_map);
 
-    pci::msi::Data data{};
-    data.vector = vector;
-    data.delivery_mode = 0;
-
-    pci::msi::Address address{};
-    address.base_address = 0xFEE;
-    address.destination_id = get_cpu().lapic_id;
-
     pci::msix::VectorControl vector_control{};
     vector_control.mask = 0;
 
-    table[index].addr_low = address.raw;
-    table[index].addr_high = 0; // TODO: High address
-    table[index].data = data.raw;
+    table[index].addr_low = address & 0xFFFF'FFFF;
+    table[index].addr_high = address >> 32;
+    table[index].data = data;
     table[index].control = vector_control.raw;
 
     control.raw = device.read<uint16_t>(device.msix.offset + pci::msix::control);
@@ -409,27 +401,20 @@ static void install_msix(pci::Device& device, uint16_t index, uint8_t vector) {
     device.write<uint16_t>(device.msix.offset + pci::msix::control, control.raw);
 }
 
-static void install_msi(pci::Device& device, uint16_t index, uint8_t vector) {
+static void install_msi(pci::Device& device, uint16_t index, uint64_t address, uint32_t data) {
     ASSERT(index == 0); // TODO: Support Multiple Message MSI
 
     pci::msi::Control control{};
-    pci::msi::Data data{};
-    pci::msi::Address address{};
-
     control.raw = device.read<uint16_t>(device.msi.offset + pci::msi::control);
     ASSERT((1 << control.mmc) < 32); // Assert count is sane
 
-    //address.raw = device.read<uint32_t>(device.msi.offset + pci::msi::addr);
-    //data.raw = device.read<uint32_t>(device.msi.offset + (control.c64 ? pci::msi::data_64 : pci::msi::data_32));
-
-    data.vector = vector;
-    data.delivery_mode = 0;
-
-    address.base_address = 0xFEE;
-    address.destination_id = get_cpu().lapic_id;
+    device.write<uint32_t>(device.msi.offset + pci::msi::addr, address & 0xFFFF'FFFF);
+    if(control.c64)
+        device.write<uint32_t>(device.msi.offset + pci::msi::addr + 4, address >> 32);
+    else
+        ASSERT((address >> 32) == 0);
 
-    device.write<uint32_t>(device.msi.offset + pci::msi::addr, address.raw);
-    device.write<uint32_t>(device.msi.offset + (control.c64 ? pci::msi::data_64 : pci::msi::data_32), data.raw);
+    device.write<uint32_t>(device.msi.offset + (control.c64 ? pci::msi::data_64 : pci::msi::data_32), data);
 
     control.enable = 1;
     control.mme = 0; // Enable 1 IRQ
@@ -438,10 +423,22 @@ static void install_msi(pci::Device& device, uint16_t index, uint8_t vector) {
 }
 
 void pci::Device::enable_irq(uint16_t index, uint8_t vector) {
+    pci::msi::Data data{};
+    data.vector = vector;
+    data.delivery_mode = 0;
+
+    pci::msi::Address address{};
+    address.base_address = 0xFEE;
+    address.destination_id = get_cpu().lapic_id;
+
+    enable_irq(index, address.raw, data.raw);
+}
+
+void pci::Device::enable_irq(uint16_t index, uint64_t address, uint32_t data) {
     if(msix.supported)
-        install_msix(*this, index, vector);
+        install_msix(*this, index, address, data);
     else if(msi.supported)
-        install_msi(*this, index, vector);
+        install_msi(*this, index, address, data);
     else
         PANIC("No IRQ routing support");
 }
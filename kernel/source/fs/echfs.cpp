@@ -170,11 +170,32 @@ size_t echfs::File::read(size_t offset, size_t count, uint8_t* data) {
 }
 
 size_t echfs::File::write(size_t offset, size_t count, uint8_t* data) {
-    PANIC("TODO: Implement file writing");
-    (void)offset;
-    (void)count;
-    (void)data;
-    return 0;
+    if(entry.type != ObjectType::File)
+        return 0;
+
+    // TODO: Support growing files, for now only existing data can be overwritten in place
+    if(offset >= entry.file_size)
+        return 0;
+
+    if((offset + count) > entry.file_size)
+        count = entry.file_size - offset;
+
+    uint64_t progress = 0;
+    while(progress < count) {
+        uint64_t block = (offset + progress) / fs->bytes_per_block;
+        uint64_t loc = fat_chain[block] * fs->bytes_per_block;
+
+        uint64_t chunk = count - progress;
+        uint64_t disk_offset = (offset + progress) % fs->bytes_per_block;
+        if(chunk > (fs->bytes_per_block - disk_offset))
+            chunk = (fs->bytes_per_block - disk_offset);
+
+        fs->partition.write(loc + disk_offset, chunk, data + progress);
+        progress += chunk;
+    }
+
+    dirty = true;
+    return count;
 }
 
 size_t echfs::File::get_size() {
@@ -185,5 +206,9 @@ size_t echfs::File::get_size() {
 }
 
 void echfs::File::close() {
-    // Nothing To Do, no caches, no resources to release
+    // Make sure anything written ends up on disk, and not just in the device cache
+    if(dirty) {
+        fs->partition.device->flush();
+        dirty = false;
+    }
 }
\ No newline at end of file
@@ -9,15 +9,15 @@
 #include <std/string.hpp>
 #include <std/algorithm.hpp>
 
-storage_dev::Device::CacheBlock& storage_dev::Device::get_cache_block(size_t block) {
-    auto evict = [this](CacheBlock& entry) {
-        if(!entry.modified)
-            return;
+void storage_dev::Device::writeback(CacheBlock& entry) {
+    if(!entry.modified)
+        return;
         
-        driver.xfer(driver.userptr, true, entry.block * sectors_per_cache_block, sectors_per_cache_block, std::span<uint8_t>{entry.buffer.data(), sectors_per_cache_block * driver.sector_size});
-        entry.modified = false;
-    };
+    driver.xfer(driver.userptr, true, entry.block * sectors_per_cache_block, sectors_per_cache_block, std::span<uint8_t>{entry.buffer.data(), sectors_per_cache_block * driver.sector_size});
+    entry.modified = false;
+}
 
+storage_dev::Device::CacheBlock& storage_dev::Device::get_cache_block(size_t block) {
     auto get_lru = [this] {
         uint64_t oldest = ~0ull;
         auto ret = cache.end();
@@ -36,7 +36,7 @@ storage_dev::Device::CacheBlock& storage_dev::Device::get_cache_block(size_t blo
     if(it == cache.end()) {
         it = get_lru();
         ASSERT(it != cache.end());
-        evict(*it);
+        writeback(*it);
 
         it->block = block;
 
@@ -102,6 +102,13 @@ bool storage_dev::Device::write(size_t offset, size_t count, uint8_t* data) {
     return true;
 }
 
+void storage_dev::Device::flush() {
+    std::lock_guard guard{lock};
+
+    for(auto& entry : cache)
+        writeback(entry);
+}
+
 static std::linked_list<storage_dev::Device*> devices;
 static IrqTicketLock lock{};
 
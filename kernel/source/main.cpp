@@ -31,36 +31,11 @@
 #include <Luna/fs/vfs.hpp>
 
 #include <Luna/vmm/vm.hpp>
-#include <Luna/vmm/drivers/e9.hpp>
-#include <Luna/vmm/drivers/uart.hpp>
-#include <Luna/vmm/drivers/nvme.hpp>
-#include <Luna/vmm/drivers/hpet.hpp>
-#include <Luna/vmm/drivers/cmos.hpp>
-#include <Luna/vmm/drivers/ps2.hpp>
-#include <Luna/vmm/drivers/fast_a20.hpp>
-#include <Luna/vmm/drivers/pit.hpp>
-#include <Luna/vmm/drivers/io_delay.hpp>
-#include <Luna/vmm/drivers/pci/pci.hpp>
-#include <Luna/vmm/drivers/pci/pio_access.hpp>
-#include <Luna/vmm/drivers/pci/ecam.hpp>
-#include <Luna/vmm/drivers/pci/hotplug.hpp>
-
-#include <Luna/vmm/drivers/q35/dram.hpp>
-#include <Luna/vmm/drivers/q35/lpc.hpp>
-#include <Luna/vmm/drivers/q35/acpi.hpp>
-#include <Luna/vmm/drivers/q35/smi.hpp>
-
-#include <Luna/vmm/drivers/irqs/pic.hpp>
-#include <Luna/vmm/drivers/irqs/lapic.hpp>
-#include <Luna/vmm/drivers/irqs/ioapic.hpp>
-
-#include <Luna/vmm/drivers/gpu/bga.hpp>
-#include <Luna/vmm/drivers/gpu/vga.hpp>
+#include <Luna/vmm/manager.hpp>
 
 #include <Luna/net/luna_debug.hpp>
 
 #include <Luna/gui/gui.hpp>
-#include <Luna/gui/windows/log_window.hpp>
 
 #include <std/mutex.hpp>
 #include <std/event_queue.hpp>
@@ -75,7 +50,6 @@ static CpuData& allocate_cpu_data() {
 }
 
 void kernel_main_ap(stivale2_smp_info* info);
-void create_vm();
 
 void kernel_main(const stivale2_struct* info) {
     log::select_logger(log::LoggerType::Early);
@@ -151,9 +125,8 @@ void kernel_main(const stivale2_struct* info) {
         gui::get_desktop().start_gui(); // Only start GUI until after USB devices are mounted
         //vbe::init();
 
-        create_vm();
-        while(1)
-            ;
+        vm::manager::create({.name = "Linux", .disk_image = "A:/disk.bin", .disk_overlay = "A:/luna/overlay.bin", .snapshot = "A:/luna/snapshot.bin", .net = vm::manager::NetBackend::Host});
+        kill_self();
     });
 
     threading::start_on_cpu();
@@ -215,178 +188,4 @@ stivale2_header header = {
     .stack = (uint64_t)(bsp_stack + bsp_stack_size),
     .flags = 0, // No KASLR
     .tags = (uint64_t)&la57_tag
-};
-
-void create_vm() {
-    this_thread()->pin_to_this_cpu(); // TODO: Is it possible to migrate vcpus between cpus?
-
-    constexpr uintptr_t himem_start = 0x10'0000;
-    constexpr size_t himem_size = 128 * 1024 * 1024; // 16MiB
-
-    vm::Vm vm{1, this_thread()};
-    {
-        auto* file = vfs::get_vfs().open("A:/luna/bios.bin");
-        ASSERT(file);
-
-        auto bios_size = file->get_size();
-        ASSERT((bios_size % 0x1000) == 0);
-
-        
-        auto isa_bios_size = min(bios_size, 128 * 1024);
-        auto isa_bios_start = himem_start - isa_bios_size;
-        size_t isa_curr = 0;
-
-
-        uintptr_t map = 0x1'0000'0000 - bios_size;
-        for(size_t curr = 0; curr < bios_size; curr += 0x1000) {
-            auto block = pmm::alloc_block();
-            ASSERT(block);
-
-            if((bios_size - curr) <= isa_bios_size) {
-                vm.mm->map(block, isa_bios_start + isa_curr, paging::mapPagePresent | paging::mapPageExecute);
-                isa_curr += 0x1000;
-            }
-
-            vm.mm->map(block, map + curr, paging::mapPagePresent | paging::mapPageExecute);
-
-            auto* va = (uint8_t*)(block + phys_mem_map);
-            ASSERT(file->read(curr, 0x1000, va) == 0x1000);
-        }
-
-        // Setup lowmem
-        for(size_t i = 0; i < isa_bios_start; i += 0x1000) {
-            auto block = pmm::alloc_block();
-            ASSERT(block);
-
-            auto* va = (uint8_t*)(block + phys_mem_map);
-            memset(va, 0, pmm::block_size);
-
-            vm.mm->map(block, i, paging::mapPagePresent | paging::mapPageWrite | paging::mapPageExecute);
-        }
-
-        // Setup himem
-        for(size_t i = 0; i < himem_size; i += 0x1000) {
-            auto block = pmm::alloc_block();
-            ASSERT(block);
-
-            auto* va = (uint8_t*)(block + phys_mem_map);
-            memset(va, 0, pmm::block_size);
-
-            vm.mm->map(block, himem_start + i, paging::mapPagePresent | paging::mapPageWrite | paging::mapPageExecute);
-        }
-
-        file->close();
-    }
-
-    auto* cmos_dev = new vm::cmos::Driver{&vm};
-
-    {
-        auto size = himem_start + himem_size - (16 * 1024 * 1024); // TODO: Investigate this, seems to be what Seabios does
-        cmos_dev->write(vm::cmos::cmos_extmem2_low, (size >> 16) & 0xFF);
-        cmos_dev->write(vm::cmos::cmos_extmem2_high, (size >> 24) & 0xFF);
-
-
-        /*
-            Boot Priority Numbers
-                1: Floppy
-                2: Harddisk
-                3: CD-Rom
-                4: BEV???
-
-            1st priority is Bootflag2 bits 0:3
-            2nd priority is Bootflag2 bits 4:7
-            3rd priority is Bootflag1 bits 4:7
-
-            We do HDD -> CD -> Floppy
-        */
-        cmos_dev->write(vm::cmos::cmos_bootflag1, (1 << 4) | 0); // Bit0 = Disable Floppy MBR Sig Check
-        cmos_dev->write(vm::cmos::cmos_bootflag2, (3 << 4) | (2 << 0));
-
-        cmos_dev->write(vm::cmos::cmos_ap_count, 0); // Currently we only support the BSP, no APs
-
-
-        cmos_dev->write(vm::cmos::rtc_day, 28); // TODO: Don't hardcode this
-        cmos_dev->write(vm::cmos::rtc_month, 2);
-        cmos_dev->write(vm::cmos::rtc_year, 21);
-        cmos_dev->write(vm::cmos::rtc_century, 20);
-    }
-    
-    auto* pci_host_bridge = new vm::pci::HostBridge{};
-
-
-    auto* a20_dev = new vm::fast_a20::Driver{&vm};
-    (void)a20_dev;
-
-    auto* io_delay_dev = new vm::io_delay::Driver{&vm};
-    (void)io_delay_dev;
-
-    auto* log_window = new gui::LogWindow{{60, 40}, "VM Log"};
-    gui::get_desktop().add_window(log_window);
-
-    auto* uart_dev = new vm::uart::Driver{&vm, 0x3F8, log_window};
-    (void)uart_dev;
-
-    auto* e9_dev = new vm::e9::Driver{&vm, log_window};
-    (void)e9_dev;
-
-    auto* ps2_dev = new vm::ps2::Driver{&vm};
-    (void)ps2_dev;
-
-    auto* hpet_dev = new vm::hpet::Driver{&vm};
-    (void)hpet_dev;
-
-    auto* pit_dev = new vm::pit::Driver{&vm};
-    (void)pit_dev;
-
-    auto* file = vfs::get_vfs().open("A:/disk.bin");
-    auto* nvme_dev = new vm::nvme::Driver{&vm, pci_host_bridge, 6, 0, file};
-    (void)nvme_dev;
-
-    auto* vgabios = vfs::get_vfs().open("A:/luna/vgabios.bin");
-    ASSERT(vgabios);
-
-    {
-        uint8_t signature[2] = {};
-        vgabios->read(0, 2, signature);
-
-        ASSERT(signature[0] == 0x55 && signature[1] == 0xAA);
-    }
-
-    auto* bga_dev = new vm::gpu::bga::Driver{&vm, pci_host_bridge, vgabios, 2, ps2_dev};
-    (void)bga_dev;
-
-    auto* vga_dev = new vm::gpu::vga::Driver{&vm};
-    (void)vga_dev;
-
-    auto* pci_hotplug = new vm::pci::hotplug::Driver{&vm};
-    (void)pci_hotplug;
-
-    auto* pci_pio_access = new vm::pci::pio_access::Driver{&vm, vm::pci::pio_access::default_base, 0, pci_host_bridge};
-    (void)pci_pio_access;
-
-    auto* pci_mmio_access = new vm::pci::ecam::Driver{&vm, pci_host_bridge, 0};
-    (void)pci_mmio_access;
-
-    auto* dram_dev = new vm::q35::dram::Driver{&vm, pci_host_bridge, pci_mmio_access};
-
-    vm.cpus[0].set(vm::VmCap::SMMEntryCallback, [](vm::VCPU*, void* dram) { ((vm::q35::dram::Driver*)dram)->smm_enter(); }, dram_dev);
-    vm.cpus[0].set(vm::VmCap::SMMLeaveCallback, [](vm::VCPU*, void* dram) { ((vm::q35::dram::Driver*)dram)->smm_leave(); }, dram_dev);
-
-    auto* smi_dev = new vm::q35::smi::Driver{&vm};
-
-    auto* acpi_dev = new vm::q35::acpi::Driver{&vm, smi_dev};
-
-    auto* lpc_dev = new vm::q35::lpc::Driver{&vm, pci_host_bridge, acpi_dev};
-    (void)lpc_dev;
-
-    auto* pic_dev = new vm::irqs::pic::Driver{&vm};
-    vm.irq_listeners.push_back(pic_dev);
-
-    auto* ioapic_dev = new vm::irqs::ioapic::Driver{&vm, 1, 0xFEC0'0000};
-    (void)ioapic_dev;
-    
-    vm.cpus[0].run();
-
-    while(1)
-        ;
-}
\ No newline at end of file
+};
\ No newline at end of file
@@ -13,6 +13,10 @@ void net::register_nic(Nic* nic) {
     print("net: Registered Interface with IP: {}\n", interface.ip);
 }
 
+bool net::has_default_if() {
+    return interfaces.size() >= 1;
+}
+
 net::Interface* net::get_default_if() {
     ASSERT(interfaces.size() >= 1);
 
@@ -0,0 +1,178 @@
+#include <Luna/vmm/bzimage.hpp>
+#include <Luna/vmm/vm.hpp>
+
+#include <Luna/mm/pmm.hpp>
+#include <Luna/misc/log.hpp>
+
+#include <std/string.hpp>
+
+using namespace vm::bzimage;
+
+// Guest RAM might not be allocated yet, or be split over non-contiguous host pages, so copy page by page
+static void write_guest(vm::Vm& vm, uintptr_t gpa, const void* data, size_t size) {
+    size_t curr = 0;
+    while(curr < size) {
+        auto chunk = min(pmm::block_size - ((gpa + curr) & 0xFFF), size - curr);
+        auto hpa = vm.gpa_to_hpa(gpa + curr, true);
+        ASSERT(hpa); // Only used for the fixed addresses of the boot structures, which are always in RAM
+
+        memcpy((uint8_t*)(hpa + phys_mem_map), (const uint8_t*)data + curr, chunk);
+        curr += chunk;
+    }
+}
+
+// Same as above, but reads straight from the file into guest RAM, without bouncing through a temporary buffer
+static bool load_guest(vm::Vm& vm, uintptr_t gpa, vfs::File* file, size_t offset, size_t size) {
+    size_t curr = 0;
+    while(curr < size) {
+        auto chunk = min(pmm::block_size - ((gpa + curr) & 0xFFF), size - curr);
+        auto hpa = vm.gpa_to_hpa(gpa + curr, true);
+        if(!hpa)
+            return false;
+
+        if(file->read(offset + curr, chunk, (uint8_t*)(hpa + phys_mem_map)) != chunk)
+            return false;
+
+        curr += chunk;
+    }
+
+    return true;
+}
+
+static void setup_page_tables(vm::Vm& vm) {
+    constexpr uint64_t present = (1 << 0), write = (1 << 1), huge = (1 << 7);
+    auto write_entry = [&](uintptr_t table, size_t i, uint64_t entry) { write_guest(vm, table + (i * sizeof(uint64_t)), &entry, sizeof(entry)); };
+
+    // Lowmem is zeroed on creation, so only the present entries have to be written
+    auto pml4 = page_tables_addr, pdpt = page_tables_addr + 0x1000;
+    write_entry(pml4, 0, pdpt | present | write);
+
+    for(size_t i = 0; i < 4; i++) {
+        auto pd = page_tables_addr + 0x2000 + (i * 0x1000);
+        write_entry(pdpt, i, pd | present | write);
+
+        for(size_t j = 0; j < 512; j++)
+            write_entry(pd, j, (((i * 512) + j) * 0x20'0000) | present | write | huge);
+    }
+}
+
+static void setup_bsp(vm::VCPU& vcpu, uintptr_t entry) {
+    // The boot protocol wants __BOOT_CS at 0x10 and __BOOT_DS at 0x18
+    const uint64_t gdt[4] = {0, 0, 0x00AF'9A00'0000'FFFF, 0x00CF'9200'0000'FFFF};
+    write_guest(*vcpu.vm, gdt_addr, gdt, sizeof(gdt));
+
+    vm::RegisterState regs{};
+    vcpu.get_regs(regs); // Start from the reset state, and only change what the boot protocol needs
+
+    regs.cs = {.selector = 0x10, .base = 0, .limit = 0xFFFF'FFFF, .attrib = {.type = 0b1011, .s = 1, .present = 1, .l = 1, .g = 1}};
+
+    vm::RegisterState::Segment data{.selector = 0x18, .base = 0, .limit = 0xFFFF'FFFF, .attrib = {.type = 0b0011, .s = 1, .present = 1, .db = 1, .g = 1}};
+    regs.ds = data;
+    regs.es = data;
+    regs.ss = data;
+    regs.fs = data;
+    regs.gs = data;
+
+    regs.tr = {.selector = 0, .base = 0, .limit = 0xFFFF, .attrib = {.type = 11, .present = 1}};
+
+    regs.gdtr = {.base = gdt_addr, .limit = sizeof(gdt) - 1};
+    regs.idtr = {.base = 0, .limit = 0};
+
+    regs.cr0 |= (1 << 0) | (1u << 31); // PE and PG
+    regs.cr3 = page_tables_addr;
+    regs.cr4 |= (1 << 5); // PAE
+    regs.efer |= (1 << 8) | (1 << 10); // LME and LMA
+
+    regs.rip = entry;
+    regs.rsi = boot_params_addr;
+    regs.rsp = boot_params_addr; // The kernel sets up its own stack, but give it something sane anyway
+    regs.rflags = (1 << 1); // Interrupts have to be disabled
+
+    vcpu.set_regs(regs);
+}
+
+bool vm::bzimage::boot(Vm& vm, vfs::File* kernel, vfs::File* initrd, const char* cmdline, const std::vector<E820Entry>& memory_map) {
+    SetupHeader hdr{};
+    if(kernel->get_size() < (setup_header_offset + sizeof(hdr)) || kernel->read(setup_header_offset, sizeof(hdr), (uint8_t*)&hdr) != sizeof(hdr))
+        return false;
+
+    if(hdr.boot_flag != 0xAA55 || hdr.header != header_magic) {
+        print("vm::bzimage: Not a bzImage\n");
+        return false;
+    }
+
+    if(hdr.version < min_version || !(hdr.xloadflags & xlf_kernel_64)) {
+        print("vm::bzimage: Kernel doesn't support the 64-bit boot protocol, version {:#x}\n", (uint16_t)hdr.version);
+        return false;
+    }
+
+    auto setup_sects = hdr.setup_sects ? hdr.setup_sects : 4;
+    auto kernel_offset = (setup_sects + 1) * 512;
+    auto kernel_size = kernel->get_size() - kernel_offset;
+
+    // The kernel has to fit in RAM including the space it needs to decompress itself
+    auto load_addr = hdr.pref_address;
+    auto load_end = load_addr + max(kernel_size, hdr.init_size);
+
+    const E820Entry* load_region = nullptr;
+    for(const auto& entry : memory_map)
+        if(entry.type == E820Type::Ram && load_addr >= entry.addr && load_end <= (entry.addr + entry.size))
+            load_region = &entry;
+
+    if(!load_region) {
+        print("vm::bzimage: Kernel doesn't fit at {:#x}, needs {:#x} bytes\n", load_addr, load_end - load_addr);
+        return false;
+    }
+
+    if(!load_guest(vm, load_addr, kernel, kernel_offset, kernel_size))
+        return false;
+
+    BootParams params{};
+
+    // Only the part of the setup header that the kernel actually has is copied, the jump instruction at 0x200 tells us how long it is
+    auto hdr_end = 0x202 + (hdr.jump >> 8);
+    memcpy(&params.hdr, &hdr, min(hdr_end - setup_header_offset, sizeof(hdr)));
+
+    params.hdr.type_of_loader = type_of_loader_undefined;
+    params.hdr.loadflags &= ~(1 << 5); // Clear QUIET_FLAG, we want early messages
+
+    auto cmdline_size = strlen(cmdline) + 1;
+    if(cmdline_size > min(max_cmdline_size, hdr.cmdline_size + 1)) {
+        print("vm::bzimage: Command line is too long\n");
+        return false;
+    }
+
+    write_guest(vm, cmdline_addr, cmdline, cmdline_size);
+    params.hdr.cmd_line_ptr = cmdline_addr;
+
+    if(initrd) {
+        auto initrd_size = initrd->get_size();
+
+        // Put the initrd as high as possible, but below what the kernel can address
+        auto top = min(load_region->addr + load_region->size, (uint64_t)hdr.initrd_addr_max + 1);
+        auto initrd_addr = align_down(top - initrd_size, pmm::block_size);
+        if(initrd_size > top || initrd_addr < load_end) {
+            print("vm::bzimage: Initrd doesn't fit, needs {:#x} bytes\n", initrd_size);
+            return false;
+        }
+
+        if(!load_guest(vm, initrd_addr, initrd, 0, initrd_size))
+            return false;
+
+        params.hdr.ramdisk_image = initrd_addr;
+        params.hdr.ramdisk_size = initrd_size;
+    }
+
+    ASSERT(memory_map.size() <= 128);
+    params.e820_entries = memory_map.size();
+    for(size_t i = 0; i < memory_map.size(); i++)
+        params.e820_table[i] = memory_map[i];
+
+    write_guest(vm, boot_params_addr, &params, sizeof(params));
+
+    setup_page_tables(vm);
+    setup_bsp(vm.cpus[0], load_addr + 0x200); // startup_64 is 512 bytes into the protected mode kernel
+
+    print("vm::bzimage: Loaded kernel {:#x} bytes at {:#x}, protocol version {:#x}\n", kernel_size, load_addr, (uint16_t)hdr.version);
+    return true;
+}
@@ -0,0 +1,246 @@
+#include <Luna/vmm/drivers/fw_cfg.hpp>
+#include <Luna/vmm/bzimage.hpp>
+
+#include <Luna/mm/pmm.hpp>
+#include <Luna/misc/log.hpp>
+
+#include <std/string.hpp>
+
+vm::fw_cfg::Driver::Driver(Vm* vm): selector{0}, offset{0}, dma_addr_high{0}, vm{vm} {
+    vm->pio_map[selector_port] = this;
+    vm->pio_map[data_port] = this;
+    vm->pio_map[dma_port_high] = this;
+    vm->pio_map[dma_port_low] = this;
+
+    add(Key::Signature, "QEMU", 4);
+    add<uint32_t>(Key::Id, IdFeatures::Traditional | IdFeatures::Dma);
+    add<uint32_t>(Key::FileDir, 0); // No files yet, so just the count
+}
+
+vm::fw_cfg::Driver::Item* vm::fw_cfg::Driver::find(uint16_t key) {
+    for(auto& item : items)
+        if(item.key == key)
+            return &item;
+
+    return nullptr;
+}
+
+vm::fw_cfg::Driver::Item& vm::fw_cfg::Driver::insert(uint16_t key) {
+    if(auto* item = find(key); item)
+        return *item;
+
+    items.push_back({.key = key, .size = 0, .data = {}, .file = nullptr, .file_offset = 0});
+    return items[items.size() - 1];
+}
+
+void vm::fw_cfg::Driver::add(uint16_t key, const void* data, size_t size) {
+    auto& item = insert(key);
+
+    item.size = size;
+    item.file = nullptr;
+    item.data.resize(size);
+    memcpy(item.data.data(), data, size);
+}
+
+void vm::fw_cfg::Driver::add(uint16_t key, vfs::File* file, size_t offset, size_t size) {
+    auto& item = insert(key);
+
+    item.size = size;
+    item.data.resize(0);
+    item.file = file;
+    item.file_offset = offset;
+}
+
+uint16_t vm::fw_cfg::Driver::add_dir_entry(const char* name, size_t size) {
+    uint16_t key = Key::FileFirst + files.size();
+    ASSERT(key < selector_write);
+
+    FileEntry entry{.size = bswap<uint32_t>(size), .select = bswap<uint16_t>(key), .reserved = 0, .name = {}};
+
+    auto name_len = strlen(name);
+    ASSERT(name_len < sizeof(entry.name));
+    memcpy(entry.name, name, name_len);
+
+    files.push_back(entry);
+
+    // The directory is a big endian count followed by all entries
+    std::vector<uint8_t> dir{};
+    dir.resize(sizeof(uint32_t) + (files.size() * sizeof(FileEntry)));
+
+    auto count = bswap<uint32_t>(files.size());
+    memcpy(dir.data(), &count, sizeof(count));
+    memcpy(dir.data() + sizeof(count), files.data(), files.size() * sizeof(FileEntry));
+
+    add(Key::FileDir, dir.data(), dir.size());
+
+    return key;
+}
+
+void vm::fw_cfg::Driver::add_file(const char* name, const void* data, size_t size) {
+    add(add_dir_entry(name, size), data, size);
+}
+
+void vm::fw_cfg::Driver::add_file(const char* name, vfs::File* file, size_t offset, size_t size) {
+    add(add_dir_entry(name, size), file, offset, size);
+}
+
+bool vm::fw_cfg::Driver::add_kernel(vfs::File* kernel, vfs::File* initrd, const char* cmdline, uintptr_t ram_end) {
+    // Same layout QEMU uses, the option ROM loads everything to where these keys say and jumps to the real mode setup code
+    constexpr uint32_t real_addr = 0x1'0000;
+    constexpr uint32_t cmdline_addr = 0x2'0000;
+    constexpr uint32_t prot_addr = 0x10'0000;
+
+    bzimage::SetupHeader hdr{};
+    if(kernel->read(bzimage::setup_header_offset, sizeof(hdr), (uint8_t*)&hdr) != sizeof(hdr))
+        return false;
+
+    if(hdr.boot_flag != 0xAA55 || hdr.header != bzimage::header_magic || hdr.version < 0x202) {
+        print("fw_cfg: Kernel is not a bzImage, or too old\n");
+        return false;
+    }
+
+    size_t setup_size = ((hdr.setup_sects ? hdr.setup_sects : 4) + 1) * 512;
+    size_t kernel_size = kernel->get_size() - setup_size;
+
+    std::vector<uint8_t> setup{};
+    setup.resize(setup_size);
+    if(kernel->read(0, setup_size, setup.data()) != setup_size)
+        return false;
+
+    auto* setup_hdr = (bzimage::SetupHeader*)(setup.data() + bzimage::setup_header_offset);
+    setup_hdr->type_of_loader = bzimage::type_of_loader_undefined;
+    setup_hdr->loadflags |= (1 << 7); // CAN_USE_HEAP
+    setup_hdr->heap_end_ptr = cmdline_addr - real_addr - 0x200;
+    setup_hdr->cmd_line_ptr = cmdline_addr;
+
+    if(initrd) {
+        size_t initrd_size = initrd->get_size();
+        size_t initrd_max = min((uintptr_t)hdr.initrd_addr_max, ram_end - 1);
+        if(initrd_size > (initrd_max - prot_addr - kernel_size)) {
+            print("fw_cfg: Initrd doesn't fit, needs {:#x} bytes\n", initrd_size);
+            return false;
+        }
+
+        uint32_t initrd_addr = align_down(initrd_max - initrd_size, pmm::block_size);
+        setup_hdr->ramdisk_image = initrd_addr;
+        setup_hdr->ramdisk_size = initrd_size;
+
+        add<uint32_t>(Key::InitrdAddr, initrd_addr);
+        add<uint32_t>(Key::InitrdSize, initrd_size);
+        add(Key::InitrdData, initrd, 0, initrd_size);
+    }
+
+    add<uint32_t>(Key::KernelAddr, prot_addr);
+    add<uint32_t>(Key::KernelSize, kernel_size);
+    add(Key::KernelData, kernel, setup_size, kernel_size);
+
+    uint32_t cmdline_size = strlen(cmdline) + 1;
+    add<uint32_t>(Key::CmdlineAddr, cmdline_addr);
+    add<uint32_t>(Key::CmdlineSize, cmdline_size);
+    add(Key::CmdlineData, cmdline, cmdline_size);
+
+    add<uint32_t>(Key::SetupAddr, real_addr);
+    add<uint32_t>(Key::SetupSize, setup_size);
+    add(Key::SetupData, setup.data(), setup_size);
+
+    return true;
+}
+
+void vm::fw_cfg::Driver::read(size_t off, uint8_t* buf, size_t size) {
+    memset(buf, 0, size);
+
+    auto* item = find(selector & ~selector_write);
+    if(!item || off >= item->size)
+        return;
+
+    auto n = min(size, item->size - off);
+    if(item->file)
+        item->file->read(item->file_offset + off, n, buf);
+    else
+        memcpy(buf, item->data.data() + off, n);
+}
+
+void vm::fw_cfg::Driver::dma_transfer(uintptr_t gpa) {
+    auto& vcpu = vm->cpus[0];
+
+    DmaAccess access{};
+    if(!vcpu.dma_read(gpa, {(uint8_t*)&access, sizeof(access)}))
+        return; // There's nowhere to report the error to
+
+    auto control = bswap<uint32_t>(access.control);
+    auto length = bswap<uint32_t>(access.length);
+    auto address = bswap<uint64_t>(access.address);
+
+    if(control & DmaControl::Select) {
+        selector = control >> 16;
+        offset = 0;
+    }
+
+    bool error = false;
+    if(control & DmaControl::Write) {
+        error = true; // None of the items are writable
+    } else if(control & DmaControl::Read) {
+        // Read straight into guest RAM, page by page since it doesn't have to be contiguous on the host
+        vm::RamPin pin{*vm};
+
+        size_t curr = 0;
+        while(curr < length) {
+            auto chunk = min(pmm::block_size - ((address + curr) & 0xFFF), length - curr);
+            auto hpa = vm->gpa_to_hpa(address + curr, true);
+            if(!hpa) { // Not RAM
+                error = true;
+                break;
+            }
+
+            read(offset + curr, (uint8_t*)(hpa + phys_mem_map), chunk);
+            curr += chunk;
+        }
+
+        offset += length;
+    } else if(control & DmaControl::Skip) {
+        offset += length;
+    }
+
+    // Only the control field is written back, 0 means the transfer is done
+    auto status = bswap<uint32_t>(error ? (uint32_t)DmaControl::Error : 0);
+    vcpu.dma_write(gpa, {(uint8_t*)&status, sizeof(status)});
+}
+
+void vm::fw_cfg::Driver::pio_write(uint16_t port, uint32_t value, [[maybe_unused]] uint8_t size) {
+    if(port == selector_port) {
+        selector = value;
+        offset = 0;
+    } else if(port == dma_port_high) {
+        dma_addr_high = bswap<uint32_t>(value);
+    } else if(port == dma_port_low) {
+        auto gpa = ((uint64_t)dma_addr_high << 32) | bswap<uint32_t>(value);
+        dma_addr_high = 0;
+
+        dma_transfer(gpa);
+    } else if(port == data_port) {
+        // Writes through the data port are deprecated, and ignored by QEMU too
+    } else {
+        print("fw_cfg: Unhandled write {:#x} <- {:#x}\n", port, value);
+    }
+}
+
+uint32_t vm::fw_cfg::Driver::pio_read(uint16_t port, uint8_t size) {
+    if(port == data_port) {
+        uint8_t buf[4] = {};
+        read(offset, buf, size);
+        offset += size;
+
+        // Wider reads return the bytes in big endian order, same as QEMU
+        uint32_t ret = 0;
+        for(size_t i = 0; i < size; i++)
+            ret = (ret << 8) | buf[i];
+
+        return ret;
+    } else if(port == dma_port_high) {
+        return bswap<uint32_t>(dma_signature >> 32);
+    } else if(port == dma_port_low) {
+        return bswap<uint32_t>(dma_signature & 0xFFFF'FFFF);
+    } else {
+        return 0;
+    }
+}
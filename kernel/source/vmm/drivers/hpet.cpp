@@ -6,6 +6,7 @@ using namespace vm::hpet;
 
 Driver::Driver(Vm* vm): vm{vm} {
     vm->mmio_map[base] = {this, 0x1000};
+    vm->snapshot_drivers.push_back(this);
 
     config_val = 0;
     counter_val = 0;
@@ -97,6 +98,26 @@ uint64_t Driver::mmio_read(uintptr_t addr, uint8_t size) {
     return 0;
 }
 
+void Driver::snapshot_save(snapshot::Writer& out) {
+    update_counter();
+
+    out.write(config_val);
+    out.write(counter_running);
+    out.write(legacy_replacement_mapping);
+    out.write(counter_val);
+    out.write(comparators);
+}
+
+void Driver::snapshot_restore(snapshot::Reader& in) {
+    in.read(config_val);
+    in.read(counter_running);
+    in.read(legacy_replacement_mapping);
+    in.read(counter_val);
+    in.read(comparators);
+
+    reset_counter(); // Counter continues from where it was saved
+}
+
 uint64_t Driver::update_counter() {
     if(!counter_running)
         return counter_val;
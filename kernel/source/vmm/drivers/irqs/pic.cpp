@@ -15,6 +15,18 @@ Driver::Driver(Vm* vm): vm{vm} {
 
     vm->pio_map[elcr_master] = this;
     vm->pio_map[elcr_slave] = this;
+
+    vm->snapshot_drivers.push_back(this);
+}
+
+void Driver::snapshot_save(snapshot::Writer& out) {
+    out.write(pics);
+    out.write(irq_output);
+}
+
+void Driver::snapshot_restore(snapshot::Reader& in) {
+    in.read(pics);
+    in.read(irq_output);
 }
 
 void Driver::pio_write(uint16_t port, uint32_t value, uint8_t size) {
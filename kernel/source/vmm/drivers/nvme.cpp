@@ -1,9 +1,15 @@
 #include <Luna/vmm/drivers/nvme.hpp>
 #include <Luna/misc/uuid.hpp>
 
+#include <std/utility.hpp>
+
 using namespace vm::nvme;
 
-Driver::Driver(Vm* vm, pci::HostBridge* bridge, uint8_t slot, uint8_t func, vfs::File* file): PCIDriver{vm}, vm{vm}, file{file} {
+Driver::Driver(Vm* vm, pci::HostBridge* bridge, uint8_t slot, uint8_t func, const std::vector<vfs::File*>& namespaces, uint16_t n_io_queues):
+        PCIDriver{vm}, n_io_queues{n_io_queues}, io_queues_allocated{n_io_queues}, msix{vm, *pci_space, 0x40, n_msix_vectors, 0, msix_table, msix_pba}, vm{vm}, namespaces{namespaces} {
+    ASSERT(namespaces.size() > 0);
+    ASSERT(n_io_queues >= 1 && n_io_queues <= max_io_queues);
+
     bridge->register_pci_driver(pci::DeviceID{0, 0, slot, func}, this);
 
     pci_space->header.vendor_id = 0x8086;
@@ -24,15 +30,130 @@ Driver::Driver(Vm* vm, pci::HostBridge* bridge, uint8_t slot, uint8_t func, vfs:
 
     pci_init_bar(0, bar_size, true, true); // MMIO, 64bit
 
+    pci_add_capability(0x40); // MSI-X
+
     queues[0].send_irqs = true;
+
+    coalesce_timer.set_handler([](void* userptr) {
+        auto& self = *(Driver*)userptr;
+        self.flush_coalesced();
+    }, this);
+
+    vm->snapshot_drivers.push_back(this);
+
+    spawn([this] { iothread_main(); });
 }
 
-void Driver::mmio_write(uintptr_t addr, uint64_t value, uint8_t size) {
-    auto reg = addr - mmio_base;
+Driver::~Driver() {
+    // Guest RAM is given back after this, so let the I/O thread finish the commands it is executing and exit
+    {
+        std::lock_guard io_guard{io_lock};
+        io_stopping = true;
+    }
+    io_work.complete();
 
-    if(reg == regs::cc && size == 4) {
-        if((cc & regs::cc_en) && !(value & regs::cc_en)) { // On to Off
+    // Faults the I/O thread takes run as an APC on this thread, see Vm::on_vcpu_thread(), so don't block
+    while(!__atomic_load_n(&io_exited, __ATOMIC_SEQ_CST))
+        asm volatile("int %0" : : "i"(threading::quantum_irq_vector) : "memory"); // Yield
+
+    // Only the I/O thread arms the coalescing timer, so now it can be cancelled for good, this also waits for a handler that is still running
+    coalesce_timer.stop();
+
+    std::lock_guard guard{lock};
+    coalesce_timer_armed = false;
+}
+
+void Driver::snapshot_save(snapshot::Writer& out) {
+    // Wait for commands that are in progress, anything that's still queued up is saved as part of the SQ state
+    std::lock_guard io_guard{io_lock};
+
+    pci_snapshot_save(out);
+    msix.snapshot_save(out);
+
+    out.write(cc);
+    out.write(csts);
+    out.write(irq_mask);
+    out.write(irq_status);
+    out.write(cq_entry_size);
+    out.write(sq_entry_size);
+    out.write(dbbuf_enabled);
+    out.write(dbbuf_shadow);
+    out.write(dbbuf_eventidx);
+    out.write(io_queues_allocated);
+    out.write(coalesce_threshold);
+    out.write(coalesce_time);
+    out.write(vectors);
+    out.write(write_cache);
+
+    uint16_t n_queues = 0;
+    for([[maybe_unused]] auto& queue : queues)
+        n_queues++;
+
+    out.write(n_queues);
+    for(auto& [qid, queue] : queues) {
+        out.write(qid);
+        out.write(queue);
+    }
+}
+
+void Driver::snapshot_restore(snapshot::Reader& in) {
+    std::lock_guard io_guard{io_lock};
+
+    pci_snapshot_restore(in);
+    msix.snapshot_restore(in);
+
+    in.read(cc);
+    in.read(csts);
+    in.read(irq_mask);
+    in.read(irq_status);
+    in.read(cq_entry_size);
+    in.read(sq_entry_size);
+    in.read(dbbuf_enabled);
+    in.read(dbbuf_shadow);
+    in.read(dbbuf_eventidx);
+    in.read(io_queues_allocated);
+    in.read(coalesce_threshold);
+    in.read(coalesce_time);
+    in.read(vectors);
+    in.read(write_cache);
+
+    uint16_t n_queues = 0;
+    in.read(n_queues);
+
+    queues.clear();
+    for(uint16_t i = 0; i < n_queues; i++) {
+        uint16_t qid = 0;
+        in.read(qid);
+        in.read(queues[qid]);
+    }
+
+    mmio_enabled = false;
+    pci_update_bars();
+    check_irq();
+    flush_coalesced(); // The timer isn't part of the snapshot, so send whatever was still being held back
+
+    io_work.complete(); // Commands might have been queued up when the snapshot was taken
+}
+
+void Driver::write_cc(uint32_t value) {
+    // Disabling the controller has to wait for the commands that are in progress
+    bool disable = (cc & regs::cc_en) && !(value & regs::cc_en);
+    if(disable)
+        io_lock.lock();
+
+    {
+        std::lock_guard guard{lock};
+        if(disable) { // On to Off
             csts &= ~regs::csts_rdy;
+            dbbuf_enabled = false;
+            io_queues_allocated = n_io_queues;
+
+            coalesce_threshold = 0;
+            coalesce_time = 0;
+            for(auto& vector : vectors)
+                vector = {};
+
+            write_cache = true; // Nothing can be cached while it's off, so there is nothing to flush
 
             auto admin = queues[0];
             queues.clear();
@@ -43,8 +164,9 @@ void Driver::mmio_write(uintptr_t addr, uint64_t value, uint8_t size) {
             queues[0].sqs = admin.sqs;
             queues[0].cqs = admin.cqs;
             queues[0].send_irqs = admin.send_irqs;
+            queues[0].vector = 0;
         }
-                
+
         if(!(cc & regs::cc_en) && (value & regs::cc_en)) // Off to On
             csts |= regs::csts_rdy;
 
@@ -56,7 +178,27 @@ void Driver::mmio_write(uintptr_t addr, uint64_t value, uint8_t size) {
         cq_entry_size = 1 << ((value >> 20) & 0xF);
 
         cc = value;
-    } else if(reg == regs::intms && size == 4) {
+    }
+
+    if(disable)
+        io_lock.unlock();
+}
+
+void Driver::mmio_write(uintptr_t addr, uint64_t value, uint8_t size) {
+    auto reg = addr - mmio_base;
+
+    if(reg == regs::cc && size == 4) {
+        write_cc(value);
+        return;
+    } else if(reg >= doorbell_base && reg < msix_table) {
+        write_doorbell(reg - doorbell_base, value);
+        return;
+    } else if(msix.mmio_write(reg, value, size)) {
+        return;
+    }
+
+    std::lock_guard guard{lock};
+    if(reg == regs::intms && size == 4) {
         irq_mask |= value; // Write 1 = set write 0 = no effect
         check_irq();
     } else if(reg == regs::intmc && size == 4) {
@@ -82,31 +224,49 @@ void Driver::mmio_write(uintptr_t addr, uint64_t value, uint8_t size) {
     } else if(reg == (regs::acq + 4) && size == 4) {
         queues[0].cq_base &= ~0xFFFF'FFFF'0000'0000;
         queues[0].cq_base |= (value << 32);
-    } else if((reg & ~0xFFF) >= 1) {
-        auto db = reg - 0x1000;
+    } else {
+        print("nvme: Unknown MMIO write {:#x} <- {:#x} ({})\n", reg, value, size);
+        PANIC("Unknown reg");
+    }
+}
 
-        db /= 4;
+void Driver::write_doorbell(uintptr_t offset, uint32_t value) {
+    auto db = offset / 4;
 
-        auto qid = (db & ~1) / 2;
-        bool completion = db & 1;
+    auto qid = (db & ~1) / 2;
+    bool completion = db & 1;
 
-        if(!completion)
-            kick_queue(qid, value);
-        else {
+    bool update_eventidx = false;
+    {
+        std::lock_guard guard{lock};
+        if(!completion) {
+            // Only note the new tail, the I/O thread does the rest
+            queues[qid].sq_tail = value;
+            io_work.complete();
+        } else {
             queues[qid].cq_head = value;
 
-            if(queues[qid].cq_head == queues[qid].cq_tail && queues[qid].send_irqs)
+            if(queues[qid].cq_head == queues[qid].cq_tail && queues[qid].send_irqs && !msix.is_enabled())
                 update_irqs(qid, false);
+
+            update_eventidx = dbbuf_enabled && qid != 0;
         }
-    } else {
-        print("nvme: Unknown MMIO write {:#x} <- {:#x} ({})\n", reg, value, size);
-        PANIC("Unknown reg");
     }
+
+    // Ask for the next head update right away, it's the only way to find out the guest is done with the entries
+    if(update_eventidx)
+        write_eventidx(qid, true, value);
 }
 
 uint64_t Driver::mmio_read(uintptr_t addr, uint8_t size) {
     auto reg = addr - mmio_base;
 
+    uint64_t value = 0;
+    if(msix.mmio_read(reg, size, value))
+        return value;
+
+    std::lock_guard guard{lock};
+
     if(reg == regs::cap_low)
         return cap;
     else if(reg == regs::cap_high && size == 4)
@@ -137,36 +297,185 @@ uint64_t Driver::mmio_read(uintptr_t addr, uint8_t size) {
     return 0;
 }
 
-void Driver::kick_queue(uint16_t qid, uint32_t value) {
-    auto& queue = queues[qid];
-    queue.sq_tail = value;
+void Driver::update_irqs(uint16_t qid, bool status) {
+    ASSERT(qid < 32);
+
+    if(status)
+        irq_status |= (1 << qid);
+    else
+        irq_status &= ~(1 << qid);
+
+    if(this_thread() == vm->cpus[0].thread) {
+        check_irq();
+    } else if(!irq_update_queued) {
+        // The interrupt controllers are only touched from the VCPU thread, so let it update the line
+        irq_update_queued = true;
+
+        vm->cpus[0].thread->queue_apc([](void* userptr) {
+            auto& self = *(Driver*)userptr;
+            std::lock_guard guard{self.lock};
+
+            self.irq_update_queued = false;
+            self.check_irq();
+        }, this);
+        vm->cpus[0].thread->invoke_apcs();
+    }
+}
+
+bool Driver::signal_vector(uint16_t vector) {
+    auto& state = vectors[vector];
+
+    // The admin CQ is never coalesced, and without an Aggregation Time the threshold could hold entries back forever
+    bool coalesce = vector != 0 && !state.coalescing_disabled && coalesce_threshold > 0 && coalesce_time > 0;
+    if(!coalesce) {
+        msix.notify(vector);
+        return false;
+    }
 
+    state.pending++;
+    if(state.pending > coalesce_threshold) {
+        state.pending = 0;
+        msix.notify(vector);
+        return false;
+    }
+
+    if(coalesce_timer_armed)
+        return false;
+
+    coalesce_timer_armed = true;
+    return true;
+}
+
+void Driver::flush_coalesced() {
+    std::lock_guard guard{lock};
+    coalesce_timer_armed = false;
+
+    for(uint16_t i = 0; i < n_msix_vectors; i++) {
+        if(vectors[i].pending) {
+            vectors[i].pending = 0;
+            msix.notify(i);
+        }
+    }
+}
+
+void Driver::iothread_main() {
+    std::vector<uint16_t> qids{};
+    while(true) {
+        io_work.await();
+        io_work.reset(); // Before looking at the queues, so doorbells that are rung while processing aren't missed
+
+        std::lock_guard io_guard{io_lock};
+        if(io_stopping)
+            break;
+
+        qids.clear();
+        {
+            std::lock_guard guard{lock};
+            for(auto& [qid, queue] : queues)
+                if(queue.sqs && queue.sq_head != queue.sq_tail)
+                    qids.push_back(qid);
+        }
+
+        for(auto qid : qids)
+            process_queue(qid);
+    }
+
+    __atomic_store_n(&io_exited, true, __ATOMIC_SEQ_CST);
+    kill_self();
+}
+
+void Driver::process_queue(uint16_t qid) {
     auto* cmd_data = new uint8_t[sq_entry_size];
     auto& cmd = *(SubmissionEntry*)cmd_data;
 
-    while(queue.sq_head != queue.sq_tail) {
-        vm->cpus[0].dma_read(queue.sq_base + (queue.sq_head * sq_entry_size), {cmd_data, sq_entry_size});
+    while(true) {
+        uintptr_t entry = 0;
+        uint16_t next_head = 0;
+        bool check_shadow = false;
+        {
+            std::lock_guard guard{lock};
+            if(!queues.contains(qid))
+                break;
+
+            auto& queue = queues[qid];
+            if(queue.sq_head == queue.sq_tail) {
+                if(!dbbuf_enabled || qid == 0) // The admin queue never uses the shadow doorbells
+                    break;
+
+                check_shadow = true;
+            } else {
+                entry = queue.sq_base + (queue.sq_head * sq_entry_size);
+                next_head = (queue.sq_head + 1) % queue.sqs;
+                queue.sq_head = next_head;
+            }
+        }
+
+        if(check_shadow) {
+            if(!refresh_sq_tail(qid))
+                break;
+
+            continue;
+        }
+
+        // Nothing is locked while the command is executed, so the VCPU can keep ringing doorbells
+        CompletionEntry res{};
+        if(vm->cpus[0].dma_read(entry, {cmd_data, sq_entry_size})) {
+            res = qid == 0 ? admin_queue_handle(cmd) : nvm_queue_handle(cmd);
+        } else {
+            memset(cmd_data, 0, sq_entry_size); // The SQ isn't in RAM, so there is no CID to complete either
+            res.status = status::data_transfer_error;
+        }
 
-        auto next_head = (queue.sq_head + 1) % queue.sqs;                    
-                
-        auto res = qid == 0 ? admin_queue_handle(cmd) : nvm_queue_handle(cmd);
         res.cid = cmd.cid;
         res.sq_id = qid;
         res.sq_head = next_head;
-        cq_push(qid, res);
 
-        queue.sq_head = next_head;
+        cq_push(qid, res);
     }
 
     delete[] cmd_data;
 }
 
+bool Driver::refresh_sq_tail(uint16_t qid) {
+    uintptr_t shadow = 0;
+    uint32_t tail = 0;
+    {
+        std::lock_guard guard{lock};
+        shadow = dbbuf_shadow + (qid * 2 * 4);
+        tail = queues[qid].sq_tail;
+    }
+
+    // Ask for a doorbell once the guest goes past what we've seen, then look again in case it already did before seeing the EventIdx
+    write_eventidx(qid, false, tail);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(!vm->cpus[0].dma_read(shadow, {(uint8_t*)&tail, sizeof(tail)}))
+        return false;
+
+    std::lock_guard guard{lock};
+    if(!dbbuf_enabled || !queues.contains(qid))
+        return false;
+
+    auto& queue = queues[qid];
+    if(tail >= queue.sqs || tail == queue.sq_tail)
+        return false;
+
+    queue.sq_tail = tail;
+    return true;
+}
+
+void Driver::write_eventidx(uint16_t qid, bool completion, uint32_t value) {
+    // If the EventIdx buffer isn't RAM the guest just never sees the hint, and keeps ringing the doorbells on every update
+    uintptr_t eventidx = dbbuf_eventidx + ((qid * 2 + (completion ? 1 : 0)) * 4);
+    vm->cpus[0].dma_write(eventidx, {(uint8_t*)&value, sizeof(value)});
+}
+
 CompletionEntry Driver::admin_queue_handle(const SubmissionEntry& cmd) {
     CompletionEntry c{};
 
     auto opcode = cmd.opcode;
     if(opcode == 1) { // Create IO Submission Queue
         ASSERT(cmd.cmd_data[1] & (1 << 0)); // Physically Contiguous
+        std::lock_guard guard{lock};
 
         auto qid = cmd.cmd_data[0] & 0xFFFF;
         auto size = (cmd.cmd_data[0] >> 16) + 1;
@@ -177,7 +486,7 @@ CompletionEntry Driver::admin_queue_handle(const SubmissionEntry& cmd) {
 
         if(!queues.contains(cqid)) {
             c.status = (1 << 8) | 0;
-        } else if(qid == 0) {
+        } else if(qid == 0 || qid > io_queues_allocated) {
             c.status = (1 << 8) | 1;
         } else if(size == 1 || cq_entry_size == 0) { // Size cannot be 0, and minimum is 2
             c.status = (1 << 8) | 2;
@@ -191,32 +500,116 @@ CompletionEntry Driver::admin_queue_handle(const SubmissionEntry& cmd) {
         }
     } else if(opcode == 5) { // Create IO Completion Queue
         ASSERT(cmd.cmd_data[1] & (1 << 0)); // Physically Contiguous
+        std::lock_guard guard{lock};
         bool send_irqs = (cmd.cmd_data[1] >> 1) & 1;
+        auto vector = cmd.cmd_data[1] >> 16;
 
         auto qid = cmd.cmd_data[0] & 0xFFFF;
         auto size = (cmd.cmd_data[0] >> 16) + 1;
                 
-        if(qid == 0 || queues.contains(qid)) {
+        if(qid == 0 || qid > io_queues_allocated || queues.contains(qid)) {
             c.status = (1 << 8) | 1;
         } else if(size == 0 || cq_entry_size == 0) {
             c.status = (1 << 8) | 2;
+        } else if(send_irqs && vector >= n_msix_vectors) {
+            c.status = status::invalid_interrupt_vector;
         } else {
             Queue queue{};
             queue.cq_base = cmd.prp0;
             queue.cqs = size;
             queue.send_irqs = send_irqs;
+            queue.vector = vector;
 
             queues[qid] = queue;
 
             c.status = 0;
         }
     } else if(opcode == 6) { // Identify
-        c.status = handle_admin_identify(cmd) ? 0 : 0xB;
+        c.status = handle_admin_identify(cmd);
     } else if(opcode == 9) { // Set Features
         auto fid = cmd.cmd_data[0] & 0xFF;
-        print("nvme: Setting unknown Feature: {:#x}\n", fid);
+        if(fid == feature::volatile_write_cache) {
+            bool enable = cmd.cmd_data[1] & 1;
+            if(write_cache && !enable)
+                flush_namespaces(); // Write out anything that's still cached
+
+            write_cache = enable;
+        } else if(fid == feature::number_of_queues) {
+            auto n_sqs = cmd.cmd_data[1] & 0xFFFF, n_cqs = cmd.cmd_data[1] >> 16; // Both 0's based
+            if(n_sqs == 0xFFFF || n_cqs == 0xFFFF) {
+                c.status = status::invalid_field;
+                return c;
+            }
+
+            // SQs and CQs always come in pairs with the same ID, so hand out the same amount of both
+            std::lock_guard guard{lock};
+            io_queues_allocated = min((uint16_t)(max(n_sqs, n_cqs) + 1), n_io_queues);
+            c.cmd_specific = (io_queues_allocated - 1) | ((io_queues_allocated - 1) << 16);
+        } else if(fid == feature::interrupt_coalescing) {
+            std::lock_guard guard{lock};
+            coalesce_threshold = cmd.cmd_data[1] & 0xFF;
+            coalesce_time = (cmd.cmd_data[1] >> 8) & 0xFF;
+        } else if(fid == feature::interrupt_vector_config) {
+            auto vector = cmd.cmd_data[1] & 0xFFFF;
+            if(vector >= n_msix_vectors) {
+                c.status = status::invalid_field;
+                return c;
+            }
+
+            std::lock_guard guard{lock};
+            vectors[vector].coalescing_disabled = (cmd.cmd_data[1] >> 16) & 1;
+        } else {
+            print("nvme: Setting unknown Feature: {:#x}\n", fid);
+        }
 
         c.status = 0;
+    } else if(opcode == 0xA) { // Get Features
+        auto fid = cmd.cmd_data[0] & 0xFF;
+        if(fid == feature::volatile_write_cache) {
+            c.cmd_specific = write_cache ? 1 : 0;
+            c.status = 0;
+        } else if(fid == feature::number_of_queues) {
+            std::lock_guard guard{lock};
+            c.cmd_specific = (io_queues_allocated - 1) | ((io_queues_allocated - 1) << 16);
+            c.status = 0;
+        } else if(fid == feature::interrupt_coalescing) {
+            std::lock_guard guard{lock};
+            c.cmd_specific = coalesce_threshold | (coalesce_time << 8);
+            c.status = 0;
+        } else if(fid == feature::interrupt_vector_config && (cmd.cmd_data[1] & 0xFFFF) < n_msix_vectors) {
+            auto vector = cmd.cmd_data[1] & 0xFFFF;
+
+            std::lock_guard guard{lock};
+            c.cmd_specific = vector | (vectors[vector].coalescing_disabled ? (1 << 16) : 0);
+            c.status = 0;
+        } else {
+            print("nvme: Getting unknown Feature: {:#x}\n", fid);
+            c.status = status::invalid_field;
+        }
+    } else if(opcode == 0x7C) { // Doorbell Buffer Config
+        if(cmd.prp != 0 || (cmd.prp0 & 0xFFF) || (cmd.prp1 & 0xFFF)) {
+            c.status = status::invalid_field;
+        } else {
+            std::vector<std::pair<uint16_t, Queue>> io_queues{};
+            {
+                std::lock_guard guard{lock};
+                dbbuf_shadow = cmd.prp0;
+                dbbuf_eventidx = cmd.prp1;
+                dbbuf_enabled = true;
+
+                for(auto& [qid, queue] : queues)
+                    if(qid != 0)
+                        io_queues.push_back({qid, queue});
+            }
+
+            // Queues that already exist start off asking for a doorbell on the next update
+            for(auto& [qid, queue] : io_queues) {
+                write_eventidx(qid, false, queue.sq_tail);
+                write_eventidx(qid, true, queue.cq_head);
+            }
+
+            c.status = 0;
+        }
     } else {
         print("nvme: Unknown Admin Opcode: {}\n", opcode);
         PANIC("Unknown op");
@@ -229,73 +622,304 @@ CompletionEntry Driver::nvm_queue_handle(const SubmissionEntry& cmd) {
     CompletionEntry c{};
 
     auto opcode = cmd.opcode;
-    if(opcode == 1) { // Write
-        print("nvme: TODO: Don't ignore writes\n");
+    if(opcode == 0 && cmd.nsid == 0xFFFF'FFFF) { // Flush of all namespaces
+        flush_namespaces();
         c.status = 0;
+        return c;
+    }
+
+    auto* file = get_namespace(cmd.nsid);
+    if(!file) {
+        c.status = status::invalid_namespace;
+        return c;
+    }
+
+    auto capacity = file->get_size() / 512;
+
+    // Read, Write and Write Zeroes all have the same LBA range fields
+    auto lba = cmd.cmd_data[0] | ((uint64_t)cmd.cmd_data[1] << 32);
+    auto n_lbas = (cmd.cmd_data[2] & 0xFFFF) + 1;
+    bool in_range = lba < capacity && n_lbas <= (capacity - lba);
+    bool fua = (cmd.cmd_data[2] >> 30) & 1; // Force Unit Access, the data has to be on disk before completing
+
+    if(opcode == 0) { // Flush
+        file->close(); // Writes back the host storage cache
+        c.status = 0;
+    } else if(opcode == 1) { // Write
+        if(!in_range)
+            c.status = status::lba_out_of_range;
+        else if((n_lbas * 512) > max_transfer_size)
+            c.status = status::invalid_field;
+        else
+            c.status = transfer(cmd, file, lba * 512, n_lbas * 512, false);
+
+        if(c.status == status::success && (fua || !write_cache))
+            file->close();
     } else if(opcode == 2) { // Read
-        auto lba = cmd.cmd_data[0] | ((uint64_t)cmd.cmd_data[1] << 32);
-        auto n_lbas = (cmd.cmd_data[2] & 0xFFFF) + 1;
+        if(!in_range)
+            c.status = status::lba_out_of_range;
+        else if((n_lbas * 512) > max_transfer_size)
+            c.status = status::invalid_field;
+        else
+            c.status = transfer(cmd, file, lba * 512, n_lbas * 512, true);
+    } else if(opcode == 8) { // Write Zeroes, there's no data transfer so MDTS doesn't apply
+        if(!in_range)
+            c.status = status::lba_out_of_range;
+        else
+            c.status = write_zeroes(file, lba * 512, n_lbas * 512);
+
+        if(c.status == status::success && (fua || !write_cache))
+            file->close();
+    } else if(opcode == 9) { // Dataset Management
+        c.status = handle_dsm(cmd, file);
+    } else {
+        print("nvme: Unknown NVM Command {}\n", opcode);
+        PANIC("Unknown cmd");
+    }
 
-        ASSERT(cmd.prp == 0); // Use PRPs
+    return c;
+}
 
-        uint64_t dst = cmd.prp0;
+void Driver::flush_namespaces() {
+    for(auto* file : namespaces)
+        file->close();
+}
 
-        uint64_t prp_list = cmd.prp1;
-        uint64_t prp_i = 0;
+void Driver::add_range(uint64_t gpa, size_t len) {
+    if(len == 0)
+        return;
 
-        auto* buf = new uint8_t[512];
+    // Guest buffers are often physically contiguous, in which case they can be done in 1 file access
+    if(!dma_ranges.empty() && (dma_ranges.back().gpa + dma_ranges.back().len) == gpa)
+        dma_ranges.back().len += len;
+    else
+        dma_ranges.push_back({.gpa = gpa, .len = len});
+}
 
-        size_t count = 0;
-        while(count != n_lbas) {
-            file->read((lba + count) * 512, 512, buf);
+uint16_t Driver::build_prp_ranges(const SubmissionEntry& cmd, size_t size) {
+    // The first PRP can start anywhere in a page, all others have to be page aligned
+    auto first = min(size, pmm::block_size - (cmd.prp0 & 0xFFF));
+    add_range(cmd.prp0, first);
+    size -= first;
 
-            vm->cpus[0].dma_write(dst, {buf, 512});
-            count++;
+    if(size == 0) {
+        return status::success;
+    } else if(size <= pmm::block_size) { // PRP2 points to the data
+        if(cmd.prp1 & 0xFFF)
+            return status::prp_invalid_offset;
 
-            if((count % 8) == 0) { // 8 Sectors in 1 page
-                if(n_lbas > 8 && n_lbas <= 16)
-                    dst = cmd.prp1;
-                else
-                    vm->cpus[0].dma_read(prp_list + (prp_i * 8), {(uint8_t*)&dst, 8});
-                prp_i++;
-            } else {
-                dst += 512;
-            }
+        add_range(cmd.prp1, size);
+        return status::success;
+    }
+
+    // PRP2 points to a list, if it doesn't fit in the rest of the page then the last entry points to the next page of the list
+    auto list = cmd.prp1;
+    if(list & 0x7)
+        return status::prp_invalid_offset;
+
+    prp_entries.resize(pmm::block_size / sizeof(uint64_t));
+    while(size > 0) {
+        size_t n_slots = (pmm::block_size - (list & 0xFFF)) / sizeof(uint64_t);
+        size_t n_needed = div_ceil(size, pmm::block_size);
+        bool chained = n_needed > n_slots;
+
+        size_t n_read = chained ? n_slots : n_needed;
+        if(!vm->cpus[0].dma_read(list, {(uint8_t*)prp_entries.data(), n_read * sizeof(uint64_t)}))
+            return status::data_transfer_error;
+
+        for(size_t i = 0; i < (chained ? (n_read - 1) : n_read); i++) {
+            if(prp_entries[i] & 0xFFF)
+                return status::prp_invalid_offset;
+
+            auto len = min(size, pmm::block_size);
+            add_range(prp_entries[i], len);
+            size -= len;
         }
 
-        delete[] buf;
+        if(chained) {
+            list = prp_entries[n_read - 1];
+            if(list & 0xFFF)
+                return status::prp_invalid_offset;
+        }
+    }
 
-        c.status = 0;
-    } else {
-        print("nvme: Unknown NVM Command {}\n", opcode);
-        PANIC("Unknown cmd");
+    return status::success;
+}
+
+uint16_t Driver::build_sgl_ranges(const SubmissionEntry& cmd, size_t size) {
+    SglDescriptor desc{};
+    memcpy(&desc, &cmd.prp0, sizeof(desc)); // The first descriptor takes the place of the 2 PRPs
+
+    auto add_data = [&](const SglDescriptor& data) {
+        auto len = min((size_t)data.len, size); // The SGL can be longer than the transfer
+        add_range(data.addr, len);
+        size -= len;
+    };
+
+    for(size_t n_segments = 0;; n_segments++) {
+        auto type = desc.id >> 4;
+        if(desc.id & 0xF) // Only plain addresses, the other subtypes are for NVMe over Fabrics
+            return status::sgl_invalid_descriptor_type;
+
+        if(type == sgl_type::data_block) {
+            add_data(desc);
+            break;
+        } else if(type != sgl_type::segment && type != sgl_type::last_segment) {
+            return status::sgl_invalid_descriptor_type;
+        }
+
+        size_t n_descs = desc.len / sizeof(SglDescriptor);
+        if(n_segments == max_sgl_segments || n_descs == 0 || (desc.len % sizeof(SglDescriptor)) || n_descs > (pmm::block_size / sizeof(SglDescriptor)))
+            return status::sgl_invalid_descriptor_count;
+
+        sgl_segment.resize(n_descs);
+        if(!vm->cpus[0].dma_read(desc.addr, {(uint8_t*)sgl_segment.data(), n_descs * sizeof(SglDescriptor)}))
+            return status::data_transfer_error;
+
+        // Only the last descriptor of a non-last segment can point to another segment
+        bool last = type == sgl_type::last_segment;
+        size_t n_data = last ? n_descs : (n_descs - 1);
+        for(size_t i = 0; i < n_data; i++) {
+            if(sgl_segment[i].id != (sgl_type::data_block << 4))
+                return status::sgl_invalid_descriptor_type;
+
+            add_data(sgl_segment[i]);
+        }
+
+        if(last)
+            break;
+
+        desc = sgl_segment[n_descs - 1];
+        if((desc.id >> 4) == sgl_type::data_block)
+            return status::sgl_invalid_descriptor_type;
     }
 
-    return c;
+    return (size == 0) ? status::success : status::sgl_invalid_data_length;
+}
+
+uint16_t Driver::read_data(const SubmissionEntry& cmd, void* data, size_t size) {
+    dma_ranges.clear();
+
+    auto sts = (cmd.prp == 0) ? build_prp_ranges(cmd, size) : build_sgl_ranges(cmd, size);
+    if(sts != status::success)
+        return sts;
+
+    auto* dst = (uint8_t*)data;
+    for(const auto& range : dma_ranges) {
+        if(!vm->cpus[0].dma_read(range.gpa, {dst, range.len}))
+            return status::data_transfer_error;
+
+        dst += range.len;
+    }
+
+    return status::success;
+}
+
+uint16_t Driver::write_zeroes(vfs::File* file, uint64_t offset, size_t size) {
+    constexpr size_t zeroes_size = 64 * 1024;
+    if(zeroes.empty())
+        zeroes.resize(zeroes_size);
+
+    while(size > 0) {
+        auto chunk = min(size, zeroes.size());
+        if(file->write(offset, chunk, zeroes.data()) != chunk)
+            return status::data_transfer_error;
+
+        offset += chunk;
+        size -= chunk;
+    }
+
+    return status::success;
+}
+
+uint16_t Driver::handle_dsm(const SubmissionEntry& cmd, vfs::File* file) {
+    auto n_ranges = (cmd.cmd_data[0] & 0xFF) + 1;
+
+    dsm_ranges.resize(n_ranges);
+    auto sts = read_data(cmd, dsm_ranges.data(), n_ranges * sizeof(DsmRange));
+    if(sts != status::success)
+        return sts;
+
+    auto capacity = file->get_size() / 512;
+    for(const auto& range : dsm_ranges)
+        if(range.lba >= capacity || range.n_lbas > (capacity - range.lba))
+            return status::lba_out_of_range;
+
+    // Deallocate is only a hint, the backing file can't give space back, and DLFEAT doesn't promise anything about reading
+    // deallocated blocks, so the data can just stay where it is
+    return status::success;
+}
+
+uint16_t Driver::transfer(const SubmissionEntry& cmd, vfs::File* file, uint64_t offset, size_t size, bool to_guest) {
+    dma_ranges.clear();
+
+    auto sts = (cmd.prp == 0) ? build_prp_ranges(cmd, size) : build_sgl_ranges(cmd, size);
+    if(sts != status::success)
+        return sts;
+
+    // Go straight between the file and guest RAM, the host contiguous pieces are as big as possible so there are few file accesses
+    for(const auto& range : dma_ranges) {
+        bool success = for_each_host_range(*vm, range.gpa, range.len, to_guest, [&](uint8_t* va, size_t chunk) {
+            auto n = to_guest ? file->read(offset, chunk, va) : file->write(offset, chunk, va);
+            offset += chunk;
+
+            return n == chunk;
+        });
+
+        if(!success)
+            return status::data_transfer_error;
+    }
+
+    return status::success;
 }
 
 void Driver::cq_push(uint16_t qid, CompletionEntry entry) {
-    auto& queue = queues[qid];
-    entry.phase = queue.phase;
+    uintptr_t slot = 0;
+    {
+        std::lock_guard guard{lock};
+        auto& queue = queues[qid];
+        entry.phase = queue.phase;
+
+        slot = queue.cq_base + (queue.cq_tail * cq_entry_size);
+        queue.cq_tail = (queue.cq_tail + 1) % queue.cqs;
 
-    vm->cpus[0].dma_write(queue.cq_base + (queue.cq_tail * cq_entry_size), {(uint8_t*)&entry, cq_entry_size});
-    queue.cq_tail = (queue.cq_tail + 1) % queue.cqs;
+        if(queue.cq_tail == 0) // Just wrapped around
+            queue.phase = !queue.phase;
+    }
 
-    if(queue.cq_tail == 0) // Just wrapped around
-        queue.phase = !queue.phase;
+    // Touching guest RAM can fault pages in from disk, so it can't be done with IRQs disabled
+    if(!vm->cpus[0].dma_write(slot, {(uint8_t*)&entry, cq_entry_size})) {
+        print("nvme: CQ {} isn't in guest RAM, dropping completion\n", qid);
+        return;
+    }
 
-    if(queue.cq_tail != queue.cq_head && queue.send_irqs) {
-        update_irqs(qid, true);
+    bool start_timer = false;
+    {
+        std::lock_guard guard{lock};
+        auto& queue = queues[qid];
+        if(queue.cq_tail != queue.cq_head && queue.send_irqs) {
+            if(msix.is_enabled())
+                start_timer = signal_vector(queue.vector);
+            else
+                update_irqs(qid, true);
+        }
     }
+
+    // The timer calls back into flush_coalesced() with its own lock held, so it can't be started with ours held
+    if(start_timer)
+        coalesce_timer.setup(TimePoint::from_us(coalesce_time * 100), false);
 }
 
-bool Driver::handle_admin_identify(const SubmissionEntry& cmd) {
+uint16_t Driver::handle_admin_identify(const SubmissionEntry& cmd) {
     auto cns = cmd.cmd_data[0] & 0xFF;
     auto csi = (cmd.cmd_data[1] >> 24) & 0xFF;
 
+    bool ok = false;
+
     if(cns == 0) {
-        if(cmd.nsid != 1)
-            return false;
+        auto* file = get_namespace(cmd.nsid);
+        if(!file)
+            return status::invalid_namespace;
 
         NamespaceIdentify data{};
         auto blocks = file->get_size() / 512;
@@ -308,7 +932,7 @@ bool Driver::handle_admin_identify(const SubmissionEntry& cmd) {
 
         data.lbaf[0] = {.lbads = 9};
 
-        vm->cpus[0].dma_write(cmd.prp0, {(uint8_t*)&data, sizeof(data)});
+        ok = vm->cpus[0].dma_write(cmd.prp0, {(uint8_t*)&data, sizeof(data)});
     } else if(cns == 1) {
         ControllerIdentify data{};
         data.vid = 0x8086;
@@ -317,46 +941,60 @@ bool Driver::handle_admin_identify(const SubmissionEntry& cmd) {
         memcpy(data.model, "Luna NVMe Controller", 22);
         memcpy(data.revision, "Luna NVMe 1.0", 15);
         memcpy(data.subnqn, "nqn.2014-08.org.nvmexpress:uuid:fbaa176f-c4fb-4c4b-9426-2c1e195fe524", 69);
-        data.mdts = 0;
-        data.nn = 1; // 1 Namespace
-
-        vm->cpus[0].dma_write(cmd.prp0, {(uint8_t*)&data, sizeof(data)});
+        data.mdts = mdts;
+        data.oacs = (1 << 8); // Doorbell Buffer Config
+        data.nn = namespaces.size();
+        data.sgls = 1; // SGLs are supported, without alignment requirements
+        data.oncs = (1 << 2) | (1 << 3); // Dataset Management and Write Zeroes
+        data.vwc = 1; // Volatile Write Cache, so guests send Flushes when they need durability
+
+        ok = vm->cpus[0].dma_write(cmd.prp0, {(uint8_t*)&data, sizeof(data)});
     } else if(cns == 2) {
         if(cmd.nsid == 0xFFFF'FFFF || cmd.nsid == 0xFFFF'FFFE)
-            return false;
-
-        ASSERT(cmd.nsid == 0);
+            return status::invalid_namespace;
 
+        // All active NSIDs above the one in the command, in increasing order
         auto* nsid_list = new uint32_t[1024];
         memset(nsid_list, 0, 1024 * sizeof(uint32_t));
-        nsid_list[0] = 1; // Only NS we support
 
-        vm->cpus[0].dma_write(cmd.prp0, {(uint8_t*)nsid_list, 1024 * sizeof(uint32_t)});
+        size_t n = 0;
+        for(uint32_t nsid = cmd.nsid + 1; nsid <= namespaces.size() && n < 1024; nsid++)
+            nsid_list[n++] = nsid;
+
+        ok = vm->cpus[0].dma_write(cmd.prp0, {(uint8_t*)nsid_list, 1024 * sizeof(uint32_t)});
 
         delete[] nsid_list;
     } else if(cns == 3) {
+        if(!get_namespace(cmd.nsid))
+            return status::invalid_namespace;
+
         UUID uuid{"c09cfac3-6cf6-41a0-8f33-56c71ccd91ff"};
 
-        uint8_t buf[20];
+        // The list is terminated by a zeroed descriptor, so clear the whole thing
+        auto* buf = new uint8_t[4096];
+        memset(buf, 0, 4096);
         buf[0] = 3; // UUID
         buf[1] = uuid.span().size_bytes();
         memcpy(buf + 4, uuid.span().data(), uuid.span().size_bytes());
+        buf[4 + uuid.span().size_bytes() - 1] ^= cmd.nsid; // Every namespace needs a UUID of its own
+
+        ok = vm->cpus[0].dma_write(cmd.prp0, {buf, 4096});
 
-        vm->cpus[0].dma_write(cmd.prp0, {(uint8_t*)buf, 20 * sizeof(uint8_t)});
+        delete[] buf;
     } else if(cns == 0x6 && csi == 0x0) {
         NVMSpecificIdentifyCNS06hCSI00h data{};
         data.vsl = 0; // Do not support Verify command
-        data.wzsl = 0; // Do not support WriteZeroes command
+        data.wzsl = 0; // No Write Zeroes size limit
         data.wusl = 0; // Do not support WriteUncorrectable command
-        data.dmrl = 0; // Do not support Dataset Management command
+        data.dmrl = 0; // No Dataset Management limits
         data.dmrsl = 0; // ^
         data.dmsl = 0; // ^
 
-        vm->cpus[0].dma_write(cmd.prp0, {(uint8_t*)&data, sizeof(data)});
+        ok = vm->cpus[0].dma_write(cmd.prp0, {(uint8_t*)&data, sizeof(data)});
     } else {
         print("nvme: Identify Unknown CNS {}\n", cns);
-        return false;
+        return status::invalid_namespace;
     }
 
-    return true;
+    return ok ? status::success : status::data_transfer_error;
 }
\ No newline at end of file
@@ -0,0 +1,416 @@
+#include <Luna/vmm/drivers/passthrough.hpp>
+
+#include <Luna/drivers/iommu/iommu.hpp>
+#include <Luna/cpu/cpu.hpp>
+#include <Luna/cpu/idt.hpp>
+#include <Luna/mm/vmm.hpp>
+
+using namespace vm::passthrough;
+
+static uint64_t hw_read(uintptr_t pa, uint8_t size) {
+    auto va = pa + phys_mem_map;
+    switch (size) {
+        case 1: return *(volatile uint8_t*)va;
+        case 2: return *(volatile uint16_t*)va;
+        case 4: return *(volatile uint32_t*)va;
+        case 8: return *(volatile uint64_t*)va;
+        default: PANIC("Unknown MMIO Access size");
+    }
+}
+
+static void hw_write(uintptr_t pa, uint64_t value, uint8_t size) {
+    auto va = pa + phys_mem_map;
+    switch (size) {
+        case 1: *(volatile uint8_t*)va = value; break;
+        case 2: *(volatile uint16_t*)va = value; break;
+        case 4: *(volatile uint32_t*)va = value; break;
+        case 8: *(volatile uint64_t*)va = value; break;
+        default: PANIC("Unknown MMIO Access size");
+    }
+}
+
+// BARs are mapped into the guest with page granularity, so anything smaller would also give it whatever else is in that host page
+static bool is_mappable(const ::pci::Bar& bar) {
+    return bar.type == ::pci::Bar::Type::Mmio && bar.len >= pmm::block_size && !(bar.base & (pmm::block_size - 1));
+}
+
+bool vm::passthrough::can_attach(const ::pci::Device& device) {
+    auto fail = [&](const char* reason) {
+        print("passthrough: Can't attach {}:{}:{}.{}, {:s}\n", device.seg, device.bus, device.slot, device.func, reason);
+        return false;
+    };
+
+    if(device.driver)
+        return fail("the host is using it");
+
+    if(!iommu::blocks_compat_irqs(device))
+        return fail("the IOMMU lets compatibility format MSIs through, so it could send any IRQ to the host");
+
+    if(!device.msix.supported && !device.msi.supported)
+        return fail("it has no MSI or MSI-X capability, and INTx isn't forwarded");
+
+    if((device.read<uint8_t>(0xE) & 0x7F) != 0)
+        return fail("bridges can't be passed through");
+
+    // The MSI-X table and PBA are trapped, so their BARs have to be mapped into the guest
+    if(device.msix.supported && (!is_mappable(device.read_bar(device.msix.table.bar)) || !is_mappable(device.read_bar(device.msix.pending.bar))))
+        return fail("its MSI-X table or PBA isn't in a page sized MMIO BAR");
+
+    return true;
+}
+
+Driver::Driver(Vm* vm, pci::HostBridge* bridge, uint8_t slot, uint8_t func, ::pci::Device& device): PCIDriver{vm}, device{device}, bars{}, traps{} {
+    ASSERT(can_attach(device));
+
+    bridge->register_pci_driver(pci::DeviceID{0, 0, slot, func}, this);
+
+    // The guest sees the same IDs and capability list as the host
+    for(size_t i = 0; i < sizeof(pci::ConfigSpaceHeader); i += 4)
+        pci_space->data32[i / 4] = device.read<uint32_t>(i);
+
+    pci_space->header.header_type = (func > 0) ? 0x80 : 0;
+    pci_space->header.command = 0;
+    pci_space->header.expansion_rom_base = 0;
+    pci_space->header.irq_line = 0;
+    pci_space->header.irq_pin = 0;
+
+    for(uint8_t i = 0; i < 6; i++) {
+        auto raw = device.read<uint32_t>(0x10 + (i * 4));
+        auto bar = device.read_bar(i);
+
+        if(bar.type == ::pci::Bar::Type::Pio) {
+            print("passthrough: Hiding I/O BAR{} of {}:{}:{}.{}\n", i, device.seg, device.bus, device.slot, device.func);
+            bar.len = 0;
+        } else if(bar.type == ::pci::Bar::Type::Mmio && bar.len && !is_mappable(bar)) {
+            print("passthrough: Hiding BAR{} of {}:{}:{}.{}, it is smaller than a page or isn't page aligned on the host\n", i, device.seg, device.bus, device.slot, device.func);
+            bar.len = 0;
+        }
+
+        bool is64 = !(raw & 1) && ((raw >> 1) & 3) == 2;
+        if(bar.type != ::pci::Bar::Type::Mmio || !bar.len) {
+            pci_init_bar(i, 0, true);
+            if(is64)
+                pci_init_bar(++i, 0, true);
+            continue;
+        }
+
+        bars[i].host = bar;
+        pci_init_bar(i, bar.len, true, is64, raw & (1 << 3));
+        if(is64)
+            i++;
+    }
+
+    if(device.msix.supported) {
+        auto off = device.msix.offset;
+        auto pba_reg = device.read<uint32_t>(off + ::pci::msix::pending);
+
+        msix = std::make_unique<vm::pci::msix::Table>(vm, *pci_space, off, device.msix.n_messages, device.msix.table.bar, device.msix.table.offset, device.msix.pending.offset);
+        pci_space->data8[off + 1] = device.read<uint8_t>(off + 1); // Keep the rest of the capability list
+        pci_space->data32[(off + ::pci::msix::pending) / 4] = pba_reg; // The PBA doesn't have to be in the same BAR as the table
+
+        auto add_trap = [&](uint8_t bar, uint64_t offset, uint64_t size) {
+            ASSERT(bars[bar].host.len); // Checked by can_attach()
+
+            auto start = align_down(offset, pmm::block_size);
+            traps[n_traps++] = {.bar = bar, .offset = start, .size = align_up(offset + size, pmm::block_size) - start};
+
+            // Anything else that shares these pages is forwarded to the hardware
+            for(auto pa = bars[bar].host.base + start; pa < (bars[bar].host.base + start + traps[n_traps - 1].size); pa += pmm::block_size)
+                vmm::get_kernel_context().map(pa, pa + phys_mem_map, paging::mapPagePresent | paging::mapPageWrite, msr::pat::uc);
+        };
+
+        add_trap(device.msix.table.bar, device.msix.table.offset, device.msix.n_messages * sizeof(vm::pci::msix::Entry));
+        add_trap(device.msix.pending.bar, device.msix.pending.offset, div_ceil(device.msix.n_messages, 64) * sizeof(uint64_t));
+    }
+
+    if(device.msi.supported) {
+        auto off = device.msi.offset;
+        ::pci::msi::Control control{.raw = device.read<uint16_t>(off + ::pci::msi::control)};
+
+        msi_offset = off;
+        msi_mask_offset = control.c64 ? 0x10 : 0xC;
+        msi_size = control.pvm ? (msi_mask_offset + 8) : (control.c64 ? 0xE : 0xA);
+
+        for(uint8_t i = 0; i < msi_size; i++)
+            pci_space->data8[off + i] = 0;
+
+        // Only 1 message is offered, the host doesn't support Multiple Message MSI either
+        control.enable = 0;
+        control.mmc = 0;
+        control.mme = 0;
+        pci_space->data8[off] = ::pci::msi::id;
+        pci_space->data8[off + 1] = device.read<uint8_t>(off + 1);
+        pci_space->data16[(off + ::pci::msi::control) / 2] = control.raw;
+    }
+
+    n_vectors = device.msix.supported ? min<size_t>(device.msix.n_messages, max_vectors) : 1;
+    for(uint16_t i = 0; i < n_vectors; i++) {
+        auto& vector = vectors[i];
+        vector = {.self = this, .i = i, .host_vector = idt::allocate_vector()};
+
+        idt::set_handler(vector.host_vector, idt::Handler{.f = [](uint8_t, idt::Regs*, void* userptr) {
+            auto& vector = *(Vector*)userptr;
+
+            vector.self->handle_irq(vector.i);
+        }, .is_irq = true, .should_iret = true, .userptr = &vector});
+    }
+
+    map_guest_ram();
+
+    device.set_privileges(::pci::privileges::Mmio | ::pci::privileges::Dma);
+    // Route the messages through the IOMMU, can_attach() made sure it drops anything else, so whatever the device sends can only ever hit its own vectors
+    // The guest LAPIC is emulated, so posted IRQs have nothing to post into, and the host handler still forwards each one
+    for(uint16_t i = 0; i < n_vectors; i++) {
+        uint64_t address = 0;
+        uint32_t data = 0;
+        if(iommu::remap_irq(device, i, vectors[i].host_vector, get_cpu().lapic_id, address, data))
+            device.enable_irq(i, address, data);
+        else
+            print("passthrough: Couldn't remap IRQ {} of {}:{}:{}.{}, leaving it disabled\n", i, device.seg, device.bus, device.slot, device.func); // A compatibility format message would bypass the isolation
+    }
+
+    print("passthrough: Attached {}:{}:{}.{} ({:#x}:{:#x})\n", device.seg, device.bus, device.slot, device.func, (uint16_t)pci_space->header.vendor_id, (uint16_t)pci_space->header.device_id);
+}
+
+Driver::~Driver() {
+    // Stop the device from doing DMA or sending IRQs before guest RAM is given back
+    device.set_privileges(0);
+
+    if(device.msix.supported) {
+        ::pci::msix::Control control{.raw = device.read<uint16_t>(device.msix.offset + ::pci::msix::control)};
+        control.enable = 0;
+        device.write<uint16_t>(device.msix.offset + ::pci::msix::control, control.raw);
+    } else {
+        ::pci::msi::Control control{.raw = device.read<uint16_t>(device.msi.offset + ::pci::msi::control)};
+        control.enable = 0;
+        device.write<uint16_t>(device.msi.offset + ::pci::msi::control, control.raw);
+    }
+
+    // There is no way to give vectors back yet, so leave a handler that doesn't touch us
+    for(uint16_t i = 0; i < n_vectors; i++) {
+        iommu::unmap_irq(device, i);
+        idt::set_handler(vectors[i].host_vector, idt::Handler{.f = [](uint8_t, idt::Regs*, void*) { }, .is_irq = true, .should_iret = true, .userptr = nullptr});
+    }
+
+    for(const auto& slot : vm->memslots)
+        for(auto gpa = slot.base; gpa < (slot.base + slot.size); gpa += pmm::block_size)
+            iommu::unmap(device, gpa);
+}
+
+void Driver::map_guest_ram() {
+    // The device can DMA anywhere at any time, so all of guest RAM has to be there up front
+    for(const auto& slot : vm->memslots) {
+        bool writable = !(slot.flags & vm::MemslotFlags::ReadOnly);
+
+        for(auto gpa = slot.base; gpa < (slot.base + slot.size); gpa += pmm::block_size) {
+            auto hpa = vm->gpa_to_hpa(gpa, writable);
+            ASSERT(hpa);
+
+            iommu::map(device, hpa, gpa, paging::mapPagePresent | (writable ? paging::mapPageWrite : 0));
+        }
+    }
+}
+
+bool Driver::is_trapped(uint8_t bar, uint64_t offset) const {
+    for(size_t i = 0; i < n_traps; i++)
+        if(traps[i].bar == bar && offset >= traps[i].offset && offset < (traps[i].offset + traps[i].size))
+            return true;
+
+    return false;
+}
+
+void Driver::unmap_bars() {
+    for(uint8_t i = 0; i < 6; i++) {
+        auto& bar = bars[i];
+        if(!bar.gpa)
+            continue;
+
+        for(uint64_t off = 0; off < pci_bars[i].size; off += pmm::block_size)
+            if(!is_trapped(i, off))
+                vm->mm->unmap(bar.gpa + off); // Not ours to free
+
+        for(size_t j = 0; j < n_traps; j++)
+            if(traps[j].bar == i)
+                vm->mmio_map[bar.gpa + traps[j].offset] = {nullptr, 0};
+
+        bar.gpa = 0;
+    }
+}
+
+void Driver::pci_update_bars() {
+    std::lock_guard guard{vm->memslot_lock};
+    unmap_bars();
+
+    if(!(pci_space->header.command & (1 << 1))) // Memory Space Decoding
+        return;
+
+    for(uint8_t i = 0; i < 6; i++) {
+        auto& bar = bars[i];
+        if(!bar.host.len)
+            continue;
+
+        uint64_t gpa = pci_space->header.bar[i] & ~0xF;
+        if(pci_bars[i].is64)
+            gpa |= (uint64_t)pci_space->header.bar[i + 1] << 32;
+
+        // Both halves of a 64-bit BAR are written separately, so it can briefly point at RAM while the guest moves it
+        auto size = pci_bars[i].size;
+        bool overlaps_ram = false;
+        for(const auto& slot : vm->memslots)
+            overlaps_ram |= ranges_overlap(gpa, size, slot.base, slot.size);
+
+        if(!gpa || overlaps_ram)
+            continue;
+
+        for(uint64_t off = 0; off < size; off += pmm::block_size)
+            if(!is_trapped(i, off))
+                vm->mm->map(bar.host.base + off, gpa + off, paging::mapPagePresent | paging::mapPageWrite); // The guest maps it UC itself, which wins over the WB nested mapping
+
+        for(size_t j = 0; j < n_traps; j++)
+            if(traps[j].bar == i)
+                vm->mmio_map[gpa + traps[j].offset] = {this, traps[j].size};
+
+        bar.gpa = gpa;
+    }
+}
+
+void Driver::mmio_write(uintptr_t addr, uint64_t value, uint8_t size) {
+    for(size_t i = 0; i < n_traps; i++) {
+        const auto& trap = traps[i];
+        const auto& bar = bars[trap.bar];
+        if(!bar.gpa || addr < (bar.gpa + trap.offset) || addr >= (bar.gpa + trap.offset + trap.size))
+            continue;
+
+        auto offset = addr - bar.gpa;
+        bool is_table = trap.bar == device.msix.table.bar && offset >= device.msix.table.offset && offset < (device.msix.table.offset + msix->table_size());
+        bool is_pba = trap.bar == device.msix.pending.bar && offset >= device.msix.pending.offset && offset < (device.msix.pending.offset + div_ceil(device.msix.n_messages, 64) * sizeof(uint64_t));
+        if((is_table || is_pba) && msix->mmio_write(offset, value, size))
+            return;
+
+        hw_write(bar.host.base + offset, value, size);
+        return;
+    }
+}
+
+uint64_t Driver::mmio_read(uintptr_t addr, uint8_t size) {
+    for(size_t i = 0; i < n_traps; i++) {
+        const auto& trap = traps[i];
+        const auto& bar = bars[trap.bar];
+        if(!bar.gpa || addr < (bar.gpa + trap.offset) || addr >= (bar.gpa + trap.offset + trap.size))
+            continue;
+
+        auto offset = addr - bar.gpa;
+        bool is_table = trap.bar == device.msix.table.bar && offset >= device.msix.table.offset && offset < (device.msix.table.offset + msix->table_size());
+        bool is_pba = trap.bar == device.msix.pending.bar && offset >= device.msix.pending.offset && offset < (device.msix.pending.offset + div_ceil(device.msix.n_messages, 64) * sizeof(uint64_t));
+
+        uint64_t value = 0;
+        if((is_table || is_pba) && msix->mmio_read(offset, size, value))
+            return value;
+
+        return hw_read(bar.host.base + offset, size);
+    }
+
+    return 0;
+}
+
+uint32_t Driver::pci_handle_read(uint16_t reg, uint8_t size) {
+    bool emulated = (msix && ranges_overlap(reg, size, device.msix.offset, sizeof(vm::pci::msix::Capability))) || (msi_offset && ranges_overlap(reg, size, msi_offset, msi_size));
+    if(emulated) {
+        std::lock_guard guard{msi_lock};
+        switch (size) {
+            case 1: return pci_space->data8[reg];
+            case 2: return pci_space->data16[reg / 2];
+            case 4: return pci_space->data32[reg / 4];
+            default: PANIC("Unknown PCI Access size");
+        }
+    }
+
+    switch (size) {
+        case 1: return device.read<uint8_t>(reg);
+        case 2: return device.read<uint16_t>(reg);
+        case 4: return device.read<uint32_t>(reg);
+        default: PANIC("Unknown PCI Access size");
+    }
+}
+
+void Driver::pci_handle_write(uint16_t reg, uint32_t value, uint8_t size) {
+    if(msix && msix->pci_write(reg, value, size))
+        return;
+
+    if(msi_offset && ranges_overlap(reg, size, msi_offset, msi_size)) {
+        std::lock_guard guard{msi_lock};
+        msi_write(reg, value, size);
+        return;
+    }
+
+    switch (size) {
+        case 1: device.write<uint8_t>(reg, value); break;
+        case 2: device.write<uint16_t>(reg, value); break;
+        case 4: device.write<uint32_t>(reg, value); break;
+        default: PANIC("Unknown PCI Access size");
+    }
+}
+
+void Driver::msi_write(uint16_t reg, uint32_t value, uint8_t size) {
+    auto control_reg = (msi_offset + ::pci::msi::control) / 2;
+    auto pending_reg = (msi_offset + msi_mask_offset + 4) / 4;
+
+    uint16_t old_control = pci_space->data16[control_reg];
+    uint32_t old_pending = pci_space->data32[pending_reg];
+    uint8_t next = pci_space->data8[msi_offset + 1];
+
+    switch (size) {
+        case 1: pci_space->data8[reg] = value; break;
+        case 2: pci_space->data16[reg / 2] = value; break;
+        case 4: pci_space->data32[reg / 4] = value; break;
+        default: PANIC("Unknown PCI Access size");
+    }
+
+    // Only Enable is writable in Message Control, and Pending Bits are read-only
+    pci_space->data8[msi_offset] = ::pci::msi::id;
+    pci_space->data8[msi_offset + 1] = next;
+    pci_space->data16[control_reg] = (old_control & ~1) | (pci_space->data16[control_reg] & 1);
+
+    ::pci::msi::Control control{.raw = old_control};
+    if(control.pvm)
+        pci_space->data32[pending_reg] = old_pending;
+
+    if(msi_pending) // Might have been unmasked
+        send_msi();
+}
+
+void Driver::send_msi() {
+    ::pci::msi::Control control{.raw = pci_space->data16[(msi_offset + ::pci::msi::control) / 2]};
+    if(!control.enable)
+        return;
+
+    auto pending_reg = (msi_offset + msi_mask_offset + 4) / 4;
+    if(control.pvm && (pci_space->data32[(msi_offset + msi_mask_offset) / 4] & 1)) {
+        msi_pending = true;
+        pci_space->data32[pending_reg] |= 1;
+        return;
+    }
+
+    msi_pending = false;
+    if(control.pvm)
+        pci_space->data32[pending_reg] &= ~1;
+
+    uint64_t address = pci_space->data32[(msi_offset + ::pci::msi::addr) / 4];
+    if(control.c64)
+        address |= (uint64_t)pci_space->data32[(msi_offset + ::pci::msi::addr + 4) / 4] << 32;
+
+    uint16_t data = pci_space->data32[(msi_offset + (control.c64 ? ::pci::msi::data_64 : ::pci::msi::data_32)) / 4];
+    vm->deliver_msi(address, data);
+}
+
+void Driver::handle_irq(uint16_t i) {
+    if(msix && msix->is_enabled()) {
+        msix->notify(i);
+        return;
+    }
+
+    // With neither enabled the guest is polling, or waiting on INTx, which can't be forwarded since the host only gets edge triggered MSIs
+    std::lock_guard guard{msi_lock};
+    if(i == 0 && msi_offset)
+        send_msi();
+}
@@ -11,6 +11,8 @@ Driver::Driver(Vm* vm): vm{vm} {
 
     vm->pio_map[channel2_status] = this;
 
+    vm->snapshot_drivers.push_back(this);
+
     ch0_timer.set_handler([](void* userptr) {
         auto& self = *(vm::pit::Driver*)userptr;
         self.irq_handler();
@@ -120,6 +122,17 @@ void Driver::setup_channel(uint8_t ch) {
     }
 }
 
+void Driver::snapshot_save(snapshot::Writer& out) {
+    out.write(channels);
+}
+
+void Driver::snapshot_restore(snapshot::Reader& in) {
+    in.read(channels);
+
+    if(channels[0].mode == 2) // Periodic timer has to be restarted, one-shot ones have most likely already fired
+        setup_channel(0);
+}
+
 bool Driver::get_channel_output(uint8_t ch) {
     ASSERT(ch == 2);
     
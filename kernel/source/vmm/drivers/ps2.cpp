@@ -138,6 +138,42 @@ Driver::Driver(Vm* vm): vm{vm} {
 
     a.irq_line = port_a_irq_line;
     b.irq_line = port_b_irq_line;
+
+    vm->snapshot_drivers.push_back(this);
+}
+
+void Driver::snapshot_save(snapshot::Writer& out) {
+    out.write(multibyte_cmd);
+    out.write(multibyte_n);
+
+    out.write(out_buffer);
+    out.write(out_i);
+    out.write(in_buffer);
+    out.write(in_i);
+
+    out.write(ram);
+    out.write(obf);
+    out.write(ibf);
+
+    out.write(a);
+    out.write(b);
+}
+
+void Driver::snapshot_restore(snapshot::Reader& in) {
+    in.read(multibyte_cmd);
+    in.read(multibyte_n);
+
+    in.read(out_buffer);
+    in.read(out_i);
+    in.read(in_buffer);
+    in.read(in_i);
+
+    in.read(ram);
+    in.read(obf);
+    in.read(ibf);
+
+    in.read(a);
+    in.read(b);
 }
 
 void Driver::pio_write(uint16_t port, uint32_t value, uint8_t size) {
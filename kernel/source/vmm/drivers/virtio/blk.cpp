@@ -0,0 +1,91 @@
+#include <Luna/vmm/drivers/virtio/blk.hpp>
+
+#include <std/string.hpp>
+
+using namespace vm::virtio::blk;
+
+Driver::Driver(Vm* vm, pci::HostBridge* bridge, uint8_t slot, uint8_t func, vfs::File* file):
+        Device{vm, bridge, slot, func, DeviceType::Block, (uint16_t)vm->cpus.size(), queue_size, Features::SegMax | Features::BlkSize | Features::Flush | Features::Mq}, config{}, file{file} {
+    pci_space->header.class_id = 1; // Storage
+    pci_space->header.subclass = 0; // SCSI, same as QEMU
+
+    config.capacity = file->get_size() / sector_size;
+    config.seg_max = seg_max;
+    config.blk_size = sector_size;
+    config.num_queues = queues.size();
+}
+
+uint64_t Driver::device_config_read(uint32_t offset, uint8_t size) {
+    uint64_t value = 0;
+    if((offset + size) <= sizeof(Config))
+        memcpy(&value, (uint8_t*)&config + offset, size);
+
+    return value;
+}
+
+void Driver::handle_queue(uint16_t i) {
+    auto& queue = queues[i];
+    std::lock_guard guard{queue.lock};
+
+    Chain chain{};
+    do {
+        queue.disable_notifications();
+
+        while(queue.pop(chain)) {
+            uint32_t written = 0;
+            auto status = handle_request(chain, written);
+
+            // The status byte is always the last writable one
+            if(chain.writable)
+                chain.write(*vm, chain.writable - 1, &status, 1);
+
+            queue.push(chain, written + 1);
+        }
+    } while(queue.enable_notifications());
+
+    // Only 1 IRQ for everything that was completed in this kick
+    notify_queue(queue);
+}
+
+uint8_t Driver::handle_request(const Chain& chain, uint32_t& written) {
+    RequestHeader header{};
+    if(chain.writable == 0 || !chain.read(*vm, 0, &header, sizeof(header)))
+        return RequestStatus::IoErr;
+
+    if(header.type == RequestType::In || header.type == RequestType::Out) {
+        bool in = header.type == RequestType::In;
+        size_t size = in ? (chain.writable - 1) : (chain.readable - sizeof(header));
+        if((size % sector_size) != 0 || header.sector > config.capacity || (size / sector_size) > (config.capacity - header.sector))
+            return RequestStatus::IoErr;
+
+        // Go straight between the file and guest RAM, without bouncing through a buffer
+        auto offset = header.sector * sector_size;
+        bool success = chain.for_each_range(*vm, in, in ? 0 : sizeof(header), size, [&](uint8_t* va, size_t chunk) {
+            size_t n = 0;
+            {
+                std::lock_guard guard{file_lock};
+                n = in ? file->read(offset, chunk, va) : file->write(offset, chunk, va);
+            }
+            offset += chunk;
+
+            return n == chunk;
+        });
+
+        if(in)
+            written = size;
+
+        return success ? RequestStatus::Ok : RequestStatus::IoErr;
+    } else if(header.type == RequestType::Flush) {
+        std::lock_guard guard{file_lock};
+        file->close(); // Flushes anything that was written to disk
+        return RequestStatus::Ok;
+    } else if(header.type == RequestType::GetId) {
+        constexpr char id[20] = "luna-virtio-blk";
+        written = min(sizeof(id), chain.writable - 1);
+        chain.write(*vm, 0, id, written);
+
+        return RequestStatus::Ok;
+    }
+
+    return RequestStatus::Unsupported;
+}
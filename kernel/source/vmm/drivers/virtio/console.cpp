@@ -0,0 +1,215 @@
+#include <Luna/vmm/drivers/virtio/console.hpp>
+
+#include <std/string.hpp>
+
+using namespace vm::virtio::console;
+
+static uint16_t port_rx_queue(uint32_t id) { return (id == 0) ? 0 : ((id + 1) * 2); }
+static uint16_t port_tx_queue(uint32_t id) { return port_rx_queue(id) + 1; }
+
+Ring::Ring(size_t size) {
+    buf.resize(size);
+}
+
+void Ring::write(const uint8_t* data, size_t size) {
+    std::lock_guard guard{lock};
+
+    for(size_t i = 0; i < size; i++) {
+        buf[(head + count) % buf.size()] = data[i];
+
+        if(count == buf.size())
+            head = (head + 1) % buf.size(); // Full, so the oldest byte was just overwritten
+        else
+            count++;
+    }
+}
+
+size_t Ring::read(uint8_t* data, size_t size) {
+    std::lock_guard guard{lock};
+
+    size_t n = min(size, count);
+    for(size_t i = 0; i < n; i++)
+        data[i] = buf[(head + i) % buf.size()];
+
+    head = (head + n) % buf.size();
+    count -= n;
+    return n;
+}
+
+Driver::Driver(Vm* vm, pci::HostBridge* bridge, uint8_t slot, uint8_t func, log::Logger* console, uint32_t max_ports):
+        Device{vm, bridge, slot, func, DeviceType::Console, (uint16_t)((max_ports + 1) * 2), queue_size, Features::Multiport | Features::EmergWrite}, config{} {
+    ASSERT(max_ports >= 1);
+
+    pci_space->header.class_id = 7; // Communication
+    pci_space->header.subclass = 0x80; // Other
+
+    config.max_nr_ports = max_ports;
+
+    ports.push_back({.name = nullptr, .logger = console, .ring = nullptr});
+}
+
+uint32_t Driver::add_port(const char* name, size_t ring_size) {
+    ASSERT(ports.size() < config.max_nr_ports);
+
+    ports.push_back({.name = name, .logger = nullptr, .ring = new Ring{ring_size}});
+    return ports.size() - 1;
+}
+
+size_t Driver::read(uint32_t id, uint8_t* data, size_t size) {
+    if(id >= ports.size() || !ports[id].ring)
+        return 0;
+
+    return ports[id].ring->read(data, size);
+}
+
+uint64_t Driver::device_config_read(uint32_t offset, uint8_t size) {
+    uint64_t value = 0;
+    if((offset + size) <= sizeof(Config))
+        memcpy(&value, (uint8_t*)&config + offset, size);
+
+    return value;
+}
+
+void Driver::device_config_write(uint32_t offset, uint64_t value, uint8_t size) {
+    // Emergency write, for output before the queues are set up
+    if(offset == offsetof(Config, emerg_wr) && size == 4) {
+        ports[0].logger->putc(value);
+        ports[0].logger->flush();
+    }
+}
+
+void Driver::device_reset() {
+    std::lock_guard guard{queues[control_rx_queue].lock};
+    control_pending.clear();
+    control_pending_head = 0;
+}
+
+void Driver::handle_queue(uint16_t i) {
+    if(i == control_tx_queue) {
+        handle_control();
+    } else if(i == control_rx_queue) {
+        std::lock_guard guard{queues[control_rx_queue].lock};
+        flush_control();
+    } else if(i & 1) {
+        handle_output((i == 1) ? 0 : ((i / 2) - 1));
+    }
+
+    // Nothing is ever sent to the guest over the port RX queues, guest input goes through PS/2
+}
+
+void Driver::handle_output(uint32_t id) {
+    if(id >= ports.size())
+        return;
+
+    auto& port = ports[id];
+    auto& queue = queues[port_tx_queue(id)];
+    std::lock_guard guard{queue.lock};
+
+    Chain chain{};
+    do {
+        queue.disable_notifications();
+
+        while(queue.pop(chain)) {
+            chain.for_each_range(*vm, false, 0, chain.readable, [&](uint8_t* va, size_t chunk) {
+                if(port.logger)
+                    port.logger->puts((const char*)va, chunk);
+                else
+                    port.ring->write(va, chunk);
+
+                return true;
+            });
+
+            queue.push(chain, 0);
+        }
+    } while(queue.enable_notifications());
+
+    // Only redraw once for everything the guest wrote in this kick
+    if(port.logger)
+        port.logger->flush();
+
+    notify_queue(queue);
+}
+
+void Driver::handle_control() {
+    auto& queue = queues[control_tx_queue];
+    std::lock_guard guard{queue.lock};
+
+    Chain chain{};
+    while(queue.pop(chain)) {
+        Control msg{};
+        if(chain.read(*vm, 0, &msg, sizeof(msg)))
+            handle_control_message(msg);
+
+        queue.push(chain, 0);
+    }
+
+    notify_queue(queue);
+}
+
+void Driver::handle_control_message(const Control& msg) {
+    switch (msg.event) {
+        case ControlEvent::DeviceReady:
+            if(msg.value != 1) {
+                print("virtio-console: Driver failed to initialize\n");
+                break;
+            }
+
+            for(uint32_t i = 0; i < ports.size(); i++)
+                send_control(i, ControlEvent::DeviceAdd, 0);
+            break;
+        case ControlEvent::PortReady: {
+            if(msg.id >= ports.size() || msg.value != 1)
+                break;
+
+            const auto& port = ports[msg.id];
+            if(port.logger)
+                send_control(msg.id, ControlEvent::ConsolePort, 1);
+            else
+                send_control(msg.id, ControlEvent::PortName, 0, port.name);
+
+            send_control(msg.id, ControlEvent::PortOpen, 1); // The host side is always open
+            break;
+        }
+        case ControlEvent::PortOpen:
+            break; // Output is accepted whether the guest has the port open or not
+        default:
+            print("virtio-console: Unhandled control event {} for port {}\n", (uint16_t)msg.event, (uint32_t)msg.id);
+    }
+}
+
+void Driver::send_control(uint32_t id, uint16_t event, uint16_t value, const char* name) {
+    Control msg{.id = id, .event = event, .value = value};
+    size_t name_len = name ? strlen(name) : 0;
+
+    std::vector<uint8_t> buf{};
+    buf.resize(sizeof(msg) + name_len);
+    memcpy(buf.data(), &msg, sizeof(msg));
+    if(name)
+        memcpy(buf.data() + sizeof(msg), name, name_len); // Not NUL terminated, the length comes from the buffer
+
+    std::lock_guard guard{queues[control_rx_queue].lock};
+    control_pending.push_back(buf);
+    flush_control();
+}
+
+void Driver::flush_control() {
+    auto& queue = queues[control_rx_queue];
+
+    Chain chain{};
+    while(control_pending_head < control_pending.size()) {
+        if(!queue.pop(chain))
+            break;
+
+        const auto& msg = control_pending[control_pending_head++];
+        auto n = min(msg.size(), chain.writable);
+        chain.write(*vm, 0, msg.data(), n);
+        queue.push(chain, n);
+    }
+
+    if(control_pending_head == control_pending.size()) {
+        control_pending.clear();
+        control_pending_head = 0;
+    }
+
+    notify_queue(queue);
+}
@@ -0,0 +1,210 @@
+#include <Luna/vmm/drivers/virtio/net.hpp>
+
+#include <std/string.hpp>
+
+using namespace vm::virtio::net;
+
+Driver::Driver(Vm* vm, pci::HostBridge* bridge, uint8_t slot, uint8_t func, const ::net::Mac& mac, vm::netswitch::Switch& sw):
+        Device{vm, bridge, slot, func, DeviceType::Net, 2, queue_size, Features::Csum | Features::GuestCsum | Features::Mac | Features::GuestTso4 | Features::HostTso4 | Features::MrgRxbuf | Features::Status},
+        config{}, sw{sw} {
+    pci_space->header.class_id = 2; // Network
+    pci_space->header.subclass = 0; // Ethernet
+
+    memcpy(config.mac, mac.data, 6);
+    config.status = LinkStatus::Up;
+    config.max_virtqueue_pairs = 1;
+
+    sw.attach(this);
+}
+
+Driver::~Driver() {
+    sw.detach(this);
+}
+
+uint64_t Driver::device_config_read(uint32_t offset, uint8_t size) {
+    uint64_t value = 0;
+    if((offset + size) <= sizeof(Config))
+        memcpy(&value, (uint8_t*)&config + offset, size);
+
+    return value;
+}
+
+void Driver::device_reset() {
+    std::lock_guard guard{queues[rx_queue].lock};
+    backlog.clear();
+    backlog_head = 0;
+}
+
+void Driver::handle_queue(uint16_t i) {
+    if(i == rx_queue) {
+        // The guest added RX buffers, so packets that didn't fit before might now
+        auto& queue = queues[rx_queue];
+        std::lock_guard guard{queue.lock};
+
+        flush_backlog();
+        notify_queue(queue);
+    } else if(i == tx_queue) {
+        transmit();
+    }
+}
+
+void Driver::transmit() {
+    auto& queue = queues[tx_queue];
+    std::lock_guard guard{queue.lock};
+
+    Chain chain{};
+    do {
+        queue.disable_notifications();
+
+        while(queue.pop(chain)) {
+            Header header{};
+            if(chain.read(*vm, 0, &header, sizeof(header))) {
+                // Point straight into guest memory, the receiver does the only copy
+                vm::netswitch::Packet packet{};
+                bool valid = chain.for_each_range(*vm, false, sizeof(Header), chain.readable - sizeof(Header), [&](uint8_t* va, size_t chunk) {
+                    packet.add_segment(va, chunk);
+                    return true;
+                });
+
+                if(header.flags & HeaderFlags::NeedsCsum) {
+                    packet.offload.needs_csum = true;
+                    packet.offload.csum_start = header.csum_start;
+                    packet.offload.csum_offset = header.csum_offset;
+                }
+
+                auto gso_type = header.gso_type & ~GsoType::Ecn;
+                if(gso_type == GsoType::TcpV4 && header.gso_size) {
+                    packet.offload.gso_size = header.gso_size;
+                    packet.offload.hdr_len = header.hdr_len;
+                } else if(gso_type != GsoType::None && gso_type != GsoType::TcpV4) {
+                    valid = false; // Only TSOv4 is offered
+                }
+
+                if(valid)
+                    sw.send(this, packet);
+            }
+
+            queue.push(chain, 0);
+        }
+    } while(queue.enable_notifications());
+
+    notify_queue(queue);
+}
+
+void Driver::receive(const vm::netswitch::Packet& packet) {
+    // Do whatever the guest can't do itself before it goes into the RX buffers
+    vm::netswitch::resolve_offloads(packet, has_feature(Features::GuestCsum), has_feature(Features::GuestTso4), [](const vm::netswitch::Packet& packet, void* userptr) {
+        auto& self = *(Driver*)userptr;
+        auto& queue = self.queues[rx_queue];
+        std::lock_guard guard{queue.lock};
+        if(!queue.enabled)
+            return;
+
+        // Packets can't overtake the ones that are already waiting
+        if(self.backlog_head == self.backlog.size() && self.deliver(packet)) {
+            self.notify_queue(queue);
+            return;
+        }
+
+        if((self.backlog.size() - self.backlog_head) >= max_backlog)
+            return; // Drop it, just like a real NIC that ran out of buffers
+
+        auto& pending = self.backlog.emplace_back();
+        pending.data.resize(packet.size);
+        packet.copy_to(0, pending.data.data(), packet.size);
+        pending.offload = packet.offload;
+    }, this);
+}
+
+void Driver::flush_backlog() {
+    while(backlog_head < backlog.size()) {
+        auto& pending = backlog[backlog_head];
+
+        vm::netswitch::Packet packet{};
+        packet.add_segment(pending.data.data(), pending.data.size());
+        packet.offload = pending.offload;
+        if(!deliver(packet))
+            return;
+
+        backlog_head++;
+    }
+
+    backlog.clear();
+    backlog_head = 0;
+}
+
+bool Driver::deliver(const vm::netswitch::Packet& packet) {
+    auto& queue = queues[rx_queue];
+    bool mergeable = has_feature(Features::MrgRxbuf);
+    size_t total = sizeof(Header) + packet.size;
+
+    // Take enough chains to fit the whole packet, or put them all back if there aren't enough yet
+    auto checkpoint = queue.checkpoint();
+    std::vector<Chain> chains{};
+    size_t space = 0;
+    while(space < total) {
+        auto& chain = chains.emplace_back();
+        if(!queue.pop(chain)) {
+            queue.rewind(checkpoint);
+            return false;
+        }
+
+        space += chain.writable;
+        if(!mergeable)
+            break;
+    }
+
+    if(space < total || chains[0].writable < sizeof(Header)) {
+        // The guest gave us buffers that are too small, so drop the packet
+        queue.rewind(checkpoint);
+        return true;
+    }
+
+    Header header{};
+    if(packet.offload.needs_csum) {
+        header.flags = HeaderFlags::NeedsCsum;
+        header.csum_start = packet.offload.csum_start;
+        header.csum_offset = packet.offload.csum_offset;
+    }
+
+    if(packet.offload.gso_size) {
+        header.gso_type = GsoType::TcpV4;
+        header.gso_size = packet.offload.gso_size;
+        header.hdr_len = packet.offload.hdr_len;
+    }
+
+    header.num_buffers = chains.size();
+
+    // Scatter the header and packet over the chains, every chain but the last is filled up completely
+    size_t chain_i = 0, chain_off = 0;
+    auto copy_out = [&](const uint8_t* data, size_t len) {
+        while(len > 0) {
+            auto& chain = chains[chain_i];
+            if(chain_off == chain.writable) {
+                chain_i++;
+                chain_off = 0;
+                continue;
+            }
+
+            auto chunk = min(chain.writable - chain_off, len);
+            chain.write(*vm, chain_off, data, chunk);
+
+            data += chunk;
+            len -= chunk;
+            chain_off += chunk;
+        }
+    };
+
+    copy_out((const uint8_t*)&header, sizeof(header));
+    for(const auto& segment : packet.segments)
+        copy_out(segment.data(), segment.size_bytes());
+
+    size_t remaining = total;
+    for(const auto& chain : chains) {
+        auto written = min(chain.writable, remaining);
+        queue.push(chain, written);
+        remaining -= written;
+    }
+
+    return true;
+}
@@ -0,0 +1,640 @@
+#include <Luna/vmm/drivers/virtio/virtio.hpp>
+
+#include <std/string.hpp>
+
+using namespace vm::virtio;
+
+bool vm::virtio::copy_from_guest(Vm& vm, uintptr_t gpa, void* data, size_t size) {
+    auto* dst = (uint8_t*)data;
+    bool ret = for_each_host_range(vm, gpa, size, false, [&](uint8_t* va, size_t chunk) { memcpy(dst, va, chunk); dst += chunk; return true; });
+
+    if(!ret)
+        memset(data, 0, size);
+
+    return ret;
+}
+
+bool vm::virtio::copy_to_guest(Vm& vm, uintptr_t gpa, const void* data, size_t size) {
+    auto* src = (const uint8_t*)data;
+    return for_each_host_range(vm, gpa, size, true, [&](uint8_t* va, size_t chunk) { memcpy(va, src, chunk); src += chunk; return true; });
+}
+
+// The ring indices are written by the guest on other CPUs, we only run on x86, so only the compiler and store->load ordering need barriers
+static void compiler_barrier() { asm volatile("" : : : "memory"); }
+static void full_barrier() { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+
+// Is new_idx past event_idx, since we last notified at old_idx, everything mod 2^16
+static bool need_event(uint16_t event_idx, uint16_t new_idx, uint16_t old_idx) {
+    return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+// The driver broke the queue, it won't be used again until the device is reset
+bool Queue::fail(const char* msg) {
+    print("virtio: {:s}\n", msg);
+    enabled = false;
+
+    return false;
+}
+
+bool Queue::add_desc(Chain& chain, uint64_t addr, uint32_t len, bool write) {
+    if(!write && chain.writable)
+        return fail("Readable descriptor after a writable one");
+
+    chain.bufs.push_back({.gpa = addr, .len = len, .write = write});
+    if(write)
+        chain.writable += len;
+    else
+        chain.readable += len;
+
+    return true;
+}
+
+bool Queue::add_indirect(Chain& chain, uint64_t addr, uint32_t len) {
+    if(!indirect || (len % 16) != 0 || len == 0)
+        return fail("Invalid indirect descriptor");
+
+    // A chain can't be longer than the queue, this also bounds the table the guest makes us allocate
+    if((len / 16) > size)
+        return fail("Indirect descriptor table larger than the queue");
+
+    // Read the whole table at once, it is usually small and this saves a lot of translations
+    std::vector<uint8_t> table{};
+    table.resize(len);
+    if(!copy_from_guest(*vm, addr, table.data(), len))
+        return false;
+
+    size_t n = len / 16;
+    if(packed) { // Packed indirect tables are used in order, there is no chaining
+        for(size_t i = 0; i < n; i++) {
+            auto& desc = ((PackedDesc*)table.data())[i];
+            if(!add_desc(chain, desc.addr, desc.len, desc.flags & DescFlags::Write))
+                return false;
+        }
+    } else {
+        size_t i = 0;
+        for(size_t count = 0;; count++) {
+            if(i >= n || count >= n)
+                return fail("Indirect descriptor chain out of bounds, or looping");
+
+            auto& desc = ((SplitDesc*)table.data())[i];
+            if(desc.flags & DescFlags::Indirect)
+                return fail("Nested indirect descriptor");
+
+            if(!add_desc(chain, desc.addr, desc.len, desc.flags & DescFlags::Write))
+                return false;
+
+            if(!(desc.flags & DescFlags::Next))
+                break;
+
+            i = desc.next;
+        }
+    }
+
+    return true;
+}
+
+bool Queue::split_pop(Chain& chain) {
+    auto avail_idx = read_guest<uint16_t>(*vm, driver + 2);
+    if(avail_idx == next_avail)
+        return false;
+
+    if((uint16_t)(avail_idx - next_avail) > size)
+        return fail("Driver made more buffers available than the queue holds");
+
+    compiler_barrier(); // Don't read the ring before the index
+
+    auto head = read_guest<uint16_t>(*vm, driver + 4 + ((next_avail % size) * 2));
+    next_avail++;
+
+    chain.id = head;
+    chain.n_descs = 1;
+
+    uint16_t i = head;
+    for(size_t count = 0;; count++) {
+        if(i >= size || count >= size)
+            return fail("Descriptor chain out of bounds, or looping");
+
+        auto desc = read_guest<SplitDesc>(*vm, this->desc + (i * sizeof(SplitDesc)));
+        if(desc.flags & DescFlags::Indirect) {
+            if(!add_indirect(chain, desc.addr, desc.len))
+                return false;
+        } else if(!add_desc(chain, desc.addr, desc.len, desc.flags & DescFlags::Write)) {
+            return false;
+        }
+
+        if(!(desc.flags & DescFlags::Next))
+            break;
+
+        i = desc.next;
+    }
+
+    return true;
+}
+
+bool Queue::packed_is_avail(uint16_t i, bool wrap) {
+    auto flags = read_guest<uint16_t>(*vm, desc + (i * sizeof(PackedDesc)) + offsetof(PackedDesc, flags));
+
+    return (bool)(flags & DescFlags::Avail) == wrap && (bool)(flags & DescFlags::Used) != wrap;
+}
+
+bool Queue::packed_pop(Chain& chain) {
+    if(!packed_is_avail(next_avail, avail_wrap))
+        return false;
+
+    compiler_barrier(); // Don't read the rest of the descriptor before the flags
+
+    chain.n_descs = 0;
+    while(true) {
+        if(chain.n_descs >= size)
+            return fail("Descriptor chain longer than the ring");
+
+        auto desc = read_guest<PackedDesc>(*vm, this->desc + (next_avail * sizeof(PackedDesc)));
+        chain.n_descs++;
+
+        if(++next_avail == size) {
+            next_avail = 0;
+            avail_wrap = !avail_wrap;
+        }
+
+        if(desc.flags & DescFlags::Indirect) {
+            if(!add_indirect(chain, desc.addr, desc.len))
+                return false;
+        } else if(!add_desc(chain, desc.addr, desc.len, desc.flags & DescFlags::Write)) {
+            return false;
+        }
+
+        if(!(desc.flags & DescFlags::Next)) {
+            chain.id = desc.id; // Only the last descriptor in a chain has to have the buffer ID
+            break;
+        }
+    }
+
+    return true;
+}
+
+bool Queue::pop(Chain& chain) {
+    chain.bufs.resize(0);
+    chain.readable = 0;
+    chain.writable = 0;
+
+    if(!enabled)
+        return false;
+
+    return packed ? packed_pop(chain) : split_pop(chain);
+}
+
+void Queue::push(const Chain& chain, uint32_t written) {
+    if(packed) {
+        auto addr = desc + (next_used * sizeof(PackedDesc));
+        write_guest<uint16_t>(*vm, addr + offsetof(PackedDesc, id), chain.id);
+        write_guest<uint32_t>(*vm, addr + offsetof(PackedDesc, len), written);
+
+        compiler_barrier(); // The flags hand the descriptor back to the driver, so they have to be written last
+
+        uint16_t flags = (used_wrap ? (DescFlags::Avail | DescFlags::Used) : 0) | (written ? DescFlags::Write : 0);
+        write_guest<uint16_t>(*vm, addr + offsetof(PackedDesc, flags), flags);
+
+        next_used += chain.n_descs;
+        if(next_used >= size) {
+            next_used -= size;
+            used_wrap = !used_wrap;
+        }
+    } else {
+        struct [[gnu::packed]] {
+            uint32_t id, len;
+        } elem = {chain.id, written};
+        write_guest(*vm, device + 4 + ((next_used % size) * sizeof(elem)), elem);
+
+        compiler_barrier();
+
+        next_used++;
+        write_guest<uint16_t>(*vm, device + 2, next_used);
+    }
+
+    used_since_notify += chain.n_descs;
+}
+
+bool Queue::should_notify() {
+    full_barrier(); // Our used index has to be visible before we read the driver's event index, or we might miss a notification
+
+    bool notify = false;
+    if(packed) {
+        auto off_wrap = read_guest<uint16_t>(*vm, driver);
+        auto flags = read_guest<uint16_t>(*vm, driver + 2);
+
+        if(flags == EventFlags::Enable) {
+            notify = true;
+        } else if(flags == EventFlags::Desc && event_idx) {
+            uint16_t off = off_wrap & 0x7FFF;
+            if((bool)(off_wrap >> 15) != used_wrap)
+                off -= size; // The event is in the previous lap of the ring
+
+            notify = need_event(off, next_used, next_used - used_since_notify);
+        }
+    } else {
+        if(event_idx) {
+            auto used_event = read_guest<uint16_t>(*vm, driver + 4 + (size * 2));
+            notify = need_event(used_event, next_used, next_used - used_since_notify);
+        } else {
+            notify = !(read_guest<uint16_t>(*vm, driver) & 1); // VIRTQ_AVAIL_F_NO_INTERRUPT
+        }
+    }
+
+    if(notify)
+        used_since_notify = 0;
+
+    return notify;
+}
+
+void Queue::disable_notifications() {
+    if(packed)
+        write_guest<uint16_t>(*vm, device + 2, EventFlags::Disable);
+    else if(!event_idx) // With event indices the driver won't kick again as long as we don't move the avail event forwards
+        write_guest<uint16_t>(*vm, device, 1); // VIRTQ_USED_F_NO_NOTIFY
+}
+
+bool Queue::enable_notifications() {
+    if(packed) {
+        if(event_idx) {
+            write_guest<uint16_t>(*vm, device, next_avail | (avail_wrap << 15));
+            write_guest<uint16_t>(*vm, device + 2, EventFlags::Desc);
+        } else {
+            write_guest<uint16_t>(*vm, device + 2, EventFlags::Enable);
+        }
+    } else {
+        if(event_idx)
+            write_guest<uint16_t>(*vm, device + 4 + (size * 8), next_avail); // avail_event
+        else
+            write_guest<uint16_t>(*vm, device, 0);
+    }
+
+    full_barrier(); // The driver might have added buffers before it saw notifications being enabled again, so check again
+
+    if(!enabled)
+        return false;
+    else if(packed)
+        return packed_is_avail(next_avail, avail_wrap);
+    else
+        return read_guest<uint16_t>(*vm, driver + 2) != next_avail;
+}
+
+void Queue::reset() {
+    size = max_size;
+    msix_vector = pci::msix::no_vector;
+    enabled = false;
+    desc = 0;
+    driver = 0;
+    device = 0;
+
+    packed = false;
+    event_idx = false;
+    indirect = false;
+
+    next_avail = 0;
+    next_used = 0;
+    avail_wrap = true;
+    used_wrap = true;
+    used_since_notify = 0;
+}
+
+Device::Device(Vm* vm, pci::HostBridge* bridge, uint8_t slot, uint8_t func, uint16_t type, uint16_t n_queues, uint16_t max_queue_size, uint64_t features):
+        PCIDriver{vm},
+        device_features{features | Features::Version1 | Features::RingIndirectDesc | Features::RingEventIdx | Features::RingPacked},
+        msix{vm, *pci_space, 0x40, (uint16_t)(n_queues + 1), 0, regions::msix_table, regions::msix_pba} {
+    bridge->register_pci_driver(pci::DeviceID{0, 0, slot, func}, this);
+
+    pci_space->header.vendor_id = pci_vendor_id;
+    pci_space->header.device_id = pci_device_id_base + type;
+    pci_space->header.revision = 1; // Modern only device
+
+    pci_space->header.subsystem_vendor_id = pci_vendor_id;
+    pci_space->header.subsystem_device_id = 0x40 + type;
+
+    pci_space->header.irq_pin = 1;
+
+    if(func > 0)
+        pci_space->header.header_type = 0x80;
+
+    pci_init_bar(0, bar_size, true, true); // MMIO, 64bit
+
+    pci_add_capability(0x40); // MSI-X
+
+    auto add_cap = [&](uint8_t offset, uint8_t type, uint32_t region, uint32_t length, uint8_t cap_len = sizeof(PciCap)) {
+        auto& cap = *(PciCap*)&pci_space->data8[offset];
+        cap = {.id = 0x9, .next = 0, .len = cap_len, .type = type, .bar = 0, .cap_id = 0, .padding = 0, .offset = region, .length = length};
+
+        pci_add_capability(offset);
+    };
+
+    add_cap(0x50, CapType::Common, regions::common, common::size);
+    add_cap(0x60, CapType::Isr, regions::isr, 1);
+    add_cap(0x70, CapType::Device, regions::device, 0x1000);
+
+    add_cap(0x80, CapType::Notify, regions::notify, n_queues * notify_off_multiplier, sizeof(PciNotifyCap));
+    ((PciNotifyCap*)&pci_space->data8[0x80])->notify_off_multiplier = notify_off_multiplier;
+
+    queues.resize(n_queues);
+    for(auto& queue : queues) {
+        queue.vm = vm;
+        queue.max_size = max_queue_size;
+    }
+
+    reset();
+
+    vm->snapshot_drivers.push_back(this);
+}
+
+void Device::reset() {
+    driver_features = 0;
+    device_feature_select = 0;
+    driver_feature_select = 0;
+    queue_select = 0;
+    config_msix_vector = pci::msix::no_vector;
+    status = 0;
+    config_generation = 0;
+
+    isr = 0;
+    pci_set_irq_line(false);
+
+    // Devices can use their queues from other threads, e.g. a NIC receiving a packet
+    for(auto& queue : queues) {
+        std::lock_guard guard{queue.lock};
+        queue.reset();
+    }
+
+    device_reset();
+}
+
+void Device::raise_irq(uint16_t vector, uint8_t isr_bit) {
+    if(msix.is_enabled()) {
+        if(vector != pci::msix::no_vector)
+            msix.notify(vector);
+
+        return;
+    }
+
+    __atomic_fetch_or(&isr, isr_bit, __ATOMIC_SEQ_CST);
+    pci_set_irq_line(true);
+}
+
+void Device::notify_queue(Queue& queue) {
+    if(queue.should_notify())
+        raise_irq(queue.msix_vector, Isr::Queue);
+}
+
+void Device::notify_config() {
+    config_generation++;
+    raise_irq(config_msix_vector, Isr::Config);
+}
+
+void Device::common_write(uint32_t reg, uint64_t value, uint8_t size) {
+    auto* queue = (queue_select < queues.size()) ? &queues[queue_select] : nullptr;
+
+    // The 64bit queue addresses can be written in 2 halves, the field is only looked up once we know the selected queue exists
+    auto write_addr = [&](uint64_t Queue::* field, uint32_t offset) {
+        if(!queue || queue->enabled)
+            return;
+
+        auto& addr = queue->*field;
+
+        if(offset == 0 && size == 8)
+            addr = value;
+        else if(offset == 0 && size == 4)
+            addr = (addr & ~0xFFFF'FFFFull) | (value & 0xFFFF'FFFF);
+        else if(offset == 4 && size == 4)
+            addr = (addr & 0xFFFF'FFFF) | (value << 32);
+    };
+
+    switch (reg) {
+        case common::device_feature_select: device_feature_select = value; break;
+        case common::driver_feature_select: driver_feature_select = value; break;
+        case common::driver_feature:
+            if(driver_feature_select < 2 && !(status & Status::FeaturesOk)) {
+                auto shift = driver_feature_select * 32;
+                driver_features = (driver_features & ~(0xFFFF'FFFFull << shift)) | ((value & 0xFFFF'FFFF) << shift);
+            }
+            break;
+        case common::config_msix_vector: config_msix_vector = value; break;
+        case common::device_status:
+            if(value == 0) {
+                reset();
+                break;
+            }
+
+            if((value & Status::FeaturesOk) && !(status & Status::FeaturesOk)) {
+                // We don't support legacy drivers, and the driver can't accept features we don't offer
+                if((driver_features & ~device_features) || !(driver_features & Features::Version1)) {
+                    print("virtio: Driver accepted unsupported features {:#x}\n", driver_features);
+                    value &= ~Status::FeaturesOk;
+                }
+            }
+
+            if((value & Status::DriverOk) && !(status & Status::DriverOk)) {
+                status = value;
+                device_ready();
+                break;
+            }
+
+            status = value;
+            break;
+        case common::queue_select: queue_select = value; break;
+        case common::queue_size:
+            if(queue && !queue->enabled && value > 0 && value <= queue->max_size)
+                queue->size = value;
+            break;
+        case common::queue_msix_vector:
+            if(queue)
+                queue->msix_vector = value;
+            break;
+        case common::queue_enable:
+            if(queue && value == 1 && !queue->enabled) {
+                if(!has_feature(Features::RingPacked) && (queue->size & (queue->size - 1))) {
+                    print("virtio: Split queue size {} is not a power of 2\n", queue->size);
+                    break;
+                }
+
+                queue->packed = has_feature(Features::RingPacked);
+                queue->event_idx = has_feature(Features::RingEventIdx);
+                queue->indirect = has_feature(Features::RingIndirectDesc);
+                queue->enabled = true;
+            }
+            break;
+        case common::queue_desc: write_addr(&Queue::desc, 0); break;
+        case common::queue_desc + 4: write_addr(&Queue::desc, 4); break;
+        case common::queue_driver: write_addr(&Queue::driver, 0); break;
+        case common::queue_driver + 4: write_addr(&Queue::driver, 4); break;
+        case common::queue_device: write_addr(&Queue::device, 0); break;
+        case common::queue_device + 4: write_addr(&Queue::device, 4); break;
+        default:
+            print("virtio: Unhandled common config write {:#x} <- {:#x} ({})\n", reg, value, (uint16_t)size);
+    }
+}
+
+uint64_t Device::common_read(uint32_t reg, uint8_t size) {
+    auto* queue = (queue_select < queues.size()) ? &queues[queue_select] : nullptr;
+
+    auto read_addr = [&](uint64_t addr, uint32_t offset) -> uint64_t {
+        if(size == 8)
+            return addr;
+
+        return (addr >> (offset * 8)) & 0xFFFF'FFFF;
+    };
+
+    switch (reg) {
+        case common::device_feature_select: return device_feature_select;
+        case common::device_feature: return (device_feature_select < 2) ? ((device_features >> (device_feature_select * 32)) & 0xFFFF'FFFF) : 0;
+        case common::driver_feature_select: return driver_feature_select;
+        case common::driver_feature: return (driver_feature_select < 2) ? ((driver_features >> (driver_feature_select * 32)) & 0xFFFF'FFFF) : 0;
+        case common::config_msix_vector: return config_msix_vector;
+        case common::num_queues: return queues.size();
+        case common::device_status: return status;
+        case common::config_generation: return config_generation;
+        case common::queue_select: return queue_select;
+        case common::queue_size: return queue ? queue->size : 0;
+        case common::queue_msix_vector: return queue ? queue->msix_vector : pci::msix::no_vector;
+        case common::queue_enable: return queue ? queue->enabled : 0;
+        case common::queue_notify_off: return queue_select;
+        case common::queue_desc: case common::queue_desc + 4: return queue ? read_addr(queue->desc, reg - common::queue_desc) : 0;
+        case common::queue_driver: case common::queue_driver + 4: return queue ? read_addr(queue->driver, reg - common::queue_driver) : 0;
+        case common::queue_device: case common::queue_device + 4: return queue ? read_addr(queue->device, reg - common::queue_device) : 0;
+        default:
+            print("virtio: Unhandled common config read {:#x} ({})\n", reg, (uint16_t)size);
+            return 0;
+    }
+}
+
+void Device::mmio_write(uintptr_t addr, uint64_t value, uint8_t size) {
+    auto offset = addr - mmio_base;
+
+    if(offset >= regions::notify && offset < (regions::notify + (queues.size() * notify_off_multiplier))) {
+        auto i = (offset - regions::notify) / notify_off_multiplier;
+        if(queues[i].enabled && (status & Status::DriverOk))
+            handle_queue(i);
+    } else if(offset >= regions::common && offset < (regions::common + common::size)) {
+        common_write(offset - regions::common, value, size);
+    } else if(offset >= regions::device && offset < (regions::device + 0x1000)) {
+        device_config_write(offset - regions::device, value, size);
+    } else if(!msix.mmio_write(offset, value, size)) {
+        print("virtio: Unhandled MMIO write {:#x} <- {:#x} ({})\n", offset, value, (uint16_t)size);
+    }
+}
+
+uint64_t Device::mmio_read(uintptr_t addr, uint8_t size) {
+    auto offset = addr - mmio_base;
+
+    uint64_t value = 0;
+    if(offset >= regions::common && offset < (regions::common + common::size)) {
+        return common_read(offset - regions::common, size);
+    } else if(offset == regions::isr) {
+        // Reading the ISR acknowledges the IRQ
+        value = __atomic_exchange_n(&isr, 0, __ATOMIC_SEQ_CST);
+        pci_set_irq_line(false);
+
+        return value;
+    } else if(offset >= regions::device && offset < (regions::device + 0x1000)) {
+        return device_config_read(offset - regions::device, size);
+    } else if(msix.mmio_read(offset, size, value)) {
+        return value;
+    }
+
+    print("virtio: Unhandled MMIO read {:#x} ({})\n", offset, (uint16_t)size);
+    return 0;
+}
+
+void Device::pci_handle_write(uint16_t reg, uint32_t value, uint8_t size) {
+    if(msix.pci_write(reg, value, size))
+        return;
+
+    print("virtio: Unhandled PCI write, reg: {:#x}, value: {:#x}\n", reg, value);
+}
+
+uint32_t Device::pci_handle_read(uint16_t reg, uint8_t size) {
+    switch (size) {
+        case 1: return pci_space->data8[reg];
+        case 2: return pci_space->data16[reg / 2];
+        case 4: return pci_space->data32[reg / 4];
+        default: PANIC("Unknown PCI Access size");
+    }
+}
+
+void Device::pci_update_bars() {
+    if(!(pci_space->header.command & (1 << 1)))
+        return;
+
+    uint64_t base = (pci_space->header.bar[0] & ~0xF) | ((uint64_t)pci_space->header.bar[1] << 32);
+
+    if(mmio_enabled)
+        vm->mmio_map[mmio_base] = {nullptr, 0};
+
+    vm->mmio_map[base] = {this, bar_size};
+    mmio_base = base;
+    mmio_enabled = true;
+}
+
+void Device::snapshot_save(snapshot::Writer& out) {
+    pci_snapshot_save(out);
+    msix.snapshot_save(out);
+
+    out.write(driver_features);
+    out.write(device_feature_select);
+    out.write(driver_feature_select);
+    out.write(queue_select);
+    out.write(config_msix_vector);
+    out.write(status);
+    out.write(config_generation);
+    out.write(isr);
+
+    for(auto& queue : queues) {
+        out.write(queue.size);
+        out.write(queue.msix_vector);
+        out.write(queue.enabled);
+        out.write(queue.desc);
+        out.write(queue.driver);
+        out.write(queue.device);
+        out.write(queue.packed);
+        out.write(queue.event_idx);
+        out.write(queue.indirect);
+        out.write(queue.next_avail);
+        out.write(queue.next_used);
+        out.write(queue.avail_wrap);
+        out.write(queue.used_wrap);
+        out.write(queue.used_since_notify);
+    }
+}
+
+void Device::snapshot_restore(snapshot::Reader& in) {
+    pci_snapshot_restore(in);
+    msix.snapshot_restore(in);
+
+    in.read(driver_features);
+    in.read(device_feature_select);
+    in.read(driver_feature_select);
+    in.read(queue_select);
+    in.read(config_msix_vector);
+    in.read(status);
+    in.read(config_generation);
+    in.read(isr);
+
+    for(auto& queue : queues) {
+        in.read(queue.size);
+        in.read(queue.msix_vector);
+        in.read(queue.enabled);
+        in.read(queue.desc);
+        in.read(queue.driver);
+        in.read(queue.device);
+        in.read(queue.packed);
+        in.read(queue.event_idx);
+        in.read(queue.indirect);
+        in.read(queue.next_avail);
+        in.read(queue.next_used);
+        in.read(queue.avail_wrap);
+        in.read(queue.used_wrap);
+        in.read(queue.used_since_notify);
+    }
+
+    mmio_enabled = false;
+    pci_update_bars();
+
+    if(isr)
+        pci_set_irq_line(true);
+}
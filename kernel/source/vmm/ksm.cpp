@@ -0,0 +1,273 @@
+#include <Luna/vmm/ksm.hpp>
+#include <Luna/vmm/vm.hpp>
+
+#include <Luna/cpu/paging.hpp>
+#include <Luna/cpu/threads.hpp>
+#include <Luna/drivers/timers/timers.hpp>
+#include <Luna/mm/pmm.hpp>
+#include <Luna/misc/log.hpp>
+
+#include <std/unordered_map.hpp>
+#include <std/string.hpp>
+
+struct SharedFrame {
+    uintptr_t hpa;
+    size_t refs;
+};
+
+struct MergeRequest {
+    uintptr_t gpa, old_hpa, new_hpa;
+};
+
+struct MergeBatch {
+    vm::Vm* vm;
+    std::vector<MergeRequest> requests;
+    Promise<void> done;
+};
+
+struct Candidate {
+    MergeBatch* batch;
+    uintptr_t gpa, hpa;
+};
+
+static IrqTicketLock lock{};
+static std::vector<vm::Vm*> vms;
+static std::vector<vm::Vm*> vms_in_pass; // VMs that are being scanned right now, they can't go away until the pass is done
+static std::unordered_map<uint64_t, SharedFrame> stable; // Page hash -> Frame
+static std::unordered_map<uintptr_t, uint64_t> shared_hpas; // Frame -> Page hash
+
+static uintptr_t zero_frame = 0; // Zero pages are so common they get their own frame, it is never freed so it isn't refcounted
+
+static bool is_zero_page(const uint8_t* page) {
+    auto* words = (const uint64_t*)page;
+    for(size_t i = 0; i < pmm::block_size / sizeof(uint64_t); i++)
+        if(words[i])
+            return false;
+
+    return true;
+}
+
+// FNV-1a, only used to find candidates, pages are always compared in full before being merged
+static uint64_t hash_page(const uint8_t* page) {
+    auto* words = (const uint64_t*)page;
+
+    uint64_t hash = 0xCBF2'9CE4'8422'2325;
+    for(size_t i = 0; i < pmm::block_size / sizeof(uint64_t); i++) {
+        hash ^= words[i];
+        hash *= 0x100'0000'01B3;
+    }
+
+    return hash;
+}
+
+static uint8_t* hpa_to_va(uintptr_t hpa) {
+    return (uint8_t*)(hpa + phys_mem_map);
+}
+
+// Runs as an APC on the VCPU thread, so the guest isn't running and the nested paging TLB can be flushed
+static void apply_batch(MergeBatch* batch) {
+    auto& vm = *batch->vm;
+
+    for(const auto& req : batch->requests) {
+        std::lock_guard guard{vm.memslot_lock};
+
+        // The page might have been remapped or written to since it was scanned, or a host side user might still be using old_hpa
+        if(vm.ram_pins || vm.mm->get_phys(req.gpa) != req.old_hpa || memcmp(hpa_to_va(req.old_hpa), hpa_to_va(req.new_hpa), pmm::block_size) != 0) {
+            vm::ksm::put(req.new_hpa);
+            continue;
+        }
+
+        vm.mm->map(req.new_hpa, req.gpa, paging::mapPagePresent | paging::mapPageExecute);
+        pmm::free_block(req.old_hpa);
+    }
+
+    batch->done.complete();
+}
+
+static void scan_vm(vm::Vm& vm, MergeBatch* batch, std::unordered_map<uint64_t, Candidate>& unstable) {
+    for(const auto& slot : vm.memslots) {
+        if(!(slot.flags & vm::MemslotFlags::Mergeable))
+            continue;
+
+        for(auto gpa = slot.base; gpa < (slot.base + slot.size); gpa += pmm::block_size) {
+            uintptr_t hpa = 0;
+            {
+                std::lock_guard guard{vm.memslot_lock};
+                hpa = vm.mm->get_phys(gpa);
+            }
+
+            if(!hpa || vm::ksm::is_shared(hpa))
+                continue;
+
+            auto* page = hpa_to_va(hpa);
+            if(is_zero_page(page)) {
+                batch->requests.push_back({.gpa = gpa, .old_hpa = hpa, .new_hpa = zero_frame});
+                continue;
+            }
+
+            auto hash = hash_page(page);
+
+            std::lock_guard guard{lock};
+            if(stable.contains(hash)) {
+                auto& frame = stable[hash];
+                if(memcmp(page, hpa_to_va(frame.hpa), pmm::block_size) == 0) {
+                    frame.refs++; // Take the reference now, so the frame can't disappear before the batch is applied
+                    batch->requests.push_back({.gpa = gpa, .old_hpa = hpa, .new_hpa = frame.hpa});
+                }
+
+                continue;
+            }
+
+            if(auto it = unstable.find(hash); it != unstable.end()) {
+                auto other = it->second;
+                if(other.hpa != hpa && memcmp(page, hpa_to_va(other.hpa), pmm::block_size) == 0) {
+                    auto frame = pmm::alloc_block();
+                    if(!frame)
+                        return;
+
+                    memcpy(hpa_to_va(frame), page, pmm::block_size);
+
+                    stable[hash] = {.hpa = frame, .refs = 2};
+                    shared_hpas[frame] = hash;
+
+                    other.batch->requests.push_back({.gpa = other.gpa, .old_hpa = other.hpa, .new_hpa = frame});
+                    batch->requests.push_back({.gpa = gpa, .old_hpa = hpa, .new_hpa = frame});
+
+                    unstable.erase(hash);
+                }
+
+                continue;
+            }
+
+            unstable[hash] = {.batch = batch, .gpa = gpa, .hpa = hpa};
+        }
+    }
+}
+
+static void scan_pass() {
+    std::vector<MergeBatch*> batches{};
+    {
+        std::lock_guard guard{lock};
+        for(auto* vm : vms) {
+            // TODO: Merging needs all VCPUs to be stopped, and the TLB flushed on all of them
+            if(vm->cpus.size() != 1)
+                continue;
+
+            auto* batch = new MergeBatch{};
+            batch->vm = vm;
+            batches.push_back(batch);
+
+            vms_in_pass.push_back(vm);
+        }
+    }
+
+    // Pages that have only been seen once, they're only merged once a second identical page turns up
+    // Rebuilt every pass, since unmerged pages can be changed by the guest at any time
+    std::unordered_map<uint64_t, Candidate> unstable{};
+    for(auto* batch : batches)
+        scan_vm(*batch->vm, batch, unstable);
+
+    size_t n_merged = 0;
+    for(auto* batch : batches) {
+        if(batch->requests.size() == 0)
+            continue;
+
+        auto* thread = batch->vm->cpus[0].thread;
+        thread->queue_apc([](void* batch) { apply_batch((MergeBatch*)batch); }, batch);
+        thread->invoke_apcs();
+    }
+
+    for(auto* batch : batches) {
+        if(batch->requests.size() > 0)
+            batch->done.await();
+
+        n_merged += batch->requests.size();
+        delete batch;
+    }
+
+    {
+        std::lock_guard guard{lock};
+        vms_in_pass.clear();
+    }
+
+    if(n_merged)
+        print("vm::ksm: Merged {} pages\n", n_merged);
+}
+
+void vm::ksm::register_vm(Vm* vm) {
+    bool start_scanner = false;
+    {
+        std::lock_guard guard{lock};
+
+        if(!zero_frame) {
+            zero_frame = pmm::alloc_block();
+            ASSERT(zero_frame);
+
+            memset(hpa_to_va(zero_frame), 0, pmm::block_size);
+            start_scanner = true;
+        }
+
+        vms.push_back(vm);
+    }
+
+    if(start_scanner) {
+        spawn([] {
+            Promise<void> promise{};
+
+            timer::Timer timer{TimePoint::from_ms(scan_interval_ms), true, [](void* promise) {
+                ((Promise<void>*)promise)->complete();
+            }, &promise};
+
+            timer.start();
+
+            while(1) {
+                promise.await();
+                promise.reset();
+
+                scan_pass();
+            }
+        });
+    }
+}
+
+void vm::ksm::unregister_vm(Vm* vm) {
+    while(true) {
+        {
+            std::lock_guard guard{lock};
+
+            if(auto it = vms.find(vm); it != vms.end())
+                vms.erase(it);
+
+            if(vms_in_pass.find(vm) == vms_in_pass.end())
+                return;
+        }
+
+        // The scanner might be waiting for this thread to apply a batch, which happens as an APC once we're scheduled in again
+        asm volatile("int %0" : : "i"(threading::quantum_irq_vector) : "memory"); // Yield
+    }
+}
+
+bool vm::ksm::is_shared(uintptr_t hpa) {
+    std::lock_guard guard{lock};
+
+    return (zero_frame && hpa == zero_frame) || shared_hpas.contains(hpa);
+}
+
+void vm::ksm::put(uintptr_t hpa) {
+    std::lock_guard guard{lock};
+
+    if(hpa == zero_frame)
+        return;
+
+    ASSERT(shared_hpas.contains(hpa));
+    auto hash = shared_hpas[hpa];
+
+    auto& frame = stable[hash];
+    ASSERT(frame.refs > 0);
+    if(--frame.refs == 0) {
+        pmm::free_block(hpa);
+
+        stable.erase(hash);
+        shared_hpas.erase(hpa);
+    }
+}
@@ -0,0 +1,875 @@
+#include <Luna/vmm/manager.hpp>
+#include <Luna/vmm/vm.hpp>
+#include <Luna/vmm/snapshot.hpp>
+#include <Luna/vmm/ksm.hpp>
+#include <Luna/vmm/profiler.hpp>
+#include <Luna/vmm/bzimage.hpp>
+#include <Luna/vmm/overlay.hpp>
+
+#include <Luna/cpu/paging.hpp>
+#include <Luna/cpu/threads.hpp>
+#include <Luna/drivers/timers/timers.hpp>
+#include <Luna/mm/pmm.hpp>
+#include <Luna/fs/vfs.hpp>
+#include <Luna/misc/log.hpp>
+
+#include <Luna/vmm/drivers/e9.hpp>
+#include <Luna/vmm/drivers/uart.hpp>
+#include <Luna/vmm/drivers/nvme.hpp>
+#include <Luna/vmm/drivers/hpet.hpp>
+#include <Luna/vmm/drivers/cmos.hpp>
+#include <Luna/vmm/drivers/ps2.hpp>
+#include <Luna/vmm/drivers/fast_a20.hpp>
+#include <Luna/vmm/drivers/pit.hpp>
+#include <Luna/vmm/drivers/io_delay.hpp>
+#include <Luna/vmm/drivers/fw_cfg.hpp>
+#include <Luna/vmm/drivers/pci/pci.hpp>
+#include <Luna/vmm/drivers/pci/pio_access.hpp>
+#include <Luna/vmm/drivers/pci/ecam.hpp>
+#include <Luna/vmm/drivers/pci/hotplug.hpp>
+#include <Luna/vmm/drivers/passthrough.hpp>
+
+#include <Luna/vmm/drivers/virtio/blk.hpp>
+#include <Luna/vmm/drivers/virtio/console.hpp>
+#include <Luna/vmm/drivers/virtio/net.hpp>
+
+#include <Luna/vmm/drivers/q35/dram.hpp>
+#include <Luna/vmm/drivers/q35/lpc.hpp>
+#include <Luna/vmm/drivers/q35/acpi.hpp>
+#include <Luna/vmm/drivers/q35/smi.hpp>
+
+#include <Luna/vmm/drivers/irqs/pic.hpp>
+#include <Luna/vmm/drivers/irqs/lapic.hpp>
+#include <Luna/vmm/drivers/irqs/ioapic.hpp>
+
+#include <Luna/vmm/drivers/gpu/bga.hpp>
+#include <Luna/vmm/drivers/gpu/vga.hpp>
+
+#include <Luna/gui/gui.hpp>
+#include <Luna/gui/windows/log_window.hpp>
+
+#include <std/unordered_map.hpp>
+#include <std/string.hpp>
+
+using namespace vm::manager;
+
+struct VmInstance {
+    size_t id;
+    VmConfig config;
+
+    VmState state = VmState::Starting;
+    bool destroy_pending = false; // destroy() was called while it was still Starting, vm_thread doesn't run it once build_vm() is done
+    uint32_t host_cpu;
+
+    vm::Vm* vm = nullptr;
+    threading::Thread* thread = nullptr;
+
+    vm::pit::Driver* pit = nullptr; // The PIT queues APCs on the VCPU thread from a host timer, so it has to be stopped before that thread exits
+    vm::virtio::net::Driver* nic = nullptr; // Other VMs and the host NIC write into guest RAM through it, so it has to leave its switch before RAM is freed
+    vm::nvme::Driver* nvme = nullptr; // Its I/O thread DMAs into guest RAM, so it has to be stopped before RAM is freed
+    std::vector<vm::passthrough::Driver*> passthrough; // Real hardware DMAs into guest RAM, so it has to be stopped before RAM is freed
+    vm::gpu::vga::Driver* vga = nullptr; // Owns VRAM outside of the memslots, which can be mapped over SMRAM in the legacy window
+    vm::q35::dram::Driver* dram = nullptr;
+    vm::virtio::console::Driver* console = nullptr;
+    uint32_t log_port = 0;
+    Promise<void> stopped;
+
+    uint64_t guest_time_at_rebalance = 0;
+};
+
+static IrqTicketLock lock{};
+static std::vector<uint32_t> host_cpus;
+static std::unordered_map<uint32_t, size_t> cpu_load; // LAPIC ID -> Number of VCPUs placed on it
+static std::vector<VmInstance*> instances;
+
+static const char* state_to_string(VmState state) {
+    switch (state) {
+        case VmState::Starting: return "Starting";
+        case VmState::Running: return "Running";
+        case VmState::Stopped: return "Stopped";
+        default: return "Unknown";
+    }
+}
+
+static uint32_t place_vcpus(size_t n) {
+    std::lock_guard guard{lock};
+    ASSERT(host_cpus.size() > 0);
+
+    // Pick the least loaded CPU
+    uint32_t best = host_cpus[0];
+    for(auto id : host_cpus)
+        if(cpu_load[id] < cpu_load[best])
+            best = id;
+
+    cpu_load[best] += n;
+    return best;
+}
+
+static uint64_t guest_time_ns(const VmInstance& instance) {
+    uint64_t ns = 0;
+    for(const auto& vcpu : instance.vm->cpus)
+        ns += vcpu.get_guest_clock_ns();
+
+    return ns;
+}
+
+// Has to be called with the lock held
+static void migrate_instance(VmInstance& instance, uint32_t lapic_id) {
+    cpu_load[instance.host_cpu] -= instance.config.n_cpus;
+    cpu_load[lapic_id] += instance.config.n_cpus;
+    instance.host_cpu = lapic_id;
+
+    for(auto& vcpu : instance.vm->cpus)
+        vcpu.migrate(lapic_id);
+}
+
+static void rebalance() {
+    std::lock_guard guard{lock};
+    if(host_cpus.size() < 2)
+        return;
+
+    std::unordered_map<uint32_t, uint64_t> busy_ns{}; // LAPIC ID -> Guest time since last rebalance
+    std::unordered_map<uint32_t, size_t> n_running{};
+    std::unordered_map<size_t, uint64_t> delta_ns{}; // Instance ID -> Guest time since last rebalance
+    for(auto id : host_cpus) {
+        busy_ns[id] = 0;
+        n_running[id] = 0;
+    }
+
+    for(auto* instance : instances) {
+        if(instance->state != VmState::Running)
+            continue;
+
+        auto now = guest_time_ns(*instance);
+        auto delta = now - instance->guest_time_at_rebalance;
+        instance->guest_time_at_rebalance = now;
+
+        delta_ns[instance->id] = delta;
+        busy_ns[instance->host_cpu] += delta;
+        n_running[instance->host_cpu]++;
+    }
+
+    uint32_t busiest = host_cpus[0], idlest = host_cpus[0];
+    for(auto id : host_cpus) {
+        if(busy_ns[id] > busy_ns[busiest])
+            busiest = id;
+        if(busy_ns[id] < busy_ns[idlest])
+            idlest = id;
+    }
+
+    // Moving the only VM off a CPU just shifts the load around
+    auto gap = busy_ns[busiest] - busy_ns[idlest];
+    if(n_running[busiest] < 2 || gap < (rebalance_interval_ms * 1'000'000 * rebalance_threshold_percent / 100))
+        return;
+
+    // Pick the VM that makes the busiest and idlest CPU closest to even
+    VmInstance* best = nullptr;
+    uint64_t best_gap = gap;
+    for(auto* instance : instances) {
+        if(instance->state != VmState::Running || instance->host_cpu != busiest)
+            continue;
+
+        auto delta = delta_ns[instance->id];
+        auto new_busiest = busy_ns[busiest] - delta, new_idlest = busy_ns[idlest] + delta;
+        auto new_gap = (new_busiest > new_idlest) ? (new_busiest - new_idlest) : (new_idlest - new_busiest);
+        if(new_gap < best_gap) {
+            best = instance;
+            best_gap = new_gap;
+        }
+    }
+
+    if(!best)
+        return;
+
+    print("vm::manager: Moving {:s} from CPU {} to CPU {}\n", best->config.name, busiest, idlest);
+    migrate_instance(*best, idlest);
+}
+
+// Returns false if the VM can't be built because of its config, e.g. a disk image that doesn't exist
+static bool build_vm(VmInstance& instance) {
+    auto& vm = *instance.vm;
+    const auto& config = instance.config;
+
+    constexpr uintptr_t himem_start = 0x10'0000;
+    size_t himem_size = config.ram_size;
+    if((himem_size % pmm::block_size) != 0) {
+        print("vm::manager: RAM size {:#x} isn't page aligned\n", himem_size);
+        return false;
+    }
+
+    // Assigned devices DMA into guest RAM through the IOMMU, so it can't be merged or moved around after they're attached
+    bool has_passthrough = false;
+    for(const auto& dev : config.passthrough)
+        has_passthrough |= dev.enabled;
+
+    if(has_passthrough && config.snapshot) {
+        print("vm::manager: Snapshots can't be used together with passthrough devices\n");
+        return false;
+    }
+
+    // If there is a valid snapshot we can skip booting the firmware and guest entirely
+    auto* snapshot_file = config.snapshot ? vfs::get_vfs().open(config.snapshot) : nullptr;
+    bool restore_snapshot = snapshot_file && vm::snapshot::is_valid(snapshot_file);
+
+    // Everything after this point keeps the snapshot file open for the hypercall or lazy restore, so it has to be closed on failure
+    auto fail = [&]() {
+        if(snapshot_file)
+            snapshot_file->close();
+        return false;
+    };
+
+    uint8_t mergeable = has_passthrough ? 0 : vm::MemslotFlags::Mergeable;
+
+    // Without firmware the ISA BIOS window is just zero filled RAM, Linux scans it for tables, so it has to exist
+    bool direct_boot = config.kernel && !config.linuxboot_rom;
+    {
+        auto* file = direct_boot ? nullptr : vfs::get_vfs().open(config.bios);
+        if(!direct_boot && !file) {
+            print("vm::manager: Couldn't open BIOS {:s}\n", config.bios);
+            return fail();
+        }
+
+        size_t bios_size = file ? file->get_size() : 0;
+        if((bios_size % 0x1000) != 0) {
+            print("vm::manager: BIOS {:s} isn't a multiple of 4KiB\n", config.bios);
+            file->close();
+            return fail();
+        }
+
+        
+        auto isa_bios_size = file ? min(bios_size, 128 * 1024) : (128 * 1024);
+        auto isa_bios_start = himem_start - isa_bios_size;
+        size_t isa_curr = 0;
+
+
+        uintptr_t map = 0x1'0000'0000 - bios_size;
+        for(size_t curr = 0; curr < bios_size; curr += 0x1000) {
+            auto block = pmm::alloc_block();
+            ASSERT(block);
+
+            auto* va = (uint8_t*)(block + phys_mem_map);
+            if(file->read(curr, 0x1000, va) != 0x1000) {
+                print("vm::manager: Couldn't read BIOS {:s}\n", config.bios);
+                pmm::free_block(block);
+
+                // There are no memslots yet, so teardown wouldn't find these, the ISA window aliases are the same pages
+                for(size_t i = 0; i < curr; i += 0x1000) {
+                    if((bios_size - i) <= isa_bios_size)
+                        vm.mm->unmap(isa_bios_start + (isa_bios_size - (bios_size - i)));
+
+                    pmm::free_block(vm.mm->unmap(map + i));
+                }
+
+                file->close();
+                return fail();
+            }
+
+            if((bios_size - curr) <= isa_bios_size) {
+                vm.mm->map(block, isa_bios_start + isa_curr, paging::mapPagePresent | paging::mapPageExecute);
+                isa_curr += 0x1000;
+            }
+
+            vm.mm->map(block, map + curr, paging::mapPagePresent | paging::mapPageExecute);
+        }
+
+        // Setup lowmem, this can't be lazily allocated since the chipset changes the SMRAM and PAM permissions of these pages
+        for(size_t i = 0; i < isa_bios_start; i += 0x1000) {
+            auto block = pmm::alloc_block();
+            ASSERT(block);
+
+            auto* va = (uint8_t*)(block + phys_mem_map);
+            memset(va, 0, pmm::block_size);
+
+            vm.mm->map(block, i, paging::mapPagePresent | paging::mapPageWrite | paging::mapPageExecute);
+        }
+
+        vm.add_memslot(0, isa_bios_start);
+        vm.add_memslot(isa_bios_start, isa_bios_size); // Shadow RAM, the firmware copies itself into here
+        vm.add_memslot(himem_start, himem_size, mergeable); // Allocated on first access by the guest, or up front by vm::passthrough
+        if(config.track_dirty)
+            vm.set_dirty_log(himem_start, true);
+
+        // The top of the BIOS is aliased with the ISA window, so can't be merged without also remapping it there
+        if(bios_size > isa_bios_size)
+            vm.add_memslot(map, bios_size - isa_bios_size, mergeable | vm::MemslotFlags::ReadOnly);
+
+        if(file)
+            file->close();
+    }
+
+    auto* cmos_dev = new vm::cmos::Driver{&vm};
+
+    {
+        auto size = himem_start + himem_size - (16 * 1024 * 1024); // TODO: Investigate this, seems to be what Seabios does
+        cmos_dev->write(vm::cmos::cmos_extmem2_low, (size >> 16) & 0xFF);
+        cmos_dev->write(vm::cmos::cmos_extmem2_high, (size >> 24) & 0xFF);
+
+
+        /*
+            Boot Priority Numbers
+                1: Floppy
+                2: Harddisk
+                3: CD-Rom
+                4: BEV???
+
+            1st priority is Bootflag2 bits 0:3
+            2nd priority is Bootflag2 bits 4:7
+            3rd priority is Bootflag1 bits 4:7
+
+            We do HDD -> CD -> Floppy
+        */
+        cmos_dev->write(vm::cmos::cmos_bootflag1, (1 << 4) | 0); // Bit0 = Disable Floppy MBR Sig Check
+        cmos_dev->write(vm::cmos::cmos_bootflag2, (3 << 4) | (2 << 0));
+
+        cmos_dev->write(vm::cmos::cmos_ap_count, 0); // Currently we only support the BSP, no APs
+
+
+        cmos_dev->write(vm::cmos::rtc_day, 28); // TODO: Don't hardcode this
+        cmos_dev->write(vm::cmos::rtc_month, 2);
+        cmos_dev->write(vm::cmos::rtc_year, 21);
+        cmos_dev->write(vm::cmos::rtc_century, 20);
+    }
+    
+    auto* pci_host_bridge = new vm::pci::HostBridge{};
+
+
+    auto* a20_dev = new vm::fast_a20::Driver{&vm};
+    (void)a20_dev;
+
+    auto* io_delay_dev = new vm::io_delay::Driver{&vm};
+    (void)io_delay_dev;
+
+    auto* log_window = new gui::LogWindow{{60, 40}, config.name};
+    gui::get_desktop().add_window(log_window);
+
+    auto* uart_dev = new vm::uart::Driver{&vm, 0x3F8, log_window};
+    (void)uart_dev;
+
+    auto* e9_dev = new vm::e9::Driver{&vm, log_window};
+    (void)e9_dev;
+
+    if(config.virtio_console) {
+        auto* console = new vm::virtio::console::Driver{&vm, pci_host_bridge, 9, 0, log_window, 2};
+        auto log_port = console->add_port("org.luna.log", vm::manager::log_ring_size);
+
+        std::lock_guard guard{lock};
+        instance.console = console;
+        instance.log_port = log_port;
+    }
+
+    auto* ps2_dev = new vm::ps2::Driver{&vm};
+    (void)ps2_dev;
+
+    auto* hpet_dev = new vm::hpet::Driver{&vm};
+    (void)hpet_dev;
+
+    instance.pit = new vm::pit::Driver{&vm};
+
+    if(config.disk_image) {
+        auto* overlay = config.disk_overlay ? vfs::get_vfs().open(config.disk_overlay) : nullptr;
+        if(config.disk_overlay && !overlay)
+            print("vm::manager: Couldn't open overlay {:s}, writes will go to the base image\n", config.disk_overlay);
+
+        vfs::File* file = nullptr;
+        if(overlay) {
+            // An overlay that hasn't been formatted yet starts out empty on top of the base image
+            if(!vm::overlay::is_valid(overlay)) {
+                auto* base = vm::overlay::open(config.disk_image);
+                if(!base || !vm::overlay::create(overlay, config.disk_image, base->get_size())) {
+                    print("vm::manager: Couldn't format overlay {:s} on top of {:s}\n", config.disk_overlay, config.disk_image);
+                    if(base)
+                        base->close();
+                    overlay->close();
+                    return fail();
+                }
+
+                base->close();
+            }
+
+            file = vm::overlay::Image::open(overlay);
+        } else {
+            file = vm::overlay::open(config.disk_image);
+        }
+
+        if(!file) {
+            print("vm::manager: Couldn't open disk image {:s}\n", config.disk_image);
+            return fail();
+        }
+
+        std::vector<vfs::File*> namespaces{};
+        namespaces.push_back(file);
+        for(auto* path : config.extra_disk_images) {
+            if(!path)
+                continue;
+
+            auto* extra = vm::overlay::open(path);
+            if(!extra) {
+                print("vm::manager: Couldn't open disk image {:s}\n", path);
+
+                for(auto* ns : namespaces)
+                    ns->close();
+                return fail();
+            }
+
+            namespaces.push_back(extra);
+        }
+
+        // One queue pair per VCPU by default, so guests never have to share one between CPUs
+        uint16_t n_queues = config.nvme_queues ? config.nvme_queues : config.n_cpus;
+        n_queues = min(n_queues, vm::nvme::max_io_queues);
+
+        instance.nvme = new vm::nvme::Driver{&vm, pci_host_bridge, 6, 0, namespaces, n_queues};
+    }
+
+    if(config.virtio_disk_image) {
+        auto* file = vm::overlay::open(config.virtio_disk_image);
+        if(!file) {
+            print("vm::manager: Couldn't open disk image {:s}\n", config.virtio_disk_image);
+            return fail();
+        }
+
+        auto* blk_dev = new vm::virtio::blk::Driver{&vm, pci_host_bridge, 7, 0, file};
+        (void)blk_dev;
+    }
+
+    if(config.net != vm::manager::NetBackend::None) {
+        net::Mac mac = {0x52, 0x54, 0x00, 0x4C, 0x55, (uint8_t)instance.id}; // Locally administered, unique per VM
+        auto& sw = (config.net == vm::manager::NetBackend::Host) ? vm::netswitch::get_host() : vm::netswitch::get_loopback();
+
+        instance.nic = new vm::virtio::net::Driver{&vm, pci_host_bridge, 8, 0, mac, sw};
+    }
+
+    {
+        uint8_t slot = 10;
+        for(const auto& dev : config.passthrough) {
+            if(!dev.enabled)
+                continue;
+
+            auto* device = pci::device_by_location(dev.seg, dev.bus, dev.slot, dev.func);
+            if(!device) {
+                print("vm::manager: Host PCI device {}:{}:{}.{} doesn't exist\n", dev.seg, dev.bus, dev.slot, dev.func);
+                continue;
+            }
+
+            if(!vm::passthrough::can_attach(*device))
+                continue;
+
+            instance.passthrough.push_back(new vm::passthrough::Driver{&vm, pci_host_bridge, slot++, 0, *device});
+        }
+    }
+
+    if(config.display) {
+        auto* vgabios = vfs::get_vfs().open(config.vgabios);
+        if(!vgabios) {
+            print("vm::manager: Couldn't open VGA BIOS {:s}\n", config.vgabios);
+            return fail();
+        }
+
+        {
+            uint8_t signature[2] = {};
+            if(vgabios->read(0, 2, signature) != 2 || signature[0] != 0x55 || signature[1] != 0xAA) {
+                print("vm::manager: VGA BIOS {:s} doesn't have an option ROM signature\n", config.vgabios);
+                vgabios->close();
+                return fail();
+            }
+        }
+
+        auto* bga_dev = new vm::gpu::bga::Driver{&vm, pci_host_bridge, vgabios, 2, ps2_dev};
+        (void)bga_dev;
+    }
+
+    auto* vga_dev = new vm::gpu::vga::Driver{&vm};
+    instance.vga = vga_dev;
+
+    if(!direct_boot) {
+        auto* fw_cfg_dev = new vm::fw_cfg::Driver{&vm};
+
+        fw_cfg_dev->add<uint64_t>(vm::fw_cfg::Key::RamSize, himem_start + himem_size);
+        fw_cfg_dev->add<uint16_t>(vm::fw_cfg::Key::NbCpus, config.n_cpus);
+        fw_cfg_dev->add<uint16_t>(vm::fw_cfg::Key::MaxCpus, config.n_cpus);
+        fw_cfg_dev->add<uint16_t>(vm::fw_cfg::Key::NoGraphic, !config.display);
+        fw_cfg_dev->add<uint16_t>(vm::fw_cfg::Key::BootMenu, 0);
+
+        // Same as QEMU, the firmware reserves the holes below 1MiB itself
+        const vm::bzimage::E820Entry e820[] = {{.addr = 0, .size = himem_start + himem_size, .type = vm::bzimage::E820Type::Ram}};
+        fw_cfg_dev->add_file("etc/e820", e820, sizeof(e820));
+
+        if(config.boot_order)
+            fw_cfg_dev->add_file("bootorder", config.boot_order, strlen(config.boot_order));
+
+        if(config.kernel) {
+            auto* kernel = vfs::get_vfs().open(config.kernel);
+            auto* initrd = config.initrd ? vfs::get_vfs().open(config.initrd) : nullptr;
+            if(!kernel || (config.initrd && !initrd)) {
+                print("vm::manager: Couldn't open {:s}\n", !kernel ? config.kernel : config.initrd);
+                if(kernel)
+                    kernel->close();
+                if(initrd)
+                    initrd->close();
+                return fail();
+            }
+
+            if(!fw_cfg_dev->add_kernel(kernel, initrd, config.cmdline, himem_start + himem_size)) {
+                print("vm::manager: Failed to load kernel {:s}\n", config.kernel);
+                kernel->close();
+                if(initrd)
+                    initrd->close();
+                return fail();
+            }
+
+            auto* rom = vfs::get_vfs().open(config.linuxboot_rom);
+            if(!rom) {
+                print("vm::manager: Couldn't open option ROM {:s}\n", config.linuxboot_rom);
+                return fail();
+            }
+
+            fw_cfg_dev->add_file("genroms/linuxboot_dma.bin", rom, 0, rom->get_size());
+        }
+    }
+
+    auto* pci_hotplug = new vm::pci::hotplug::Driver{&vm};
+    (void)pci_hotplug;
+
+    auto* pci_pio_access = new vm::pci::pio_access::Driver{&vm, vm::pci::pio_access::default_base, 0, pci_host_bridge};
+    (void)pci_pio_access;
+
+    auto* pci_mmio_access = new vm::pci::ecam::Driver{&vm, pci_host_bridge, 0};
+    (void)pci_mmio_access;
+
+    auto* dram_dev = new vm::q35::dram::Driver{&vm, pci_host_bridge, pci_mmio_access, vga_dev};
+    instance.dram = dram_dev;
+
+    vm.cpus[0].set(vm::VmCap::SMMEntryCallback, [](vm::VCPU*, void* dram) { ((vm::q35::dram::Driver*)dram)->smm_enter(); }, dram_dev);
+    vm.cpus[0].set(vm::VmCap::SMMLeaveCallback, [](vm::VCPU*, void* dram) { ((vm::q35::dram::Driver*)dram)->smm_leave(); }, dram_dev);
+
+    auto* smi_dev = new vm::q35::smi::Driver{&vm};
+
+    auto* acpi_dev = new vm::q35::acpi::Driver{&vm, smi_dev};
+
+    auto* lpc_dev = new vm::q35::lpc::Driver{&vm, pci_host_bridge, acpi_dev};
+    (void)lpc_dev;
+
+    auto* pic_dev = new vm::irqs::pic::Driver{&vm};
+    vm.irq_listeners.push_back(pic_dev);
+
+    auto* ioapic_dev = new vm::irqs::ioapic::Driver{&vm, 1, 0xFEC0'0000};
+    (void)ioapic_dev;
+
+    if(snapshot_file) {
+        // Guest can request a snapshot to be taken, e.g. once it has finished booting
+        vm.cpus[0].set(vm::VmCap::HypercallCallback, [](vm::VCPU* vcpu, void* file) {
+            vm::RegisterState regs{};
+            vcpu->get_regs(regs, vm::VmRegs::General);
+
+            if(regs.rax == vm::snapshot::hypercall_save) {
+                // Set the return value before saving, so the restored guest also sees the call succeeding
+                regs.rax = 0;
+                vcpu->set_regs(regs, vm::VmRegs::General);
+
+                if(!vm::snapshot::save(*vcpu->vm, (vfs::File*)file)) {
+                    regs.rax = 1;
+                    vcpu->set_regs(regs, vm::VmRegs::General);
+                }
+
+                ((vfs::File*)file)->close(); // Flush to disk
+            }
+        }, snapshot_file);
+    }
+
+    if(restore_snapshot) {
+        if(!vm::snapshot::restore(vm, snapshot_file)) {
+            print("vm::manager: Failed to restore snapshot {:s}\n", config.snapshot);
+            return fail();
+        }
+
+        print("vm: Restored from snapshot\n");
+    } else if(direct_boot) {
+        // Lowmem up to the VGA window and himem are RAM, the EBDA and BIOS area are reserved like they would be on real hardware
+        std::vector<vm::bzimage::E820Entry> memory_map{};
+        memory_map.push_back({.addr = 0, .size = 0x9'FC00, .type = vm::bzimage::E820Type::Ram});
+        memory_map.push_back({.addr = 0x9'FC00, .size = 0x400, .type = vm::bzimage::E820Type::Reserved});
+        memory_map.push_back({.addr = 0xF'0000, .size = 0x1'0000, .type = vm::bzimage::E820Type::Reserved});
+        memory_map.push_back({.addr = himem_start, .size = himem_size, .type = vm::bzimage::E820Type::Ram});
+
+        auto* kernel = vfs::get_vfs().open(config.kernel);
+        auto* initrd = config.initrd ? vfs::get_vfs().open(config.initrd) : nullptr;
+
+        bool booted = false;
+        if(!kernel || (config.initrd && !initrd))
+            print("vm::manager: Couldn't open {:s}\n", !kernel ? config.kernel : config.initrd);
+        else if(!(booted = vm::bzimage::boot(vm, kernel, initrd, config.cmdline, memory_map)))
+            print("vm::manager: Failed to load kernel {:s}\n", config.kernel);
+
+        if(kernel)
+            kernel->close();
+        if(initrd)
+            initrd->close();
+
+        if(!booted)
+            return fail();
+    }
+
+    vm::ksm::register_vm(&vm);
+
+    if(config.profile)
+        vm::profiler::start(&vm, config.name, config.profile_symbols);
+
+    return true;
+}
+
+static void teardown(VmInstance& instance) {
+    auto& vm = *instance.vm;
+
+    vm::ksm::unregister_vm(&vm);
+
+    if(instance.config.profile) {
+        vm::profiler::export_folded(&vm, instance.config.profile);
+        vm::profiler::stop(&vm);
+    }
+
+    delete instance.pit;
+    instance.pit = nullptr;
+
+    delete instance.nic;
+    instance.nic = nullptr;
+
+    delete instance.nvme;
+    instance.nvme = nullptr;
+
+    for(auto* dev : instance.passthrough)
+        delete dev;
+    instance.passthrough.clear();
+
+    // The legacy window in memslot 0 might have VRAM mapped over SMRAM, put SMRAM back so the loop below frees it, and free VRAM on its own
+    if(instance.dram)
+        instance.dram->reclaim_window();
+
+    if(instance.vga)
+        instance.vga->free_vram();
+
+    // Give back all guest RAM, the device models and nested paging structures are kept around since they can't be torn down yet
+    size_t n_freed = 0;
+    for(const auto& slot : vm.memslots) {
+        for(auto gpa = slot.base; gpa < (slot.base + slot.size); gpa += pmm::block_size) {
+            std::lock_guard guard{vm.memslot_lock};
+
+            auto hpa = vm.mm->unmap(gpa);
+            if(!hpa)
+                continue;
+
+            if(vm::ksm::is_shared(hpa))
+                vm::ksm::put(hpa);
+            else
+                pmm::free_block(hpa);
+            n_freed++;
+        }
+    }
+
+    print("vm::manager: Stopped {:s}, freed {} KiB of guest RAM\n", instance.config.name, n_freed * (pmm::block_size / 1024));
+
+    std::lock_guard guard{lock};
+    instance.state = VmState::Stopped;
+    cpu_load[instance.host_cpu] -= instance.config.n_cpus;
+}
+
+static void vm_thread(VmInstance* instance) {
+    // The VMCS contains host state of the CPU it was created on, it is only moved together with the VCPU, see VCPU::migrate()
+    this_thread()->pin_to_cpu(instance->host_cpu);
+
+    instance->vm = new vm::Vm{instance->config.n_cpus, this_thread()};
+
+    if(build_vm(*instance)) {
+        bool destroyed = false;
+        {
+            std::lock_guard guard{lock};
+            destroyed = instance->destroy_pending;
+            if(!destroyed)
+                instance->state = VmState::Running;
+        }
+
+        if(destroyed) {
+            print("vm::manager: {:s} was destroyed before it started\n", instance->config.name);
+        } else {
+            print("vm::manager: Started {:s} on CPU {}\n", instance->config.name, instance->host_cpu);
+
+            if(!instance->vm->cpus[0].run())
+                print("vm::manager: {:s} stopped due to an error\n", instance->config.name);
+        }
+    } else {
+        print("vm::manager: Failed to create {:s}\n", instance->config.name);
+    }
+
+    teardown(*instance);
+    instance->stopped.complete();
+
+    kill_self();
+}
+
+void vm::manager::add_host_cpu(uint32_t lapic_id) {
+    std::lock_guard guard{lock};
+
+    host_cpus.push_back(lapic_id);
+    cpu_load[lapic_id] = 0;
+}
+
+size_t vm::manager::create(const VmConfig& config) {
+    if(config.n_cpus != 1) { // TODO: Guests can't start APs yet, INIT/SIPI isn't emulated
+        print("vm::manager: {:s}: {} VCPUs requested, only 1 is supported\n", config.name, config.n_cpus);
+        return invalid_id;
+    }
+
+    auto* instance = new VmInstance{};
+    instance->config = config;
+    instance->host_cpu = place_vcpus(config.n_cpus);
+
+    bool start_rebalancer = false;
+    {
+        std::lock_guard guard{lock};
+
+        instance->id = instances.size();
+        instances.push_back(instance);
+
+        start_rebalancer = (instance->id == 0);
+    }
+
+    if(start_rebalancer) {
+        spawn([] {
+            Promise<void> promise{};
+
+            timer::Timer timer{TimePoint::from_ms(rebalance_interval_ms), true, [](void* promise) {
+                ((Promise<void>*)promise)->complete();
+            }, &promise};
+
+            timer.start();
+
+            while(1) {
+                promise.await();
+                promise.reset();
+
+                rebalance();
+            }
+        });
+    }
+
+    instance->thread = spawn([instance] { vm_thread(instance); });
+
+    return instance->id;
+}
+
+void vm::manager::destroy(size_t id) {
+    VmInstance* instance = nullptr;
+    {
+        std::lock_guard guard{lock};
+        ASSERT(id < instances.size());
+
+        instance = instances[id];
+        if(instance->state == VmState::Stopped)
+            return;
+
+        if(instance->state == VmState::Starting) {
+            // The VM might not even exist yet, so let vm_thread stop it once build_vm() is done
+            instance->destroy_pending = true;
+        } else {
+            // Kick the VCPUs out of the guest, they'll notice should_exit before reentering
+            for(auto& vcpu : instance->vm->cpus) {
+                vcpu.exit();
+                vcpu.thread->invoke_apcs();
+            }
+        }
+    }
+
+    instance->stopped.await();
+}
+
+bool vm::manager::migrate(size_t id, uint32_t lapic_id) {
+    std::lock_guard guard{lock};
+    ASSERT(id < instances.size());
+    ASSERT(cpu_load.contains(lapic_id)); // Has to be a CPU that supports virtualization
+
+    auto& instance = *instances[id];
+    if(instance.state != VmState::Running)
+        return false;
+
+    if(instance.host_cpu != lapic_id)
+        migrate_instance(instance, lapic_id);
+
+    return true;
+}
+
+bool vm::manager::get_usage(size_t id, Usage& usage) {
+    VmInstance* instance = nullptr;
+    {
+        std::lock_guard guard{lock};
+        if(id >= instances.size())
+            return false;
+
+        instance = instances[id];
+        usage = {.state = instance->state, .host_cpu = instance->host_cpu, .guest_time_ns = 0, .resident_pages = 0, .shared_pages = 0, .dirty_pages = 0};
+    }
+
+    if(usage.state != VmState::Running)
+        return true;
+
+    usage.guest_time_ns = guest_time_ns(*instance);
+
+    auto& vm = *instance->vm;
+    for(const auto& slot : vm.memslots) {
+        for(auto gpa = slot.base; gpa < (slot.base + slot.size); gpa += pmm::block_size) {
+            std::lock_guard guard{vm.memslot_lock};
+
+            auto hpa = vm.mm->get_phys(gpa);
+            if(!hpa)
+                continue;
+
+            usage.resident_pages++;
+            if(vm::ksm::is_shared(hpa))
+                usage.shared_pages++;
+        }
+    }
+
+    std::vector<uint64_t> bitmap{};
+    for(auto& slot : vm.memslots)
+        if(slot.flags & vm::MemslotFlags::DirtyLog)
+            usage.dirty_pages += vm.get_dirty_log(slot.base, bitmap);
+
+    return true;
+}
+
+void vm::manager::print_usage() {
+    size_t n_instances = 0;
+    {
+        std::lock_guard guard{lock};
+        n_instances = instances.size();
+    }
+
+    for(size_t i = 0; i < n_instances; i++) {
+        Usage usage{};
+        if(!get_usage(i, usage))
+            continue;
+
+        auto kib = pmm::block_size / 1024;
+        print("vm::manager: {} {:s}: {:s} on CPU {}, {} ms in guest, {} KiB resident ({} KiB shared)\n", i, instances[i]->config.name, state_to_string(usage.state),
+                usage.host_cpu, usage.guest_time_ns / 1'000'000, usage.resident_pages * kib, usage.shared_pages * kib);
+        if(instances[i]->config.track_dirty)
+            print("    {} KiB dirtied since the last sample\n", usage.dirty_pages * kib);
+    }
+}
+
+size_t vm::manager::read_log(size_t id, uint8_t* data, size_t size) {
+    vm::virtio::console::Driver* console = nullptr;
+    uint32_t port = 0;
+    {
+        std::lock_guard guard{lock};
+        if(id >= instances.size())
+            return 0;
+
+        console = instances[id]->console;
+        port = instances[id]->log_port;
+    }
+
+    // The device model is never freed, so this also works after the VM has stopped
+    if(!console)
+        return 0;
+
+    return console->read(port, data, size);
+}
@@ -0,0 +1,341 @@
+#include <Luna/vmm/netswitch.hpp>
+
+#include <Luna/cpu/threads.hpp>
+#include <Luna/misc/log.hpp>
+
+#include <std/string.hpp>
+
+using namespace vm::netswitch;
+
+constexpr size_t eth_header_size = 14;
+constexpr uint16_t ethertype_ipv4 = 0x800;
+constexpr uint8_t ip_proto_tcp = 6;
+
+namespace tcp_flags {
+    constexpr uint8_t fin = (1 << 0);
+    constexpr uint8_t psh = (1 << 3);
+    constexpr uint8_t cwr = (1 << 7);
+} // namespace tcp_flags
+
+static uint16_t load_be16(const uint8_t* p) { return ((uint16_t)p[0] << 8) | p[1]; }
+static uint32_t load_be32(const uint8_t* p) { return ((uint32_t)load_be16(p) << 16) | load_be16(p + 2); }
+static void store_be16(uint8_t* p, uint16_t v) { p[0] = v >> 8; p[1] = v; }
+static void store_be32(uint8_t* p, uint32_t v) { store_be16(p, v >> 16); store_be16(p + 2, v); }
+
+// Internet checksum, RFC 1071
+static uint64_t csum_partial(const uint8_t* data, size_t len, uint64_t sum = 0) {
+    for(; len > 1; data += 2, len -= 2)
+        sum += load_be16(data);
+
+    if(len)
+        sum += (uint16_t)data[0] << 8;
+
+    return sum;
+}
+
+static uint16_t csum_fold(uint64_t sum) {
+    while(sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+
+    return ~sum;
+}
+
+static uint64_t mac_key(const uint8_t* mac) {
+    uint64_t key = 0;
+    memcpy(&key, mac, 6);
+    return key;
+}
+
+size_t Packet::copy_to(size_t offset, uint8_t* dst, size_t len) const {
+    size_t copied = 0;
+    for(const auto& segment : segments) {
+        if(copied == len)
+            break;
+
+        if(offset >= segment.size_bytes()) {
+            offset -= segment.size_bytes();
+            continue;
+        }
+
+        auto chunk = min(segment.size_bytes() - offset, len - copied);
+        memcpy(dst + copied, segment.data() + offset, chunk);
+
+        copied += chunk;
+        offset = 0;
+    }
+
+    return copied;
+}
+
+void Switch::attach(Port* port) {
+    std::lock_guard guard{lock};
+    ports.push_back(port);
+}
+
+void Switch::detach(Port* port) {
+    std::lock_guard guard{lock};
+
+    for(auto it = ports.begin(); it != ports.end(); ++it) {
+        if(*it == port) {
+            ports.erase(it);
+            break;
+        }
+    }
+
+    std::vector<uint64_t> stale{};
+    for(const auto& [mac, entry] : fdb)
+        if(entry == port)
+            stale.push_back(mac);
+
+    for(auto mac : stale)
+        fdb.erase(mac);
+}
+
+void Switch::send(Port* from, const Packet& packet) {
+    uint8_t macs[12]{};
+    if(packet.size < eth_header_size || packet.copy_to(0, macs, 12) != 12)
+        return;
+
+    std::lock_guard guard{lock};
+
+    bool src_multicast = macs[6] & 1;
+    if(!src_multicast)
+        fdb[mac_key(macs + 6)] = from;
+
+    bool dst_multicast = macs[0] & 1;
+    if(!dst_multicast) {
+        if(auto it = fdb.find(mac_key(macs)); it != fdb.end()) {
+            if(it->second != from)
+                it->second->receive(packet);
+
+            return;
+        }
+    }
+
+    // Broadcast, multicast or unknown destination, so flood it
+    for(auto* port : ports)
+        if(port != from)
+            port->receive(packet);
+}
+
+static bool complete_checksum(uint8_t* frame, size_t size, uint16_t start, uint16_t offset) {
+    if((size_t)start + offset + 2 > size)
+        return false;
+
+    // The field already contains the pseudo header checksum
+    store_be16(frame + start + offset, csum_fold(csum_partial(frame + start, size - start)));
+    return true;
+}
+
+// Splits a TCPv4 frame into segments of mss bytes of payload, and fills in all checksums
+static void segment_tcp4(const std::vector<uint8_t>& frame, uint16_t mss, void (*f)(const Packet& packet, void* userptr), void* userptr) {
+    if(frame.size() < (eth_header_size + 20) || load_be16(frame.data() + 12) != ethertype_ipv4)
+        return;
+
+    auto* ip = frame.data() + eth_header_size;
+    size_t ip_hdr_len = (ip[0] & 0xF) * 4;
+    if(ip_hdr_len < 20 || ip[9] != ip_proto_tcp || (eth_header_size + ip_hdr_len + 20) > frame.size())
+        return;
+
+    auto* tcp = ip + ip_hdr_len;
+    size_t tcp_hdr_len = (tcp[12] >> 4) * 4;
+    size_t hdr_len = eth_header_size + ip_hdr_len + tcp_hdr_len;
+    if(tcp_hdr_len < 20 || hdr_len > frame.size())
+        return;
+
+    auto ip_id = load_be16(ip + 4);
+    auto seq = load_be32(tcp + 4);
+    auto flags = tcp[13];
+
+    std::vector<uint8_t> segment{};
+    segment.resize(hdr_len + mss);
+
+    size_t payload = frame.size() - hdr_len;
+    for(size_t off = 0, i = 0; i == 0 || off < payload; off += mss, i++) {
+        auto len = min((size_t)mss, payload - off);
+        bool first = (off == 0), last = (off + len) >= payload;
+
+        memcpy(segment.data(), frame.data(), hdr_len);
+        memcpy(segment.data() + hdr_len, frame.data() + hdr_len + off, len);
+
+        auto* seg_ip = segment.data() + eth_header_size;
+        store_be16(seg_ip + 2, ip_hdr_len + tcp_hdr_len + len);
+        store_be16(seg_ip + 4, ip_id + i);
+        store_be16(seg_ip + 10, 0);
+        store_be16(seg_ip + 10, csum_fold(csum_partial(seg_ip, ip_hdr_len)));
+
+        auto* seg_tcp = seg_ip + ip_hdr_len;
+        store_be32(seg_tcp + 4, seq + off);
+
+        uint8_t seg_flags = flags;
+        if(!last)
+            seg_flags &= ~(tcp_flags::fin | tcp_flags::psh);
+        if(!first)
+            seg_flags &= ~tcp_flags::cwr;
+        seg_tcp[13] = seg_flags;
+
+        // Pseudo header: Source and destination IP, protocol and TCP length
+        size_t tcp_len = tcp_hdr_len + len;
+        uint64_t sum = csum_partial(seg_ip + 12, 8);
+        sum += ip_proto_tcp;
+        sum += tcp_len;
+
+        store_be16(seg_tcp + 16, 0);
+        store_be16(seg_tcp + 16, csum_fold(csum_partial(seg_tcp, tcp_len, sum)));
+
+        Packet out{};
+        out.add_segment(segment.data(), hdr_len + len);
+        f(out, userptr);
+    }
+}
+
+void vm::netswitch::resolve_offloads(const Packet& packet, bool can_csum, bool can_tso, void (*f)(const Packet& packet, void* userptr), void* userptr) {
+    bool do_tso = packet.offload.gso_size && !can_tso;
+    bool do_csum = packet.offload.needs_csum && !can_csum;
+    if(!do_tso && !do_csum) {
+        f(packet, userptr);
+        return;
+    }
+
+    std::vector<uint8_t> frame{};
+    frame.resize(packet.size);
+    packet.copy_to(0, frame.data(), packet.size);
+
+    if(do_tso) {
+        segment_tcp4(frame, packet.offload.gso_size, f, userptr);
+        return;
+    }
+
+    if(!complete_checksum(frame.data(), frame.size(), packet.offload.csum_start, packet.offload.csum_offset))
+        return;
+
+    Packet out{};
+    out.add_segment(frame.data(), frame.size());
+    out.offload = packet.offload;
+    out.offload.needs_csum = false;
+    f(out, userptr);
+}
+
+// Bridges a switch to a host NIC, frames are received in IRQ context so they're queued up and forwarded from a thread
+struct HostUplink final : public Port {
+    static constexpr size_t ring_size = 64;
+
+    HostUplink(net::Nic* nic, Switch& sw): nic{nic}, sw{sw} {
+        nic->rx_userptr = this;
+        nic->rx_handler = [](const std::span<uint8_t>& frame, void* userptr) {
+            ((HostUplink*)userptr)->handle_rx(frame);
+        };
+        nic->set_promiscuous(true);
+
+        spawn([this] { run(); });
+    }
+
+    // To the wire, the NIC can't do TCP checksums or TSO so those are done here
+    void receive(const Packet& packet) {
+        resolve_offloads(packet, false, false, [](const Packet& packet, void* userptr) {
+            auto& self = *(HostUplink*)userptr;
+            if(packet.size > max_frame_size)
+                return;
+
+            uint8_t* data = nullptr;
+            if(packet.segments.size() == 1) {
+                data = (uint8_t*)packet.segments[0].data();
+            } else {
+                packet.copy_to(0, self.tx_frame, packet.size);
+                data = self.tx_frame;
+            }
+
+            self.nic->send_frame(std::span<uint8_t>{data, packet.size});
+        }, this);
+    }
+
+    private:
+    void handle_rx(const std::span<uint8_t>& frame) {
+        if(frame.size_bytes() < eth_header_size || frame.size_bytes() > max_frame_size)
+            return;
+
+        // Frames for the host itself only have to go to the host network stack
+        if(memcmp(frame.data(), nic->get_mac().data, 6) == 0)
+            return;
+
+        {
+            std::lock_guard guard{ring_lock};
+            if(((head + 1) % ring_size) == tail)
+                return; // Full, drop it
+
+            ring[head].len = frame.size_bytes();
+            memcpy(ring[head].data, frame.data(), frame.size_bytes());
+            head = (head + 1) % ring_size;
+        }
+
+        rx_ready.complete();
+    }
+
+    void run() {
+        while(true) {
+            rx_ready.await();
+            rx_ready.reset();
+
+            while(true) {
+                size_t len = 0;
+                {
+                    std::lock_guard guard{ring_lock};
+                    if(head == tail)
+                        break;
+
+                    len = ring[tail].len;
+                    memcpy(rx_frame, ring[tail].data, len);
+                    tail = (tail + 1) % ring_size;
+                }
+
+                Packet packet{};
+                packet.add_segment(rx_frame, len);
+                sw.send(this, packet);
+            }
+        }
+    }
+
+    net::Nic* nic;
+    Switch& sw;
+
+    struct Slot {
+        size_t len;
+        uint8_t data[max_frame_size];
+    };
+
+    IrqTicketLock ring_lock{};
+    Slot ring[ring_size];
+    size_t head = 0, tail = 0;
+    Promise<void> rx_ready{};
+
+    uint8_t rx_frame[max_frame_size]; // Only used by the forwarding thread
+    uint8_t tx_frame[max_frame_size]; // Only used with the switch locked
+};
+
+static Switch loopback{};
+
+static TicketLock host_lock{};
+static Switch host{};
+static bool has_uplink = false;
+
+Switch& vm::netswitch::get_loopback() {
+    return loopback;
+}
+
+Switch& vm::netswitch::get_host() {
+    std::lock_guard guard{host_lock};
+    if(!has_uplink) {
+        has_uplink = true;
+
+        if(net::has_default_if()) {
+            auto* nic = net::get_default_if()->nic;
+            host.attach(new HostUplink{nic, host});
+
+            print("netswitch: Bridged host switch to NIC {}\n", nic->get_mac());
+        } else {
+            print("netswitch: No host NIC, host switch is only connected to VMs\n");
+        }
+    }
+
+    return host;
+}
@@ -0,0 +1,210 @@
+#include <Luna/vmm/overlay.hpp>
+
+#include <Luna/misc/log.hpp>
+
+#include <std/string.hpp>
+
+using namespace vm::overlay;
+
+vm::overlay::Image::Image(vfs::File* file, vfs::File* backing, const Header& header): header{header}, cluster_size{1ull << header.cluster_bits}, table{}, file{file}, backing{backing} {}
+
+Image* vm::overlay::Image::open(vfs::File* file, size_t depth) {
+    Header header{};
+    if(!is_valid(file) || file->read(0, sizeof(header), (uint8_t*)&header) != sizeof(header))
+        return nullptr;
+
+    if(header.cluster_bits < 9 || header.cluster_bits > 21) {
+        print("vm::overlay: Unsupported cluster size {:#x}\n", 1ull << header.cluster_bits);
+        return nullptr;
+    }
+
+    auto table_size = header.n_clusters * sizeof(uint64_t);
+    if(header.n_clusters != div_ceil(header.virtual_size, 1ull << header.cluster_bits) || (header.table_offset + table_size) > file->get_size()) {
+        print("vm::overlay: Corrupt header\n");
+        return nullptr;
+    }
+
+    vfs::File* backing = nullptr;
+    if(header.backing[0]) {
+        char path[sizeof(header.backing) + 1] = {};
+        memcpy(path, header.backing, sizeof(header.backing));
+
+        backing = vm::overlay::open(path, depth + 1);
+        if(!backing) {
+            print("vm::overlay: Failed to open backing image {:s}\n", path);
+            return nullptr;
+        }
+    }
+
+    auto* image = new Image{file, backing, header};
+    image->table.resize(header.n_clusters);
+    if(file->read(header.table_offset, table_size, (uint8_t*)image->table.data()) != table_size) {
+        delete image;
+        return nullptr;
+    }
+
+    return image;
+}
+
+void vm::overlay::Image::read_cluster(size_t cluster, size_t offset, size_t count, uint8_t* data) {
+    if(auto entry = table[cluster]; entry) {
+        if(file->read(entry + offset, count, data) != count)
+            memset(data, 0, count);
+
+        return;
+    }
+
+    // Unallocated, anything the backing image doesn't have (or if there is none) reads as zero without touching the disk
+    size_t n = 0;
+    auto pos = (cluster * cluster_size) + offset;
+    if(backing && pos < backing->get_size())
+        n = backing->read(pos, min(count, backing->get_size() - pos), data);
+
+    memset(data + n, 0, count - n);
+}
+
+bool vm::overlay::Image::alloc_cluster(size_t cluster) {
+    auto addr = header.next_free;
+    if((addr + cluster_size) > file->get_size()) {
+        print("vm::overlay: Out of space, the image needs to be preallocated larger\n");
+        return false;
+    }
+
+    // The part of the cluster that isn't about to be overwritten still has to contain the old data
+    std::vector<uint8_t> buf{};
+    buf.resize(cluster_size);
+    read_cluster(cluster, 0, cluster_size, buf.data());
+    if(file->write(addr, cluster_size, buf.data()) != cluster_size)
+        return false;
+
+    // Bump next_free before publishing the table entry, so if anything fails in between a cluster is leaked, instead of handed out twice
+    header.next_free += cluster_size;
+    if(file->write(offsetof(Header, next_free), sizeof(uint64_t), (uint8_t*)&header.next_free) != sizeof(uint64_t))
+        return false;
+
+    if(file->write(header.table_offset + (cluster * sizeof(uint64_t)), sizeof(uint64_t), (uint8_t*)&addr) != sizeof(uint64_t))
+        return false;
+
+    table[cluster] = addr;
+    return true;
+}
+
+size_t vm::overlay::Image::read(size_t offset, size_t count, uint8_t* data) {
+    if(offset >= header.virtual_size)
+        return 0;
+
+    count = min(count, header.virtual_size - offset);
+
+    size_t curr = 0;
+    while(curr < count) {
+        auto pos = offset + curr;
+        auto cluster_offset = pos & (cluster_size - 1);
+        auto chunk = min(cluster_size - cluster_offset, count - curr);
+
+        read_cluster(pos >> header.cluster_bits, cluster_offset, chunk, data + curr);
+        curr += chunk;
+    }
+
+    return count;
+}
+
+size_t vm::overlay::Image::write(size_t offset, size_t count, uint8_t* data) {
+    if(offset >= header.virtual_size)
+        return 0;
+
+    count = min(count, header.virtual_size - offset);
+
+    size_t curr = 0;
+    while(curr < count) {
+        auto pos = offset + curr;
+        auto cluster = pos >> header.cluster_bits;
+        auto cluster_offset = pos & (cluster_size - 1);
+        auto chunk = min(cluster_size - cluster_offset, count - curr);
+
+        if(!table[cluster] && !alloc_cluster(cluster))
+            break;
+
+        if(file->write(table[cluster] + cluster_offset, chunk, data + curr) != chunk)
+            break;
+
+        curr += chunk;
+    }
+
+    return curr;
+}
+
+void vm::overlay::Image::close() {
+    file->close();
+
+    if(backing)
+        backing->close();
+}
+
+bool vm::overlay::is_valid(vfs::File* file) {
+    Header header{};
+    if(file->get_size() < sizeof(header))
+        return false;
+
+    if(file->read(0, sizeof(header), (uint8_t*)&header) != sizeof(header))
+        return false;
+
+    return memcmp(header.magic, magic, 8) == 0 && header.version == version;
+}
+
+bool vm::overlay::create(vfs::File* file, const char* backing, size_t virtual_size, uint32_t cluster_bits) {
+    Header header{};
+    memcpy(header.magic, magic, 8);
+    header.version = version;
+    header.cluster_bits = cluster_bits;
+    header.virtual_size = virtual_size;
+
+    size_t cluster_size = 1ull << cluster_bits;
+    header.n_clusters = div_ceil(virtual_size, cluster_size);
+    header.table_offset = align_up(sizeof(Header), 512);
+
+    auto table_size = header.n_clusters * sizeof(uint64_t);
+    header.next_free = align_up(header.table_offset + table_size, cluster_size);
+
+    if(backing) {
+        auto len = strlen(backing);
+        if(len > sizeof(header.backing)) {
+            print("vm::overlay: Backing image path is too long\n");
+            return false;
+        }
+
+        memcpy(header.backing, backing, len);
+    }
+
+    if(header.next_free > file->get_size()) {
+        print("vm::overlay: File is too small to hold the table, needs at least {:#x} bytes\n", (uint64_t)header.next_free);
+        return false;
+    }
+
+    // Don't rely on the file being zeroed, an unallocated cluster has to be 0 in the table
+    std::vector<uint64_t> table{};
+    table.resize(header.n_clusters);
+    if(file->write(header.table_offset, table_size, (uint8_t*)table.data()) != table_size)
+        return false;
+
+    // Write the header last, so the file is only recognized as an overlay once it is complete
+    if(file->write(0, sizeof(header), (uint8_t*)&header) != sizeof(header))
+        return false;
+
+    file->close(); // Flush to disk
+
+    print("vm::overlay: Created {} MiB overlay with {} KiB clusters\n", virtual_size / 1024 / 1024, cluster_size / 1024);
+    return true;
+}
+
+vfs::File* vm::overlay::open(const char* path, size_t depth) {
+    if(depth >= max_chain_depth) {
+        print("vm::overlay: Backing chain is too deep, or loops\n");
+        return nullptr;
+    }
+
+    auto* file = vfs::get_vfs().open(path);
+    if(!file || !is_valid(file))
+        return file; // Not an overlay, so just a raw image
+
+    return Image::open(file, depth);
+}
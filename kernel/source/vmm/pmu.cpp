@@ -0,0 +1,233 @@
+#include <Luna/vmm/pmu.hpp>
+
+#include <Luna/cpu/regs.hpp>
+
+using namespace vm::pmu;
+
+Pmu::Pmu(CpuVendor vendor): vendor{vendor} {
+    if(vendor == CpuVendor::Intel) {
+        uint32_t a, b, c, d;
+        if(!cpu::cpuid(0xA, a, b, c, d) || (a & 0xFF) < 2)
+            return; // No global control MSRs before v2, so don't bother
+
+        n_counters = min<size_t>((a >> 8) & 0xFF, max_counters);
+        width = (a >> 16) & 0xFF;
+        event_mask_length = (a >> 24) & 0xFF;
+        event_mask = b;
+
+        if(cpu::cpuid(1, a, b, c, d) && (c & (1 << 15))) // PDCM
+            full_width_writes = msr::read(msr::ia32_perf_capabilities) & (1 << 13);
+
+        global_ctrl = (1 << n_counters) - 1; // Reset value enables every counter, so only the event selects matter
+    } else if(vendor == CpuVendor::AMD) {
+        n_counters = 4; // The legacy counters are always there
+        width = 48;
+    }
+
+    mask = (width == 64) ? ~0ull : ((1ull << width) - 1);
+}
+
+void Pmu::cpuid_leaf_a(uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d) const {
+    a = b = c = d = 0;
+    if(vendor != CpuVendor::Intel || n_counters == 0)
+        return;
+
+    a = 2 | (n_counters << 8) | (width << 16) | (event_mask_length << 24);
+    b = event_mask;
+}
+
+uint32_t Pmu::counter_msr(size_t i) const {
+    if(vendor == CpuVendor::Intel)
+        return (full_width_writes ? msr::ia32_a_pmc0 : msr::ia32_pmc0) + i;
+    else
+        return msr::perf_legacy_ctr_0 + i;
+}
+
+bool Pmu::is_enabled(size_t i) const {
+    if(!(evtsels[i] & evtsel::Enable))
+        return false;
+
+    return (vendor == CpuVendor::AMD) || (global_ctrl & (1ull << i));
+}
+
+uint64_t Pmu::hw_evtsel(size_t i) const {
+    auto v = evtsels[i] & ~evtsel::Int; // Overflows are checked on exit, instead of taking a host PMI
+
+    if(vendor == CpuVendor::Intel)
+        return v & ~evtsel::AnyThread;
+    else
+        return (v & ~evtsel::HostOnly) | evtsel::GuestOnly; // Only count while in the guest, even though it's enabled in the host
+}
+
+uint64_t Pmu::hw_counter(size_t i) const {
+    if(vendor == CpuVendor::AMD || full_width_writes)
+        return counters[i];
+
+    // Legacy writes sign extend bit 31, which is fine for the usual -period values, but anything else would jump by almost 2^width
+    // Only load the low bits then, and add the rest back on save
+    auto value = counters[i];
+    if((((uint64_t)(int64_t)(int32_t)value) & mask) == value)
+        return value;
+
+    return value & 0x7FFF'FFFF;
+}
+
+bool Pmu::handles_msr(uint32_t index) const {
+    if(n_counters == 0)
+        return false;
+
+    auto in = [&](uint32_t base) { return index >= base && index < (base + n_counters); };
+    if(vendor == CpuVendor::Intel)
+        return in(msr::ia32_pmc0) || in(msr::ia32_a_pmc0) || in(msr::ia32_perfevtsel0) || index == msr::ia32_fixed_ctr_ctrl
+            || index == msr::ia32_perf_global_status || index == msr::ia32_perf_global_ctrl || index == msr::ia32_perf_global_ovf_ctrl;
+    else
+        return in(msr::perf_legacy_evt_sel0) || in(msr::perf_legacy_ctr_0);
+}
+
+uint64_t Pmu::read_msr(uint32_t index) {
+    if(vendor == CpuVendor::Intel) {
+        if(index >= msr::ia32_pmc0 && index < (msr::ia32_pmc0 + n_counters))
+            return counters[index - msr::ia32_pmc0];
+        else if(index >= msr::ia32_a_pmc0 && index < (msr::ia32_a_pmc0 + n_counters))
+            return counters[index - msr::ia32_a_pmc0];
+        else if(index >= msr::ia32_perfevtsel0 && index < (msr::ia32_perfevtsel0 + n_counters))
+            return evtsels[index - msr::ia32_perfevtsel0];
+        else if(index == msr::ia32_perf_global_status)
+            return global_status;
+        else if(index == msr::ia32_perf_global_ctrl)
+            return global_ctrl;
+    } else {
+        if(index >= msr::perf_legacy_evt_sel0 && index < (msr::perf_legacy_evt_sel0 + n_counters))
+            return evtsels[index - msr::perf_legacy_evt_sel0];
+        else if(index >= msr::perf_legacy_ctr_0 && index < (msr::perf_legacy_ctr_0 + n_counters))
+            return counters[index - msr::perf_legacy_ctr_0];
+    }
+
+    return 0; // Fixed counter control and overflow control
+}
+
+bool Pmu::write_msr(uint32_t index, uint64_t value) {
+    if(vendor == CpuVendor::Intel) {
+        if(index >= msr::ia32_pmc0 && index < (msr::ia32_pmc0 + n_counters))
+            counters[index - msr::ia32_pmc0] = (uint64_t)(int64_t)(int32_t)value & mask; // Legacy writes sign extend bit 31
+        else if(index >= msr::ia32_a_pmc0 && index < (msr::ia32_a_pmc0 + n_counters))
+            counters[index - msr::ia32_a_pmc0] = value & mask;
+        else if(index >= msr::ia32_perfevtsel0 && index < (msr::ia32_perfevtsel0 + n_counters)) {
+            if(value & evtsel::IntelReserved)
+                return false;
+
+            evtsels[index - msr::ia32_perfevtsel0] = value;
+        } else if(index == msr::ia32_perf_global_ctrl)
+            global_ctrl = value & ((1 << n_counters) - 1);
+        else if(index == msr::ia32_perf_global_ovf_ctrl)
+            global_status &= ~value;
+    } else {
+        if(index >= msr::perf_legacy_evt_sel0 && index < (msr::perf_legacy_evt_sel0 + n_counters)) {
+            if(value & evtsel::AmdReserved)
+                return false;
+
+            evtsels[index - msr::perf_legacy_evt_sel0] = value;
+        } else if(index >= msr::perf_legacy_ctr_0 && index < (msr::perf_legacy_ctr_0 + n_counters)) {
+            counters[index - msr::perf_legacy_ctr_0] = value & mask;
+        }
+    }
+
+    return true;
+}
+
+uint64_t Pmu::rdpmc(uint32_t index) const {
+    if(index < n_counters) // Intel fixed counters have bit 30 set, we don't have those
+        return counters[index];
+
+    return 0;
+}
+
+void Pmu::load() {
+    bool active = false;
+    for(size_t i = 0; i < n_counters; i++)
+        if(is_enabled(i))
+            active = true;
+
+    if(!active)
+        return;
+
+    if(vendor == CpuVendor::Intel) {
+        host_global_ctrl = msr::read(msr::ia32_perf_global_ctrl);
+        msr::write(msr::ia32_perf_global_ctrl, 0);
+    }
+
+    for(size_t i = 0; i < n_counters; i++) {
+        host_evtsels[i] = msr::read(evtsel_msr(i));
+        host_counters[i] = msr::read(counter_msr(i));
+
+        auto value = hw_counter(i);
+        reload_base[i] = counters[i] - value;
+
+        msr::write(evtsel_msr(i), 0);
+        msr::write(counter_msr(i), value);
+        if(is_enabled(i))
+            msr::write(evtsel_msr(i), hw_evtsel(i));
+    }
+
+    // Without the VMCS doing it atomically, the counters see the last few instructions before entry
+    if(vendor == CpuVendor::Intel && !hw_global_ctrl)
+        msr::write(msr::ia32_perf_global_ctrl, global_ctrl);
+
+    loaded = true;
+}
+
+void Pmu::save() {
+    if(!loaded)
+        return;
+
+    if(vendor == CpuVendor::Intel && !hw_global_ctrl)
+        msr::write(msr::ia32_perf_global_ctrl, 0);
+
+    for(size_t i = 0; i < n_counters; i++) {
+        msr::write(evtsel_msr(i), 0);
+        auto value = (msr::read(counter_msr(i)) + reload_base[i]) & mask;
+
+        // A single run of the guest can't count anywhere near 2^48 events, so the counter going down means it wrapped
+        if(is_enabled(i) && value < counters[i]) {
+            global_status |= (1ull << i);
+
+            if(evtsels[i] & evtsel::Int)
+                pmi_pending = true;
+        }
+
+        counters[i] = value;
+
+        msr::write(counter_msr(i), host_counters[i]);
+        msr::write(evtsel_msr(i), host_evtsels[i]);
+    }
+
+    if(vendor == CpuVendor::Intel)
+        msr::write(msr::ia32_perf_global_ctrl, host_global_ctrl);
+
+    loaded = false;
+}
+
+void Pmu::snapshot_save(snapshot::Writer& out) {
+    out.write(evtsels);
+    out.write(counters);
+    out.write(global_ctrl);
+    out.write(global_status);
+}
+
+void Pmu::snapshot_restore(snapshot::Reader& in) {
+    in.read(evtsels);
+    in.read(counters);
+    in.read(global_ctrl);
+    in.read(global_status);
+
+    // Don't trust the snapshot any more than the guest, the event selects go straight into the real MSRs
+    for(size_t i = 0; i < max_counters; i++) {
+        evtsels[i] &= ~reserved_evtsel_bits();
+        counters[i] &= mask;
+    }
+
+    if(vendor == CpuVendor::Intel) {
+        global_ctrl &= (1 << n_counters) - 1;
+        global_status &= (1 << n_counters) - 1;
+    }
+}
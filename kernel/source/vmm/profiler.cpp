@@ -0,0 +1,304 @@
+#include <Luna/vmm/profiler.hpp>
+#include <Luna/vmm/vm.hpp>
+
+#include <Luna/cpu/threads.hpp>
+#include <Luna/drivers/timers/timers.hpp>
+#include <Luna/fs/vfs.hpp>
+#include <Luna/misc/log.hpp>
+#include <Luna/misc/format.hpp>
+
+#include <std/unordered_map.hpp>
+#include <std/string.hpp>
+
+struct Symbol {
+    uint64_t addr;
+    const char* name;
+};
+
+struct Profile {
+    vm::Vm* vm;
+    const char* name;
+
+    uint64_t n_samples = 0;
+    std::unordered_map<uint64_t, uint64_t> kernel; // RIP -> Samples, for everything that isn't CPL 3
+    std::unordered_map<uint64_t, std::unordered_map<uint64_t, uint64_t>> user; // CR3 -> RIP -> Samples
+
+    char* symbol_data = nullptr; // The System.map itself, the names point into it
+    std::vector<Symbol> symbols; // Sorted by address
+};
+
+struct UserSample {
+    uint64_t cr3, rip, count;
+};
+
+static IrqTicketLock lock{};
+static std::vector<Profile*> profiles;
+static bool sampler_running = false;
+
+static Profile* find_profile(vm::Vm* vm) {
+    for(auto* profile : profiles)
+        if(profile->vm == vm)
+            return profile;
+
+    return nullptr;
+}
+
+static void load_symbols(Profile& profile, const char* path) {
+    auto* file = vfs::get_vfs().open(path);
+    if(!file) {
+        print("vm::profiler: Couldn't open {:s}, kernel RIPs won't be resolved\n", path);
+        return;
+    }
+
+    auto size = file->get_size();
+    auto* data = new char[size + 1];
+    if(file->read(0, size, (uint8_t*)data) != size) {
+        print("vm::profiler: Couldn't read {:s}\n", path);
+
+        delete[] data;
+        file->close();
+        return;
+    }
+    data[size] = '\0';
+    file->close();
+
+    // Every line is "<address in hex> <type> <name>", only text symbols are kept
+    size_t i = 0;
+    while(i < size) {
+        uint64_t addr = 0;
+        size_t n_digits = 0;
+        while(i < size) {
+            auto c = data[i];
+            if(c >= '0' && c <= '9')
+                addr = (addr << 4) | (c - '0');
+            else if(c >= 'a' && c <= 'f')
+                addr = (addr << 4) | (c - 'a' + 10);
+            else if(c >= 'A' && c <= 'F')
+                addr = (addr << 4) | (c - 'A' + 10);
+            else
+                break;
+
+            i++;
+            n_digits++;
+        }
+
+        char type = ((i + 2) < size) ? data[i + 1] : '\0';
+        const char* name = &data[min<size_t>(i + 3, size)];
+
+        while(i < size && data[i] != '\n')
+            i++;
+
+        if(i < size)
+            data[i++] = '\0';
+
+        if(n_digits == 0 || !(type == 'T' || type == 't' || type == 'W' || type == 'w'))
+            continue;
+
+        // System.map is sorted already, anything out of order would break the lookup so skip it
+        if(profile.symbols.size() > 0 && addr < profile.symbols.back().addr)
+            continue;
+
+        profile.symbols.push_back({.addr = addr, .name = name});
+    }
+
+    profile.symbol_data = data;
+    print("vm::profiler: Loaded {} symbols from {:s}\n", profile.symbols.size(), path);
+}
+
+// Returns the index of the symbol rip is in, or ~0 if it doesn't have one
+static size_t resolve(const Profile& profile, uint64_t rip) {
+    const auto& symbols = profile.symbols;
+
+    // The last text symbol is _etext or similar, so anything past it, like modules, can't be resolved
+    if(symbols.size() < 2 || rip < symbols[0].addr || rip >= symbols.back().addr)
+        return ~0ull;
+
+    size_t low = 0, high = symbols.size() - 1;
+    while((high - low) > 1) {
+        auto mid = low + (high - low) / 2;
+        if(symbols[mid].addr <= rip)
+            low = mid;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+struct BufferWriter {
+    BufferWriter(std::vector<uint8_t>& data): data{data} {}
+
+    void putc(const char c) { data.push_back(c); }
+    void puts(const char* str, size_t len) {
+        for(size_t i = 0; i < len; i++)
+            putc(str[i]);
+    }
+
+    void flush() {}
+
+    std::vector<uint8_t>& data;
+};
+
+void vm::profiler::start(Vm* vm, const char* name, const char* system_map) {
+    auto* profile = new Profile{};
+    profile->vm = vm;
+    profile->name = name;
+
+    if(system_map)
+        load_symbols(*profile, system_map);
+
+    bool start_sampler = false;
+    {
+        std::lock_guard guard{lock};
+        ASSERT(!find_profile(vm));
+
+        profiles.push_back(profile);
+
+        start_sampler = !sampler_running;
+        sampler_running = true;
+    }
+
+    if(start_sampler) {
+        spawn([] {
+            Promise<void> promise{};
+
+            timer::Timer timer{TimePoint::from_ms(sample_interval_ms), true, [](void* promise) {
+                ((Promise<void>*)promise)->complete();
+            }, &promise};
+
+            timer.start();
+
+            while(1) {
+                promise.await();
+                promise.reset();
+
+                std::lock_guard guard{lock};
+                if(profiles.size() == 0) {
+                    // Cleared under the lock, so a start() after this spawns a new sampler
+                    sampler_running = false;
+                    break;
+                }
+
+                for(auto* profile : profiles) {
+                    for(auto& vcpu : profile->vm->cpus) {
+                        __atomic_store_n(&vcpu.sample_pending, true, __ATOMIC_SEQ_CST);
+                        vcpu.thread->invoke_apcs(); // Kick the VCPU out of the guest, it takes the sample before reentering
+                    }
+                }
+            }
+
+            timer.stop(); // kill_self() doesn't run destructors, and the handler points at our stack
+            kill_self();
+        });
+    }
+}
+
+void vm::profiler::stop(Vm* vm) {
+    Profile* profile = nullptr;
+    {
+        std::lock_guard guard{lock};
+
+        profile = find_profile(vm);
+        if(profile)
+            profiles.erase(profiles.find(profile));
+    }
+
+    if(!profile)
+        return;
+
+    print("vm::profiler: {:s}: {} samples\n", profile->name, profile->n_samples);
+
+    delete[] profile->symbol_data;
+    delete profile;
+}
+
+bool vm::profiler::export_folded(Vm* vm, const char* path) {
+    Profile* profile = nullptr;
+    std::vector<std::pair<uint64_t, uint64_t>> kernel_samples{};
+    std::vector<UserSample> user_samples{};
+
+    // Only copy the counts out here, resolving and writing them happens without holding the lock
+    {
+        std::lock_guard guard{lock};
+        profile = find_profile(vm);
+        if(!profile)
+            return false;
+
+        for(const auto& [rip, count] : profile->kernel)
+            kernel_samples.push_back({rip, count});
+
+        for(auto& [cr3, rips] : profile->user)
+            for(const auto& [rip, count] : rips)
+                user_samples.push_back({.cr3 = cr3, .rip = rip, .count = count});
+    }
+
+    std::vector<uint64_t> symbol_counts{};
+    symbol_counts.resize(profile->symbols.size(), 0);
+
+    std::vector<uint8_t> data{};
+    BufferWriter out{data};
+
+    for(const auto& [rip, count] : kernel_samples) {
+        if(auto i = resolve(*profile, rip); i != ~0ull)
+            symbol_counts[i] += count;
+        else
+            format::format_to(out, "{:s};kernel;{:#x} {}\n", profile->name, rip, count);
+    }
+
+    for(size_t i = 0; i < symbol_counts.size(); i++)
+        if(symbol_counts[i])
+            format::format_to(out, "{:s};kernel;{:s} {}\n", profile->name, profile->symbols[i].name, symbol_counts[i]);
+
+    for(const auto& sample : user_samples)
+        format::format_to(out, "{:s};cr3_{:x};{:#x} {}\n", profile->name, sample.cr3, sample.rip, sample.count);
+
+    auto* file = vfs::get_vfs().open(path);
+    if(!file) {
+        print("vm::profiler: Couldn't open {:s}\n", path);
+        return false;
+    }
+
+    auto size = file->get_size();
+    if(data.size() > size) {
+        print("vm::profiler: {:s} is too small, need {} bytes but it is {}\n", path, data.size(), size);
+
+        file->close();
+        return false;
+    }
+
+    bool ok = file->write(0, data.size(), data.data()) == data.size();
+
+    // Blank lines are skipped by flamegraph.pl, so this gets rid of anything from a previous export
+    uint8_t padding[512];
+    memset(padding, '\n', sizeof(padding));
+    for(size_t offset = data.size(); ok && offset < size; offset += sizeof(padding)) {
+        auto chunk = min<size_t>(sizeof(padding), size - offset);
+        ok = file->write(offset, chunk, padding) == chunk;
+    }
+
+    file->close();
+
+    if(ok)
+        print("vm::profiler: Wrote {} bytes of samples to {:s}\n", data.size(), path);
+
+    return ok;
+}
+
+void vm::profiler::sample(VCPU& vcpu) {
+    vm::RegisterState regs{};
+    vcpu.get_regs(regs);
+
+    auto rip = regs.cs.base + regs.rip;
+    auto cpl = regs.ss.attrib.dpl; // SS.DPL is always the CPL, CS.DPL isn't for conforming segments
+
+    std::lock_guard guard{lock};
+    auto* profile = find_profile(vcpu.vm);
+    if(!profile)
+        return;
+
+    profile->n_samples++;
+    if(cpl == 3)
+        profile->user[regs.cr3 & ~0xFFFull][rip]++; // Without the PCID
+    else
+        profile->kernel[rip]++;
+}
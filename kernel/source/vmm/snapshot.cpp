@@ -0,0 +1,280 @@
+#include <Luna/vmm/snapshot.hpp>
+#include <Luna/vmm/vm.hpp>
+
+#include <Luna/cpu/tsc.hpp>
+#include <Luna/mm/pmm.hpp>
+#include <Luna/misc/log.hpp>
+
+#include <std/string.hpp>
+
+using namespace vm::snapshot;
+
+static void save_vcpu(vm::VCPU& vcpu, Writer& out) {
+    vm::RegisterState regs{};
+    vcpu.get_regs(regs);
+    out.write(regs);
+
+    auto simd_size = get_cpu().simd_data.region_size;
+    out.write<uint64_t>(simd_size);
+    out.write(vcpu.vcpu->get_guest_simd_context().data(), simd_size);
+
+    out.write(vcpu.mtrr);
+    out.write(vcpu.apicbase);
+    out.write(vcpu.ia32_tsc_adjust);
+    out.write(vcpu.smbase);
+    out.write(vcpu.ia32_xss);
+    out.write(vcpu.is_in_smm);
+    out.write(vcpu.irq_pin);
+    out.write<uint8_t>(vcpu.vcpu->get_nmi_blocking());
+
+    out.write<uint64_t>(vcpu.host_tsc_at_vmexit + vcpu.guest_tsc_offset); // Guest TSC at the last VM Exit
+    out.write(vcpu.time_spent_in_vm);
+
+    vcpu.lapic.snapshot_save(out);
+    vcpu.pmu.snapshot_save(out);
+}
+
+static bool restore_vcpu(vm::VCPU& vcpu, Reader& in) {
+    vm::RegisterState regs{};
+    in.read(regs);
+    vcpu.set_regs(regs);
+
+    uint64_t simd_size = 0;
+    in.read(simd_size);
+    if(simd_size != get_cpu().simd_data.region_size) {
+        print("vm::snapshot: SIMD Context size mismatch, {:#x} vs {:#x}\n", simd_size, get_cpu().simd_data.region_size);
+        return false;
+    }
+    in.read(vcpu.vcpu->get_guest_simd_context().data(), simd_size);
+
+    in.read(vcpu.mtrr);
+    in.read(vcpu.apicbase);
+    in.read(vcpu.ia32_tsc_adjust);
+    in.read(vcpu.smbase);
+    in.read(vcpu.ia32_xss);
+    in.read(vcpu.is_in_smm);
+    in.read(vcpu.irq_pin);
+
+    uint8_t nmi_blocking = 0;
+    in.read(nmi_blocking);
+    vcpu.vcpu->set_nmi_blocking(nmi_blocking);
+
+    vcpu.lapic.update_apicbase(vcpu.apicbase);
+
+    uint64_t guest_tsc = 0;
+    in.read(guest_tsc);
+    in.read(vcpu.time_spent_in_vm);
+
+    // The VCPU will compensate for the time between now and the first entry, so the guest continues at the same TSC value
+    vcpu.host_tsc_at_vmexit = tsc::rdtsc();
+    vcpu.adjust_guest_tsc(guest_tsc - (vcpu.host_tsc_at_vmexit + vcpu.guest_tsc_offset));
+
+    vcpu.lapic.snapshot_restore(in);
+    vcpu.pmu.snapshot_restore(in);
+
+    return !in.failed;
+}
+
+static bool is_zero_page(const uint8_t* page) {
+    auto* words = (const uint64_t*)page;
+    for(size_t i = 0; i < pmm::block_size / sizeof(uint64_t); i++)
+        if(words[i])
+            return false;
+
+    return true;
+}
+
+bool vm::snapshot::is_valid(vfs::File* file) {
+    Header header{};
+    if(file->get_size() < sizeof(header))
+        return false;
+
+    Reader in{file};
+    in.read(header);
+
+    return !in.failed && memcmp(header.magic, magic, 8) == 0 && header.version == version;
+}
+
+bool vm::snapshot::save(Vm& vm, vfs::File* file) {
+    // Pages that are still lazily backed by a file have to be brought in first, the file might be the one we're about to overwrite
+    for(auto& slot : vm.memslots) {
+        if(!slot.backing)
+            continue;
+
+        for(size_t i = 0; i < slot.backing_offsets.size(); i++) {
+            if(slot.backing_offsets[i])
+                vm.handle_memslot_fault(slot.base + (i * pmm::block_size));
+
+            slot.backing_offsets[i] = 0;
+        }
+    }
+
+    Writer out{file};
+
+    Header header{};
+    memcpy(header.magic, magic, 8);
+    header.version = version;
+    header.n_cpus = vm.cpus.size();
+    header.n_drivers = vm.snapshot_drivers.size();
+    header.n_memslots = vm.memslots.size();
+    out.write(header);
+
+    for(auto& vcpu : vm.cpus)
+        save_vcpu(vcpu, out);
+
+    for(auto* driver : vm.snapshot_drivers) {
+        DriverHeader driver_header{};
+
+        auto id_len = strlen(driver->snapshot_id());
+        ASSERT(id_len < sizeof(driver_header.id));
+        memcpy(driver_header.id, driver->snapshot_id(), id_len);
+
+        auto header_offset = out.offset;
+        out.write(driver_header);
+
+        driver->snapshot_save(out);
+
+        driver_header.size = out.offset - header_offset - sizeof(DriverHeader);
+        out.write_at(header_offset, driver_header);
+    }
+
+    std::vector<uint64_t> table_offsets{};
+    auto table_offset = out.offset + (vm.memslots.size() * sizeof(MemslotHeader));
+    for(auto& slot : vm.memslots) {
+        out.write(MemslotHeader{.base = slot.base, .size = slot.size, .table_offset = table_offset});
+
+        table_offsets.push_back(table_offset);
+        table_offset += (slot.size / pmm::block_size) * sizeof(uint64_t);
+    }
+
+    out.offset = align_up(table_offset, pmm::block_size);
+    for(size_t i = 0; i < vm.memslots.size(); i++) {
+        auto& slot = vm.memslots[i];
+
+        std::vector<uint64_t> table{};
+        table.resize(slot.size / pmm::block_size);
+
+        for(size_t j = 0; j < table.size(); j++) {
+            auto hpa = vm.mm->get_phys(slot.base + (j * pmm::block_size));
+            if(!hpa)
+                continue; // Never touched, so still zero filled
+
+            auto* page = (uint8_t*)(hpa + phys_mem_map);
+            if(is_zero_page(page))
+                continue;
+
+            table[j] = out.offset;
+            out.write(page, pmm::block_size);
+        }
+
+        auto end = out.offset;
+
+        out.offset = table_offsets[i];
+        out.write(table.data(), table.size() * sizeof(uint64_t));
+
+        out.offset = end;
+    }
+
+    if(out.failed)
+        print("vm::snapshot: Failed to write snapshot, is the file large enough? Needs {:#x} bytes\n", out.offset);
+    else
+        print("vm::snapshot: Saved {} KiB snapshot\n", out.offset / 1024);
+
+    return !out.failed;
+}
+
+bool vm::snapshot::restore(Vm& vm, vfs::File* file) {
+    if(!is_valid(file))
+        return false;
+
+    auto file_size = file->get_size();
+    Reader in{file};
+
+    Header header{};
+    in.read(header);
+
+    if(in.failed)
+        return false;
+
+    if(header.n_cpus != vm.cpus.size() || header.n_drivers != vm.snapshot_drivers.size() || header.n_memslots != vm.memslots.size()) {
+        print("vm::snapshot: VM Configuration mismatch\n");
+        return false;
+    }
+
+    for(auto& vcpu : vm.cpus)
+        if(!restore_vcpu(vcpu, in))
+            return false;
+
+    for(auto* driver : vm.snapshot_drivers) {
+        DriverHeader driver_header{};
+        in.read(driver_header);
+
+        if(in.failed || driver_header.size > (file_size - in.offset)) {
+            print("vm::snapshot: Truncated driver state\n");
+            return false;
+        }
+
+        if(strncmp(driver_header.id, driver->snapshot_id(), sizeof(driver_header.id)) != 0) {
+            print("vm::snapshot: Driver mismatch, expected {:s}\n", driver->snapshot_id());
+            return false;
+        }
+
+        auto start = in.offset;
+        driver->snapshot_restore(in);
+        if(in.failed || (in.offset - start) > driver_header.size) {
+            print("vm::snapshot: Failed to restore {:s}\n", driver->snapshot_id());
+            return false;
+        }
+
+        in.offset = start + driver_header.size;
+    }
+
+    for(auto& slot : vm.memslots) {
+        MemslotHeader slot_header{};
+        in.read(slot_header);
+
+        if(slot_header.base != slot.base || slot_header.size != slot.size) {
+            print("vm::snapshot: Memslot mismatch, {:#x} -> {:#x}\n", slot.base, slot.base + slot.size);
+            return false;
+        }
+
+        if(in.failed) {
+            print("vm::snapshot: Truncated memslot header\n");
+            return false;
+        }
+
+        slot.backing_offsets.resize(slot.size / pmm::block_size);
+
+        Reader table{file, slot_header.table_offset};
+        table.read(slot.backing_offsets.data(), slot.backing_offsets.size() * sizeof(uint64_t));
+
+        // Every page is read in on a fault, so an offset past the end would only show up much later
+        bool valid = !table.failed;
+        for(size_t i = 0; valid && i < slot.backing_offsets.size(); i++)
+            if(slot.backing_offsets[i] && (slot.backing_offsets[i] > file_size || (file_size - slot.backing_offsets[i]) < pmm::block_size))
+                valid = false;
+
+        if(!valid) {
+            print("vm::snapshot: Truncated or corrupt page table for memslot {:#x} -> {:#x}\n", slot.base, slot.base + slot.size);
+            slot.backing_offsets.clear();
+            return false;
+        }
+
+        slot.backing = file;
+
+        // Pages that are already mapped, like firmware shadow RAM, are filled in right now, everything else will be faulted in
+        for(size_t i = 0; i < slot.backing_offsets.size(); i++) {
+            auto hpa = vm.mm->get_phys(slot.base + (i * pmm::block_size));
+            if(!hpa)
+                continue;
+
+            auto* page = (uint8_t*)(hpa + phys_mem_map);
+            if(slot.backing_offsets[i])
+                file->read(slot.backing_offsets[i], pmm::block_size, page);
+            else
+                memset(page, 0, pmm::block_size);
+        }
+    }
+
+    return !in.failed;
+}
@@ -1,11 +1,14 @@
 #include <Luna/vmm/vm.hpp>
 
 #include <Luna/misc/log.hpp>
+#include <Luna/cpu/threads.hpp>
 
 #include <Luna/cpu/intel/vmx.hpp>
 #include <Luna/cpu/amd/svm.hpp>
 
 #include <Luna/vmm/emulate.hpp>
+#include <Luna/vmm/ksm.hpp>
+#include <Luna/vmm/manager.hpp>
 
 void vm::init() {
     if(vmx::is_supported()) {
@@ -18,10 +21,22 @@ void vm::init() {
         svm::init();
     } else
         PANIC("Unknown virtualization vendor");
+
+    manager::add_host_cpu(get_cpu().lapic_id);
 }
 
-vm::VCPU::VCPU(vm::Vm* vm, threading::Thread* thread, uint8_t id): vm{vm}, thread{thread}, time_spent_in_vm{0}, lapic{id} {
-    switch (get_cpu().cpu.vm.vendor) {
+// The backend can't change after the VCPU is created, so switch on its vendor instead of calling through AbstractVm
+// Both backends are final, so every call made through this is a direct call, which also works with every exit
+template<typename F>
+static decltype(auto) with_backend(const vm::VCPU& vcpu, F&& f) {
+    if(vcpu.vendor == CpuVendor::Intel)
+        return f(*static_cast<vmx::Vm*>(vcpu.vcpu));
+    else
+        return f(*static_cast<svm::Vm*>(vcpu.vcpu));
+}
+
+vm::VCPU::VCPU(vm::Vm* vm, threading::Thread* thread, uint8_t id): vm{vm}, vendor{get_cpu().cpu.vm.vendor}, thread{thread}, time_spent_in_vm{0}, lapic{id}, pmu{vendor} {
+    switch (vendor) {
         case CpuVendor::Intel:
             vcpu = new vmx::Vm{vm->mm, this};
 
@@ -68,7 +83,7 @@ vm::VCPU::VCPU(vm::Vm* vm, threading::Thread* thread, uint8_t id): vm{vm}, threa
     regs.efer = efer_constraint;
     regs.pat = msr::pat::reset_state_pat;
 
-    vcpu->set_regs(regs, VmRegs::General | VmRegs::Segment | VmRegs::Control);
+    set_regs(regs, VmRegs::General | VmRegs::Segment | VmRegs::Control);
 
     auto& simd = vcpu->get_guest_simd_context();
     simd.data()->fcw = 0x40;
@@ -82,12 +97,19 @@ vm::VCPU::VCPU(vm::Vm* vm, threading::Thread* thread, uint8_t id): vm{vm}, threa
 }
 
 void vm::VCPU::exit() {
-    should_exit = true;
+    __atomic_store_n(&should_exit, true, __ATOMIC_SEQ_CST);
+}
+
+void vm::VCPU::migrate(uint32_t lapic_id) {
+    __atomic_store_n(&migrate_to, lapic_id, __ATOMIC_SEQ_CST);
+
+    thread->invoke_apcs(); // Kick the VCPU out of the guest, it'll migrate before reentering
 }
         
-void vm::VCPU::get_regs(vm::RegisterState& regs, uint64_t flags) const { vcpu->get_regs(regs, flags); }
-void vm::VCPU::set_regs(const vm::RegisterState& regs, uint64_t flags) { vcpu->set_regs(regs, flags); }
-void vm::VCPU::set(VmCap cap, bool value) { vcpu->set(cap, value); }
+void vm::VCPU::get_regs(vm::RegisterState& regs, uint64_t flags) const { with_backend(*this, [&](auto& backend) { backend.get_regs(regs, flags); }); }
+void vm::VCPU::set_regs(const vm::RegisterState& regs, uint64_t flags) { with_backend(*this, [&](auto& backend) { backend.set_regs(regs, flags); }); }
+void vm::VCPU::inject_int(AbstractVm::InjectType type, uint8_t vector, bool error_code, uint32_t error) { with_backend(*this, [&](auto& backend) { backend.inject_int(type, vector, error_code, error); }); }
+void vm::VCPU::set(VmCap cap, bool value) { with_backend(*this, [&](auto& backend) { backend.set(cap, value); }); }
 void vm::VCPU::set(VmCap cap, void (*fn)(VCPU*, void*), void* userptr) { 
     if(cap == VmCap::SMMEntryCallback) {
         smm_entry_callback = fn;
@@ -104,10 +126,17 @@ void vm::VCPU::set(VmCap cap, void (*fn)(VCPU*, void*), void* userptr) {
 
 bool vm::VCPU::run() {
     while(true) {
-        if(should_exit)
+        if(__atomic_load_n(&should_exit, __ATOMIC_SEQ_CST))
             return true;
 
-        if(!vcpu->run())
+        if(auto lapic_id = __atomic_exchange_n(&migrate_to, no_migration, __ATOMIC_SEQ_CST); lapic_id != no_migration) {
+            // The thread is pinned, so we can't be moved between unloading and repinning
+            // run() will update the host state and flush stale translations once we're on the new CPU
+            with_backend(*this, [](auto& backend) { backend.unload(); });
+            thread->pin_to_cpu(lapic_id);
+        }
+
+        if(!with_backend(*this, [](auto& backend) { return backend.run(); }))
             return false;
     }
 }
@@ -150,6 +179,10 @@ bool vm::VCPU::handle_vmexit(const VmExit& exit) {
             }
         }
 
+        // Not an MMIO region, it might be a RAM page that hasn't been faulted in yet
+        if(vm->handle_memslot_fault(exit.mmu.gpa, exit.mmu.access.w))
+            goto did_mmio;
+
         // No MMIO region, so a page violation
         print("vm: MMU Violation\n");
         print("    gRIP: {:#x}, gPA: {:#x}\n", grip, exit.mmu.gpa);
@@ -270,6 +303,7 @@ bool vm::VCPU::handle_vmexit(const VmExit& exit) {
             passthrough();
 
             regs.rcx |= (1u << 31); // Set Hypervisor Present bit
+            regs.rcx &= ~(1u << 15); // No IA32_PERF_CAPABILITIES, the vPMU doesn't do full width writes or PEBS
 
             os_support_bit(regs.rcx, 18, 27); // Only set OSXSAVE bit if actually enabled by OS
 
@@ -296,7 +330,13 @@ bool vm::VCPU::handle_vmexit(const VmExit& exit) {
                 print("vcpu: Unhandled CPUID 0x7 subleaf {:#x}\n", subleaf);
             }
         } else if(leaf == 0xA) { // Architectural Performance Monitoring Leaf
-            zero_cpuid();
+            uint32_t a, b, c, d;
+            pmu.cpuid_leaf_a(a, b, c, d);
+
+            write_low32(regs.rax, a);
+            write_low32(regs.rbx, b);
+            write_low32(regs.rcx, c);
+            write_low32(regs.rdx, d);
         } else if(leaf == 0xB) {
             passthrough();
         } else if(leaf == 0xD) {
@@ -322,6 +362,7 @@ bool vm::VCPU::handle_vmexit(const VmExit& exit) {
             passthrough();
             os_support_bit(regs.rdx, 9, 24);
             regs.rcx &= ~(1 << 2); // Clear SVM
+            regs.rcx &= ~((1 << 23) | (1 << 24) | (1 << 28)); // Clear PerfCtrExt{Core, NB, LLC}, the vPMU only has the legacy counters
         } else if(leaf == 0x8000'0002 || leaf == 0x8000'0003 || leaf == 0x8000'0004) { // CPU Brand string
             passthrough();
         } else if(leaf == 0x8000'0005) { // L1 and TLB id
@@ -390,7 +431,7 @@ bool vm::VCPU::handle_vmexit(const VmExit& exit) {
                 value = regs.sysenter_esp;
         } else if(index == msr::ia32_mtrr_cap) {
             if(exit.msr.write) {
-                vcpu->inject_int(AbstractVm::InjectType::Exception, 13, true, 0); // Inject #GP(0)
+                inject_int(AbstractVm::InjectType::Exception, 13, true, 0); // Inject #GP(0)
                 return 0;
             }
 
@@ -402,6 +443,14 @@ bool vm::VCPU::handle_vmexit(const VmExit& exit) {
             } else {
                 value = apicbase;
             }
+        } else if(pmu.handles_msr(index)) {
+            if(exit.msr.write) {
+                if(!pmu.write_msr(index, value)) {
+                    regs.rip -= exit.instruction_len; // Faults don't retire the instruction
+                    inject_int(AbstractVm::InjectType::Exception, 13, true, 0); // Inject #GP(0)
+                }
+            } else
+                value = pmu.read_msr(index);
         } else if(index == msr::ia32_bios_sign_id) {
             if(exit.msr.write) {
                 ASSERT(value == 0); // TODO, CPUID should write the rev
@@ -460,11 +509,22 @@ bool vm::VCPU::handle_vmexit(const VmExit& exit) {
         break;
     }
 
+    case VmExit::Reason::Rdpmc: {
+        get_regs(regs, VmRegs::General);
+
+        auto value = pmu.rdpmc(regs.rcx & 0xFFFF'FFFF);
+        regs.rax = value & 0xFFFF'FFFF;
+        regs.rdx = value >> 32;
+
+        set_regs(regs, VmRegs::General);
+        break;
+    }
+
     case VmExit::Reason::RSM: {
         if(is_in_smm)
             handle_rsm();
         else
-            vcpu->inject_int(vm::AbstractVm::InjectType::Exception, 6); // Inject a UD
+            inject_int(vm::AbstractVm::InjectType::Exception, 6); // Inject a UD
         break;
     }
 
@@ -707,8 +767,9 @@ void vm::VCPU::enter_smm() {
         PUT_SEGMENT(9, tr);
     }
 
-    auto* dst = (uint8_t*)(vm->mm->get_phys(smbase + 0xFE00) + phys_mem_map);
-    memcpy(dst, save, 512);
+    // SMBASE is set by the guest, so it might not point at RAM, the state is lost then but the host is left alone
+    if(!dma_write(smbase + 0xFE00, {save, 512}))
+        print("vm: SMRAM state save area at {:#x} isn't RAM\n", smbase + 0xFE00);
 
     regs.rflags = (1 << 1);
     regs.rip = 0x8000;
@@ -737,8 +798,8 @@ void vm::VCPU::handle_rsm() {
     ASSERT(is_in_smm);
 
     uint8_t buf[512] = {};
-    auto* src = (uint8_t*)(vm->mm->get_phys(smbase + 0xFE00) + phys_mem_map);
-    memcpy(buf, src, 512);
+    if(!dma_read(smbase + 0xFE00, {buf, 512}))
+        print("vm: SMRAM state save area at {:#x} isn't RAM\n", smbase + 0xFE00);
 
     RegisterState rregs{};
     get_regs(rregs);
@@ -856,33 +917,44 @@ void vm::VCPU::handle_rsm() {
     is_in_smm = false;
 }
 
-void vm::VCPU::dma_read(uintptr_t gpa, std::span<uint8_t> buf) {
+bool vm::VCPU::dma_read(uintptr_t gpa, std::span<uint8_t> buf) {
+    RamPin pin{*vm};
+
     uintptr_t curr = 0;
     while(curr != buf.size_bytes()) {
-        auto va = vm->mm->get_phys(gpa + curr) + phys_mem_map;
-        auto top = align_up(va, pmm::block_size);
-
+        auto hpa = vm->gpa_to_hpa(gpa + curr);
+        if(!hpa)
+            return false;
 
-        auto chunk = min(top - va + 1, buf.size_bytes() - curr);
+        auto va = hpa + phys_mem_map;
+        auto chunk = min(pmm::block_size - (va & 0xFFF), buf.size_bytes() - curr); // Only up to the end of the page, the next one can be anywhere on the host
 
         memcpy(buf.data() + curr, (uint8_t*)va, chunk);
 
         curr += chunk;
     }
+
+    return true;
 }
 
-void vm::VCPU::dma_write(uintptr_t gpa, std::span<uint8_t> buf) {
+bool vm::VCPU::dma_write(uintptr_t gpa, std::span<uint8_t> buf) {
+    RamPin pin{*vm};
+
     uintptr_t curr = 0;
     while(curr != buf.size_bytes()) {
-        auto va = vm->mm->get_phys(gpa + curr) + phys_mem_map;
-        auto top = align_up(va, pmm::block_size);
+        auto hpa = vm->gpa_to_hpa(gpa + curr, true);
+        if(!hpa)
+            return false;
 
-        auto chunk = min(top - va + 1, buf.size_bytes() - curr);
+        auto va = hpa + phys_mem_map;
+        auto chunk = min(pmm::block_size - (va & 0xFFF), buf.size_bytes() - curr);
 
         memcpy((uint8_t*)va, buf.data() + curr, chunk);
 
         curr += chunk;
     }
+
+    return true;
 }
 
 vm::PageWalkInfo vm::VCPU::walk_guest_paging(uintptr_t gva) {
@@ -903,8 +975,9 @@ vm::PageWalkInfo vm::VCPU::walk_guest_paging(uintptr_t gva) {
         auto pml1_i = (gva >> 12) & 0x3FF;
 
         uint32_t pml2_addr = regs.cr3 & 0xFFFF'F000;
-        auto* pml2 = (uint32_t*)(vm->mm->get_phys(pml2_addr) + phys_mem_map); // Page tables are always in 1 page so this is fine
-        uint32_t pml2_entry = pml2[pml2_i];
+        uint32_t pml2_entry = 0;
+        if(!dma_read(pml2_addr + (pml2_i * 4), {(uint8_t*)&pml2_entry, 4}))
+            return {.found = false};
 
         ASSERT(pml2_entry & (1 << 0)); // Assert its present
         write = write && (pml2_entry >> 1) & 1;
@@ -915,8 +988,9 @@ vm::PageWalkInfo vm::VCPU::walk_guest_paging(uintptr_t gva) {
         }
 
         uint32_t pml1_addr = pml2_entry & 0xFFFF'F000;
-        auto* pml1 = (uint32_t*)(vm->mm->get_phys(pml1_addr) + phys_mem_map); // Page tables are always in 1 page so this is fine
-        uint32_t pml1_entry = pml1[pml1_i];
+        uint32_t pml1_entry = 0;
+        if(!dma_read(pml1_addr + (pml1_i * 4), {(uint8_t*)&pml1_entry, 4}))
+            return {.found = false};
         
         ASSERT(pml1_entry & (1 << 0)); // Assert its present
         write = write && (pml1_entry >> 1) & 1;
@@ -934,13 +1008,15 @@ void vm::VCPU::mem_read(uintptr_t gva, std::span<uint8_t> buf) {
     uintptr_t curr = 0;
     while(curr != buf.size_bytes()) {
         auto gpa = walk_guest_paging(gva + curr).gpa;
-        auto hpa = vm->mm->get_phys(gpa);
+        auto hpa = vm->gpa_to_hpa(gpa);
         auto hva = hpa + phys_mem_map;
-        auto top = align_up(hva, pmm::block_size);
 
-        auto chunk = min(top - hva + 1, buf.size_bytes() - curr);
+        auto chunk = min(pmm::block_size - (gpa & 0xFFF), buf.size_bytes() - curr); // Only up to the end of the page, both the next guest and host page can be anywhere
 
-        memcpy(buf.data() + curr, (uint8_t*)hva, chunk);
+        if(hpa)
+            memcpy(buf.data() + curr, (uint8_t*)hva, chunk);
+        else
+            memset(buf.data() + curr, 0, chunk); // Not RAM
 
         curr += chunk;
     }
@@ -951,13 +1027,13 @@ void vm::VCPU::mem_write(uintptr_t gva, std::span<uint8_t> buf) {
     while(curr != buf.size_bytes()) {
         auto res = walk_guest_paging(gva + curr);
         ASSERT(res.is_write);
-        auto hpa = vm->mm->get_phys(res.gpa);
+        auto hpa = vm->gpa_to_hpa(res.gpa, true);
         auto hva = hpa + phys_mem_map;
-        auto top = align_up(hva, pmm::block_size);
 
-        auto chunk = min(top - hva + 1, buf.size_bytes() - curr);
+        auto chunk = min(pmm::block_size - (res.gpa & 0xFFF), buf.size_bytes() - curr);
 
-        memcpy((uint8_t*)hva, buf.data() + curr, chunk);
+        if(hpa) // Writes to anything that isn't RAM are dropped
+            memcpy((uint8_t*)hva, buf.data() + curr, chunk);
 
         curr += chunk;
     }
@@ -966,7 +1042,7 @@ void vm::VCPU::mem_write(uintptr_t gva, std::span<uint8_t> buf) {
 void vm::VCPU::adjust_guest_tsc(int64_t diff) {
     guest_tsc_offset += diff;
 
-    vcpu->set(VmCap::TSCOffset, guest_tsc_offset);
+    with_backend(*this, [&](auto& backend) { backend.set(VmCap::TSCOffset, guest_tsc_offset); }); // Done on every entry
 }
 
 vm::Vm::Vm(uint8_t n_cpus, threading::Thread* thread) {
@@ -983,6 +1059,7 @@ vm::Vm::Vm(uint8_t n_cpus, threading::Thread* thread) {
 
 
     ASSERT(n_cpus > 0); // Make sure there's at least 1 VCPU
+    cpus.reserve(n_cpus); // VCPUs are referenced by pointer, so they can't be moved around
     for(uint8_t i = 0; i < n_cpus; i++)
         cpus.emplace_back(this, thread, i);
 }
@@ -990,4 +1067,321 @@ vm::Vm::Vm(uint8_t n_cpus, threading::Thread* thread) {
 void vm::Vm::set_irq(uint8_t irq, bool level) {
     for(auto& listener : irq_listeners)
         listener->irq_set(irq, level);
-}
\ No newline at end of file
+}
+
+void vm::Vm::deliver_msi(uint64_t address, uint32_t data) {
+    auto dest = (address >> 12) & 0xFF;
+    bool logical = (address >> 2) & 1;
+
+    auto vector = data & 0xFF;
+    auto mode = (data >> 8) & 0b111;
+    if((address >> 20) != 0xFEE || (mode != 0 && mode != 1)) { // Only Fixed and Lowest Priority, which is all that devices use
+        print("vm: Unsupported MSI {:#x} <- {:#x}\n", address, data);
+        return;
+    }
+
+    for(auto& cpu : cpus) {
+        if(!cpu.lapic.matches_destination(dest, logical))
+            continue;
+
+        cpu.lapic.raise_irq(vector);
+        if(cpu.thread != this_thread())
+            cpu.thread->invoke_apcs(); // Kick it out of the guest, so the IRQ gets injected
+
+        if(mode == 1) // Lowest Priority, just pick the first one
+            break;
+    }
+}
+
+void vm::Vm::add_memslot(uintptr_t base, size_t size, uint8_t flags) {
+    ASSERT((base & 0xFFF) == 0 && (size & 0xFFF) == 0);
+
+    std::lock_guard guard{memslot_lock};
+    memslots.push_back({.base = base, .size = size, .flags = flags, .backing = nullptr, .backing_offsets = {}, .dirty_bitmap = {}});
+}
+
+vm::Memslot* vm::Vm::find_memslot(uintptr_t gpa) {
+    for(auto& slot : memslots)
+        if(gpa >= slot.base && gpa < (slot.base + slot.size))
+            return &slot;
+
+    return nullptr;
+}
+
+bool vm::Vm::handle_memslot_fault(uintptr_t gpa, bool write) {
+    gpa &= ~0xFFF;
+
+    // Guests tend to touch memory sequentially, so also bring in the rest of the surrounding window, this saves a VM Exit for every page
+    constexpr size_t fault_around_pages = 16;
+    struct {
+        uintptr_t gpa;
+        uint64_t offset;
+    } pages[fault_around_pages];
+    size_t n_pages = 0;
+
+    vfs::File* backing = nullptr;
+    {
+        std::lock_guard guard{memslot_lock};
+
+        auto* slot = find_memslot(gpa);
+        if(!slot)
+            return false;
+
+        if(auto hpa = mm->get_phys(gpa); hpa) {
+            // Page is present, so this is either a write to a merged page, a write protected page that is being dirty logged, or a real violation
+            if(!write || (slot->flags & MemslotFlags::ReadOnly))
+                return false;
+
+            if(!ksm::is_shared(hpa)) {
+                if(!(slot->flags & MemslotFlags::DirtyLog) || mm->has_dirty_bits())
+                    return false;
+
+                // Being writable is what marks the page as dirty, it'll be write protected again when the log is harvested
+                mm->protect(gpa, paging::mapPagePresent | paging::mapPageWrite | paging::mapPageExecute);
+                return true;
+            }
+
+            auto block = pmm::alloc_block();
+            ASSERT(block);
+
+            memcpy((uint8_t*)(block + phys_mem_map), (uint8_t*)(hpa + phys_mem_map), pmm::block_size);
+            mm->map(block, gpa, paging::mapPagePresent | paging::mapPageWrite | paging::mapPageExecute);
+
+            // A host side user might still be reading from the merged page, don't let it be freed under it
+            if(ram_pins)
+                deferred_puts.push_back(hpa);
+            else
+                ksm::put(hpa);
+            return true;
+        }
+
+        auto start = max(align_down(gpa, fault_around_pages * pmm::block_size), slot->base);
+        auto end = min(start + (fault_around_pages * pmm::block_size), slot->base + slot->size);
+        for(auto addr = start; addr < end; addr += pmm::block_size) {
+            if(addr != gpa && mm->get_phys(addr))
+                continue;
+
+            auto offset = slot->backing ? slot->backing_offsets[(addr - slot->base) / pmm::block_size] : 0;
+            pages[n_pages++] = {.gpa = addr, .offset = offset};
+        }
+
+        backing = slot->backing;
+    }
+
+    // Try to get all blocks in 1 go, but if memory is fragmented fall back to allocating them 1 by 1
+    auto blocks = pmm::alloc_n_blocks(n_pages);
+    auto get_block = [&](size_t i) {
+        if(blocks)
+            return blocks + (i * pmm::block_size);
+
+        auto block = pmm::alloc_block();
+        ASSERT(block);
+        return block;
+    };
+
+    uintptr_t hpas[fault_around_pages] = {};
+    for(size_t i = 0; i < n_pages; i++) {
+        hpas[i] = get_block(i);
+
+        auto* va = (uint8_t*)(hpas[i] + phys_mem_map);
+        if(pages[i].offset)
+            ASSERT(backing->read(pages[i].offset, pmm::block_size, va) == pmm::block_size);
+        else
+            memset(va, 0, pmm::block_size);
+    }
+
+    std::lock_guard guard{memslot_lock};
+    for(size_t i = 0; i < n_pages; i++) {
+        if(mm->get_phys(pages[i].gpa)) { // Another VCPU beat us to it
+            pmm::free_block(hpas[i]);
+            continue;
+        }
+
+        mm->map(hpas[i], pages[i].gpa, paging::mapPagePresent | paging::mapPageWrite | paging::mapPageExecute);
+    }
+
+    return true;
+}
+
+void vm::Vm::set_dirty_log(uintptr_t base, bool enable) {
+    struct Args {
+        Vm* vm;
+        uintptr_t base;
+        bool enable;
+    } args{this, base, enable};
+
+    // Starting the log write protects the slot, which has to reach the TLB of the CPU the guest runs on
+    on_vcpu_thread([](void* userptr) {
+        auto& [vm, base, enable] = *(Args*)userptr;
+
+        bool any_logged = false;
+        {
+            std::lock_guard guard{vm->memslot_lock};
+
+            auto* slot = vm->find_memslot(base);
+            ASSERT(slot && slot->base == base);
+
+            auto n_pages = slot->size / pmm::block_size;
+            if(enable && !(slot->flags & MemslotFlags::DirtyLog)) {
+                slot->flags |= MemslotFlags::DirtyLog;
+                slot->dirty_bitmap.resize(div_ceil(n_pages, 64));
+
+                // Start out clean, whatever was dirtied before logging was enabled isn't interesting
+                vm->mm->clear_dirty(slot->base, n_pages, slot->dirty_bitmap.data(), true);
+                memset(slot->dirty_bitmap.data(), 0, slot->dirty_bitmap.size() * sizeof(uint64_t));
+            } else if(!enable && (slot->flags & MemslotFlags::DirtyLog)) {
+                slot->flags &= ~MemslotFlags::DirtyLog;
+                slot->dirty_bitmap.clear();
+
+                // Pages were write protected to track them, so give back write access to everything that isn't merged
+                if(!vm->mm->has_dirty_bits() && !(slot->flags & MemslotFlags::ReadOnly))
+                    for(auto gpa = slot->base; gpa < (slot->base + slot->size); gpa += pmm::block_size)
+                        if(auto hpa = vm->mm->get_phys(gpa); hpa && !ksm::is_shared(hpa))
+                            vm->mm->protect(gpa, paging::mapPagePresent | paging::mapPageWrite | paging::mapPageExecute);
+            }
+
+            for(const auto& other : vm->memslots)
+                if(other.flags & MemslotFlags::DirtyLog)
+                    any_logged = true;
+        }
+
+        // Hardware logging only has to be on while some slot is being logged, turning it off flushes the log, which takes memslot_lock
+        for(auto& vcpu : vm->cpus)
+            vcpu.set(VmCap::DirtyLogging, any_logged);
+    }, &args);
+}
+
+void vm::Vm::log_dirty(uintptr_t gpa) {
+    std::lock_guard guard{memslot_lock};
+
+    auto* slot = find_memslot(gpa);
+    if(!slot || !(slot->flags & MemslotFlags::DirtyLog))
+        return;
+
+    auto page = (gpa - slot->base) / pmm::block_size;
+    slot->dirty_bitmap[page / 64] |= (1ull << (page % 64));
+}
+
+size_t vm::Vm::get_dirty_log(uintptr_t base, std::vector<uint64_t>& bitmap) {
+    struct Args {
+        Vm* vm;
+        uintptr_t base;
+        std::vector<uint64_t>* bitmap;
+        size_t n_dirty;
+    } args{this, base, &bitmap, 0};
+
+    // Clearing the dirty state write protects pages or clears their dirty bits, the TLB of the CPU the guest runs on has to see that
+    on_vcpu_thread([](void* userptr) {
+        auto& args = *(Args*)userptr;
+        auto& vm = *args.vm;
+
+        // If every dirtied page has already been logged, only those have to be checked, instead of scanning the page tables of the entire slot
+        bool scan = false;
+        for(auto& vcpu : vm.cpus)
+            if(!vcpu.vcpu->logs_dirty_pages())
+                scan = true;
+
+        std::lock_guard guard{vm.memslot_lock};
+
+        auto* slot = vm.find_memslot(args.base);
+        ASSERT(slot && slot->base == args.base && (slot->flags & MemslotFlags::DirtyLog));
+
+        vm.mm->clear_dirty(slot->base, slot->size / pmm::block_size, slot->dirty_bitmap.data(), scan);
+
+        auto& bitmap = *args.bitmap;
+        bitmap.resize(slot->dirty_bitmap.size());
+        for(size_t i = 0; i < slot->dirty_bitmap.size(); i++) {
+            bitmap[i] = slot->dirty_bitmap[i];
+            slot->dirty_bitmap[i] = 0;
+
+            args.n_dirty += __builtin_popcountll(bitmap[i]);
+        }
+    }, &args);
+
+    return args.n_dirty;
+}
+
+uintptr_t vm::Vm::gpa_to_hpa(uintptr_t gpa, bool write) {
+    // Only RAM can be accessed, anything else that is mapped, like VRAM, framebuffers or passthrough BARs, isn't ours to touch through phys_mem_map
+    {
+        std::lock_guard guard{memslot_lock};
+
+        auto* slot = find_memslot(gpa);
+        if(!slot || (write && (slot->flags & MemslotFlags::ReadOnly)))
+            return 0;
+    }
+
+    auto off = gpa & 0xFFF;
+    auto hpa = mm->get_phys(gpa - off);
+    if(!hpa && handle_memslot_fault(gpa, write)) // RAM that the guest hasn't touched yet, pages that weren't present don't need a TLB invalidation
+        hpa = mm->get_phys(gpa - off);
+
+    // Breaking up a merged page remaps it, so when a device thread does it the guest's TLB could keep pointing at the shared page
+    if(hpa && write && ksm::is_shared(hpa)) {
+        struct Args {
+            Vm* vm;
+            uintptr_t gpa;
+        } args{this, gpa};
+
+        on_vcpu_thread([](void* userptr) {
+            auto& args = *(Args*)userptr;
+            args.vm->handle_memslot_fault(args.gpa, true);
+        }, &args);
+
+        hpa = mm->get_phys(gpa - off);
+        if(ksm::is_shared(hpa)) // E.g. ROM, which can't be written
+            hpa = 0;
+    }
+
+    if(!hpa)
+        return 0;
+
+    // Host writes don't go through the nested page tables, so they never set a dirty bit or hit a write protected page
+    if(write)
+        log_dirty(gpa);
+
+    return hpa + off;
+}
+
+void vm::Vm::on_vcpu_thread(void (*f)(void*), void* userptr) {
+    auto* thread = cpus[0].thread; // All VCPUs share 1 thread
+    if(thread == this_thread()) {
+        f(userptr);
+        return;
+    }
+
+    struct Call {
+        void (*f)(void*);
+        void* userptr;
+        Promise<void> done;
+    } call{f, userptr, {}};
+
+    thread->queue_apc([](void* userptr) {
+        auto* call = (Call*)userptr;
+
+        call->f(call->userptr);
+        call->done.complete();
+    }, &call);
+    thread->invoke_apcs();
+
+    call.done.await();
+}
+
+void vm::Vm::pin_ram() {
+    std::lock_guard guard{memslot_lock};
+    ram_pins++;
+}
+
+void vm::Vm::unpin_ram() {
+    std::vector<uintptr_t> puts{};
+    {
+        std::lock_guard guard{memslot_lock};
+        ASSERT(ram_pins > 0);
+
+        if(--ram_pins == 0)
+            std::swap(puts, deferred_puts);
+    }
+
+    for(auto hpa : puts)
+        ksm::put(hpa);
+}